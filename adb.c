@@ -14,47 +14,57 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include "adb.h"
 #include "child.h"
 #include "util.h"
 #include "argv.h"
+#include "timing.h"
 
-void
-adb_send_file(const char* local,
-              const char* remote,
-              const char* const* adb_args)
+// Run adb with ADB_ARGS and then CMD.  Return the start of what it
+// printed, trimmed of whitespace, in BUF.  If adb fails, die with the
+// gist of its complaint.
+static char*
+adb_run(const char* const* adb_args,
+        const char* const* cmd,
+        char* buf,
+        size_t bufsz)
 {
-    SCOPED_RESLIST(rl_send_stub);
+    SCOPED_RESLIST(rl_adb_run);
 
     struct child_start_info csi = {
         .flags = CHILD_MERGE_STDERR,
         .exename = "adb",
         .argv = argv_concat((const char*[]){"adb", NULL},
                             adb_args ?: empty_argv,
-                            (const char*[]){"push", local, remote, NULL},
+                            cmd,
                             NULL),
     };
     struct child* adb = child_start(&csi);
     fdh_destroy(adb->fd[0]);
 
-    char buf[512];
-    size_t len = read_all(adb->fd[1]->fd, buf, sizeof (buf));
+    size_t len = read_all(adb->fd[1]->fd, buf, bufsz);
     fdh_destroy(adb->fd[1]);
 
-    int status = child_wait(adb);
-    if (!(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
-        if (len == sizeof (buf))
-            --len;
+    if (len == bufsz)
+        --len;
 
-        while (len > 0 && isspace(buf[len - 1]))
-            --len;
+    while (len > 0 && isspace(buf[len - 1]))
+        --len;
 
-        buf[len] = '\0';
+    buf[len] = '\0';
 
-        char* epos = buf;
-        while (*epos != '\0' && isspace(*epos))
-            ++epos;
+    char* epos = buf;
+    while (*epos != '\0' && isspace(*epos))
+        ++epos;
 
+    int status = child_wait(adb);
+    if (!(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
         if (strncmp(epos, "error: ", strlen("error: ")) == 0) {
             epos += strlen("error: ");
             char* e = strchr(epos, '\n');
@@ -63,4 +73,318 @@ adb_send_file(const char* local,
 
         die(ECOMM, "adb error: %s", epos);
     }
+
+    return epos;
+}
+
+// We talk to the adb server ourselves instead of running adb for
+// every request.  The server speaks a simple protocol on a local TCP
+// port: we send a request as four hex digits of length followed by
+// the request text, and the server answers OKAY or FAIL, the latter
+// followed by a length-prefixed complaint.  A request naming a
+// transport turns the connection into a pipe to that device, on
+// which we then open a service (shell:, exec:, sync:).
+
+struct adb_target {
+    const char* host;
+    const char* port;
+    const char* serial;
+    char kind; // 'd' for usb, 'e' for emulator, or 0 for any
+};
+
+static void
+adb_parse_args(const char* const* adb_args, struct adb_target* t)
+{
+    memset(t, 0, sizeof (*t));
+    t->host = "localhost";
+    t->port = getenv("ANDROID_ADB_SERVER_PORT") ?: "5037";
+    for (; adb_args != NULL && *adb_args != NULL; ++adb_args) {
+        const char* arg = *adb_args;
+        if (!strcmp(arg, "-d") || !strcmp(arg, "-e"))
+            t->kind = arg[1];
+        else if (!strcmp(arg, "-s") && adb_args[1] != NULL)
+            t->serial = *++adb_args;
+        else if (!strcmp(arg, "-H") && adb_args[1] != NULL)
+            t->host = *++adb_args;
+        else if (!strcmp(arg, "-P") && adb_args[1] != NULL)
+            t->port = *++adb_args;
+        else if (!strcmp(arg, "-p") && adb_args[1] != NULL)
+            ++adb_args; // Only matters to adb's own sync
+    }
+
+    if (t->serial == NULL && t->kind == 0)
+        t->serial = getenv("ANDROID_SERIAL");
+}
+
+// Connect to the adb server.  Return the socket or -1 if nobody's
+// listening.
+static int
+adb_server_connect_1(const struct adb_target* t)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof (hints));
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* ai_list;
+    int rc = getaddrinfo(t->host, t->port, &hints, &ai_list);
+    if (rc != 0)
+        die(ECOMM, "adb server %s:%s: %s",
+            t->host, t->port, gai_strerror(rc));
+
+    int s = -1;
+    for (struct addrinfo* ai = ai_list; ai != NULL && s == -1;
+         ai = ai->ai_next)
+    {
+        struct reslist* rl = reslist_push_new();
+        struct cleanup* cl = cleanup_allocate();
+        int fd = socket(ai->ai_family,
+                        ai->ai_socktype | SOCK_CLOEXEC,
+                        ai->ai_protocol);
+        if (fd == -1) {
+            freeaddrinfo(ai_list);
+            die_errno("socket");
+        }
+
+        cleanup_commit_close_fd(cl, fd);
+        reslist_pop_nodestroy(rl);
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            s = fd;
+        else
+            reslist_destroy(rl);
+    }
+
+    freeaddrinfo(ai_list);
+    return s;
+}
+
+// Like adb itself, start the server if it isn't running yet.
+static int
+adb_server_connect(const struct adb_target* t,
+                   const char* const* adb_args)
+{
+    int s = adb_server_connect_1(t);
+    if (s == -1) {
+        char buf[512];
+        adb_run(adb_args,
+                (const char*[]){"start-server", NULL},
+                buf,
+                sizeof (buf));
+        timing_mark("adb start-server");
+        s = adb_server_connect_1(t);
+    }
+
+    if (s == -1)
+        die(ECOMM, "cannot reach adb server at %s:%s", t->host, t->port);
+
+    return s;
+}
+
+static char*
+adb_read_string(int s)
+{
+    char hex[5];
+    if (read_all(s, hex, 4) != 4)
+        die(ECOMM, "adb server hung up");
+
+    hex[4] = '\0';
+    char* end;
+    unsigned long len = strtoul(hex, &end, 16);
+    if (*end != '\0')
+        die(ECOMM, "bad length from adb server: \"%s\"", hex);
+
+    char* str = xalloc(len + 1);
+    if (read_all(s, str, len) != len)
+        die(ECOMM, "adb server hung up");
+
+    str[len] = '\0';
+    return str;
+}
+
+static void
+adb_read_status(int s)
+{
+    char status[4];
+    if (read_all(s, status, sizeof (status)) != sizeof (status))
+        die(ECOMM, "adb server hung up");
+
+    if (!memcmp(status, "FAIL", sizeof (status)))
+        die(ECOMM, "adb error: %s", adb_read_string(s));
+
+    if (memcmp(status, "OKAY", sizeof (status)))
+        die(ECOMM, "bad reply from adb server: \"%.4s\"", status);
+}
+
+static void
+adb_request(int s, const char* request)
+{
+    size_t len = strlen(request);
+    if (len > 0xFFFF)
+        die(EINVAL, "adb request too long");
+
+    char* msg = xaprintf("%04zx%s", len, request);
+    write_all(s, msg, strlen(msg));
+    adb_read_status(s);
+}
+
+// Send a host request about the device that T selects, like
+// "forward:...".
+static void
+adb_host_request(int s, const struct adb_target* t, const char* request)
+{
+    if (t->serial != NULL)
+        request = xaprintf("host-serial:%s:%s", t->serial, request);
+    else if (t->kind == 'd')
+        request = xaprintf("host-usb:%s", request);
+    else if (t->kind == 'e')
+        request = xaprintf("host-local:%s", request);
+    else
+        request = xaprintf("host:%s", request);
+
+    adb_request(s, request);
+}
+
+int
+adb_connect_service(const char* service, const char* const* adb_args)
+{
+    struct adb_target t;
+    adb_parse_args(adb_args, &t);
+    int s = adb_server_connect(&t, adb_args);
+
+    const char* transport;
+    if (t.serial != NULL)
+        transport = xaprintf("host:transport:%s", t.serial);
+    else if (t.kind == 'd')
+        transport = "host:transport-usb";
+    else if (t.kind == 'e')
+        transport = "host:transport-local";
+    else
+        transport = "host:transport-any";
+
+    adb_request(s, transport);
+    adb_request(s, service);
+    timing_mark("adb service opened");
+    return s;
+}
+
+static void
+adb_sync_send(int s, const char* id, uint32_t arg)
+{
+    struct adb_sync_hdr hdr;
+    memcpy(hdr.id, id, sizeof (hdr.id));
+    hdr.arg = arg;
+    write_all(s, &hdr, sizeof (hdr));
+}
+
+void
+adb_send_file(const char* local,
+              const char* remote,
+              const char* const* adb_args)
+{
+    SCOPED_RESLIST(rl_send_file);
+
+    int fd = xopen(local, O_RDONLY, 0);
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        die_errno("fstat(\"%s\")", local);
+
+    int s = adb_connect_service("sync:", adb_args);
+    char* target = xaprintf("%s,%u", remote, (unsigned) st.st_mode);
+    size_t targetsz = strlen(target);
+    if (targetsz > ADB_SYNC_DATA_MAX)
+        die(EINVAL, "remote file name too long");
+
+    adb_sync_send(s, "SEND", targetsz);
+    write_all(s, target, targetsz);
+
+    char* buf = xalloc(ADB_SYNC_DATA_MAX);
+    size_t nr_read;
+    do {
+        nr_read = read_all(fd, buf, ADB_SYNC_DATA_MAX);
+        if (nr_read > 0) {
+            adb_sync_send(s, "DATA", nr_read);
+            write_all(s, buf, nr_read);
+        }
+    } while (nr_read == ADB_SYNC_DATA_MAX);
+
+    adb_sync_send(s, "DONE", (uint32_t) st.st_mtime);
+
+    struct adb_sync_hdr reply;
+    if (read_all(s, &reply, sizeof (reply)) != sizeof (reply))
+        die(ECOMM, "adb server hung up during push");
+
+    if (!memcmp(reply.id, "FAIL", sizeof (reply.id))) {
+        size_t len = XMIN(reply.arg, (uint32_t) ADB_SYNC_DATA_MAX);
+        len = read_all(s, buf, len);
+        die(ECOMM, "adb push of %s failed: %.*s", remote, (int) len, buf);
+    }
+
+    if (memcmp(reply.id, "OKAY", sizeof (reply.id)))
+        die(ECOMM, "bad reply to adb push: \"%.4s\"", reply.id);
+
+    adb_sync_send(s, "QUIT", 0);
+}
+
+unsigned
+adb_forward_abstract(const char* name, const char* const* adb_args)
+{
+    SCOPED_RESLIST(rl_forward);
+    struct adb_target t;
+    adb_parse_args(adb_args, &t);
+    int s = adb_server_connect(&t, adb_args);
+    adb_host_request(s, &t,
+                     xaprintf("forward:tcp:0;localabstract:%s", name));
+
+    // The server says OKAY once for finding the device and once for
+    // the forward, and then, if it's new enough to pick a port at
+    // all, tells us which one it picked.
+    adb_read_status(s);
+    const char* out = adb_read_string(s);
+    char* end;
+    unsigned long port = strtoul(out, &end, 10);
+    if (*out == '\0' || *end != '\0' || port == 0 || port > 65535)
+        die(ECOMM, "adb forward did not report a port: \"%s\"", out);
+
+    return port;
+}
+
+void
+adb_forward_remove(unsigned port, const char* const* adb_args)
+{
+    SCOPED_RESLIST(rl_forward_remove);
+    struct adb_target t;
+    adb_parse_args(adb_args, &t);
+    int s = adb_server_connect(&t, adb_args);
+    adb_host_request(s, &t, xaprintf("killforward:tcp:%u", port));
+    adb_read_status(s);
+}
+
+// Return the serial numbers of the devices that adb reports as
+// ready, as a NULL-terminated array.
+const char**
+adb_list_devices(const char* const* adb_args)
+{
+    struct adb_target t;
+    adb_parse_args(adb_args, &t);
+    struct reslist* rl_devices = reslist_push_new();
+    int s = adb_server_connect(&t, adb_args);
+    adb_request(s, "host:devices");
+    char* list = adb_read_string(s);
+    reslist_pop_nodestroy(rl_devices);
+    char* buf = xstrdup(list);
+    reslist_destroy(rl_devices);
+
+    const char** serials = xcalloc(sizeof (*serials));
+    char* line;
+    char* pos = buf;
+    while ((line = strsep(&pos, "\n")) != NULL) {
+        char* state = strchr(line, '\t');
+        if (state == NULL || strcmp(state + 1, "device") != 0)
+            continue;
+
+        *state = '\0';
+        serials = argv_concat(serials,
+                              (const char*[]){line, NULL},
+                              NULL);
+    }
+
+    return serials;
 }
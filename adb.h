@@ -9,6 +9,29 @@
  *
  */
 #pragma once
+#include <stdint.h>
+
+// The sync: service frames everything with one of these: a
+// four-letter id (SEND, DATA, DONE, OKAY, FAIL, QUIT) and an
+// argument, usually the length of what follows.  The adb server
+// caps DATA packets at ADB_SYNC_DATA_MAX.
+#define ADB_SYNC_DATA_MAX (64*1024)
+
+struct adb_sync_hdr {
+    char id[4];
+    uint32_t arg;
+} __attribute__((packed));
+
+// Connect to SERVICE ("shell:", "exec:CMD", "sync:", and so on) on
+// the device that ADB_ARGS select and return the socket.  We talk to
+// the adb server directly and run adb only to start the server.
+int adb_connect_service(const char* service, const char* const* adb_args);
 void adb_send_file(const char* local,
                    const char* remote,
                    const char* const* adb_args);
+const char** adb_list_devices(const char* const* adb_args);
+
+// Forward a free local TCP port to the abstract socket NAME on the
+// device and return the port.
+unsigned adb_forward_abstract(const char* name, const char* const* adb_args);
+void adb_forward_remove(unsigned port, const char* const* adb_args);
@@ -0,0 +1,690 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "archive.h"
+#include "constants.h"
+
+// Three kinds of thread cooperate to build an archive.  The walker
+// lists the tree into a queue of entries.  The writer takes entries
+// off the front of the queue and writes them to the data pipe.
+// Meanwhile, reader threads load small files further down the queue
+// into memory so that the writer doesn't wait on one open and read
+// after another when a tree holds thousands of tiny files.  Big
+// files the writer streams itself.
+//
+// None of these threads may die() or allocate on a reslist, so they
+// use malloc and report trouble through the errors pipe.
+
+enum ar_state {
+    AR_PENDING,
+    AR_LOADING,
+    AR_LOADED,
+};
+
+struct ar_entry {
+    struct ar_entry* next;
+    char* path;
+    char* name;
+    struct stat st;
+    enum ar_state state;
+    char* data;
+    size_t datasz;
+    int err;
+};
+
+struct archive {
+    char* root;
+    int data_fd;
+    int err_fd;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct ar_entry* head;
+    struct ar_entry** tailp;
+    struct ar_entry* cursor;
+    size_t prefetched;
+    bool walk_done;
+    bool stop;
+    bool running;
+    unsigned nr_problems;
+    unsigned nr_readers;
+    pthread_t walker;
+    pthread_t writer;
+    pthread_t readers[ARCHIVE_READER_THREADS];
+};
+
+static bool
+ar_prefetchable_p(const struct ar_entry* e)
+{
+    return S_ISREG(e->st.st_mode) &&
+        e->st.st_size <= ARCHIVE_SMALL_FILE_MAX;
+}
+
+static void
+ar_warn(struct archive* ar, const char* fmt, ...)
+{
+    char buf[512];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf, sizeof (buf) - 1, fmt, args);
+    va_end(args);
+    if (n < 0)
+        return;
+
+    n = XMIN((size_t) n, sizeof (buf) - 2);
+    buf[n++] = '\n';
+    while (write(ar->err_fd, buf, n) == -1 && errno == EINTR)
+        ;
+
+    __atomic_add_fetch(&ar->nr_problems, 1, __ATOMIC_SEQ_CST);
+}
+
+static bool
+ar_write(struct archive* ar, const void* buf, size_t sz)
+{
+    const char* p = buf;
+    while (sz > 0) {
+        ssize_t ret = write(ar->data_fd, p, sz);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return false;
+
+        p += ret;
+        sz -= ret;
+    }
+
+    return true;
+}
+
+static bool
+ar_pad(struct archive* ar, uint64_t sz)
+{
+    static const char zeros[ARCHIVE_BLOCKSZ];
+    size_t partial = sz % ARCHIVE_BLOCKSZ;
+    return partial == 0 || ar_write(ar, zeros, ARCHIVE_BLOCKSZ - partial);
+}
+
+static char*
+ar_strdup_printf(const char* fmt, ...)
+{
+    char* s;
+    va_list args;
+    va_start(args, fmt);
+    int ret = vasprintf(&s, fmt, args);
+    va_end(args);
+    return ret < 0 ? NULL : s;
+}
+
+static void
+ar_enqueue(struct archive* ar, struct ar_entry* e)
+{
+    pthread_mutex_lock(&ar->lock);
+    *ar->tailp = e;
+    ar->tailp = &e->next;
+    if (ar->cursor == NULL)
+        ar->cursor = e;
+    pthread_cond_broadcast(&ar->cond);
+    pthread_mutex_unlock(&ar->lock);
+}
+
+static bool
+ar_stopped_p(struct archive* ar)
+{
+    return __atomic_load_n(&ar->stop, __ATOMIC_SEQ_CST);
+}
+
+static void
+ar_walk(struct archive* ar, const char* path, const char* name)
+{
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        ar_warn(ar, "%s: %s", path, strerror(errno));
+        return;
+    }
+
+    struct dirent* de;
+    while (!ar_stopped_p(ar) && (de = readdir(dir)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+
+        struct ar_entry* e = calloc(1, sizeof (*e));
+        if (e == NULL) {
+            ar_warn(ar, "%s/%s: out of memory", path, de->d_name);
+            continue;
+        }
+
+        e->path = ar_strdup_printf("%s/%s", path, de->d_name);
+        e->name = (name[0]
+                   ? ar_strdup_printf("%s/%s", name, de->d_name)
+                   : ar_strdup_printf("%s", de->d_name));
+        if (e->path == NULL || e->name == NULL) {
+            ar_warn(ar, "%s/%s: out of memory", path, de->d_name);
+            free(e->path);
+            free(e->name);
+            free(e);
+            continue;
+        }
+
+        if (lstat(e->path, &e->st) == -1) {
+            ar_warn(ar, "%s: %s", e->path, strerror(errno));
+            free(e->path);
+            free(e->name);
+            free(e);
+            continue;
+        }
+
+        // Queue a directory before descending into it so that
+        // the extractor creates it before its contents.
+        bool recurse = S_ISDIR(e->st.st_mode);
+        char* subpath = recurse ? strdup(e->path) : NULL;
+        char* subname = recurse ? strdup(e->name) : NULL;
+        ar_enqueue(ar, e);
+        if (subpath && subname)
+            ar_walk(ar, subpath, subname);
+        free(subpath);
+        free(subname);
+    }
+
+    closedir(dir);
+}
+
+static void*
+ar_walker_main(void* arg)
+{
+    struct archive* ar = arg;
+    ar_walk(ar, ar->root, "");
+    pthread_mutex_lock(&ar->lock);
+    ar->walk_done = true;
+    pthread_cond_broadcast(&ar->cond);
+    pthread_mutex_unlock(&ar->lock);
+    return NULL;
+}
+
+// Read up to SZ bytes of PATH into a new buffer.  Return NULL and
+// set *ERR on failure.
+static char*
+ar_load(const char* path, size_t sz, size_t* nr_loaded, int* err)
+{
+    char* buf = malloc(XMAX(sz, 1));
+    if (buf == NULL) {
+        *err = ENOMEM;
+        return NULL;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        *err = errno;
+        free(buf);
+        return NULL;
+    }
+
+    size_t pos = 0;
+    while (pos < sz) {
+        ssize_t ret = read(fd, buf + pos, sz - pos);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret < 0) {
+            *err = errno;
+            break;
+        }
+        if (ret == 0)
+            break;
+        pos += ret;
+    }
+
+    close(fd);
+    *nr_loaded = pos;
+    return buf;
+}
+
+static void*
+ar_reader_main(void* arg)
+{
+    struct archive* ar = arg;
+    pthread_mutex_lock(&ar->lock);
+    for (;;) {
+        struct ar_entry* e = ar->cursor;
+        while (e != NULL && !ar_prefetchable_p(e))
+            e = e->next;
+
+        ar->cursor = e;
+        if (ar->stop || (e == NULL && ar->walk_done))
+            break;
+
+        if (e == NULL ||
+            ar->prefetched + e->st.st_size > ARCHIVE_PREFETCH_MAX)
+        {
+            pthread_cond_wait(&ar->cond, &ar->lock);
+            continue;
+        }
+
+        ar->cursor = e->next;
+        e->state = AR_LOADING;
+        ar->prefetched += e->st.st_size;
+        pthread_mutex_unlock(&ar->lock);
+
+        int err = 0;
+        size_t datasz = 0;
+        char* data = ar_load(e->path, e->st.st_size, &datasz, &err);
+
+        pthread_mutex_lock(&ar->lock);
+        e->data = data;
+        e->datasz = datasz;
+        e->err = err;
+        e->state = AR_LOADED;
+        pthread_cond_broadcast(&ar->cond);
+    }
+
+    pthread_mutex_unlock(&ar->lock);
+    return NULL;
+}
+
+// Fill a NUL-terminated octal header field.  Values too big for
+// the field get a pax record instead, so truncation is harmless.
+static void
+ar_octal(char* field, size_t width, uint64_t value)
+{
+    field[width - 1] = '\0';
+    for (size_t i = width - 1; i > 0; --i) {
+        field[i - 1] = '0' + (value & 7);
+        value >>= 3;
+    }
+}
+
+// Copy a string into a header field, which need not be terminated.
+static void
+ar_string(char* field, size_t width, const char* value)
+{
+    memcpy(field, value, XMIN(strlen(value), width));
+}
+
+struct ustar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+static bool
+ar_put_header(struct archive* ar,
+              const char* name,
+              char typeflag,
+              mode_t mode,
+              uint64_t size,
+              time_t mtime,
+              const char* linkname)
+{
+    struct ustar_header h;
+    _Static_assert(sizeof (h) == ARCHIVE_BLOCKSZ, "bad ustar header");
+    memset(&h, 0, sizeof (h));
+    ar_string(h.name, sizeof (h.name), name);
+    ar_octal(h.mode, sizeof (h.mode), mode & 07777);
+    ar_octal(h.uid, sizeof (h.uid), 0);
+    ar_octal(h.gid, sizeof (h.gid), 0);
+    ar_octal(h.size, sizeof (h.size), size);
+    ar_octal(h.mtime, sizeof (h.mtime), mtime > 0 ? mtime : 0);
+    h.typeflag = typeflag;
+    if (linkname)
+        ar_string(h.linkname, sizeof (h.linkname), linkname);
+    memcpy(h.magic, "ustar", 6);
+    memcpy(h.version, "00", 2);
+
+    unsigned sum = 0;
+    memset(h.chksum, ' ', sizeof (h.chksum));
+    for (size_t i = 0; i < sizeof (h); ++i)
+        sum += ((unsigned char*) &h)[i];
+    ar_octal(h.chksum, sizeof (h.chksum) - 1, sum);
+    return ar_write(ar, &h, sizeof (h));
+}
+
+// Format one pax record.  A record's length field counts its own
+// digits, so find the fixed point.
+static char*
+ar_pax_record(const char* key, const char* value)
+{
+    size_t body = strlen(key) + strlen(value) + 3;
+    size_t len = body;
+    for (;;) {
+        size_t n = body + snprintf(NULL, 0, "%zu", len);
+        if (n == len)
+            break;
+        len = n;
+    }
+
+    return ar_strdup_printf("%zu %s=%s\n", len, key, value);
+}
+
+// Write the headers for entry E.  ustar can't describe long names
+// or big files, so we put those in a pax extended header first.
+static bool
+ar_put_entry_header(struct archive* ar,
+                    const struct ar_entry* e,
+                    const char* name,
+                    char typeflag,
+                    uint64_t size,
+                    const char* linkname)
+{
+    char* records[3] = { NULL, NULL, NULL };
+    bool ok = true;
+
+    if (strlen(name) > sizeof (((struct ustar_header*)0)->name))
+        records[0] = ar_pax_record("path", name);
+    if (linkname &&
+        strlen(linkname) > sizeof (((struct ustar_header*)0)->linkname))
+        records[1] = ar_pax_record("linkpath", linkname);
+    if (size > 077777777777ULL) {
+        char sizebuf[32];
+        snprintf(sizebuf, sizeof (sizebuf), "%llu",
+                 (unsigned long long) size);
+        records[2] = ar_pax_record("size", sizebuf);
+    }
+
+    size_t paxsz = 0;
+    for (int i = 0; i < ARRAYSIZE(records); ++i)
+        if (records[i])
+            paxsz += strlen(records[i]);
+
+    if (paxsz > 0) {
+        ok = ar_put_header(ar, "././@PaxHeader", 'x', 0644, paxsz, 0, NULL);
+        for (int i = 0; ok && i < ARRAYSIZE(records); ++i)
+            if (records[i])
+                ok = ar_write(ar, records[i], strlen(records[i]));
+        ok = ok && ar_pad(ar, paxsz);
+    }
+
+    for (int i = 0; i < ARRAYSIZE(records); ++i)
+        free(records[i]);
+
+    return ok && ar_put_header(ar,
+                               name,
+                               typeflag,
+                               e->st.st_mode,
+                               size,
+                               e->st.st_mtime,
+                               linkname);
+}
+
+// Copy exactly SIZE bytes of file data to the archive: the header
+// has already promised that many.  If the file shrank or we can't
+// read it, pad with zeros and complain.
+static bool
+ar_stream_file(struct archive* ar, int fd, const struct ar_entry* e)
+{
+    uint64_t size = e->st.st_size;
+    uint64_t pos = 0;
+    bool complained = false;
+    char* buf = malloc(ARCHIVE_STREAM_BUFSZ);
+    if (buf == NULL)
+        return false;
+
+    hint_sequential_read(fd);
+    while (pos < size) {
+        size_t want = XMIN(size - pos, ARCHIVE_STREAM_BUFSZ);
+        ssize_t ret = complained ? 0 : read(fd, buf, want);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            if (!complained)
+                ar_warn(ar, "%s: %s", e->path,
+                        ret < 0 ? strerror(errno) : "file shrank");
+            complained = true;
+            memset(buf, 0, want);
+            ret = want;
+        }
+
+        if (!ar_write(ar, buf, ret)) {
+            free(buf);
+            return false;
+        }
+
+        pos += ret;
+    }
+
+    free(buf);
+    return ar_pad(ar, size);
+}
+
+// Write one entry.  Return false if the archive itself is broken
+// (i.e., our reader went away).
+static bool
+ar_put_entry(struct archive* ar, struct ar_entry* e)
+{
+    mode_t fmt = e->st.st_mode & S_IFMT;
+
+    if (fmt == S_IFDIR) {
+        char* name = ar_strdup_printf("%s/", e->name);
+        bool ok = name && ar_put_entry_header(ar, e, name, '5', 0, NULL);
+        free(name);
+        return ok;
+    }
+
+    if (fmt == S_IFLNK) {
+        char target[PATH_MAX + 1];
+        ssize_t len = readlink(e->path, target, sizeof (target) - 1);
+        if (len < 0) {
+            ar_warn(ar, "%s: %s", e->path, strerror(errno));
+            return true;
+        }
+
+        target[len] = '\0';
+        return ar_put_entry_header(ar, e, e->name, '2', 0, target);
+    }
+
+    if (fmt != S_IFREG) {
+        ar_warn(ar, "%s: skipping special file", e->path);
+        return true;
+    }
+
+    if (e->state == AR_LOADED) {
+        if (e->data == NULL) {
+            ar_warn(ar, "%s: %s", e->path, strerror(e->err));
+            return true;
+        }
+
+        if (e->datasz < (size_t) e->st.st_size)
+            ar_warn(ar, "%s: %s", e->path,
+                    e->err ? strerror(e->err) : "file shrank");
+
+        // Describe what we actually read, not what stat promised.
+        return ar_put_entry_header(ar, e, e->name, '0', e->datasz, NULL) &&
+            ar_write(ar, e->data, e->datasz) &&
+            ar_pad(ar, e->datasz);
+    }
+
+    int fd = open(e->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        ar_warn(ar, "%s: %s", e->path, strerror(errno));
+        return true;
+    }
+
+    bool ok = ar_put_entry_header(ar, e, e->name, '0', e->st.st_size, NULL)
+        && ar_stream_file(ar, fd, e);
+    close(fd);
+    return ok;
+}
+
+static void
+ar_free_entry(struct ar_entry* e)
+{
+    free(e->data);
+    free(e->path);
+    free(e->name);
+    free(e);
+}
+
+static void*
+ar_writer_main(void* arg)
+{
+    struct archive* ar = arg;
+    bool ok = true;
+
+    pthread_mutex_lock(&ar->lock);
+    for (;;) {
+        struct ar_entry* e = ar->head;
+        if (ar->stop || (e == NULL && ar->walk_done))
+            break;
+
+        if (e == NULL || e->state == AR_LOADING) {
+            pthread_cond_wait(&ar->cond, &ar->lock);
+            continue;
+        }
+
+        // If the readers haven't gotten to this entry yet, don't
+        // let them start now: we'll read it ourselves.
+        ar->head = e->next;
+        if (ar->head == NULL)
+            ar->tailp = &ar->head;
+        if (ar->cursor == e)
+            ar->cursor = e->next;
+        pthread_mutex_unlock(&ar->lock);
+
+        ok = ar_put_entry(ar, e);
+
+        pthread_mutex_lock(&ar->lock);
+        if (e->state == AR_LOADED) {
+            ar->prefetched -= e->st.st_size;
+            pthread_cond_broadcast(&ar->cond);
+        }
+
+        ar_free_entry(e);
+        if (!ok) {
+            ar->stop = true;
+            pthread_cond_broadcast(&ar->cond);
+        }
+    }
+
+    pthread_mutex_unlock(&ar->lock);
+
+    // Two zero blocks end a tar archive.
+    static const char zeros[2 * ARCHIVE_BLOCKSZ];
+    if (ok)
+        ok = ar_write(ar, zeros, sizeof (zeros));
+
+    pthread_join(ar->walker, NULL);
+    for (unsigned i = 0; i < ar->nr_readers; ++i)
+        pthread_join(ar->readers[i], NULL);
+
+    while (ar->head != NULL) {
+        struct ar_entry* e = ar->head;
+        ar->head = e->next;
+        ar_free_entry(e);
+    }
+
+    close(ar->data_fd);
+    close(ar->err_fd);
+    return NULL;
+}
+
+static void
+ar_cleanup(void* arg)
+{
+    struct archive* ar = arg;
+    if (ar->running) {
+        pthread_mutex_lock(&ar->lock);
+        ar->stop = true;
+        pthread_cond_broadcast(&ar->cond);
+        pthread_mutex_unlock(&ar->lock);
+        pthread_join(ar->writer, NULL);
+        ar->running = false;
+    }
+}
+
+// Make a pipe whose read end we track as an fdh and whose write end
+// belongs to the archive threads, which close it when they're done.
+static int
+ar_pipe(struct fdh** rd)
+{
+    int fds[2];
+    if (pipe(fds) == -1)
+        die_errno("pipe");
+
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    struct cleanup* cl = cleanup_allocate();
+    cleanup_commit_close_fd(cl, fds[0]);
+    *rd = fdh_dup(fds[0]);
+    return fds[1];
+}
+
+struct archive*
+archive_start(const char* root, struct fdh** data, struct fdh** errors)
+{
+    struct archive* ar = xcalloc(sizeof (*ar));
+    ar->root = xstrdup(root);
+    ar->tailp = &ar->head;
+    pthread_mutex_init(&ar->lock, NULL);
+    pthread_cond_init(&ar->cond, NULL);
+
+    // Register the cleanup before making the pipes so that on
+    // unwind, our read ends close first and a writer blocked on a
+    // full pipe fails with EPIPE instead of hanging the join.
+    struct cleanup* cl = cleanup_allocate();
+    cleanup_commit(cl, ar_cleanup, ar);
+    ar->data_fd = ar_pipe(data);
+    ar->err_fd = ar_pipe(errors);
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    ar->nr_readers = XMAX(1, XMIN(ncpu, ARCHIVE_READER_THREADS));
+
+    sigset_t all_signals;
+    sigset_t saved_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &saved_mask);
+    int ret = pthread_create(&ar->walker, NULL, ar_walker_main, ar);
+    for (unsigned i = 0; ret == 0 && i < ar->nr_readers; ++i)
+        ret = pthread_create(&ar->readers[i], NULL, ar_reader_main, ar);
+    if (ret == 0)
+        ret = pthread_create(&ar->writer, NULL, ar_writer_main, ar);
+    pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+
+    // We don't try to unwind a partial start: the caller is about to
+    // die anyway.
+    if (ret != 0)
+        die(ret, "pthread_create: %s", strerror(ret));
+
+    ar->running = true;
+    return ar;
+}
+
+unsigned
+archive_finish(struct archive* ar)
+{
+    if (ar->running) {
+        pthread_join(ar->writer, NULL);
+        ar->running = false;
+    }
+
+    return __atomic_load_n(&ar->nr_problems, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,27 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+#include "util.h"
+
+// An archive streams a directory tree as a POSIX (pax) tar archive
+// from background threads.  The tar stream comes out of DATA and
+// one line per file we had to skip or truncate comes out of ERRORS.
+// Both reach EOF when the archive is complete.
+
+struct archive;
+
+struct archive* archive_start(const char* root,
+                              struct fdh** data,
+                              struct fdh** errors);
+
+// Wait for the archive threads to finish and return the number of
+// problems reported on ERRORS.
+unsigned archive_finish(struct archive* ar);
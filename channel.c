@@ -11,11 +11,18 @@
 #include <assert.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include "channel.h"
 #include "util.h"
 #include "ringbuf.h"
 #include "adbenc.h"
+#include "iothread.h"
+#include "trace.h"
 
 struct channel*
 channel_new(struct fdh* fdh,
@@ -26,9 +33,75 @@ channel_new(struct fdh* fdh,
     ch->fdh = fdh;
     ch->dir = direction;
     ch->rb = ringbuf_new(rbsz);
+    ch->prio = CHANNEL_PRIO_NORMAL;
+    ch->weight = 1;
     return ch;
 }
 
+// Count one syscall against C.  Safe from an IO thread.
+static void
+channel_count_syscall(struct channel* c)
+{
+    __atomic_add_fetch(&c->stats.syscalls, 1, __ATOMIC_RELAXED);
+}
+
+static void
+channel_count_escapes(struct channel* c, size_t nr)
+{
+    if (nr > 0)
+        __atomic_add_fetch(&c->stats.escape_bytes, nr, __ATOMIC_RELAXED);
+}
+
+static void
+channel_note_peak(struct channel* c)
+{
+    size_t buffered = channel_buffered(c);
+    if (buffered > c->stats.peak_buffered)
+        c->stats.peak_buffered = buffered;
+}
+
+// Start or end a stall interval.  We read the clock only on
+// transitions, so callers can report their state as often as they
+// like.
+void
+stall_note(struct stall* s, bool stalled)
+{
+    if (stalled == (s->since_ns != 0))
+        return;
+
+    uint64_t now = monotonic_ns();
+    if (stalled) {
+        s->since_ns = now;
+        s->count += 1;
+    } else {
+        s->total_ns += now - s->since_ns;
+        s->since_ns = 0;
+    }
+}
+
+// Total time stalled as of NOW, counting any stall in progress.
+uint64_t
+stall_ns(const struct stall* s, uint64_t now)
+{
+    uint64_t total = s->total_ns;
+    if (s->since_ns != 0 && now > s->since_ns)
+        total += now - s->since_ns;
+    return total;
+}
+
+// A channel that reads from its fd but has used up the window its
+// peer granted is stalled on the peer's consumer.  Called from the
+// pump, which sees every channel whose window or fd changed.
+void
+channel_note_stalls(struct channel* c)
+{
+    bool blocked = false;
+    if (c->dir == CHANNEL_FROM_FD && c->track_window && c->fdh != NULL)
+        blocked = __atomic_load_n(&c->window, __ATOMIC_ACQUIRE) == 0;
+
+    stall_note(&c->stats.window_blocked, blocked);
+}
+
 static size_t
 channel_wanted_readsz(struct channel* c)
 {
@@ -38,6 +111,11 @@ channel_wanted_readsz(struct channel* c)
     if (c->fdh == NULL)
         return 0;
 
+    // Spliced bytes we haven't sent stay in the pipe, which therefore
+    // stays readable; don't poll it again until they're on their way.
+    if (c->splice_avail > 0 || c->splice_busy)
+        return 0;
+
     return XMIN(ringbuf_room(c->rb), c->window);
 }
 
@@ -50,26 +128,252 @@ channel_wanted_writesz(struct channel* c)
     if (c->fdh == NULL)
         return 0;
 
-    return XMIN(ringbuf_size(c->rb), UINT32_MAX - c->bytes_written);
+    return XMIN(channel_buffered(c), UINT32_MAX - c->bytes_written);
 }
 
 static size_t
 channel_read_1(struct channel* c, size_t sz)
 {
     size_t nr_read = ringbuf_read_in(c->rb, c->fdh->fd, sz);
+    channel_count_syscall(c);
     ringbuf_note_added(c->rb, nr_read);
     return nr_read;
 }
 
+// Bytes waiting to go to C's fd: first whatever is in C's own
+// ringbuf, then the segments chained behind it, plus any spliced
+// bytes C still owes.  For a FROM_FD channel, bytes waiting to go
+// to the peer, including spliced ones still sitting in the pipe.
+size_t
+channel_buffered(const struct channel* c)
+{
+    return (ringbuf_size(c->rb) + c->chain_bytes +
+            c->splice_avail + c->splice_left);
+}
+
+static struct ringbuf_seg*
+channel_chain_at(struct channel* c, unsigned n)
+{
+    return c->chain[(c->chain_head + n) % CHANNEL_MAX_CHAIN];
+}
+
+static void
+channel_chain_consume(struct channel* c, size_t nr)
+{
+    assert(nr <= c->chain_bytes);
+    c->chain_bytes -= nr;
+    while (nr > 0) {
+        struct ringbuf_seg* seg = channel_chain_at(c, 0);
+        size_t left = ringbuf_seg_size(seg) - c->chain_skip;
+        if (nr < left) {
+            c->chain_skip += nr;
+            break;
+        }
+
+        nr -= left;
+        ringbuf_seg_release(seg);
+        c->chain_head = (c->chain_head + 1) % CHANNEL_MAX_CHAIN;
+        c->chain_len -= 1;
+        c->chain_skip = 0;
+    }
+
+    if (c->chain_len == 0 && c->held) {
+        TAILQ_REMOVE(c->held_list, c, held_link);
+        c->held = false;
+    }
+}
+
+// Copy C's held segments into its own ringbuf and let go of them.
+// Window accounting guarantees that the ringbuf has room.
+void
+channel_unchain(struct channel* c)
+{
+    assert(ringbuf_room(c->rb) >= c->chain_bytes);
+    while (c->chain_len > 0) {
+        struct ringbuf_seg* seg = channel_chain_at(c, 0);
+        struct iovec iov[2];
+        ringbuf_seg_iov(seg, c->chain_skip, iov);
+        for (int i = 0; i < ARRAYSIZE(iov); ++i) {
+            ringbuf_copy_in(c->rb, iov[i].iov_base, iov[i].iov_len);
+            ringbuf_note_added(c->rb, iov[i].iov_len);
+        }
+
+        channel_chain_consume(c, iovec_sum(iov, ARRAYSIZE(iov)));
+    }
+}
+
+// Gather as much chained data as we can into one writev.
+static size_t
+channel_write_chain(struct channel* c, size_t sz)
+{
+    struct iovec iov[2 * CHANNEL_MAX_CHAIN];
+    unsigned nio = 0;
+    size_t total = 0;
+
+    for (unsigned n = 0; n < c->chain_len && total < sz; ++n) {
+        struct iovec segiov[2];
+        ringbuf_seg_iov(channel_chain_at(c, n),
+                        n == 0 ? c->chain_skip : 0,
+                        segiov);
+        for (int i = 0; i < ARRAYSIZE(segiov) && total < sz; ++i) {
+            if (segiov[i].iov_len == 0)
+                continue;
+
+            iov[nio] = segiov[i];
+            iov[nio].iov_len = XMIN(iov[nio].iov_len, sz - total);
+            total += iov[nio].iov_len;
+            nio += 1;
+        }
+    }
+
+    ssize_t ret = writev(c->fdh->fd, iov, nio);
+    channel_count_syscall(c);
+    if (ret < 0)
+        die_errno("writev");
+
+    channel_chain_consume(c, ret);
+    return ret;
+}
+
 static size_t
 channel_write_1(struct channel* c, size_t sz)
 {
-    size_t nr_written = ringbuf_write_out(c->rb, c->fdh->fd, sz);
+    size_t rbsz = ringbuf_size(c->rb);
+    if (rbsz == 0)
+        return channel_write_chain(c, sz);
+
+    size_t nr_written =
+        ringbuf_write_out(c->rb, c->fdh->fd, XMIN(sz, rbsz));
+    channel_count_syscall(c);
     ringbuf_note_removed(c->rb, nr_written);
     return nr_written;
 }
 
-static size_t
+// Can C take part in splicing?  A FROM_FD channel can be a source if
+// it reads from a pipe; a TO_FD channel can be a destination if it
+// writes to a pipe or a socket.  Either way, bytes must pass through
+// unchanged, so no encoding and no IO thread.
+bool
+channel_can_splice(struct channel* c)
+{
+#ifdef HAVE_SPLICE
+    struct stat st;
+
+    if (c->fdh == NULL || c->iot || c->adb_encoding_hack)
+        return false;
+
+    if (fstat(c->fdh->fd, &st) == -1)
+        return false;
+
+    return (S_ISFIFO(st.st_mode) ||
+            (c->dir == CHANNEL_TO_FD && S_ISSOCK(st.st_mode)));
+#else
+    return false;
+#endif
+}
+
+// C no longer owes spliced bytes, either because it wrote them or
+// because it gave up on its fd.  Let the source get on with reading
+// or closing.
+static void
+channel_splice_done(struct channel* c)
+{
+    struct channel* src = c->splice_src;
+    c->splice_src = NULL;
+    c->splice_after = 0;
+    c->splice_left = 0;
+    src->splice_busy = false;
+    channel_mark_dirty(src);
+    if (src->pending_close)
+        channel_close(src);
+}
+
+// Move as many owed bytes as we can from the source's pipe to C's
+// fd.  Return false with errno set on error.  Doesn't die, so it's
+// safe to call from outside channel_poll.
+static bool
+channel_splice_1(struct channel* c)
+{
+#ifdef HAVE_SPLICE
+    ssize_t ret = splice(c->splice_src->fdh->fd, NULL,
+                         c->fdh->fd, NULL,
+                         c->splice_left,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    channel_count_syscall(c);
+    if (ret < 0)
+        return errno == EAGAIN || errno == EINTR;
+
+    if (ret == 0) {
+        // The source counted these bytes in its pipe, so they can't
+        // have gone anywhere.
+        errno = EIO;
+        return false;
+    }
+
+    c->splice_left -= ret;
+    c->stats.bytes += ret;
+    trace(TRACE_CHANNEL_WRITE, c->chno, ret, c->splice_left);
+    if (c->splice_left == 0)
+        channel_splice_done(c);
+
+    return true;
+#else
+    errno = ENOSYS;
+    return false;
+#endif
+}
+
+// Work off C's splice debt: first the ringbuf bytes queued ahead of
+// the spliced ones, then the spliced bytes themselves.
+static void
+channel_splice_out(struct channel* c)
+{
+    if (c->splice_after > 0) {
+        size_t nr_written =
+            ringbuf_write_out(c->rb, c->fdh->fd, c->splice_after);
+        channel_count_syscall(c);
+        ringbuf_note_removed(c->rb, nr_written);
+        c->stats.bytes += nr_written;
+        c->splice_after -= nr_written;
+        if (c->splice_after > 0)
+            return;
+    }
+
+    if (!channel_splice_1(c))
+        die_errno("splice");
+}
+
+// Send SZ bytes from SRC's pipe to C's fd without copying them
+// through our address space.  SRC must have counted the bytes in its
+// splice_avail; the caller takes them out of there.  The bytes go
+// after anything already buffered in C and before anything written
+// to C later.  Until C has written them all, SRC keeps its fd open
+// and doesn't read from it.
+void
+channel_splice_from(struct channel* c, struct channel* src, size_t sz)
+{
+    assert(c->dir == CHANNEL_TO_FD);
+    assert(src->dir == CHANNEL_FROM_FD && src->splice_p);
+    assert(c->fdh != NULL && c->splice_left == 0);
+    assert(c->chain_len == 0 && !c->track_bytes_written);
+    assert(sz > 0 && sz <= src->splice_avail);
+
+    c->splice_src = src;
+    c->splice_after = ringbuf_size(c->rb);
+    c->splice_left = sz;
+    src->splice_busy = true;
+    channel_mark_dirty(c);
+
+    // If nothing's ahead of the bytes, try sending them now.  We'll
+    // find out about any error when we next poll C.
+    if (c->splice_after == 0)
+        (void) channel_splice_1(c);
+}
+
+// Returns the number of bytes added to the ringbuf, or -1 with errno
+// set if we failed before reading anything.  Doesn't die, so it's
+// safe to call from an IO thread.
+static ssize_t
 channel_read_adb_hack(struct channel* c, size_t sz)
 {
     size_t nr_added = 0;
@@ -78,8 +382,9 @@ channel_read_adb_hack(struct channel* c, size_t sz)
         char buf[4096];
         size_t to_read = XMIN(sz - nr_added, sizeof (buf));
         ssize_t chunksz = read(c->fdh->fd, buf, to_read);
+        channel_count_syscall(c);
         if (chunksz < 0 && nr_added == 0)
-            die_errno("read");
+            return -1;
         if (chunksz < 1)
             break;
 
@@ -97,6 +402,8 @@ channel_read_adb_hack(struct channel* c, size_t sz)
             np += (dec - decstart);
         }
 
+        c->leftover_escape = state;
+        channel_count_escapes(c, chunksz - np);
         ringbuf_note_added(c->rb, np);
         nr_added += np;
     }
@@ -104,20 +411,10 @@ channel_read_adb_hack(struct channel* c, size_t sz)
     return nr_added;
 }
 
+// Returns the number of bytes removed from the ringbuf, or -1 with
+// errno set if we failed before writing anything.  Like
+// channel_read_adb_hack, safe to call from an IO thread.
 static ssize_t
-write_skip(int fd, const void* buf, size_t sz, size_t skip)
-{
-    assert(skip <= sz);
-    buf = (const char*) buf + skip;
-    sz -= skip;
-    ssize_t nr_written = write(fd, buf, sz);
-    if (nr_written >= 0)
-        nr_written += skip;
-
-    return nr_written;
-}
-
-static size_t
 channel_write_adb_hack(struct channel* c, size_t sz)
 {
     size_t nr_removed = 0;
@@ -139,15 +436,15 @@ channel_write_adb_hack(struct channel* c, size_t sz)
             adb_encode(&state, &enc, encend, &in, inend);
         }
 
-        // If we left a byte in the ringbuffer, don't actually write
-        // its first half now (since we wrote it before), but pretend
-        // we did.
-        size_t skip = (c->leftover_escape != 0);
-        ssize_t nr_written =
-            write_skip(c->fdh->fd, encbuf, enc - encbuf, skip);
+        // If we left a byte in the ringbuffer after writing the
+        // first half of its escape sequence, the encoder resumes
+        // with the second half, so encbuf starts with exactly the
+        // bytes we still owe the peer.
+        ssize_t nr_written = write(c->fdh->fd, encbuf, enc - encbuf);
+        channel_count_syscall(c);
 
         if (nr_written < 0 && nr_removed == 0)
-            die_errno("write");
+            return -1;
         if (nr_written < 0)
             break;
 
@@ -162,15 +459,11 @@ channel_write_adb_hack(struct channel* c, size_t sz)
             nr_encoded += (in - (char*) iov[i].iov_base);
         }
 
-        // If we wrote a partial encoded byte, leave the plain byte in
-        // the ringbuf so that we know this channel still needs to
-        // write.
-        if (state != 0) {
-            assert(nr_encoded > 0);
-            nr_encoded -= 1;
-        }
-
+        // If we wrote a partial encoded byte, the encoder hasn't
+        // consumed it, so the plain byte stays in the ringbuf and we
+        // know this channel still needs to write.
         ringbuf_note_removed(c->rb, nr_encoded);
+        channel_count_escapes(c, nr_written - nr_encoded);
         nr_removed += nr_encoded;
         c->leftover_escape = state;
     }
@@ -181,6 +474,14 @@ channel_write_adb_hack(struct channel* c, size_t sz)
 struct pollfd
 channel_request_poll(struct channel* c)
 {
+    if (c->iot) {
+        // Before we sleep on the IO thread's notification pipe, make
+        // sure the thread has seen any room or data we've made
+        // available to it since it last went to sleep.
+        iothread_kick(c->iot);
+        return (struct pollfd){iothread_notify_fd(c->iot), POLLIN, 0};
+    }
+
     if (channel_wanted_readsz(c))
         return (struct pollfd){c->fdh->fd, POLLIN, 0};
 
@@ -198,11 +499,18 @@ channel_write(struct channel* c, const struct iovec* iov, unsigned nio)
     if (c->fdh == NULL)
         return; // If the stream is closed, just discard
 
-    bool try_direct = !c->always_buffer && ringbuf_size(c->rb) == 0;
+    // Keep bytes in order: anything we buffer below goes after the
+    // chained segments, so move those into the ringbuf first.
+    if (c->chain_len > 0)
+        channel_unchain(c);
+
+    bool try_direct = (!c->always_buffer &&
+                       ringbuf_size(c->rb) == 0 &&
+                       c->splice_left == 0);
     size_t directwrsz = 0;
     size_t totalsz;
 
-    if (c->adb_encoding_hack)
+    if (c->adb_encoding_hack || c->iot)
         try_direct = false;
 
     // If writing directly, would make us overflow the write counter,
@@ -219,6 +527,9 @@ channel_write(struct channel* c, const struct iovec* iov, unsigned nio)
     if (try_direct) {
         // If writev fails, just fall back to buffering path
         directwrsz = XMAX(writev(c->fdh->fd, iov, nio), 0);
+        channel_count_syscall(c);
+        c->stats.bytes += directwrsz;
+        trace(TRACE_CHANNEL_WRITE, c->chno, directwrsz, totalsz - directwrsz);
         if (c->track_bytes_written)
             c->bytes_written += directwrsz;
     }
@@ -231,6 +542,69 @@ channel_write(struct channel* c, const struct iovec* iov, unsigned nio)
         ringbuf_copy_in(c->rb, b, blen);
         ringbuf_note_added(c->rb, blen);
     }
+
+    channel_note_peak(c);
+    channel_mark_dirty(c);
+}
+
+// Like channel_write, but write the next SZ bytes of SRC and remove
+// them from SRC.  Whatever we can't write immediately stays where
+// it is: we hold it in SRC and chain the segment onto C instead of
+// copying it into C's ringbuf.  We fall back to copying for
+// channels that transform or thread their output and when we run
+// out of segments.
+void
+channel_write_from(struct channel* c, struct ringbuf* src, size_t sz)
+{
+    assert(c->dir == CHANNEL_TO_FD);
+    struct iovec iov[2];
+
+    if (c->fdh == NULL || c->adb_encoding_hack || c->iot ||
+        c->chain_len == CHANNEL_MAX_CHAIN)
+    {
+        ringbuf_readable_iov(src, iov, sz);
+        channel_write(c, iov, ARRAYSIZE(iov));
+        ringbuf_note_removed(src, sz);
+        return;
+    }
+
+    if (!c->always_buffer &&
+        channel_buffered(c) == 0 &&
+        (!c->track_bytes_written || UINT32_MAX - c->bytes_written >= sz))
+    {
+        ringbuf_readable_iov(src, iov, sz);
+        size_t directwrsz =
+            XMAX(writev(c->fdh->fd, iov, ARRAYSIZE(iov)), 0);
+        channel_count_syscall(c);
+        c->stats.bytes += directwrsz;
+        trace(TRACE_CHANNEL_WRITE, c->chno, directwrsz, sz - directwrsz);
+        if (c->track_bytes_written)
+            c->bytes_written += directwrsz;
+
+        ringbuf_note_removed(src, directwrsz);
+        sz -= directwrsz;
+    }
+
+    if (sz > 0) {
+        struct ringbuf_seg* seg = ringbuf_hold(src, sz);
+        if (seg == NULL) {
+            ringbuf_readable_iov(src, iov, sz);
+            channel_write(c, iov, ARRAYSIZE(iov));
+            ringbuf_note_removed(src, sz);
+            return;
+        }
+
+        c->chain[(c->chain_head + c->chain_len) % CHANNEL_MAX_CHAIN] = seg;
+        c->chain_len += 1;
+        c->chain_bytes += sz;
+        if (!c->held && c->held_list != NULL) {
+            TAILQ_INSERT_TAIL(c->held_list, c, held_link);
+            c->held = true;
+        }
+        channel_note_peak(c);
+    }
+
+    channel_mark_dirty(c);
 }
 
 // Begin channel shutdown process.  Closure is not complete until
@@ -239,15 +613,46 @@ void
 channel_close(struct channel* c)
 {
     c->pending_close = true;
+    channel_mark_dirty(c);
+
+    // TO_PEER may still owe bytes from our pipe: keep it open until
+    // channel_splice_done calls us again.
+    if (c->splice_busy)
+        return;
+
     if (c->fdh != NULL
-        && ((c->dir == CHANNEL_TO_FD && ringbuf_size(c->rb) == 0)
+        && ((c->dir == CHANNEL_TO_FD && channel_buffered(c) == 0)
             || c->dir == CHANNEL_FROM_FD))
     {
+        if (c->iot) {
+            iothread_stop(c->iot);
+            c->iot = NULL;
+        }
+
+        // A socket we share with a channel going the other way stays
+        // open after we close our descriptor, so tell the far end
+        // explicitly that we're done writing.
+        if (c->shutdown_on_close && c->dir == CHANNEL_TO_FD)
+            (void) shutdown(c->fdh->fd, SHUT_WR);
+
+        trace(TRACE_CHANNEL_CLOSE, c->chno, c->dir, 0);
         fdh_destroy(c->fdh);
         c->fdh = NULL;
+
+        // Any unsent spliced bytes go away with the pipe.
+        c->splice_avail = 0;
     }
 }
 
+// Remember when data first arrived in an empty buffer so that the
+// pump knows how long it has been holding small reads.
+static void
+channel_note_buffered(struct channel* c, size_t nr_read)
+{
+    if (c->coalesce && c->first_buffered_ns == 0 && nr_read > 0)
+        c->first_buffered_ns = monotonic_ns();
+}
+
 static void
 poll_channel_1(void* arg)
 {
@@ -256,46 +661,137 @@ poll_channel_1(void* arg)
 
     if ((sz = channel_wanted_readsz(c)) > 0) {
         size_t nr_read;
-        if (c->adb_encoding_hack)
-            nr_read = channel_read_adb_hack(c, sz);
-        else
+        int avail = 0;
+        if (c->splice_p) {
+            channel_count_syscall(c);
+            if (ioctl(c->fdh->fd, FIONREAD, &avail) != 0)
+                avail = 0;
+        }
+
+        if (avail > 0 &&
+            XMIN((size_t) avail, c->window) >= CHANNEL_SPLICE_MIN)
+        {
+            // Leave the bytes where they are and let the pump splice
+            // them to the peer.  We still charge them to the window
+            // now, exactly as if we'd read them.
+            nr_read = XMIN((size_t) avail, c->window);
+            c->splice_avail = nr_read;
+        } else if (c->adb_encoding_hack) {
+            ssize_t ret = channel_read_adb_hack(c, sz);
+            if (ret < 0)
+                die_errno("read");
+            nr_read = ret;
+        } else {
             nr_read = channel_read_1(c, sz);
+        }
 
         assert(nr_read <= c->window);
         if (c->track_window)
             c->window -= nr_read;
 
+        channel_note_buffered(c, nr_read);
+        c->stats.bytes += nr_read;
+        channel_note_peak(c);
+        trace(TRACE_CHANNEL_READ, c->chno, nr_read, c->window);
+
         if (nr_read == 0)
             channel_close(c);
     }
 
+    // Poll told us the fd has room for one write; having used it on
+    // the debt, leave whatever follows for next time.
+    if (c->splice_left > 0) {
+        channel_splice_out(c);
+        return;
+    }
+
     if ((sz = channel_wanted_writesz(c)) > 0) {
         size_t nr_written;
-        if (c->adb_encoding_hack)
-            nr_written = channel_write_adb_hack(c, sz);
-        else
+        if (c->adb_encoding_hack) {
+            ssize_t ret = channel_write_adb_hack(c, sz);
+            if (ret < 0)
+                die_errno("write");
+            nr_written = ret;
+        } else {
             nr_written = channel_write_1(c, sz);
+        }
 
         assert(nr_written <= UINT32_MAX - c->bytes_written);
+        c->stats.bytes += nr_written;
+        trace(TRACE_CHANNEL_WRITE, c->chno, nr_written, channel_buffered(c));
         if (c->track_bytes_written)
             c->bytes_written += nr_written;
 
-        if (c->pending_close && ringbuf_size(c->rb) == 0)
+        if (c->pending_close && channel_buffered(c) == 0)
             channel_close(c);
     }
 }
 
+// Queue C for attention from the next io_loop_pump.  Any change to
+// a channel's buffer, window, or close state must end up here.
+void
+channel_mark_dirty(struct channel* c)
+{
+    if (!c->dirty && c->dirty_list != NULL) {
+        TAILQ_INSERT_TAIL(c->dirty_list, c, dirty_link);
+        c->dirty = true;
+    }
+}
+
 bool
 channel_dead_p(struct channel* c)
 {
     return (c->fdh == NULL &&
-            ringbuf_size(c->rb) == 0 &&
+            channel_buffered(c) == 0 &&
             c->sent_eof == true);
 }
 
+static void
+channel_poll_threaded(struct channel* c)
+{
+    struct iothread_result r;
+    iothread_harvest(c->iot, &r);
+    c->stats.bytes += r.nr_done;
+    if (r.nr_done > 0)
+        trace(c->dir == CHANNEL_FROM_FD
+              ? TRACE_CHANNEL_READ
+              : TRACE_CHANNEL_WRITE,
+              c->chno,
+              r.nr_done,
+              (c->dir == CHANNEL_FROM_FD
+               ? __atomic_load_n(&c->window, __ATOMIC_ACQUIRE)
+               : ringbuf_size(c->rb)));
+
+    if (c->dir == CHANNEL_TO_FD && c->track_bytes_written) {
+        assert(r.nr_done <= UINT32_MAX - c->bytes_written);
+        c->bytes_written += r.nr_done;
+    }
+
+    if (c->dir == CHANNEL_FROM_FD) {
+        channel_note_buffered(c, r.nr_done);
+        channel_note_peak(c);
+    }
+
+    if (r.err != 0) {
+        // The thread has already purged any bytes it couldn't write.
+        channel_close(c);
+        c->err = r.err;
+    } else if (r.eof ||
+               (c->pending_close && ringbuf_size(c->rb) == 0))
+    {
+        channel_close(c);
+    }
+}
+
 void
 channel_poll(struct channel* c)
 {
+    channel_mark_dirty(c);
+    if (c->iot) {
+        channel_poll_threaded(c);
+        return;
+    }
+
     struct errinfo ei = { .want_msg = false };
     if (catch_error(poll_channel_1, c, &ei) && ei.err != EINTR) {
         if (c->dir == CHANNEL_TO_FD) {
@@ -310,9 +806,76 @@ channel_poll(struct channel* c)
             // without adding special logic all over the place to
             // account for this situation.
             ringbuf_note_removed(c->rb, ringbuf_size(c->rb));
+            channel_chain_consume(c, c->chain_bytes);
+            if (c->splice_src != NULL)
+                channel_splice_done(c);
         }
 
         channel_close(c);
         c->err = ei.err;
     }
 }
+
+// Hand IO on C's file descriptor to a dedicated thread.  From now on,
+// the main loop interacts with C only through its ringbuf and the
+// thread's notification pipe.
+void
+channel_start_thread(struct channel* c)
+{
+    assert(c->iot == NULL);
+    if (c->fdh != NULL)
+        c->iot = iothread_start(c);
+}
+
+// Like channel_wanted_readsz and channel_wanted_writesz, but callable
+// from an IO thread: we look only at the ringbuf and the window.
+size_t
+channel_thread_wanted(struct channel* c)
+{
+    if (c->dir == CHANNEL_TO_FD)
+        return ringbuf_size(c->rb);
+
+    size_t sz = ringbuf_room(c->rb);
+    if (c->track_window)
+        sz = XMIN(sz, __atomic_load_n(&c->window, __ATOMIC_ACQUIRE));
+
+    return sz;
+}
+
+// Move up to SZ bytes between C's fd and its ringbuf.  Return the
+// number of bytes moved, zero on EOF, or -1 with errno set.  Never
+// dies.
+ssize_t
+channel_thread_io(struct channel* c, size_t sz)
+{
+    struct iovec iov[2];
+    ssize_t ret;
+
+    sz = XMIN(sz, SSIZE_MAX);
+    if (c->dir == CHANNEL_FROM_FD) {
+        if (c->adb_encoding_hack) {
+            ret = channel_read_adb_hack(c, sz);
+        } else {
+            ringbuf_writable_iov(c->rb, iov, sz);
+            ret = readv(c->fdh->fd, iov, ARRAYSIZE(iov));
+            channel_count_syscall(c);
+            if (ret > 0)
+                ringbuf_note_added(c->rb, ret);
+        }
+
+        if (ret > 0 && c->track_window)
+            __atomic_sub_fetch(&c->window, (uint32_t) ret, __ATOMIC_RELEASE);
+    } else {
+        if (c->adb_encoding_hack) {
+            ret = channel_write_adb_hack(c, sz);
+        } else {
+            ringbuf_readable_iov(c->rb, iov, sz);
+            ret = writev(c->fdh->fd, iov, ARRAYSIZE(iov));
+            channel_count_syscall(c);
+            if (ret > 0)
+                ringbuf_note_removed(c->rb, ret);
+        }
+    }
+
+    return ret;
+}
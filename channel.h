@@ -11,19 +11,96 @@
 #pragma once
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/poll.h>
+#include <sys/queue.h>
 
 enum channel_direction {
     CHANNEL_TO_FD,
     CHANNEL_FROM_FD,
 };
 
+struct iothread;
+struct ringbuf_seg;
+
+// Maximum number of held segments a channel can have queued behind
+// its ringbuf.  See channel_write_from.
+#define CHANNEL_MAX_CHAIN 16
+
+// A spliced channel (see channel_splice_from) moves reads at least
+// this large from fd to peer inside the kernel.  Smaller reads go
+// through the ringbuf as usual, where they can be coalesced, and
+// where they don't pay for a separate write of the frame header.
+#define CHANNEL_SPLICE_MIN 16384
+
+// Channels whose state changed since the last pump, channels
+// waiting for the scheduler, or channels holding segments of
+// FROM_PEER.  See io_loop_pump.
+TAILQ_HEAD(channel_list, channel);
+
+// Scheduling classes for outgoing channel data, highest priority
+// first.  Data from a lower class goes out only when no channel in
+// a higher class has anything to send, except for the occasional
+// frame that keeps it from starving.  See xmit_scheduled_data.
+enum channel_priority {
+    CHANNEL_PRIO_INTERACTIVE,
+    CHANNEL_PRIO_NORMAL,
+    CHANNEL_PRIO_BULK,
+    NR_CHANNEL_PRIO
+};
+
+// An interval during which something couldn't make progress, and
+// the total of all such intervals.  See stall_note.
+struct stall {
+    uint64_t since_ns;
+    uint64_t total_ns;
+    uint64_t count;
+};
+
+void stall_note(struct stall* s, bool stalled);
+uint64_t stall_ns(const struct stall* s, uint64_t now);
+
+// Counters kept for every channel, cheap enough to leave on all the
+// time.  BYTES counts payload bytes between the fd and the ringbuf,
+// whichever way they move; ESCAPE_BYTES counts what adb encoding
+// added to or removed from them on the fd.  An IO thread updates
+// SYSCALLS and ESCAPE_BYTES concurrently, so those are atomic.
+struct channel_stats {
+    uint64_t bytes;
+    uint64_t frames;
+    size_t syscalls;
+    size_t escape_bytes;
+    size_t peak_buffered;
+    struct stall window_blocked;
+    struct stall to_peer_blocked;
+};
+
 struct channel {
     struct fdh* fdh;
+    struct iothread* iot;
+    struct channel_list* dirty_list;
+    TAILQ_ENTRY(channel) dirty_link;
+    TAILQ_ENTRY(channel) sched_link;
+    struct channel_list* held_list;
+    TAILQ_ENTRY(channel) held_link;
+    unsigned chno;
+    enum channel_priority prio;
+    uint32_t weight;
+    size_t deficit;
+    uint64_t first_buffered_ns;
     enum channel_direction dir;
     int err;
     struct ringbuf* rb;
+    struct ringbuf_seg* chain[CHANNEL_MAX_CHAIN];
+    unsigned chain_head;
+    unsigned chain_len;
+    size_t chain_skip;
+    size_t chain_bytes;
+    struct channel* splice_src;
+    size_t splice_avail;
+    size_t splice_after;
+    size_t splice_left;
     uint32_t bytes_written;
     uint32_t window;
     unsigned sent_eof : 1;
@@ -33,6 +110,16 @@ struct channel {
     unsigned track_window : 1;
     unsigned adb_encoding_hack : 1;
     unsigned leftover_escape : 2;
+    unsigned dirty : 1;
+    unsigned held : 1;
+    unsigned scheduled : 1;
+    unsigned has_turn : 1;
+    unsigned coalesce : 1;
+    unsigned shutdown_on_close : 1;
+    unsigned splice_p : 1;
+    unsigned splice_busy : 1;
+    unsigned regular_file : 1;
+    struct channel_stats stats;
 };
 
 struct channel* channel_new(struct fdh* fdh,
@@ -46,6 +133,23 @@ void channel_write(struct channel* c,
                    const struct iovec* iov,
                    unsigned nio);
 
+void channel_write_from(struct channel* c,
+                        struct ringbuf* src,
+                        size_t sz);
+
+size_t channel_buffered(const struct channel* c);
+bool channel_can_splice(struct channel* c);
+void channel_splice_from(struct channel* c,
+                         struct channel* src,
+                         size_t sz);
+void channel_unchain(struct channel* c);
+
 void channel_close(struct channel* c);
+void channel_note_stalls(struct channel* c);
 
 bool channel_dead_p(struct channel* c);
+void channel_mark_dirty(struct channel* c);
+
+void channel_start_thread(struct channel* c);
+size_t channel_thread_wanted(struct channel* c);
+ssize_t channel_thread_io(struct channel* c, size_t sz);
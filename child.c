@@ -16,14 +16,20 @@
 #include <string.h>
 #include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include "child.h"
 
+#if !defined(F_DUPFD_CLOEXEC) && defined(__linux__)
+#define F_DUPFD_CLOEXEC 1030
+#endif
+
 struct internal_child_info {
     int flags;
     const struct child_start_info* csi;
     int* childfd;
+    int* extra_childfd;
     int pty_slave;
 };
 
@@ -48,6 +54,26 @@ child_child_1(void* arg)
         if (dup2(ci->childfd[i], i) == -1)
             die_errno("dup2(%d->%d)", ci->childfd[i], i);
 
+    // Move our ends of the extra pipes out of the way first so that
+    // putting one in place can't clobber another.
+    const struct child_start_info* csi = ci->csi;
+    int fd_floor = 3;
+    for (unsigned i = 0; i < csi->nr_extra_fd; ++i)
+        fd_floor = XMAX(fd_floor, csi->extra_fd[i].fd + 1);
+
+    for (unsigned i = 0; i < csi->nr_extra_fd; ++i) {
+        int fd = fcntl(ci->extra_childfd[i], F_DUPFD_CLOEXEC, fd_floor);
+        if (fd == -1)
+            die_errno("F_DUPFD_CLOEXEC");
+        ci->extra_childfd[i] = fd;
+    }
+
+    for (unsigned i = 0; i < csi->nr_extra_fd; ++i)
+        if (dup2(ci->extra_childfd[i], csi->extra_fd[i].fd) == -1)
+            die_errno("dup2(%d->%d)",
+                      ci->extra_childfd[i],
+                      csi->extra_fd[i].fd);
+
     sigset_t blocked;
     sigemptyset(&blocked);
     sigprocmask(SIG_SETMASK, &blocked, NULL);
@@ -69,25 +95,33 @@ child_child(struct internal_child_info* ci)
     _exit(127); // Do not allow errors to propagate further
 }
 
+void
+child_kill_deathsig(struct child* child)
+{
+    if (child->dead_p)
+        return;
+
+    int sig = child->deathsig ?: SIGTERM;
+    pid_t child_pid = child->pid;
+    if (sig < 0) {
+        /* Send to process group instead */
+        sig = -sig;
+        child_pid = -child_pid;
+    }
+
+    if (kill(child_pid, sig) < 0 && errno != ESRCH)
+        die_errno("kill(%d)", (int) child_pid);
+}
+
 static void
 child_cleanup(void* arg)
 {
     struct child* child = arg;
     if (!child->dead_p) {
-        if (child->pty_master == NULL) {
-            /* In the pty case, the system's automatic SIGHUP should
-             * take care of the killing.  */
-            int sig = child->deathsig ?: SIGTERM;
-            pid_t child_pid = child->pid;
-            if (sig < 0) {
-                /* Send to process group instead */
-                sig = -sig;
-                child_pid = -child_pid;
-            }
-
-            if (kill(child->pid, SIGTERM) < 0 && errno != ESRCH)
-                die_errno("kill(%d)", (int) child->pid);
-        }
+        /* In the pty case, the system's automatic SIGHUP should
+         * take care of the killing.  */
+        if (child->pty_master == NULL)
+            child_kill_deathsig(child);
 
         child_wait(child);
     }
@@ -173,6 +207,15 @@ child_start(const struct child_start_info* csi)
         xpipe(&parentfd[2], &childfd[2]);
     }
 
+    unsigned nr_extra_fd = csi->nr_extra_fd;
+    int extra_childfd[nr_extra_fd + 1];
+    int extra_parentfd[nr_extra_fd + 1];
+    for (unsigned i = 0; i < nr_extra_fd; ++i)
+        if (csi->extra_fd[i].child_writes_p)
+            xpipe(&extra_parentfd[i], &extra_childfd[i]);
+        else
+            xpipe(&extra_childfd[i], &extra_parentfd[i]);
+
     reslist_pop_nodestroy(rl_local);
     child->flags = flags;
     child->deathsig = csi->deathsig;
@@ -183,6 +226,10 @@ child_start(const struct child_start_info* csi)
     if ((flags & CHILD_INHERIT_STDERR) == 0)
         child->fd[2] = fdh_dup(parentfd[2]);
 
+    child->extra_fd = xalloc((nr_extra_fd + 1) * sizeof (*child->extra_fd));
+    for (unsigned i = 0; i < nr_extra_fd; ++i)
+        child->extra_fd[i] = fdh_dup(extra_parentfd[i]);
+
     pid_t child_pid = fork();
 
     if (child_pid == -1)
@@ -194,6 +241,7 @@ child_start(const struct child_start_info* csi)
             .csi = csi,
             .pty_slave = pty_slave,
             .childfd = childfd,
+            .extra_childfd = extra_childfd,
         };
 
         child_child(&ci);
@@ -20,6 +20,13 @@
 #define CHILD_SETSID (1<<6)
 #define CHILD_SOCKETPAIR_STDIO (1<<7)
 
+// A descriptor for the child beyond stdio.  The child sees a pipe
+// as FD; we get the other end.
+struct child_extra_fd {
+    int fd;
+    bool child_writes_p;
+};
+
 struct child_start_info {
     int flags;
     const char* exename;
@@ -27,6 +34,8 @@ struct child_start_info {
     void (*pty_setup)(int master, int slave, void* data);
     void* pty_setup_data;
     int deathsig;
+    const struct child_extra_fd* extra_fd;
+    unsigned nr_extra_fd;
 };
 
 struct child {
@@ -37,7 +46,12 @@ struct child {
     unsigned dead_p : 1;
     struct fdh* pty_master;
     struct fdh* fd[3];
+    struct fdh** extra_fd;
 };
 
 struct child* child_start(const struct child_start_info* csi);
 int child_wait(struct child* c);
+
+// Send the child its death signal (SIGTERM unless CSI said
+// otherwise) without waiting for it.
+void child_kill_deathsig(struct child* c);
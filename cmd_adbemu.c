@@ -0,0 +1,749 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "util.h"
+#include "adb.h"
+#include "argv.h"
+#include "constants.h"
+#include "dbg.h"
+#include "linkemu.h"
+
+// fb-adb adb-emulator stands in for the adb server so that we can
+// exercise adb.c without a device.  It speaks the server's host
+// protocol on a local TCP port and pretends that this machine is
+// every device it lists: host:devices, the host:transport family,
+// forward and killforward of localabstract sockets, and host:kill,
+// plus, on a device, the shell: (on a pty), exec: (on a socket), and
+// sync: (SEND only) services.  With --no-exec, devices refuse exec:
+// the way older ones do, which sends fb-adb down its pty fallback.
+// Services run right here, under fb-adb link-emulator (see
+// cmd_linkemu.c), so --link shapes them the way it shapes
+// --local-link sessions.
+//
+// Paths are taken literally, as a device would take them: a push
+// lands where the device would put it, and the stub that adb.c
+// starts is whatever is at that path on this machine.  Run
+//
+//   fb-adb adb-emulator -P 15037 &
+//   ANDROID_ADB_SERVER_PORT=15037 fb-adb shell -f echo hello
+//
+// on a machine where that's fine and whose stub runs here.
+//
+// We handle host requests ourselves, one at a time, and fork a
+// process for each service and each forwarded connection.
+
+static const char usage[] = (
+    "\n"
+    "  -P PORT\n"
+    "  --port PORT\n"
+    "    Listen on this TCP port on the loopback interface.\n"
+    "    Default is $ANDROID_ADB_SERVER_PORT or 5037; 0 picks a\n"
+    "    free one.  We print the port once we're listening.\n"
+    "\n"
+    "  -s SERIAL\n"
+    "  --device SERIAL\n"
+    "    List a device with this serial number.  Default is one\n"
+    "    device, emulator-5554.\n"
+    "\n"
+    "  -O SERIAL\n"
+    "  --offline SERIAL\n"
+    "    List an offline device with this serial number.\n"
+    "\n"
+    "  -X\n"
+    "  --no-exec\n"
+    "    Refuse the exec: service, as adbd before Android 5.0 does.\n"
+    "\n"
+    "  -L SPEC\n"
+    "  --link SPEC\n"
+    "    Shape service connections as fb-adb link-emulator SPEC\n"
+    "    would.  Default is an unshaped link.\n"
+    "\n"
+    "  -h\n"
+    "  --help\n"
+    "    Display this message.\n"
+    "\n"
+    );
+
+struct adbemu_forward {
+    struct reslist* rl;
+    int l;
+    unsigned port;
+    const char* name;
+};
+
+#define ADBEMU_MAX_FORWARDS 64
+
+struct adbemu {
+    struct reslist* rl;
+    const char* const* devices;
+    const char* const* offline;
+    const char* link;
+    bool no_exec;
+    struct adbemu_forward* fwds;
+    unsigned nr_fwds;
+    bool quit;
+};
+
+static bool
+has_prefix_p(const char* s, const char* prefix)
+{
+    return !strncmp(s, prefix, strlen(prefix));
+}
+
+// Read a request: four hex digits of length and that many bytes.
+// Return NULL if the client hung up instead.
+static char*
+adbemu_read_request(int s)
+{
+    char hex[5];
+    if (read_all(s, hex, 4) != 4)
+        return NULL;
+
+    hex[4] = '\0';
+    char* end;
+    unsigned long len = strtoul(hex, &end, 16);
+    if (*end != '\0')
+        die(ECOMM, "bad request length \"%s\"", hex);
+
+    char* req = xalloc(len + 1);
+    if (read_all(s, req, len) != len)
+        return NULL;
+
+    req[len] = '\0';
+    return req;
+}
+
+static void
+adbemu_send_string(int s, const char* str)
+{
+    char* msg = xaprintf("%04zx%s", strlen(str), str);
+    write_all(s, msg, strlen(msg));
+}
+
+static void
+adbemu_okay(int s)
+{
+    write_all(s, "OKAY", 4);
+}
+
+static void
+adbemu_fail(int s, const char* why)
+{
+    write_all(s, "FAIL", 4);
+    adbemu_send_string(s, why);
+}
+
+// Listen on PORT on the loopback interface, or on a free port if
+// PORT is zero, and return the socket.  Set *PORT_OUT to the port.
+static int
+adbemu_listen(unsigned port, unsigned* port_out)
+{
+    struct cleanup* cl = cleanup_allocate();
+    int l = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (l == -1)
+        die_errno("socket");
+
+    cleanup_commit_close_fd(cl, l);
+    int on = 1;
+    if (setsockopt(l, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on)) == -1)
+        die_errno("setsockopt");
+
+    struct sockaddr_in sin = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+
+    socklen_t sinlen = sizeof (sin);
+    if (bind(l, (struct sockaddr*) &sin, sinlen) == -1)
+        die_errno("bind(%u)", port);
+
+    if (listen(l, SOMAXCONN) == -1)
+        die_errno("listen");
+
+    if (getsockname(l, (struct sockaddr*) &sin, &sinlen) == -1)
+        die_errno("getsockname");
+
+    *port_out = ntohs(sin.sin_port);
+    return l;
+}
+
+// Find the device that SERIAL names, or the only device if SERIAL
+// is NULL, and die with adb's complaint if there isn't one.
+static const char*
+adbemu_find_device(const struct adbemu* emu, const char* serial)
+{
+    if (serial == NULL) {
+        if (emu->devices[0] == NULL)
+            die(ENODEV, "no devices/emulators found");
+        if (emu->devices[1] != NULL)
+            die(ENODEV, "more than one device/emulator");
+        return emu->devices[0];
+    }
+
+    for (const char* const* d = emu->devices; *d != NULL; ++d)
+        if (!strcmp(*d, serial))
+            return *d;
+
+    for (const char* const* d = emu->offline; *d != NULL; ++d)
+        if (!strcmp(*d, serial))
+            die(ENODEV, "device offline");
+
+    die(ENODEV, "device '%s' not found", serial);
+}
+
+// Strip the host:, host-serial:SERIAL:, host-usb:, or host-local:
+// prefix from REQ and check the device it names.  Serial numbers
+// can contain colons, so we match them against the devices we
+// know.  Return what follows the prefix, or NULL if REQ has none.
+static const char*
+adbemu_host_prefix(const struct adbemu* emu, const char* req)
+{
+    static const char* const any[] = {
+        "host:", "host-usb:", "host-local:",
+    };
+    for (unsigned i = 0; i < ARRAYSIZE(any); ++i)
+        if (has_prefix_p(req, any[i]))
+            return req + strlen(any[i]);
+
+    if (!has_prefix_p(req, "host-serial:"))
+        return NULL;
+
+    const char* rest = req + strlen("host-serial:");
+    for (const char* const* d = emu->devices; *d != NULL; ++d) {
+        size_t len = strlen(*d);
+        if (!strncmp(rest, *d, len) && rest[len] == ':')
+            return rest + len + 1;
+    }
+
+    const char* colon = strrchr(rest, ':');
+    die(ENODEV, "device '%.*s' not found",
+        (int) (colon ? colon - rest : (ptrdiff_t) strlen(rest)), rest);
+}
+
+// Run fb-adb link-emulator with ARGS on our stdin and stdout, which
+// the caller has made the client's socket.
+static void __attribute__((noreturn))
+adbemu_exec_link(const char* const* args)
+{
+    const char* const* argv =
+        argv_concat((const char*[]){orig_argv0, "link-emulator", NULL},
+                    args,
+                    NULL);
+    execvp(orig_argv0, (char**) argv);
+    die_errno("execvp(\"%s\")", orig_argv0);
+}
+
+// Make the parent directories of PATH, as adbd does for a push.
+static void
+adbemu_mkdir_parents(const char* path)
+{
+    char* copy = xstrdup(path);
+    for (char* slash = strchr(copy + 1, '/');
+         slash != NULL;
+         slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        if (mkdir(copy, 0777) == -1 && errno != EEXIST)
+            die_errno("mkdir(\"%s\")", copy);
+        *slash = '/';
+    }
+}
+
+static void
+adbemu_sync_reply(int s, const char* id, uint32_t arg)
+{
+    struct adb_sync_hdr hdr;
+    memcpy(hdr.id, id, sizeof (hdr.id));
+    hdr.arg = arg;
+    write_all(s, &hdr, sizeof (hdr));
+}
+
+static void
+adbemu_read_sync_hdr(int s, struct adb_sync_hdr* hdr)
+{
+    if (read_all(s, hdr, sizeof (*hdr)) != sizeof (*hdr))
+        die(ECOMM, "sync client hung up");
+}
+
+struct adbemu_send {
+    int s;
+    char* buf;
+    char* target;
+};
+
+// Receive one file: "PATH,MODE" in BUF, then DATA packets until
+// DONE, which carries the mtime.
+static void
+adbemu_sync_send_1(void* data)
+{
+    struct adbemu_send* snd = data;
+    char* comma = strrchr(snd->target, ',');
+    if (comma == NULL)
+        die(EINVAL, "no mode in \"%s\"", snd->target);
+
+    *comma = '\0';
+    const char* path = snd->target;
+    mode_t mode = strtoul(comma + 1, NULL, 10) & 07777;
+    adbemu_mkdir_parents(path);
+    // Like adbd, replace whatever's there instead of writing
+    // through it.
+    if (unlink(path) == -1 && errno != ENOENT)
+        die_errno("unlink(\"%s\")", path);
+
+    int fd = xopen(path, O_WRONLY | O_CREAT | O_EXCL, mode);
+    if (fchmod(fd, mode) == -1)
+        die_errno("fchmod(\"%s\")", path);
+
+    for (;;) {
+        struct adb_sync_hdr hdr;
+        adbemu_read_sync_hdr(snd->s, &hdr);
+        if (!memcmp(hdr.id, "DONE", sizeof (hdr.id))) {
+            struct timespec times[2] = {
+                { .tv_nsec = UTIME_OMIT },
+                { .tv_sec = hdr.arg },
+            };
+            if (futimens(fd, times) == -1)
+                die_errno("futimens(\"%s\")", path);
+            break;
+        }
+
+        if (memcmp(hdr.id, "DATA", sizeof (hdr.id)) ||
+            hdr.arg > ADB_SYNC_DATA_MAX)
+        {
+            die(ECOMM, "bad sync packet \"%.4s\"", hdr.id);
+        }
+
+        if (read_all(snd->s, snd->buf, hdr.arg) != hdr.arg)
+            die(ECOMM, "sync client hung up");
+
+        write_all(fd, snd->buf, hdr.arg);
+    }
+
+    dbg("received %s mode %o", path, (unsigned) mode);
+}
+
+static void
+adbemu_sync(int s)
+{
+    char* buf = xalloc(ADB_SYNC_DATA_MAX + 1);
+    for (;;) {
+        SCOPED_RESLIST(rl_sync);
+        struct adb_sync_hdr hdr;
+        if (read_all(s, &hdr, sizeof (hdr)) != sizeof (hdr) ||
+            !memcmp(hdr.id, "QUIT", sizeof (hdr.id)))
+        {
+            return;
+        }
+
+        if (memcmp(hdr.id, "SEND", sizeof (hdr.id)) ||
+            hdr.arg > ADB_SYNC_DATA_MAX)
+        {
+            die(ECOMM, "unsupported sync request \"%.4s\"", hdr.id);
+        }
+
+        if (read_all(s, buf, hdr.arg) != hdr.arg)
+            die(ECOMM, "sync client hung up");
+
+        buf[hdr.arg] = '\0';
+        struct adbemu_send snd = {
+            .s = s,
+            .buf = buf,
+            .target = xstrdup(buf),
+        };
+
+        struct errinfo ei = { .want_msg = true };
+        if (catch_error(adbemu_sync_send_1, &snd, &ei)) {
+            adbemu_sync_reply(s, "FAIL", strlen(ei.msg));
+            write_all(s, ei.msg, strlen(ei.msg));
+            return;
+        }
+
+        adbemu_sync_reply(s, "OKAY", 0);
+    }
+}
+
+struct adbemu_conn {
+    const struct adbemu* emu;
+    int s;
+};
+
+// Open the service the client asks for on the device it picked.
+// Services that run a program replace this process.
+static void
+adbemu_service_1(void* data)
+{
+    struct adbemu_conn* conn = data;
+    int s = conn->s;
+    const char* link = conn->emu->link;
+    char* req = adbemu_read_request(s);
+    if (req == NULL)
+        return;
+
+    dbg("service %s", req);
+    if (!strcmp(req, "sync:")) {
+        adbemu_okay(s);
+        adbemu_sync(s);
+        return;
+    }
+
+    const char* const* args;
+    if (has_prefix_p(req, "shell:")) {
+        const char* cmd = req + strlen("shell:");
+        args = argv_concat((const char*[]){"--pty", link, DEFAULT_SHELL, NULL},
+                           (*cmd == '\0'
+                            ? empty_argv
+                            : (const char*[]){"-c", cmd, NULL}),
+                           NULL);
+    } else if (has_prefix_p(req, "exec:") && !conn->emu->no_exec) {
+        args = argv_concat((const char*[]){
+                link, DEFAULT_SHELL, "-c", req + strlen("exec:"), NULL},
+            NULL);
+    } else {
+        // What adbd says about services it doesn't know.
+        die(EINVAL, "closed");
+    }
+
+    adbemu_okay(s);
+    if (dup2(s, 0) == -1 || dup2(s, 1) == -1)
+        die_errno("dup2");
+
+    adbemu_exec_link(args);
+}
+
+// Run in a child process: serve the connection S once the client
+// has picked a device.
+static void __attribute__((noreturn))
+adbemu_service(const struct adbemu* emu, int s)
+{
+    struct adbemu_conn conn = { .emu = emu, .s = s };
+    struct errinfo ei = { .want_msg = true };
+    if (catch_error(adbemu_service_1, &conn, &ei)) {
+        dbg("service failed: %s", ei.msg);
+        adbemu_fail(s, ei.msg);
+    }
+
+    _exit(0);
+}
+
+static void
+adbemu_forward_add(struct adbemu* emu, int s, const char* spec)
+{
+    const char* prefix = "tcp:0;localabstract:";
+    if (!has_prefix_p(spec, prefix))
+        die(EINVAL, "cannot forward %s", spec);
+
+    if (emu->nr_fwds == ADBEMU_MAX_FORWARDS)
+        die(EMFILE, "too many forwards");
+
+    // The forward outlives this request, so its reslist goes on
+    // EMU's, where adbemu_forward_remove can find it.
+    SCOPED_RESLIST(rl_forward);
+    struct adbemu_forward f;
+    f.rl = reslist_push_new();
+    f.name = xstrdup(spec + strlen(prefix));
+    f.l = adbemu_listen(0, &f.port);
+    reslist_pop_nodestroy(f.rl);
+    reslist_xfer(emu->rl, rl_forward);
+    emu->fwds[emu->nr_fwds++] = f;
+
+    // One OKAY for the device and one for the forward, then the
+    // port, as adb_forward_abstract expects.
+    adbemu_okay(s);
+    adbemu_okay(s);
+    adbemu_send_string(s, xaprintf("%u", f.port));
+    dbg("forwarding port %u to %s", f.port, f.name);
+}
+
+static void
+adbemu_forward_remove(struct adbemu* emu, int s, const char* spec)
+{
+    unsigned port = 0;
+    if (sscanf(spec, "tcp:%u", &port) != 1)
+        die(EINVAL, "cannot remove forward %s", spec);
+
+    for (unsigned i = 0; i < emu->nr_fwds; ++i) {
+        if (emu->fwds[i].port != port)
+            continue;
+
+        reslist_destroy(emu->fwds[i].rl);
+        emu->fwds[i] = emu->fwds[--emu->nr_fwds];
+        adbemu_okay(s);
+        adbemu_okay(s);
+        return;
+    }
+
+    die(ENOENT, "listener '%s' not found", spec);
+}
+
+static void
+adbemu_spawn_service(struct adbemu* emu, int s)
+{
+    pid_t pid = fork();
+    if (pid == -1)
+        die_errno("fork");
+
+    if (pid == 0)
+        adbemu_service(emu, s);
+}
+
+// Like the adb server, don't let Nagle hold back the tails of
+// packets on the connections we accept.
+static void
+adbemu_nodelay(int s)
+{
+    int on = 1;
+    if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on)) == -1)
+        die_errno("setsockopt(TCP_NODELAY)");
+}
+
+// Hand a connection to forward F to a child that connects it to F's
+// target on this "device".
+static void
+adbemu_forward_accept(const struct adbemu* emu, struct adbemu_forward* f)
+{
+    SCOPED_RESLIST(rl_accept);
+    struct cleanup* cl = cleanup_allocate();
+    int c = accept4(f->l, NULL, NULL, SOCK_CLOEXEC);
+    if (c == -1) {
+        if (errno == EINTR || errno == ECONNABORTED)
+            return;
+        die_errno("accept");
+    }
+
+    cleanup_commit_close_fd(cl, c);
+    adbemu_nodelay(c);
+    pid_t pid = fork();
+    if (pid == -1)
+        die_errno("fork");
+
+    if (pid == 0) {
+        if (dup2(c, 0) == -1 || dup2(c, 1) == -1)
+            die_errno("dup2");
+
+        adbemu_exec_link((const char*[]){
+                "--connect",
+                xaprintf("localabstract:%s", f->name),
+                emu->link,
+                NULL});
+    }
+}
+
+struct adbemu_request {
+    struct adbemu* emu;
+    int s;
+};
+
+// Handle one host request.  Requests that pick a device go on to
+// a service in a child process.
+static void
+adbemu_request_1(void* data)
+{
+    struct adbemu_request* r = data;
+    struct adbemu* emu = r->emu;
+    int s = r->s;
+    char* req = adbemu_read_request(s);
+    if (req == NULL)
+        return;
+
+    dbg("request %s", req);
+    if (!strcmp(req, "host:devices")) {
+        char* list = "";
+        for (const char* const* d = emu->devices; *d != NULL; ++d)
+            list = xaprintf("%s%s\tdevice\n", list, *d);
+        for (const char* const* d = emu->offline; *d != NULL; ++d)
+            list = xaprintf("%s%s\toffline\n", list, *d);
+        adbemu_okay(s);
+        adbemu_send_string(s, list);
+    } else if (!strcmp(req, "host:kill")) {
+        adbemu_okay(s);
+        emu->quit = true;
+    } else if (has_prefix_p(req, "host:transport:")) {
+        adbemu_find_device(emu, req + strlen("host:transport:"));
+        adbemu_okay(s);
+        adbemu_spawn_service(emu, s);
+    } else if (!strcmp(req, "host:transport-any") ||
+               !strcmp(req, "host:transport-usb") ||
+               !strcmp(req, "host:transport-local"))
+    {
+        adbemu_find_device(emu, NULL);
+        adbemu_okay(s);
+        adbemu_spawn_service(emu, s);
+    } else {
+        const char* rest = adbemu_host_prefix(emu, req);
+        if (rest != NULL && !has_prefix_p(req, "host-serial:"))
+            adbemu_find_device(emu, NULL);
+
+        if (rest != NULL && has_prefix_p(rest, "forward:"))
+            adbemu_forward_add(emu, s, rest + strlen("forward:"));
+        else if (rest != NULL && has_prefix_p(rest, "killforward:"))
+            adbemu_forward_remove(emu, s, rest + strlen("killforward:"));
+        else
+            die(EINVAL, "unknown request %s", req);
+    }
+}
+
+static void
+adbemu_accept(struct adbemu* emu, int l)
+{
+    SCOPED_RESLIST(rl_accept);
+    struct cleanup* cl = cleanup_allocate();
+    int s = accept4(l, NULL, NULL, SOCK_CLOEXEC);
+    if (s == -1) {
+        if (errno == EINTR || errno == ECONNABORTED)
+            return;
+        die_errno("accept");
+    }
+
+    cleanup_commit_close_fd(cl, s);
+    adbemu_nodelay(s);
+    struct adbemu_request r = { .emu = emu, .s = s };
+    struct errinfo ei = { .want_msg = true };
+    if (catch_error(adbemu_request_1, &r, &ei)) {
+        dbg("request failed: %s", ei.msg);
+        adbemu_fail(s, ei.msg);
+    }
+}
+
+int
+adb_emulator_main(int argc, const char** argv)
+{
+    struct adbemu emu = {
+        .devices = empty_argv,
+        .offline = empty_argv,
+        .link = "",
+    };
+
+    const char* portstr = getenv("ANDROID_ADB_SERVER_PORT") ?: "5037";
+
+    static struct option opts[] = {
+        { "help", no_argument, NULL, 'h' },
+        { "port", required_argument, NULL, 'P' },
+        { "device", required_argument, NULL, 's' },
+        { "offline", required_argument, NULL, 'O' },
+        { "link", required_argument, NULL, 'L' },
+        { "no-exec", no_argument, NULL, 'X' },
+        { 0 }
+    };
+
+    for (;;) {
+        char c = getopt_long(argc,
+                             (char**) argv,
+                             ":hP:s:O:L:X",
+                             opts,
+                             NULL);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'P':
+                portstr = optarg;
+                break;
+            case 's':
+                emu.devices = argv_concat(emu.devices,
+                                          (const char*[]){optarg, NULL},
+                                          NULL);
+                break;
+            case 'O':
+                emu.offline = argv_concat(emu.offline,
+                                          (const char*[]){optarg, NULL},
+                                          NULL);
+                break;
+            case 'L':
+                emu.link = optarg;
+                break;
+            case 'X':
+                emu.no_exec = true;
+                break;
+            case ':':
+                die(EINVAL, "missing option for -%c", optopt);
+            case '?':
+                if (optopt != '?')
+                    die(EINVAL, "invalid option -%c", optopt);
+            case 'h':
+                printf("%s [OPTS]: "
+                       "stand in for the adb server (internal)\n",
+                       prgname);
+                fputs(usage, stdout);
+                return 0;
+            default:
+                abort();
+        }
+    }
+
+    if (optind != argc)
+        die(EINVAL, "too many arguments");
+
+    emu.rl = reslist_push_new();
+    reslist_pop_nodestroy(emu.rl);
+    emu.fwds = xcalloc(ADBEMU_MAX_FORWARDS * sizeof (*emu.fwds));
+    if (emu.devices[0] == NULL && emu.offline[0] == NULL)
+        emu.devices = argv_concat((const char*[]){"emulator-5554", NULL},
+                                  NULL);
+
+    // Check the link spec now rather than in every service.
+    struct link_params lp;
+    link_params_parse(emu.link, &lp);
+
+    char* end;
+    errno = 0;
+    unsigned long port = strtoul(portstr, &end, 10);
+    if (errno != 0 || *portstr == '\0' || *end != '\0' || port > 65535)
+        die(EINVAL, "invalid port: %s", portstr);
+
+    unsigned listen_port;
+    int l = adbemu_listen(port, &listen_port);
+    printf("%u\n", listen_port);
+    fflush(stdout);
+
+    while (!emu.quit) {
+        SCOPED_RESLIST(rl_poll);
+        struct pollfd* polls = xalloc((emu.nr_fwds + 1) * sizeof (*polls));
+        polls[0] = (struct pollfd){ l, POLLIN, 0 };
+        for (unsigned i = 0; i < emu.nr_fwds; ++i)
+            polls[i + 1] = (struct pollfd){ emu.fwds[i].l, POLLIN, 0 };
+
+        unsigned nr_polls = emu.nr_fwds + 1;
+        if (poll(polls, nr_polls, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            die_errno("poll");
+        }
+
+        // Forwards come and go as we serve requests, so look at
+        // their listeners before the main one.
+        for (unsigned i = 1; i < nr_polls; ++i)
+            if (polls[i].revents != 0)
+                adbemu_forward_accept(&emu, &emu.fwds[i - 1]);
+
+        if (polls[0].revents != 0)
+            adbemu_accept(&emu, l);
+
+        while (waitpid(-1, NULL, WNOHANG) > 0)
+            continue;
+    }
+
+    return 0;
+}
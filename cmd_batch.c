@@ -0,0 +1,843 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "util.h"
+#include "child.h"
+#include "argv.h"
+#include "constants.h"
+
+// fb-adb batch runs a list of shell commands over a single stub
+// session, so the list pays for setting up the stub once instead of
+// once per command.  As with sync, the work happens in a pair of
+// helpers that talk over the session's stdin and stdout:
+// "batch-session" is an ordinary session whose stub runs
+// "batch-runner" in place of a command.  We feed the runner the
+// commands; it runs up to N of them at once and sends back each
+// one's output and exit status, tagged with the command's number.
+//
+// We print the output of the oldest unfinished command as it
+// arrives and hold on to everyone else's until that command's turn
+// comes, so output comes out in list order and never interleaves.
+// Standard output and standard error stay separate throughout.
+// Held output lives in memory until there's BATCH_MAX_HELD of it;
+// after that, each stream that gets more goes to an unlinked
+// temporary file instead.  We can't just stop reading from the
+// runner, since the oldest command's output comes down the same
+// pipe as everyone else's.
+
+// The stub only ever runs batch-runner.
+#ifndef BUILD_STUB
+static const char usage[] = (
+    "\n"
+    "  -j N\n"
+    "  --jobs N\n"
+    "    Run up to N commands at once.  Default is one at a time.\n"
+    "\n"
+    "  -o DIR\n"
+    "  --output-dir DIR\n"
+    "    Write the standard output and standard error of the Nth\n"
+    "    command to DIR/N.out and DIR/N.err instead of printing them.\n"
+    "\n"
+    "  -S FILE\n"
+    "  --status-file FILE\n"
+    "    Write a line \"N STATUS COMMAND\" to FILE for every command.\n"
+    "\n"
+    "  -s SERIAL\n"
+    "    Run the commands on the device with serial number SERIAL.\n"
+    "\n"
+    "  -l\n"
+    "  --local\n"
+    "    Run the commands on this machine instead.\n"
+    "\n"
+    "  -r\n"
+    "  --root\n"
+    "    Run the commands as root.\n"
+    "\n"
+    "  -u USER\n"
+    "  --user USER\n"
+    "    Run the commands as USER.\n"
+    "\n"
+    "  -f\n"
+    "  --force-send-stub\n"
+    "    Push the stub to the device even if it's already there.\n"
+    "\n"
+    "  -H, -P\n"
+    "    Control the adb server to which fb-adb connects.  See adb help.\n"
+    "\n"
+    "  -h\n"
+    "  --help\n"
+    "    Display this message.\n"
+    "\n"
+    "  FILE (default standard input) lists one shell command per\n"
+    "  line; blank lines and lines starting with # don't count.\n"
+    "  Commands don't get any input.  We exit with the highest exit\n"
+    "  status of any command and report each failure on stderr.\n"
+    "\n"
+    );
+#endif
+
+#pragma pack(push, 1)
+
+// We send a batch_hello, then a batch_cmd_hdr and the text of each
+// command.  EOF ends the list.
+struct batch_hello {
+    uint32_t jobs;
+};
+
+struct batch_cmd_hdr {
+    uint32_t len;
+};
+
+enum batch_rec_type {
+    BATCH_STDOUT = 'o',
+    BATCH_STDERR = 'e',
+    BATCH_EXIT = 'x',
+};
+
+// The runner answers with records: a batch_rec_hdr followed by LEN
+// bytes of data.  Commands are numbered from zero in the order we
+// sent them.  A BATCH_EXIT record carries a batch_exit and is the
+// last record for its command.
+struct batch_rec_hdr {
+    uint8_t type;
+    uint32_t id;
+    uint32_t len;
+};
+
+struct batch_exit {
+    int32_t status;
+};
+
+#pragma pack(pop)
+
+// A byte queue.  Consumed bytes are reclaimed the next time we need
+// room; storage we outgrow stays on the current reslist, so callers
+// that keep a buffer across scopes give it a reslist of its own.
+struct batch_buf {
+    char* data;
+    size_t start;
+    size_t len;
+    size_t cap;
+};
+
+static void
+batch_buf_reserve(struct batch_buf* b, size_t sz)
+{
+    if (b->cap - b->len >= sz)
+        return;
+
+    if (b->start > 0) {
+        memmove(b->data, b->data + b->start, b->len - b->start);
+        b->len -= b->start;
+        b->start = 0;
+        if (b->cap - b->len >= sz)
+            return;
+    }
+
+    size_t need;
+    if (SATADD(&need, b->len, sz))
+        die(ENOMEM, "batch buffer too large");
+
+    size_t newcap = XMAX(XMAX(b->cap * 2, need), (size_t) 4096);
+    char* data = xalloc(newcap);
+    if (b->len > 0)
+        memcpy(data, b->data, b->len);
+    b->data = data;
+    b->cap = newcap;
+}
+
+static size_t
+batch_buf_size(const struct batch_buf* b)
+{
+    return b->len - b->start;
+}
+
+// Fill B from FD, reading at most SZ bytes.  Return false at EOF.
+static bool
+batch_buf_read(struct batch_buf* b, int fd, size_t sz)
+{
+    batch_buf_reserve(b, sz);
+    ssize_t nr_read;
+    do {
+        nr_read = read(fd, b->data + b->len, sz);
+    } while (nr_read < 0 && errno == EINTR);
+
+    if (nr_read < 0)
+        die_errno("read");
+
+    b->len += nr_read;
+    return nr_read > 0;
+}
+
+static int
+batch_exit_status(int status)
+{
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return 255;
+}
+
+struct batch_job {
+    struct reslist* rl;
+    struct child* child;
+    uint32_t id;
+};
+
+static void
+batch_job_start(struct batch_job* j,
+                uint32_t id,
+                const char* text,
+                size_t len)
+{
+    j->rl = reslist_push_new();
+    struct child_start_info csi = {
+        .exename = DEFAULT_SHELL,
+        .argv = (const char*[]){
+            "sh", "-c", xaprintf("%.*s", (int) len, text), NULL},
+    };
+
+    j->child = child_start(&csi);
+    fdh_destroy(j->child->fd[0]);
+    j->child->fd[0] = NULL;
+    j->id = id;
+    reslist_pop_nodestroy(j->rl);
+}
+
+// Send the record whose data follows room for its header at REC.
+static void
+batch_send_record(char* rec, uint8_t type, uint32_t id, size_t len)
+{
+    struct batch_rec_hdr hdr = { .type = type, .id = id, .len = len };
+    memcpy(rec, &hdr, sizeof (hdr));
+    write_all(1, rec, sizeof (hdr) + len);
+}
+
+static void
+batch_job_finish(struct batch_job* j, char* rec)
+{
+    struct batch_exit e = {
+        .status = batch_exit_status(child_wait(j->child)),
+    };
+
+    memcpy(rec + sizeof (struct batch_rec_hdr), &e, sizeof (e));
+    batch_send_record(rec, BATCH_EXIT, j->id, sizeof (e));
+    reslist_destroy(j->rl);
+    memset(j, 0, sizeof (*j));
+}
+
+int
+batch_runner_main(int argc, const char** argv)
+{
+    if (argc != 1)
+        die(EINVAL, "this command is internal");
+
+    struct batch_hello hello;
+    if (read_all(0, &hello, sizeof (hello)) != sizeof (hello))
+        die(ECOMM, "batch peer disconnected");
+    if (hello.jobs == 0 || hello.jobs > BATCH_MAX_JOBS)
+        die(ECOMM, "bad job count %u", (unsigned) hello.jobs);
+
+    unsigned max_polls = 2 * hello.jobs + 1;
+    struct batch_job* jobs = xcalloc(hello.jobs * sizeof (*jobs));
+    struct pollfd* polls = xalloc(max_polls * sizeof (*polls));
+    struct batch_job** poll_job = xalloc(max_polls * sizeof (*poll_job));
+    char* rec = xalloc(sizeof (struct batch_rec_hdr) + BATCH_IO_BUFSZ);
+    struct batch_buf in = { 0 };
+    bool in_eof = false;
+    uint32_t next_id = 0;
+    unsigned nr_running = 0;
+
+    for (;;) {
+        struct batch_job* free_job = jobs;
+        while (nr_running < hello.jobs) {
+            struct batch_cmd_hdr ch;
+            size_t avail = batch_buf_size(&in);
+            if (avail < sizeof (ch))
+                break;
+            memcpy(&ch, in.data + in.start, sizeof (ch));
+            if (ch.len > INT_MAX)
+                die(ECOMM, "command too long");
+            if (avail - sizeof (ch) < ch.len)
+                break;
+
+            while (free_job->child != NULL)
+                free_job += 1;
+
+            batch_job_start(free_job,
+                            next_id++,
+                            in.data + in.start + sizeof (ch),
+                            ch.len);
+            in.start += sizeof (ch) + ch.len;
+            nr_running += 1;
+        }
+
+        if (in_eof && nr_running == 0) {
+            if (batch_buf_size(&in) > 0)
+                die(ECOMM, "truncated command list");
+            break;
+        }
+
+        unsigned nr_polls = 0;
+        if (!in_eof) {
+            polls[nr_polls] = (struct pollfd){ 0, POLLIN, 0 };
+            poll_job[nr_polls] = NULL;
+            nr_polls += 1;
+        }
+
+        for (unsigned i = 0; i < hello.jobs; ++i) {
+            struct batch_job* j = &jobs[i];
+            for (int s = 1; j->child != NULL && s < 3; ++s) {
+                if (j->child->fd[s] == NULL)
+                    continue;
+
+                polls[nr_polls] = (struct pollfd){
+                    j->child->fd[s]->fd, POLLIN, 0 };
+                poll_job[nr_polls] = j;
+                nr_polls += 1;
+            }
+        }
+
+        if (poll(polls, nr_polls, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            die_errno("poll");
+        }
+
+        for (unsigned i = 0; i < nr_polls; ++i) {
+            if (polls[i].revents == 0)
+                continue;
+
+            struct batch_job* j = poll_job[i];
+            if (j == NULL) {
+                if (!batch_buf_read(&in, 0, BATCH_IO_BUFSZ))
+                    in_eof = true;
+                continue;
+            }
+
+            int s = (j->child->fd[1] != NULL &&
+                     j->child->fd[1]->fd == polls[i].fd) ? 1 : 2;
+            ssize_t nr_read = read(polls[i].fd,
+                                   rec + sizeof (struct batch_rec_hdr),
+                                   BATCH_IO_BUFSZ);
+            if (nr_read < 0 && errno == EINTR)
+                continue;
+
+            if (nr_read < 0)
+                die_errno("read");
+
+            if (nr_read > 0) {
+                batch_send_record(rec,
+                                  s == 1 ? BATCH_STDOUT : BATCH_STDERR,
+                                  j->id,
+                                  nr_read);
+                continue;
+            }
+
+            fdh_destroy(j->child->fd[s]);
+            j->child->fd[s] = NULL;
+            if (j->child->fd[1] == NULL && j->child->fd[2] == NULL) {
+                batch_job_finish(j, rec);
+                nr_running -= 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+#ifndef BUILD_STUB
+static void
+batch_buf_append(struct batch_buf* b, const void* data, size_t sz)
+{
+    batch_buf_reserve(b, sz);
+    memcpy(b->data + b->len, data, sz);
+    b->len += sz;
+}
+
+struct batch_cmd {
+    const char* text;
+    struct reslist* rl; // Owns output files and held output
+    struct batch_buf held[2];
+    int spill[2];       // Held output past the memory limit, or -1
+    int out[2];
+    int exit_status;
+    bool done;
+};
+
+struct batch_client {
+    struct batch_cmd* cmds;
+    uint32_t nr_cmds;
+    uint32_t head;
+    const char* output_dir;
+    FILE* status_file;
+    size_t held_bytes;
+    int ret;
+};
+
+// Read the list of commands from FD.  Each command's text stays in
+// the buffer we read it into.
+static struct batch_cmd*
+batch_read_commands(int fd, uint32_t* nr_out)
+{
+    struct batch_buf b = { 0 };
+    while (batch_buf_read(&b, fd, BATCH_IO_BUFSZ))
+        continue;
+
+    batch_buf_append(&b, "", 1);
+    size_t capacity = 0;
+    uint32_t nr = 0;
+    struct batch_cmd* cmds = NULL;
+    char* pos = b.data;
+    char* end = b.data + b.len - 1;
+    while (pos < end) {
+        char* nl = memchr(pos, '\n', end - pos);
+        char* eol = nl ?: end;
+        const char* p = pos;
+        while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r'))
+            p += 1;
+
+        if (p < eol && *p != '#') {
+            if (nr == UINT32_MAX)
+                die(E2BIG, "too many commands");
+            if (eol - pos > UINT32_MAX)
+                die(E2BIG, "command too long");
+
+            if (nr == capacity) {
+                capacity = XMAX(capacity * 2, (size_t) 16);
+                struct batch_cmd* n = xcalloc(capacity * sizeof (*n));
+                if (nr > 0)
+                    memcpy(n, cmds, nr * sizeof (*n));
+                cmds = n;
+            }
+
+            *eol = '\0';
+            cmds[nr].text = pos;
+            cmds[nr].out[0] = cmds[nr].out[1] = -1;
+            cmds[nr].spill[0] = cmds[nr].spill[1] = -1;
+            nr += 1;
+        }
+
+        pos = nl ? nl + 1 : end;
+    }
+
+    *nr_out = nr;
+    return cmds;
+}
+
+// Give CMD a reslist of its own, so that its output files and
+// held output go away when it's done with them.
+static void
+batch_cmd_reslist(struct batch_cmd* cmd)
+{
+    if (cmd->rl == NULL) {
+        cmd->rl = reslist_push_new();
+        reslist_pop_nodestroy(cmd->rl);
+    }
+}
+
+static void
+batch_cmd_release(struct batch_cmd* cmd)
+{
+    if (cmd->rl != NULL) {
+        reslist_destroy(cmd->rl);
+        cmd->rl = NULL;
+    }
+
+    memset(cmd->held, 0, sizeof (cmd->held));
+    cmd->out[0] = cmd->out[1] = -1;
+    cmd->spill[0] = cmd->spill[1] = -1;
+}
+
+static int
+batch_open_output(struct batch_client* bc, uint32_t id, int stream)
+{
+    struct batch_cmd* cmd = &bc->cmds[id];
+    if (cmd->out[stream] == -1) {
+        static const char* const suffix[2] = { "out", "err" };
+        batch_cmd_reslist(cmd);
+        SCOPED_RESLIST(rl_open);
+        char* fn = xaprintf("%s/%u.%s",
+                            bc->output_dir,
+                            (unsigned) id + 1,
+                            suffix[stream]);
+        cmd->out[stream] = xopen(fn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        reslist_xfer(cmd->rl, rl_open);
+    }
+
+    return cmd->out[stream];
+}
+
+// Open a file to hold the rest of STREAM's output until CMD's turn
+// comes.  Nobody else needs to see it, so it has no name.
+static int
+batch_open_spill(struct batch_cmd* cmd, int stream)
+{
+    batch_cmd_reslist(cmd);
+    SCOPED_RESLIST(rl_spill);
+    char* fn = xaprintf("%s/fb-adb-batch-XXXXXX", DEFAULT_TEMP_DIR);
+    struct cleanup* cl = cleanup_allocate();
+    int fd = mkostemp(fn, O_CLOEXEC);
+    if (fd == -1)
+        die_errno("mkostemp");
+
+    cleanup_commit_close_fd(cl, fd);
+    if (unlink(fn) == -1)
+        die_errno("unlink(\"%s\")", fn);
+
+    reslist_xfer(cmd->rl, rl_spill);
+    return cmd->spill[stream] = fd;
+}
+
+// Write everything CMD held for STREAM to our own output.
+static void
+batch_flush_held(struct batch_client* bc, struct batch_cmd* cmd, int stream)
+{
+    struct batch_buf* held = &cmd->held[stream];
+    write_all(stream + 1, held->data + held->start, batch_buf_size(held));
+    bc->held_bytes -= batch_buf_size(held);
+
+    int fd = cmd->spill[stream];
+    if (fd == -1)
+        return;
+
+    if (lseek(fd, 0, SEEK_SET) == -1)
+        die_errno("lseek");
+
+    hint_sequential_read(fd);
+    SCOPED_RESLIST(rl_flush);
+    char* buf = xalloc(BATCH_IO_BUFSZ);
+    size_t nr_read;
+    while ((nr_read = read_all(fd, buf, BATCH_IO_BUFSZ)) > 0)
+        write_all(stream + 1, buf, nr_read);
+}
+
+static void
+batch_output(struct batch_client* bc,
+             uint32_t id,
+             int stream,
+             const char* data,
+             size_t len)
+{
+    struct batch_cmd* cmd = &bc->cmds[id];
+    if (bc->output_dir != NULL) {
+        write_all(batch_open_output(bc, id, stream), data, len);
+    } else if (id == bc->head) {
+        write_all(stream + 1, data, len);
+    } else if (cmd->spill[stream] != -1 ||
+               len > BATCH_MAX_HELD - bc->held_bytes)
+    {
+        int fd = cmd->spill[stream];
+        if (fd == -1)
+            fd = batch_open_spill(cmd, stream);
+        write_all(fd, data, len);
+    } else {
+        batch_cmd_reslist(cmd);
+        SCOPED_RESLIST(rl_hold);
+        batch_buf_append(&cmd->held[stream], data, len);
+        reslist_xfer(cmd->rl, rl_hold);
+        bc->held_bytes += len;
+    }
+}
+
+static void
+batch_report(struct batch_client* bc, uint32_t id)
+{
+    struct batch_cmd* cmd = &bc->cmds[id];
+    if (bc->status_file != NULL &&
+        fprintf(bc->status_file, "%u %d %s\n",
+                (unsigned) id + 1, cmd->exit_status, cmd->text) < 0)
+    {
+        die_errno("write");
+    }
+
+    if (cmd->exit_status != 0) {
+        fprintf(stderr, "%s: command %u exited with status %d: %s\n",
+                prgname, (unsigned) id + 1, cmd->exit_status, cmd->text);
+        bc->ret = XMAX(bc->ret, cmd->exit_status);
+    }
+}
+
+// Move past every finished command at the head of the list,
+// releasing whatever the next one has said so far.
+static void
+batch_advance(struct batch_client* bc)
+{
+    while (bc->head < bc->nr_cmds && bc->cmds[bc->head].done) {
+        batch_report(bc, bc->head);
+        bc->head += 1;
+        if (bc->head == bc->nr_cmds)
+            break;
+
+        struct batch_cmd* cmd = &bc->cmds[bc->head];
+        if (bc->output_dir == NULL && cmd->rl != NULL) {
+            for (int i = 0; i < 2; ++i)
+                batch_flush_held(bc, cmd, i);
+            batch_cmd_release(cmd);
+        }
+    }
+}
+
+static void
+batch_process_record(struct batch_client* bc,
+                     const struct batch_rec_hdr* hdr,
+                     const char* data)
+{
+    if (hdr->id >= bc->nr_cmds || bc->cmds[hdr->id].done)
+        die(ECOMM, "record for bogus command %u", (unsigned) hdr->id);
+
+    struct batch_cmd* cmd = &bc->cmds[hdr->id];
+    if (hdr->type == BATCH_STDOUT || hdr->type == BATCH_STDERR) {
+        batch_output(bc,
+                     hdr->id,
+                     hdr->type == BATCH_STDOUT ? 0 : 1,
+                     data,
+                     hdr->len);
+    } else if (hdr->type == BATCH_EXIT &&
+               hdr->len == sizeof (struct batch_exit))
+    {
+        struct batch_exit e;
+        memcpy(&e, data, sizeof (e));
+        cmd->exit_status = e.status;
+        cmd->done = true;
+        if (bc->output_dir != NULL) {
+            for (int i = 0; i < 2; ++i)
+                batch_open_output(bc, hdr->id, i);
+            batch_cmd_release(cmd);
+        }
+
+        batch_advance(bc);
+    } else {
+        die(ECOMM, "bad batch record type %u", (unsigned) hdr->type);
+    }
+}
+
+int
+batch_main(int argc, const char** argv)
+{
+    const char* const* shell_args = empty_argv;
+    const char* status_file = NULL;
+    struct batch_client bc;
+    unsigned max_jobs = 1;
+
+    memset(&bc, 0, sizeof (bc));
+
+    static struct option opts[] = {
+        { "help", no_argument, NULL, 'h' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "output-dir", required_argument, NULL, 'o' },
+        { "status-file", required_argument, NULL, 'S' },
+        { "local", no_argument, NULL, 'l' },
+        { "root", no_argument, NULL, 'r' },
+        { "user", required_argument, NULL, 'u' },
+        { "force-send-stub", no_argument, NULL, 'f' },
+        { 0 }
+    };
+
+    for (;;) {
+        char c = getopt_long(argc,
+                             (char**) argv,
+                             "+:hj:o:S:s:lru:fH:P:",
+                             opts,
+                             NULL);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'j': {
+                char* end;
+                errno = 0;
+                unsigned long n = strtoul(optarg, &end, 10);
+                if (errno != 0 || *end != '\0' ||
+                    n == 0 || n > BATCH_MAX_JOBS)
+                {
+                    die(EINVAL, "invalid job count: %s", optarg);
+                }
+                max_jobs = n;
+                break;
+            }
+            case 'o':
+                bc.output_dir = optarg;
+                break;
+            case 'S':
+                status_file = optarg;
+                break;
+            case 'l':
+            case 'r':
+            case 'f':
+                shell_args = argv_concat(
+                    shell_args,
+                    (const char*[]){xaprintf("-%c", c), NULL},
+                    NULL);
+                break;
+            case 's':
+            case 'u':
+            case 'H':
+            case 'P':
+                shell_args = argv_concat(
+                    shell_args,
+                    (const char*[]){xaprintf("-%c", c), optarg, NULL},
+                    NULL);
+                break;
+            case ':':
+                die(EINVAL, "missing option for -%c", optopt);
+            case '?':
+                if (optopt != '?')
+                    die(EINVAL, "invalid option -%c", optopt);
+            case 'h':
+                printf("%s [OPTS] [FILE]: "
+                       "run shell commands over one session\n",
+                       prgname);
+                fputs(usage, stdout);
+                return 0;
+            default:
+                abort();
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc > 1)
+        die(EINVAL, "too many arguments");
+
+    int list_fd = 0;
+    if (argc == 1 && strcmp(argv[0], "-") != 0)
+        list_fd = xopen(argv[0], O_RDONLY, 0);
+
+    bc.cmds = batch_read_commands(list_fd, &bc.nr_cmds);
+    if (bc.nr_cmds == 0)
+        return 0;
+
+    if (bc.output_dir != NULL &&
+        mkdir(bc.output_dir, 0777) == -1 &&
+        errno != EEXIST)
+    {
+        die_errno("mkdir(\"%s\")", bc.output_dir);
+    }
+
+    if (status_file != NULL)
+        bc.status_file = xfdopen(
+            xopen(status_file, O_WRONLY | O_CREAT | O_TRUNC, 0666),
+            "w");
+
+    struct batch_buf out = { 0 };
+    struct batch_hello hello = { .jobs = max_jobs };
+    batch_buf_append(&out, &hello, sizeof (hello));
+    for (uint32_t i = 0; i < bc.nr_cmds; ++i) {
+        struct batch_cmd_hdr ch = { .len = strlen(bc.cmds[i].text) };
+        if (ch.len > INT_MAX)
+            die(E2BIG, "command %u too long", (unsigned) i + 1);
+        batch_buf_append(&out, &ch, sizeof (ch));
+        batch_buf_append(&out, bc.cmds[i].text, ch.len);
+    }
+
+    struct child_start_info csi = {
+        .flags = CHILD_INHERIT_STDERR,
+        .exename = orig_argv0,
+        .argv = argv_concat((const char*[]){orig_argv0,
+                                            "batch-session",
+                                            NULL},
+                            shell_args,
+                            NULL),
+    };
+
+    struct child* session = child_start(&csi);
+    struct fdh* to_runner = session->fd[0];
+    struct fdh* from_runner = session->fd[1];
+    fd_set_blocking_mode(to_runner->fd, non_blocking);
+
+    struct batch_buf in = { 0 };
+    for (;;) {
+        struct pollfd polls[2];
+        unsigned nr_polls = 0;
+        polls[nr_polls++] = (struct pollfd){ from_runner->fd, POLLIN, 0 };
+        if (to_runner != NULL)
+            polls[nr_polls++] = (struct pollfd){ to_runner->fd, POLLOUT, 0 };
+
+        if (poll(polls, nr_polls, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            die_errno("poll");
+        }
+
+        if (to_runner != NULL && polls[1].revents != 0) {
+            ssize_t nr_written = write(to_runner->fd,
+                                       out.data + out.start,
+                                       batch_buf_size(&out));
+            if (nr_written < 0 &&
+                errno != EINTR &&
+                errno != EAGAIN &&
+                errno != EPIPE)
+            {
+                die_errno("write");
+            }
+
+            if (nr_written > 0)
+                out.start += nr_written;
+
+            // On EPIPE, the session is gone; we find out why when
+            // we read EOF from it.
+            if (batch_buf_size(&out) == 0 ||
+                (nr_written < 0 && errno == EPIPE))
+            {
+                fdh_destroy(to_runner);
+                to_runner = NULL;
+                session->fd[0] = NULL;
+            }
+        }
+
+        if (polls[0].revents == 0)
+            continue;
+
+        if (!batch_buf_read(&in, from_runner->fd, BATCH_IO_BUFSZ))
+            break;
+
+        for (;;) {
+            struct batch_rec_hdr hdr;
+            size_t avail = batch_buf_size(&in);
+            if (avail < sizeof (hdr))
+                break;
+            memcpy(&hdr, in.data + in.start, sizeof (hdr));
+            if (hdr.len > BATCH_IO_BUFSZ)
+                die(ECOMM, "batch record too long");
+            if (avail - sizeof (hdr) < hdr.len)
+                break;
+
+            batch_process_record(&bc,
+                                 &hdr,
+                                 in.data + in.start + sizeof (hdr));
+            in.start += sizeof (hdr) + hdr.len;
+        }
+    }
+
+    int session_status = batch_exit_status(child_wait(session));
+    if (bc.head < bc.nr_cmds)
+        die(ECOMM, "session ended with %u of %u commands unfinished",
+            (unsigned) (bc.nr_cmds - bc.head), (unsigned) bc.nr_cmds);
+
+    if (bc.status_file != NULL && fflush(bc.status_file) == EOF)
+        die_errno("write");
+
+    return XMAX(bc.ret, session_status);
+}
+#endif
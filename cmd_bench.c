@@ -0,0 +1,798 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include "util.h"
+#include "child.h"
+#include "argv.h"
+#include "constants.h"
+#include "linkemu.h"
+
+// fb-adb bench measures how fast whole fb-adb sessions move data on
+// this machine.  Each run is an ordinary `fb-adb rcmd --local`
+// session in a child of ours, on bare pipes or behind the link
+// emulator (see cmd_linkemu.c), with its command and stream buffer
+// sizes forced to one point of the sweep.  We feed the session's
+// stdin and drain its stdout ourselves, so every byte crosses the
+// host, the stub, and the remote command.
+//
+// The remote command prints a newline before it does anything else,
+// and we send nothing until that newline arrives, so each run splits
+// cleanly into startup (starting the stub, negotiating, and starting
+// the command) and transfer (everything after, through exit).  We
+// run every configuration --repeat times and report the median and
+// the range of each, since one run on a busy machine says little.
+//
+// Besides throughput, we report the CPU time the whole session
+// tree used per gigabyte (from RUSAGE_CHILDREN) and its read and
+// write system calls per megabyte.  Linux counts the latter in
+// /proc/PID/io and folds a child's counts into its parent's when the
+// parent reaps it, so the difference between our process's total
+// and our own thread's share is exactly what the session did.
+//
+// With --splice both, each configuration runs once with the stub
+// splicing bulk output straight to the host and once with
+// FB_ADB_NO_SPLICE set, so the two can be compared.
+
+static const char usage[] = (
+    "\n"
+    "  -s SIZE\n"
+    "  --size SIZE\n"
+    "    Move SIZE bytes (k, M, G) in each run.  Default 16M.\n"
+    "\n"
+    "  -S SCENARIO[,SCENARIO...]\n"
+    "  --scenarios SCENARIO[,SCENARIO...]\n"
+    "    Run only these scenarios.  Default is all of them:\n"
+    "      upload      our data into a remote cat >/dev/null\n"
+    "      download    a remote cat of a file out to us\n"
+    "      bidir       our data through a remote cat and back\n"
+    "      escapes     upload of nothing but '~' and '!', which the\n"
+    "                  adb encoding doubles on pty transports\n"
+    "      small-up    upload in %u-byte writes\n"
+    "      small-down  download the remote end writes %u bytes at a time\n"
+    "\n"
+    "  -k TRANSPORT[,TRANSPORT...]\n"
+    "  --transports TRANSPORT[,TRANSPORT...]\n"
+    "    Run each scenario over these transports.  local is the\n"
+    "    stub on bare pipes; pty, shell, and socket run the stub\n"
+    "    behind the link emulator with that transport.  Default is\n"
+    "    local,pty,shell,socket.\n"
+    "\n"
+    "  -L SPEC\n"
+    "  --link SPEC\n"
+    "    Link emulator parameters for the emulated transports; see\n"
+    "    fb-adb link-emulator --help.  Default is an unshaped link.\n"
+    "\n"
+    "  -c SIZE[,SIZE...]\n"
+    "  --cmd-bufsz SIZE[,SIZE...]\n"
+    "    Command buffer sizes (largest frame) to sweep.\n"
+    "    Default %u,16384,%u.\n"
+    "\n"
+    "  -b SIZE[,SIZE...]\n"
+    "  --stream-bufsz SIZE[,SIZE...]\n"
+    "    Stream buffer sizes (and so windows) to sweep.\n"
+    "    Default %u,65536,%u.\n"
+    "\n"
+    "  -x MODE\n"
+    "  --splice MODE\n"
+    "    on runs sessions as usual, off sets FB_ADB_NO_SPLICE so\n"
+    "    the stub copies child output through its buffers instead\n"
+    "    of splicing it, and both runs each configuration both ways.\n"
+    "    Splicing applies only to the local and socket transports.\n"
+    "    Default on.\n"
+    "\n"
+    "  -R COUNT\n"
+    "  --repeat COUNT\n"
+    "    Run each configuration COUNT times and report the median,\n"
+    "    minimum, and maximum.  Default %u.\n"
+    "\n"
+    "  -o FILE\n"
+    "  --output FILE\n"
+    "    Also write each result to FILE as one JSON object per line.\n"
+    "\n"
+    "  -h\n"
+    "  --help\n"
+    "    Display this message.\n"
+    "\n"
+    );
+
+// Size of the pattern we send over and over, and of our reads.
+#define BENCH_IO_BUFSZ (64*1024)
+// Write size for the small-write scenarios.
+#define BENCH_SMALL_WRITE 64
+#define BENCH_MB (1024.0 * 1024.0)
+#define BENCH_DEFAULT_REPEAT 3
+
+enum bench_data {
+    BENCH_DATA_RANDOM,
+    BENCH_DATA_ESCAPES,
+};
+
+struct bench_scenario {
+    const char* name;
+    bool upload_p;
+    bool download_p;
+    enum bench_data data;
+    size_t write_size;
+    // Remote command; %s is a file holding the download data and %u
+    // is BENCH_SMALL_WRITE.
+    const char* command;
+};
+
+static const struct bench_scenario bench_scenarios[] = {
+    { "upload", true, false, BENCH_DATA_RANDOM, BENCH_IO_BUFSZ,
+      "exec cat >/dev/null" },
+    { "download", false, true, BENCH_DATA_RANDOM, 0,
+      "exec cat %s" },
+    { "bidir", true, true, BENCH_DATA_RANDOM, BENCH_IO_BUFSZ,
+      "exec cat" },
+    { "escapes", true, false, BENCH_DATA_ESCAPES, BENCH_IO_BUFSZ,
+      "exec cat >/dev/null" },
+    { "small-up", true, false, BENCH_DATA_RANDOM, BENCH_SMALL_WRITE,
+      "exec cat >/dev/null" },
+    { "small-down", false, true, BENCH_DATA_RANDOM, 0,
+      "exec dd if=%s bs=%u 2>/dev/null" },
+};
+
+#define NR_BENCH_SCENARIOS \
+    (sizeof (bench_scenarios) / sizeof (bench_scenarios[0]))
+
+struct bench_config {
+    uint64_t size;
+    const char* link_spec;
+    const char* const* transports;
+    size_t* cmd_bufsz;
+    unsigned nr_cmd_bufsz;
+    size_t* stream_bufsz;
+    unsigned nr_stream_bufsz;
+    bool splice_modes[2];        // Indexed by splice_p
+    unsigned repeat;
+    FILE* json;
+    const char* download_file;
+    char* pattern[2];
+};
+
+struct bench_result {
+    double startup_secs;
+    double secs;                 // Transfer only
+    double cpu_secs;
+    long long io_syscalls;       // -1 if the system won't say
+};
+
+static uint64_t
+bench_parse_size(const char* what, const char* value)
+{
+    char* end;
+    errno = 0;
+    unsigned long long n = strtoull(value, &end, 10);
+    uint64_t mult = 1;
+    if (*end == 'k' || *end == 'K')
+        mult = 1024;
+    else if (*end == 'm' || *end == 'M')
+        mult = 1024 * 1024;
+    else if (*end == 'g' || *end == 'G')
+        mult = 1024 * 1024 * 1024;
+
+    if (mult != 1)
+        ++end;
+
+    if (errno != 0 || end == value || *end != '\0' ||
+        n == 0 || n > UINT64_MAX / mult)
+    {
+        die(EINVAL, "invalid %s: %s", what, value);
+    }
+
+    return n * mult;
+}
+
+static const char* const*
+bench_split_list(const char* list)
+{
+    const char* const* items = empty_argv;
+    char* copy = xstrdup(list);
+    char* saveptr = NULL;
+    for (char* item = strtok_r(copy, ",", &saveptr);
+         item != NULL;
+         item = strtok_r(NULL, ",", &saveptr))
+    {
+        items = argv_concat(items, (const char*[]){item, NULL}, NULL);
+    }
+
+    if (argv_count(items) == 0)
+        die(EINVAL, "empty list: \"%s\"", list);
+
+    return items;
+}
+
+static unsigned
+bench_parse_sizes(const char* what, const char* list, size_t** sizes)
+{
+    const char* const* items = bench_split_list(list);
+    unsigned n = argv_count(items);
+    *sizes = xalloc(n * sizeof (**sizes));
+    for (unsigned i = 0; i < n; ++i)
+        (*sizes)[i] = bench_parse_size(what, items[i]);
+    return n;
+}
+
+static const struct bench_scenario*
+bench_find_scenario(const char* name)
+{
+    for (unsigned i = 0; i < NR_BENCH_SCENARIOS; ++i)
+        if (!strcmp(bench_scenarios[i].name, name))
+            return &bench_scenarios[i];
+
+    die(EINVAL, "unknown scenario \"%s\"", name);
+}
+
+static void
+bench_check_transport(const char* name)
+{
+    if (strcmp(name, "local") &&
+        strcmp(name, "pty") &&
+        strcmp(name, "shell") &&
+        strcmp(name, "socket"))
+    {
+        die(EINVAL, "unknown transport \"%s\"", name);
+    }
+}
+
+static void
+bench_fill_pattern(char* buf, size_t size, enum bench_data data)
+{
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+    for (size_t i = 0; i < size; ++i) {
+        if (data == BENCH_DATA_ESCAPES) {
+            buf[i] = (i % 2) ? '!' : '~';
+        } else {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            buf[i] = (char) x;
+        }
+    }
+}
+
+// Sum the syscr and syscw lines of a /proc/PID/io file.
+static bool
+bench_read_io_syscalls(const char* path, long long* out)
+{
+    SCOPED_RESLIST(rl);
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return false;
+
+    long long total = 0;
+    unsigned found = 0;
+    char line[128];
+    while (fgets(line, sizeof (line), f) != NULL) {
+        long long n;
+        if (sscanf(line, "syscr: %lld", &n) == 1 ||
+            sscanf(line, "syscw: %lld", &n) == 1)
+        {
+            total += n;
+            found += 1;
+        }
+    }
+
+    fclose(f);
+    *out = total;
+    return found == 2;
+}
+
+// Count read and write system calls made by our reaped descendants,
+// give or take the reads that take the count, which are the same
+// every time and so cancel out of differences.
+static bool
+bench_children_io_syscalls(long long* out)
+{
+    SCOPED_RESLIST(rl);
+    long long all;
+    long long ours;
+    if (!bench_read_io_syscalls("/proc/self/io", &all) ||
+        !bench_read_io_syscalls(
+            xaprintf("/proc/self/task/%d/io", (int) getpid()),
+            &ours))
+    {
+        return false;
+    }
+
+    *out = all - ours;
+    return true;
+}
+
+static double
+bench_children_cpu_secs(void)
+{
+    struct rusage ru;
+    if (getrusage(RUSAGE_CHILDREN, &ru) != 0)
+        die_errno("getrusage");
+
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static const char* const*
+bench_session_argv(const struct bench_config* bc,
+                   const struct bench_scenario* sc,
+                   const char* transport,
+                   size_t cmd_bufsz,
+                   size_t stream_bufsz)
+{
+    const char* local_args[] = {"--local", NULL};
+    const char* link_args[] = {"--local-link", bc->link_spec,
+                               "-k", transport,
+                               NULL};
+    const char* const* transport_args =
+        strcmp(transport, "local") ? link_args : local_args;
+
+    return argv_concat(
+        (const char*[]){orig_argv0, "rcmd", "-T", NULL},
+        transport_args,
+        (const char*[]){"--cmd-bufsz", xaprintf("%zu", cmd_bufsz),
+                        "--stream-bufsz", xaprintf("%zu", stream_bufsz),
+                        "sh", "-c",
+                        xaprintf("echo; %s",
+                                 xaprintf(sc->command,
+                                          bc->download_file,
+                                          (unsigned) BENCH_SMALL_WRITE)),
+                        NULL},
+        NULL);
+}
+
+// Run one session, feeding it and draining it, and wait for it.
+// Fill in R's startup and transfer times.
+static void
+bench_run_1(const struct bench_config* bc,
+            const struct bench_scenario* sc,
+            const char* const* argv,
+            struct bench_result* r)
+{
+    uint64_t start_ns = monotonic_ns();
+    uint64_t ready_ns = 0;
+    bool ready_p = false;
+
+    struct child_start_info csi = {
+        .flags = CHILD_INHERIT_STDERR,
+        .exename = orig_argv0,
+        .argv = argv,
+    };
+
+    struct child* child = child_start(&csi);
+    struct fdh* to_child = child->fd[0];
+    struct fdh* from_child = child->fd[1];
+    child->fd[0] = child->fd[1] = NULL;
+    fd_set_blocking_mode(to_child->fd, non_blocking);
+
+    if (!sc->upload_p) {
+        fdh_destroy(to_child);
+        to_child = NULL;
+    }
+
+    const char* pattern = bc->pattern[sc->data];
+    char* buf = xalloc(BENCH_IO_BUFSZ);
+    uint64_t nr_written = 0;
+    uint64_t nr_read = 0;
+
+    while (to_child != NULL || from_child != NULL) {
+        struct pollfd polls[2];
+        unsigned nr_polls = 0;
+        if (to_child != NULL && ready_p)
+            polls[nr_polls++] = (struct pollfd){to_child->fd, POLLOUT, 0};
+        if (from_child != NULL)
+            polls[nr_polls++] = (struct pollfd){from_child->fd, POLLIN, 0};
+
+        if (poll(polls, nr_polls, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            die_errno("poll");
+        }
+
+        for (unsigned i = 0; i < nr_polls; ++i) {
+            if (polls[i].revents == 0)
+                continue;
+
+            if (to_child != NULL && polls[i].fd == to_child->fd) {
+                size_t off = nr_written % BENCH_IO_BUFSZ;
+                size_t len = XMIN((uint64_t) sc->write_size,
+                                  bc->size - nr_written);
+                len = XMIN(len, BENCH_IO_BUFSZ - off);
+                ssize_t ret = write(to_child->fd, pattern + off, len);
+                if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+                    continue;
+                if (ret < 0)
+                    die_errno("write");
+                nr_written += ret;
+                if (nr_written == bc->size) {
+                    fdh_destroy(to_child);
+                    to_child = NULL;
+                }
+            } else {
+                ssize_t ret = read(from_child->fd, buf, BENCH_IO_BUFSZ);
+                if (ret < 0 && errno == EINTR)
+                    continue;
+                if (ret < 0)
+                    die_errno("read");
+                if (ret == 0) {
+                    if (!ready_p)
+                        die(ECOMM, "session ended before its command ran");
+                    fdh_destroy(from_child);
+                    from_child = NULL;
+                } else if (!ready_p) {
+                    if (buf[0] != '\n')
+                        die(ECOMM, "session began with garbage");
+                    ready_ns = monotonic_ns();
+                    ready_p = true;
+                    nr_read += ret - 1;
+                } else {
+                    nr_read += ret;
+                }
+            }
+        }
+    }
+
+    int status = child_wait(child);
+    if (status != 0)
+        die(ECOMM, "session exited with status %d", status);
+
+    r->startup_secs = (ready_ns - start_ns) / 1e9;
+    r->secs = (monotonic_ns() - ready_ns) / 1e9;
+
+    uint64_t want_read = (sc->download_p ? bc->size : 0);
+    if (nr_read != want_read)
+        die(ECOMM, "session returned %llu bytes, not %llu",
+            (unsigned long long) nr_read,
+            (unsigned long long) want_read);
+}
+
+static void
+bench_run(const struct bench_config* bc,
+          const struct bench_scenario* sc,
+          const char* transport,
+          size_t cmd_bufsz,
+          size_t stream_bufsz,
+          bool splice_p,
+          struct bench_result* r)
+{
+    SCOPED_RESLIST(rl);
+    const char* const* argv =
+        bench_session_argv(bc, sc, transport, cmd_bufsz, stream_bufsz);
+
+    if (splice_p)
+        unsetenv("FB_ADB_NO_SPLICE");
+    else if (setenv("FB_ADB_NO_SPLICE", "1", 1) != 0)
+        die_errno("setenv");
+
+    long long syscalls_before;
+    bool syscalls_p = bench_children_io_syscalls(&syscalls_before);
+    double cpu_before = bench_children_cpu_secs();
+    bench_run_1(bc, sc, argv, r);
+    r->cpu_secs = bench_children_cpu_secs() - cpu_before;
+    long long syscalls_after;
+    syscalls_p = syscalls_p && bench_children_io_syscalls(&syscalls_after);
+    r->io_syscalls = syscalls_p ? syscalls_after - syscalls_before : -1;
+}
+
+struct bench_spread {
+    double median;
+    double min;
+    double max;
+};
+
+static int
+bench_compare_double(const void* a, const void* b)
+{
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// Summarize the N values in V, sorting V as we go.
+static struct bench_spread
+bench_spread(double* v, unsigned n)
+{
+    qsort(v, n, sizeof (*v), bench_compare_double);
+    double median = (n % 2)
+        ? v[n / 2]
+        : (v[n / 2 - 1] + v[n / 2]) / 2;
+    return (struct bench_spread){median, v[0], v[n - 1]};
+}
+
+static void
+bench_json_spread(FILE* json, const char* name, struct bench_spread s)
+{
+    fprintf(json, "\"%s\":%.6f,\"%s_min\":%.6f,\"%s_max\":%.6f,",
+            name, s.median, name, s.min, name, s.max);
+}
+
+static void
+bench_report(const struct bench_config* bc,
+             const struct bench_scenario* sc,
+             const char* transport,
+             size_t cmd_bufsz,
+             size_t stream_bufsz,
+             bool splice_p,
+             const struct bench_result* results,
+             unsigned nr_results)
+{
+    SCOPED_RESLIST(rl);
+
+    // Bidirectional runs move the data both ways.
+    double mb = bc->size / BENCH_MB;
+    if (sc->upload_p && sc->download_p)
+        mb *= 2;
+
+    double* startup = xalloc(nr_results * sizeof (*startup));
+    double* secs = xalloc(nr_results * sizeof (*secs));
+    double* mb_per_sec = xalloc(nr_results * sizeof (*mb_per_sec));
+    double* cpu_per_gb = xalloc(nr_results * sizeof (*cpu_per_gb));
+    double* syscalls_per_mb = xalloc(nr_results * sizeof (*syscalls_per_mb));
+    bool syscalls_p = true;
+    for (unsigned i = 0; i < nr_results; ++i) {
+        const struct bench_result* r = &results[i];
+        startup[i] = r->startup_secs * 1000;
+        secs[i] = r->secs;
+        mb_per_sec[i] = mb / r->secs;
+        cpu_per_gb[i] = r->cpu_secs / (mb / 1024.0);
+        syscalls_per_mb[i] = r->io_syscalls / mb;
+        syscalls_p = syscalls_p && r->io_syscalls >= 0;
+    }
+
+    struct bench_spread startup_s = bench_spread(startup, nr_results);
+    struct bench_spread secs_s = bench_spread(secs, nr_results);
+    struct bench_spread mb_per_sec_s = bench_spread(mb_per_sec, nr_results);
+    struct bench_spread cpu_per_gb_s = bench_spread(cpu_per_gb, nr_results);
+    struct bench_spread syscalls_per_mb_s =
+        bench_spread(syscalls_per_mb, nr_results);
+
+    printf("%-10s %-6s %6zu %8zu %-6s "
+           "%9.1f MB/s [%.1f-%.1f] %7.1f ms start [%.1f-%.1f] "
+           "%8.2f cpu-s/GB",
+           sc->name, transport, cmd_bufsz, stream_bufsz,
+           splice_p ? "splice" : "copy",
+           mb_per_sec_s.median, mb_per_sec_s.min, mb_per_sec_s.max,
+           startup_s.median, startup_s.min, startup_s.max,
+           cpu_per_gb_s.median);
+    if (syscalls_p)
+        printf(" %10.0f syscalls/MB", syscalls_per_mb_s.median);
+    putchar('\n');
+    fflush(stdout);
+
+    if (bc->json != NULL) {
+        fprintf(bc->json,
+                "{\"scenario\":\"%s\",\"transport\":\"%s\","
+                "\"link\":\"%s\",\"cmd_bufsz\":%zu,"
+                "\"stream_bufsz\":%zu,\"splice\":%s,"
+                "\"bytes\":%llu,\"runs\":%u,",
+                sc->name, transport,
+                strcmp(transport, "local") ? bc->link_spec : "",
+                cmd_bufsz, stream_bufsz,
+                splice_p ? "true" : "false",
+                (unsigned long long) bc->size, nr_results);
+        bench_json_spread(bc->json, "startup_ms", startup_s);
+        bench_json_spread(bc->json, "secs", secs_s);
+        bench_json_spread(bc->json, "mb_per_sec", mb_per_sec_s);
+        bench_json_spread(bc->json, "cpu_secs_per_gb", cpu_per_gb_s);
+        if (syscalls_p)
+            fprintf(bc->json, "\"io_syscalls_per_mb\":%.1f}\n",
+                    syscalls_per_mb_s.median);
+        else
+            fprintf(bc->json, "\"io_syscalls_per_mb\":null}\n");
+        if (fflush(bc->json) != 0)
+            die_errno("write");
+    }
+}
+
+// Write the data the download scenarios send us.
+static const char*
+bench_make_download_file(const struct bench_config* bc)
+{
+    const char* name;
+    FILE* f = xnamed_tempfile(&name);
+    const char* pattern = bc->pattern[BENCH_DATA_RANDOM];
+    for (uint64_t done = 0; done < bc->size; ) {
+        size_t len = XMIN((uint64_t) BENCH_IO_BUFSZ, bc->size - done);
+        if (fwrite(pattern, 1, len, f) != len)
+            die_errno("fwrite");
+        done += len;
+    }
+
+    if (fflush(f) != 0)
+        die_errno("fflush");
+
+    return name;
+}
+
+int
+bench_main(int argc, const char** argv)
+{
+    struct bench_config bc = {
+        .size = 16 * 1024 * 1024,
+        .link_spec = "",
+        .transports = (const char*[]){"local", "pty", "shell", "socket",
+                                      NULL},
+        .splice_modes = { false, true },
+        .repeat = BENCH_DEFAULT_REPEAT,
+    };
+
+    const char* const* scenario_names = NULL;
+    const char* cmd_bufsz_list =
+        xaprintf("%u,16384,%u", DEFAULT_CMD_BUFSZ, XFER_CMD_BUFSZ);
+    const char* stream_bufsz_list =
+        xaprintf("%u,65536,%u", DEFAULT_STREAM_BUFSZ, XFER_STREAM_BUFSZ);
+    const char* output = NULL;
+
+    static struct option opts[] = {
+        { "help", no_argument, NULL, 'h' },
+        { "size", required_argument, NULL, 's' },
+        { "scenarios", required_argument, NULL, 'S' },
+        { "transports", required_argument, NULL, 'k' },
+        { "link", required_argument, NULL, 'L' },
+        { "cmd-bufsz", required_argument, NULL, 'c' },
+        { "stream-bufsz", required_argument, NULL, 'b' },
+        { "splice", required_argument, NULL, 'x' },
+        { "repeat", required_argument, NULL, 'R' },
+        { "output", required_argument, NULL, 'o' },
+        { 0 }
+    };
+
+    for (;;) {
+        char c = getopt_long(argc,
+                             (char**) argv,
+                             "+:hs:S:k:L:c:b:x:R:o:",
+                             opts,
+                             NULL);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 's':
+                bc.size = bench_parse_size("size", optarg);
+                break;
+            case 'S':
+                scenario_names = bench_split_list(optarg);
+                break;
+            case 'k':
+                bc.transports = bench_split_list(optarg);
+                break;
+            case 'L': {
+                struct link_params lp;
+                link_params_parse(optarg, &lp);
+                bc.link_spec = optarg;
+                break;
+            }
+            case 'c':
+                cmd_bufsz_list = optarg;
+                break;
+            case 'b':
+                stream_bufsz_list = optarg;
+                break;
+            case 'x':
+                if (!strcmp(optarg, "on")) {
+                    bc.splice_modes[0] = false;
+                    bc.splice_modes[1] = true;
+                } else if (!strcmp(optarg, "off")) {
+                    bc.splice_modes[0] = true;
+                    bc.splice_modes[1] = false;
+                } else if (!strcmp(optarg, "both")) {
+                    bc.splice_modes[0] = true;
+                    bc.splice_modes[1] = true;
+                } else {
+                    die(EINVAL, "invalid splice mode \"%s\"", optarg);
+                }
+                break;
+            case 'R': {
+                uint64_t repeat = bench_parse_size("repeat count", optarg);
+                if (repeat > UINT_MAX / sizeof (struct bench_result))
+                    die(EINVAL, "invalid repeat count: %s", optarg);
+                bc.repeat = repeat;
+                break;
+            }
+            case 'o':
+                output = optarg;
+                break;
+            case ':':
+                die(EINVAL, "missing option for -%c", optopt);
+            case '?':
+                if (optopt != '?')
+                    die(EINVAL, "invalid option -%c", optopt);
+            case 'h':
+                printf("%s [OPTS]: "
+                       "measure fb-adb throughput on this machine\n",
+                       prgname);
+                printf(usage,
+                       (unsigned) BENCH_SMALL_WRITE,
+                       (unsigned) BENCH_SMALL_WRITE,
+                       (unsigned) DEFAULT_CMD_BUFSZ,
+                       (unsigned) XFER_CMD_BUFSZ,
+                       (unsigned) DEFAULT_STREAM_BUFSZ,
+                       (unsigned) XFER_STREAM_BUFSZ,
+                       (unsigned) BENCH_DEFAULT_REPEAT);
+                return 0;
+            default:
+                abort();
+        }
+    }
+
+    if (optind != argc)
+        die(EINVAL, "this command takes no arguments");
+
+    const struct bench_scenario** scenarios;
+    unsigned nr_scenarios;
+    if (scenario_names == NULL) {
+        nr_scenarios = NR_BENCH_SCENARIOS;
+        scenarios = xalloc(nr_scenarios * sizeof (*scenarios));
+        for (unsigned i = 0; i < nr_scenarios; ++i)
+            scenarios[i] = &bench_scenarios[i];
+    } else {
+        nr_scenarios = argv_count(scenario_names);
+        scenarios = xalloc(nr_scenarios * sizeof (*scenarios));
+        for (unsigned i = 0; i < nr_scenarios; ++i)
+            scenarios[i] = bench_find_scenario(scenario_names[i]);
+    }
+
+    for (const char* const* t = bc.transports; *t != NULL; ++t)
+        bench_check_transport(*t);
+
+    bc.nr_cmd_bufsz =
+        bench_parse_sizes("command buffer size",
+                          cmd_bufsz_list,
+                          &bc.cmd_bufsz);
+    bc.nr_stream_bufsz =
+        bench_parse_sizes("stream buffer size",
+                          stream_bufsz_list,
+                          &bc.stream_bufsz);
+
+    if (output != NULL) {
+        bc.json = fopen(output, "w");
+        if (bc.json == NULL)
+            die_errno("open(\"%s\")", output);
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        bc.pattern[i] = xalloc(BENCH_IO_BUFSZ);
+        bench_fill_pattern(bc.pattern[i], BENCH_IO_BUFSZ, i);
+    }
+
+    bc.download_file = bench_make_download_file(&bc);
+
+    for (unsigned si = 0; si < nr_scenarios; ++si)
+        for (const char* const* t = bc.transports; *t != NULL; ++t)
+            for (unsigned ci = 0; ci < bc.nr_cmd_bufsz; ++ci)
+                for (unsigned bi = 0; bi < bc.nr_stream_bufsz; ++bi)
+                    for (int sp = 1; sp >= 0; --sp) {
+                        if (!bc.splice_modes[sp])
+                            continue;
+                        SCOPED_RESLIST(rl_config);
+                        struct bench_result* results =
+                            xalloc(bc.repeat * sizeof (*results));
+                        for (unsigned ri = 0; ri < bc.repeat; ++ri)
+                            bench_run(&bc, scenarios[si], *t,
+                                      bc.cmd_bufsz[ci], bc.stream_bufsz[bi],
+                                      sp, &results[ri]);
+                        bench_report(&bc, scenarios[si], *t,
+                                     bc.cmd_bufsz[ci], bc.stream_bufsz[bi],
+                                     sp, results, bc.repeat);
+                    }
+
+    if (bc.json != NULL && fclose(bc.json) != 0)
+        die_errno("close(\"%s\")", output);
+
+    return 0;
+}
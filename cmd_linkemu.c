@@ -0,0 +1,476 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "util.h"
+#include "child.h"
+#include "ringbuf.h"
+#include "dbg.h"
+#include "fwd.h"
+#include "linkemu.h"
+
+// fb-adb link-emulator stands in for the adb connection so that we
+// can measure fb-adb on an ordinary machine, deterministically.  We
+// run PROGRAM on a pty, the way adb's shell: service does, or on
+// plain pipes, the way exec: does, and relay our stdin and stdout to
+// it through a model of the link.  Each direction cuts the stream
+// into packets, holds each packet for its serialization time at the
+// link's bandwidth plus a latency with seeded (and so repeatable)
+// jitter, and stops reading once its queue is full, which pushes
+// back on the sender the way a real link does.
+//
+// With --local-link SPEC, fb-adb shell and friends run the local
+// stub behind one of these instead of on bare pipes: through an
+// interactive shell on a pty (prompt, echo, and all) for the pty
+// transport, and directly otherwise.  The socket transport reaches
+// the stub's socket through another one, started with --connect, in
+// place of an adb forward.
+
+struct link_packet {
+    uint64_t due_ns;
+    size_t size;
+};
+
+struct link_dir {
+    const char* name;
+    int from;
+    int to;
+    bool from_eof;
+    bool to_gone;
+    struct ringbuf* rb;
+    struct link_packet* pkts;
+    unsigned max_pkts;
+    unsigned first_pkt;
+    unsigned nr_pkts;
+    uint64_t wire_free_ns;
+    uint64_t last_due_ns;
+};
+
+static uint64_t
+parse_link_size(const char* spec, const char* value)
+{
+    char* end;
+    errno = 0;
+    unsigned long long n = strtoull(value, &end, 10);
+    uint64_t mult = 1;
+    if (*end == 'k' || *end == 'K')
+        mult = 1024;
+    else if (*end == 'm' || *end == 'M')
+        mult = 1024 * 1024;
+    else if (*end == 'g' || *end == 'G')
+        mult = 1024 * 1024 * 1024;
+
+    if (mult != 1)
+        ++end;
+
+    if (errno != 0 || end == value || *end != '\0' ||
+        n > UINT64_MAX / mult)
+    {
+        die(EINVAL, "bad number in link spec \"%s\": \"%s\"", spec, value);
+    }
+
+    return n * mult;
+}
+
+static uint64_t
+parse_link_ms(const char* spec, const char* value)
+{
+    char* end;
+    double ms = strtod(value, &end);
+    if (end == value || *end != '\0' || !(ms >= 0) || ms > 1e9)
+        die(EINVAL, "bad time in link spec \"%s\": \"%s\"", spec, value);
+
+    return (uint64_t) (ms * 1e6);
+}
+
+void
+link_params_parse(const char* spec, struct link_params* lp)
+{
+    memset(lp, 0, sizeof (*lp));
+    lp->packet_size = LINK_DEFAULT_PACKET_SIZE;
+    lp->queue_size = LINK_DEFAULT_QUEUE_SIZE;
+    lp->seed = 1;
+
+    char* copy = xstrdup(spec);
+    char* pos = copy;
+    char* item;
+    while ((item = strsep(&pos, ",")) != NULL) {
+        if (*item == '\0')
+            continue;
+
+        char* value = strchr(item, '=');
+        if (value == NULL)
+            die(EINVAL, "link spec item \"%s\" lacks '='", item);
+
+        *value++ = '\0';
+        if (!strcmp(item, "bw"))
+            lp->bandwidth = parse_link_size(spec, value);
+        else if (!strcmp(item, "lat"))
+            lp->latency_ns = parse_link_ms(spec, value);
+        else if (!strcmp(item, "jitter"))
+            lp->jitter_ns = parse_link_ms(spec, value);
+        else if (!strcmp(item, "packet"))
+            lp->packet_size = parse_link_size(spec, value);
+        else if (!strcmp(item, "queue"))
+            lp->queue_size = parse_link_size(spec, value);
+        else if (!strcmp(item, "seed"))
+            lp->seed = parse_link_size(spec, value);
+        else
+            die(EINVAL, "unknown link spec item \"%s\"", item);
+    }
+
+    if (lp->packet_size == 0 || lp->packet_size > INT_MAX)
+        die(EINVAL, "bad packet size in link spec \"%s\"", spec);
+
+    if (lp->queue_size < lp->packet_size || lp->queue_size > INT_MAX)
+        die(EINVAL, "link queue must hold at least one packet");
+}
+
+// xorshift64: we want the same jitter on every run, not good
+// randomness.
+static uint64_t
+link_random(uint64_t* state)
+{
+    uint64_t x = *state ?: 1;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static void
+link_dir_init(struct link_dir* d,
+              const char* name,
+              int from,
+              int to,
+              const struct link_params* lp)
+{
+    memset(d, 0, sizeof (*d));
+    d->name = name;
+    d->from = from;
+    d->to = to;
+    d->rb = ringbuf_new(nextpow2sz(lp->queue_size));
+    d->max_pkts = lp->queue_size / lp->packet_size + 1;
+    d->pkts = xcalloc(d->max_pkts * sizeof (*d->pkts));
+    fd_set_blocking_mode(from, non_blocking);
+    fd_set_blocking_mode(to, non_blocking);
+}
+
+static struct link_packet*
+link_dir_head(struct link_dir* d)
+{
+    return d->nr_pkts > 0 ? &d->pkts[d->first_pkt] : NULL;
+}
+
+static bool
+link_dir_want_read(const struct link_dir* d, const struct link_params* lp)
+{
+    return !d->from_eof &&
+        d->nr_pkts < d->max_pkts &&
+        ringbuf_room(d->rb) >= lp->packet_size;
+}
+
+// Whether D has nothing more to deliver.
+static bool
+link_dir_done_p(const struct link_dir* d)
+{
+    return d->to_gone || (d->from_eof && d->nr_pkts == 0);
+}
+
+static void
+link_dir_read(struct link_dir* d,
+              const struct link_params* lp,
+              uint64_t* rng,
+              uint64_t now)
+{
+    struct iovec iov[2];
+    ringbuf_writable_iov(d->rb, iov, lp->packet_size);
+    ssize_t ret;
+    do {
+        ret = readv(d->from, iov, ARRAYSIZE(iov));
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0 && errno == EAGAIN)
+        return;
+
+    // A pty master reports EIO once the last slave closes, and a
+    // socket reports ECONNRESET if its peer closed without reading
+    // everything.  Either way, deliver what we already have.
+    if (ret < 0 && errno != EIO && errno != ECONNRESET)
+        die_errno("read(%s)", d->name);
+
+    if (ret <= 0) {
+        dbg("link %s: eof", d->name);
+        d->from_eof = true;
+        return;
+    }
+
+    ringbuf_note_added(d->rb, ret);
+
+    uint64_t wire_ns = 0;
+    if (lp->bandwidth != 0)
+        wire_ns = (uint64_t) ret * 1000000000 / lp->bandwidth;
+
+    d->wire_free_ns = XMAX(d->wire_free_ns, now) + wire_ns;
+    int64_t jitter = 0;
+    if (lp->jitter_ns != 0)
+        jitter = (int64_t) (link_random(rng) % (2 * lp->jitter_ns + 1))
+            - (int64_t) lp->jitter_ns;
+
+    uint64_t due = d->wire_free_ns + lp->latency_ns;
+    due = (jitter < 0 && (uint64_t) -jitter > due) ? 0 : due + jitter;
+
+    // Links don't reorder.
+    due = XMAX(due, d->last_due_ns);
+    d->last_due_ns = due;
+
+    unsigned slot = (d->first_pkt + d->nr_pkts) % d->max_pkts;
+    d->pkts[slot].due_ns = due;
+    d->pkts[slot].size = ret;
+    d->nr_pkts += 1;
+}
+
+static void
+link_dir_write(struct link_dir* d, uint64_t now)
+{
+    struct link_packet* p = link_dir_head(d);
+    if (p == NULL || p->due_ns > now || d->to_gone)
+        return;
+
+    struct iovec iov[2];
+    ringbuf_readable_iov(d->rb, iov, p->size);
+    ssize_t ret;
+    do {
+        ret = writev(d->to, iov, ARRAYSIZE(iov));
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0 && errno == EAGAIN)
+        return;
+
+    if (ret < 0 &&
+        (errno == EPIPE || errno == EIO || errno == ECONNRESET))
+    {
+        dbg("link %s: peer gone", d->name);
+        d->to_gone = true;
+        return;
+    }
+
+    if (ret < 0)
+        die_errno("write(%s)", d->name);
+
+    ringbuf_note_removed(d->rb, ret);
+    p->size -= ret;
+    if (p->size == 0) {
+        d->first_pkt = (d->first_pkt + 1) % d->max_pkts;
+        d->nr_pkts -= 1;
+    }
+}
+
+// Return the poll timeout until D's next packet is due, or -1.
+static int
+link_dir_timeout_ms(struct link_dir* d, uint64_t now)
+{
+    struct link_packet* p = link_dir_head(d);
+    if (p == NULL || d->to_gone || p->due_ns <= now)
+        return -1;
+
+    uint64_t ms = (p->due_ns - now + 999999) / 1000000;
+    return (int) XMIN(ms, (uint64_t) INT_MAX);
+}
+
+static int
+link_exit_status(int status)
+{
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return 255;
+}
+
+// We do our own packetizing, so if FD is a TCP socket, keep Nagle
+// from holding back the short tail of a frame behind a delayed ACK.
+// Bandwidth, latency, and jitter should be the only shaping we do.
+static void
+link_nodelay(int fd)
+{
+    int on = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on)) == -1 &&
+        errno != ENOTSOCK && errno != EOPNOTSUPP && errno != ENOPROTOOPT)
+    {
+        die_errno("setsockopt(TCP_NODELAY)");
+    }
+}
+
+static void
+print_usage(void)
+{
+    printf("%s [--pty] SPEC PROGRAM [ARGS...]: "
+           "run PROGRAM behind an emulated adb link (internal)\n"
+           "%s --connect ENDPOINT SPEC: "
+           "connect to ENDPOINT behind an emulated adb link\n"
+           "\n"
+           "  SPEC is a comma-separated list of:\n"
+           "    bw=BYTES      bytes per second each way (k, M, G);\n"
+           "                  default unlimited\n"
+           "    lat=MS        one-way latency in milliseconds\n"
+           "    jitter=MS     latency varies by up to this much\n"
+           "    packet=BYTES  largest packet; default %u\n"
+           "    queue=BYTES   bytes in flight each way; default %u\n"
+           "    seed=N        seed for the jitter\n",
+           prgname,
+           prgname,
+           (unsigned) LINK_DEFAULT_PACKET_SIZE,
+           (unsigned) LINK_DEFAULT_QUEUE_SIZE);
+}
+
+int
+link_emulator_main(int argc, const char** argv)
+{
+    bool pty_p = false;
+    const char* connect_to = NULL;
+    int argi = 1;
+    if (argi < argc && !strcmp(argv[argi], "--pty")) {
+        pty_p = true;
+        argi += 1;
+    } else if (argi + 1 < argc && !strcmp(argv[argi], "--connect")) {
+        connect_to = argv[argi + 1];
+        argi += 2;
+    }
+
+    if (argi < argc && (!strcmp(argv[argi], "-h") ||
+                        !strcmp(argv[argi], "--help")))
+    {
+        print_usage();
+        return 0;
+    }
+
+    if (argc - argi < (connect_to ? 1 : 2))
+        die(EINVAL, "bad arguments; see link-emulator --help");
+
+    struct link_params lp;
+    link_params_parse(argv[argi], &lp);
+    argi += 1;
+
+    struct child* child = NULL;
+    int s = -1;
+    int to_prog;
+    int from_prog;
+    link_nodelay(0);
+    link_nodelay(1);
+    if (connect_to != NULL) {
+        s = fwd_endpoint_connect(connect_to);
+        link_nodelay(s);
+        to_prog = from_prog = s;
+    } else {
+        struct child_start_info csi = {
+            .flags = (pty_p
+                      ? (CHILD_PTY_STDIN |
+                         CHILD_PTY_STDOUT |
+                         CHILD_PTY_STDERR)
+                      : CHILD_MERGE_STDERR),
+            .exename = argv[argi],
+            .argv = &argv[argi],
+        };
+
+        child = child_start(&csi);
+        to_prog = child->fd[0]->fd;
+        from_prog = child->fd[1]->fd;
+    }
+
+    struct link_dir up;
+    struct link_dir down;
+    link_dir_init(&up, "up", 0, to_prog, &lp);
+    link_dir_init(&down, "down", from_prog, 1, &lp);
+    struct link_dir* dirs[2] = { &up, &down };
+    uint64_t rng = lp.seed;
+
+    // The session is over once everything the program wrote has
+    // reached our peer.  Over a pty, as with adb's shell: service,
+    // our peer's hanging up also hangs up the program.
+    while (!link_dir_done_p(&down)) {
+        if (up.from_eof && up.nr_pkts == 0 && !up.to_gone) {
+            if (pty_p)
+                break;
+
+            if (child != NULL) {
+                fdh_destroy(child->fd[0]);
+                child->fd[0] = NULL;
+            } else if (shutdown(s, SHUT_WR) == -1) {
+                die_errno("shutdown");
+            }
+
+            up.to_gone = true;
+        }
+
+        uint64_t now = monotonic_ns();
+        struct pollfd polls[4];
+        unsigned nr_polls = 0;
+        int timeout = -1;
+        for (unsigned i = 0; i < ARRAYSIZE(dirs); ++i) {
+            struct link_dir* d = dirs[i];
+            if (link_dir_want_read(d, &lp) && !d->to_gone)
+                polls[nr_polls++] = (struct pollfd){ d->from, POLLIN, 0 };
+
+            struct link_packet* p = link_dir_head(d);
+            if (p != NULL && !d->to_gone && p->due_ns <= now)
+                polls[nr_polls++] = (struct pollfd){ d->to, POLLOUT, 0 };
+
+            int dt = link_dir_timeout_ms(d, now);
+            if (dt != -1 && (timeout == -1 || dt < timeout))
+                timeout = dt;
+        }
+
+        if (poll(polls, nr_polls, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            die_errno("poll");
+        }
+
+        now = monotonic_ns();
+        for (unsigned i = 0; i < nr_polls; ++i) {
+            if (polls[i].revents == 0)
+                continue;
+
+            for (unsigned j = 0; j < ARRAYSIZE(dirs); ++j) {
+                struct link_dir* d = dirs[j];
+                if (polls[i].events == POLLIN && polls[i].fd == d->from)
+                    link_dir_read(d, &lp, &rng, now);
+                else if (polls[i].events == POLLOUT && polls[i].fd == d->to)
+                    link_dir_write(d, now);
+            }
+        }
+    }
+
+    if (child == NULL)
+        return 0;
+
+    // Hang up on the program if it's still around.
+    if (child->fd[0] != NULL)
+        fdh_destroy(child->fd[0]);
+    fdh_destroy(child->fd[1]);
+    if (child->pty_master != NULL)
+        fdh_destroy(child->pty_master);
+    child->fd[0] = child->fd[1] = child->pty_master = NULL;
+
+    return link_exit_status(child_wait(child));
+}
@@ -0,0 +1,1051 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "util.h"
+#include "adb.h"
+#include "adbenc.h"
+#include "argv.h"
+#include "constants.h"
+#include "core.h"
+#include "channel.h"
+#include "ringbuf.h"
+#include "shex.h"
+
+// fb-adb multi runs one command on many devices from one process.
+// Each device gets an ordinary host session (see cmd_shex.c) with
+// its own fb_adb_sh, and all the sessions share a single poll loop,
+// along with the pipes that carry their output back to us.
+//
+// Starting the stub is what takes time, so we overlap it across
+// devices: we ask every device for a current stub over adb's exec
+// service at once and take the start lines as they arrive.  The
+// slow, blocking cases go to a starter process per device: a device
+// that can't give us a stub that way (no exec service, or a missing
+// or stale stub) and so needs start_stub_adb's probe and push, and
+// any session that has to talk su or run-as into re-executing the
+// stub.  The starter hands the finished connection back to us over
+// a socket and exits, so a fleet of fresh devices gets its stubs
+// pushed in parallel.  A session that fails is torn down without
+// disturbing the others.  We tag each line of output
+// with the device it came from (or file it per device) and collect
+// the exit statuses at the end.
+
+static const char usage[] = (
+    "\n"
+    "  -s SERIAL\n"
+    "    Run CMD on the device with serial number SERIAL.\n"
+    "    Repeatable.\n"
+    "\n"
+    "  -a\n"
+    "  --all\n"
+    "    Run CMD on every device that adb lists as ready.\n"
+    "\n"
+    "  -j N\n"
+    "  --jobs N\n"
+    "    Run at most N sessions at once.  Default is all of them.\n"
+    "\n"
+    "  -o DIR\n"
+    "  --output-dir DIR\n"
+    "    Write each device's standard output and standard error to\n"
+    "    DIR/SERIAL.out and DIR/SERIAL.err instead of printing them\n"
+    "    with each line prefixed by SERIAL.  Prefixed output splits\n"
+    "    lines longer than 4096 bytes into several, each with its\n"
+    "    own prefix, and ends an unfinished last line with a\n"
+    "    newline; use -o to get output exactly as the command\n"
+    "    wrote it.\n"
+    "\n"
+    "  -l\n"
+    "  --local\n"
+    "    Run the sessions on this machine instead; each SERIAL\n"
+    "    just names one.\n"
+    "\n"
+    "  -r\n"
+    "  --root\n"
+    "    Run CMD as root.\n"
+    "\n"
+    "  -u USER\n"
+    "  --user USER\n"
+    "    Run CMD as USER.\n"
+    "\n"
+    "  -f\n"
+    "  --force-send-stub\n"
+    "    Push the stub to every device even if it's already there.\n"
+    "\n"
+    "  -H, -P\n"
+    "    Control the adb server to which fb-adb connects.  See adb help.\n"
+    "\n"
+    "  -h\n"
+    "  --help\n"
+    "    Display this message.\n"
+    "\n"
+    "  CMD doesn't get any input.  We exit with the highest exit\n"
+    "  status of any session and report each failure on stderr.\n"
+    "\n"
+    );
+
+enum multi_state {
+    MULTI_WAITING,
+    MULTI_PROBING,              // Waiting for the stub's start line
+    MULTI_STARTING,             // Waiting for our starter process
+    MULTI_RUNNING,
+    MULTI_CLOSING,              // Command exited; flushing its output
+    MULTI_DONE,
+};
+
+struct multi_config {
+    bool local_mode;
+    bool force_send_stub;
+    bool want_root;
+    const char* want_user;
+    int argc;
+    const char** argv;
+};
+
+struct multi_stream {
+    struct fdh* fdh;            // Pipe from the session, until drained
+    struct pollfd* poll;
+    int out;
+    char* line;
+    size_t line_len;
+};
+
+struct multi_session {
+    const char* serial;
+    const char* const* adb_args;
+    const struct multi_config* cfg;
+    enum multi_state state;
+    struct reslist* rl;         // Owns the session; NULL when done
+    struct reslist* probe_rl;   // Owns PROBE_FD
+    int probe_fd;
+    char start_line[512];
+    size_t start_line_len;
+    struct fdh* starter;        // Socket to our starter process
+    pid_t starter_pid;
+    struct stub_conn conn;
+    int uid;
+    bool clean_p;
+    int pipe_write[2];          // Session's ends of the stream pipes
+    struct fb_adb_shex shex;
+    struct multi_stream stream[2];
+    enum multi_state polled_state;
+    struct pollfd* polls;
+    int exit_status;
+};
+
+// Print ST's unfinished line, if any, tagged with S's serial number.
+static void
+multi_stream_flush(struct multi_session* s, struct multi_stream* st)
+{
+    SCOPED_RESLIST(rl);
+
+    if (st->line_len == 0)
+        return;
+
+    size_t serial_len = strlen(s->serial);
+    char* out = xalloc(serial_len + 2 + st->line_len + 1);
+    size_t pos = 0;
+    memcpy(out + pos, s->serial, serial_len);
+    pos += serial_len;
+    memcpy(out + pos, ": ", 2);
+    pos += 2;
+    memcpy(out + pos, st->line, st->line_len);
+    pos += st->line_len;
+    if (out[pos - 1] != '\n')
+        out[pos++] = '\n';
+
+    write_all(st->out, out, pos);
+    st->line_len = 0;
+}
+
+// Pass LEN bytes of S's output along.  When we're tagging lines, we
+// print only whole ones and hold on to the rest, so that lines from
+// different devices never run into each other.  A line longer than
+// MULTI_LINE_MAX comes out in pieces.
+static void
+multi_stream_output(struct multi_session* s,
+                    struct multi_stream* st,
+                    const char* buf,
+                    size_t len)
+{
+    if (st->line == NULL) {
+        write_all(st->out, buf, len);
+        return;
+    }
+
+    while (len > 0) {
+        const char* nl = memchr(buf, '\n', len);
+        size_t chunk = nl ? (size_t) (nl - buf + 1) : len;
+        chunk = XMIN(chunk, MULTI_LINE_MAX - st->line_len);
+        memcpy(st->line + st->line_len, buf, chunk);
+        st->line_len += chunk;
+        buf += chunk;
+        len -= chunk;
+        if (st->line[st->line_len - 1] == '\n' ||
+            st->line_len == MULTI_LINE_MAX)
+        {
+            multi_stream_flush(s, st);
+        }
+    }
+}
+
+static void
+multi_open_outputs(struct multi_session* s, const char* output_dir)
+{
+    if (output_dir == NULL) {
+        for (int i = 0; i < 2; ++i) {
+            s->stream[i].out = i + 1;
+            s->stream[i].line = xalloc(MULTI_LINE_MAX);
+        }
+
+        return;
+    }
+
+    static const char* const suffix[2] = { "out", "err" };
+    for (int i = 0; i < 2; ++i) {
+        char* fn = xaprintf("%s/%s.%s", output_dir, s->serial, suffix[i]);
+        s->stream[i].out = xopen(fn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+}
+
+static void
+multi_end(struct multi_session* s, int exit_status)
+{
+    s->exit_status = exit_status;
+    s->state = MULTI_DONE;
+    if (s->probe_rl != NULL) {
+        reslist_destroy(s->probe_rl);
+        s->probe_rl = NULL;
+    }
+
+    if (s->rl != NULL) {
+        reslist_destroy(s->rl);
+        s->rl = NULL;
+    }
+}
+
+// Call FN on S.  If it fails, report why and end the session: its
+// connection and output pipes close, but the other sessions carry
+// on.  FN must move anything that should outlive it to S->rl.
+static void
+multi_call(struct multi_session* s, void (*fn)(void*))
+{
+    struct errinfo ei = { .want_msg = true };
+    if (catch_error(fn, s, &ei)) {
+        fprintf(stderr, "%s: %s: %s\n", prgname, s->serial, ei.msg);
+        multi_end(s, 255);
+    }
+}
+
+static bool
+multi_output_live_p(struct fb_adb_sh* sh)
+{
+    for (unsigned chno = CHILD_STDIN; chno < sh->nrch; ++chno)
+        if (!channel_dead_p(sh->ch[chno]))
+            return true;
+
+    return false;
+}
+
+// Send the command over S->conn and set up the session around it,
+// as shex_main_common does for a single `fb-adb shell -T`.
+static void
+multi_launch_1(void* data)
+{
+    struct multi_session* s = data;
+    const struct multi_config* cfg = s->cfg;
+    SCOPED_RESLIST(rl_launch);
+
+    fd_set_blocking_mode(s->conn.from->fd, blocking);
+    struct tty_flags tty_flags[3];
+    memset(tty_flags, 0, sizeof (tty_flags));
+    struct msg_shex_hello* hello =
+        make_hello_msg(DEFAULT_CMD_BUFSZ,
+                       DEFAULT_STREAM_BUFSZ,
+                       cfg->argc + 1,
+                       tty_flags);
+    hello->clean_transport_p = s->clean_p;
+    write_all_adb_encoded(s->conn.to->fd, hello, hello->msg.size);
+    send_cmdline(s->conn.to->fd, cfg->argc, cfg->argv, NULL);
+
+    struct fb_adb_sh* sh = &s->shex.sh;
+    sh->max_outgoing_msg = DEFAULT_CMD_BUFSZ;
+    sh->process_msg = shex_process_msg;
+    sh->nrch = FIRST_EXTRA_CHANNEL;
+    struct channel** ch = xalloc(sh->nrch * sizeof (*ch));
+
+    ch[FROM_PEER] = channel_new(s->conn.from,
+                                DEFAULT_CMD_BUFSZ * RECV_BUFSZ_MSGS,
+                                CHANNEL_FROM_FD);
+    ch[FROM_PEER]->window = UINT32_MAX;
+
+    ch[TO_PEER] = channel_new(s->conn.to,
+                              DEFAULT_CMD_BUFSZ,
+                              CHANNEL_TO_FD);
+    ch[TO_PEER]->adb_encoding_hack = !s->clean_p;
+
+    // CMD doesn't get any input: the stub sees its stdin close at
+    // once.
+    ch[CHILD_STDIN] = channel_new(NULL,
+                                  DEFAULT_STREAM_BUFSZ,
+                                  CHANNEL_FROM_FD);
+    ch[CHILD_STDIN]->track_window = true;
+
+    for (int i = 0; i < 2; ++i) {
+        int fd = (s->pipe_write[i] != -1
+                  ? s->pipe_write[i]
+                  : s->stream[i].out);
+        struct channel* c = channel_new(fdh_dup(fd),
+                                        DEFAULT_STREAM_BUFSZ,
+                                        CHANNEL_TO_FD);
+        c->track_bytes_written = true;
+        c->bytes_written = ringbuf_room(c->rb);
+        ch[CHILD_STDOUT + i] = c;
+    }
+
+    ch[CHILD_STDERR]->track_window = true;
+    sh->ch = ch;
+    io_loop_init(sh);
+    reslist_xfer(s->rl, rl_launch);
+    s->state = MULTI_RUNNING;
+}
+
+// What a starter process tells us: how the stub started, or why it
+// didn't.  When the starter made the connection, its two descriptors
+// come along with the reply.
+struct multi_start_reply {
+    int err;
+    int uid;
+    bool clean_p;
+    bool conn_p;
+    char msg[256];
+};
+
+static bool
+multi_want_re_exec_p(const struct multi_session* s)
+{
+    return ((s->cfg->want_root && s->uid != 0) ||
+            s->cfg->want_user != NULL);
+}
+
+// In the starter: start the stub the way fb-adb shell would, pushing
+// it if needed, unless we already have a connection to one, and have
+// it re-exec itself as the user we want.
+static void
+multi_starter_1(void* data)
+{
+    struct multi_session* s = data;
+    const struct multi_config* cfg = s->cfg;
+
+    if (s->conn.to == NULL && cfg->local_mode) {
+        start_stub_local(&s->conn);
+        s->clean_p = true;
+    } else if (s->conn.to == NULL) {
+        start_stub_adb(cfg->force_send_stub,
+                       false,
+                       s->adb_args,
+                       &s->uid,
+                       &s->clean_p,
+                       &s->conn);
+    }
+
+    fd_set_blocking_mode(s->conn.from->fd, blocking);
+    if (cfg->want_root && s->uid != 0)
+        command_re_exec_as_root(&s->conn);
+
+    if (cfg->want_user != NULL)
+        command_re_exec_as_user(&s->conn, cfg->want_user);
+}
+
+// In the starter: close every descriptor we inherited except stdio
+// and the ones in KEEP, so that we don't hold other sessions' pipes
+// and connections open for as long as we take.
+static void
+multi_starter_close_fds(const int* keep, unsigned nr_keep)
+{
+    DIR* dir = opendir("/proc/self/fd");
+    if (dir == NULL)
+        return;
+
+    int fds[256];
+    unsigned nr_fds;
+    do {
+        nr_fds = 0;
+        rewinddir(dir);
+        struct dirent* de;
+        while (nr_fds < ARRAYSIZE(fds) && (de = readdir(dir)) != NULL) {
+            int fd = atoi(de->d_name);
+            bool keep_p = (fd <= 2 || fd == dirfd(dir));
+            for (unsigned i = 0; i < nr_keep && !keep_p; ++i)
+                keep_p = (fd == keep[i]);
+            if (!keep_p)
+                fds[nr_fds++] = fd;
+        }
+
+        for (unsigned i = 0; i < nr_fds; ++i)
+            close(fds[i]);
+    } while (nr_fds == ARRAYSIZE(fds));
+
+    closedir(dir);
+}
+
+__attribute__((noreturn))
+static void
+multi_starter_main(struct multi_session* s, int sock)
+{
+    int keep[3] = { sock, -1, -1 };
+    if (s->conn.to != NULL) {
+        keep[1] = s->conn.to->fd;
+        keep[2] = s->conn.from->fd;
+    }
+
+    multi_starter_close_fds(keep, ARRAYSIZE(keep));
+
+    struct multi_start_reply reply;
+    memset(&reply, 0, sizeof (reply));
+    bool had_conn_p = (s->conn.to != NULL);
+    struct errinfo ei = { .want_msg = true };
+    if (catch_error(multi_starter_1, s, &ei)) {
+        reply.err = ei.err ?: ECOMM;
+        snprintf(reply.msg, sizeof (reply.msg), "%s", ei.msg);
+    } else {
+        reply.uid = s->uid;
+        reply.clean_p = s->clean_p;
+        reply.conn_p = !had_conn_p;
+    }
+
+    int fds[2];
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof (fds))];
+    } control;
+    struct iovec iov = { &reply, sizeof (reply) };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (reply.conn_p) {
+        fds[0] = s->conn.to->fd;
+        fds[1] = s->conn.from->fd;
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof (control.buf);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof (fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof (fds));
+    }
+
+    ssize_t ret;
+    do {
+        ret = sendmsg(sock, &mh, MSG_NOSIGNAL);
+    } while (ret == -1 && errno == EINTR);
+
+    // Skip our cleanups: the stub we started belongs to our parent
+    // now.
+    fflush(stderr);
+    _exit(ret == -1);
+}
+
+static void
+multi_reap_starter(struct multi_session* s)
+{
+    int ret;
+    do {
+        ret = waitpid(s->starter_pid, NULL, 0);
+    } while (ret == -1 && errno == EINTR);
+
+    s->starter_pid = 0;
+}
+
+static void
+multi_starter_cleanup(void* data)
+{
+    struct multi_session* s = data;
+    if (s->starter_pid != 0) {
+        kill(s->starter_pid, SIGKILL);
+        multi_reap_starter(s);
+    }
+}
+
+// Hand the slow part of starting S to a starter process; its reply
+// arrives in multi_starter_done_1.
+static void
+multi_spawn_starter_1(void* data)
+{
+    struct multi_session* s = data;
+    SCOPED_RESLIST(rl_spawn);
+
+    int sock[2];
+    xsocketpair(AF_UNIX, SOCK_SEQPACKET, 0, &sock[0], &sock[1]);
+    struct cleanup* cl = cleanup_allocate();
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == -1)
+        die_errno("fork");
+
+    if (pid == 0)
+        multi_starter_main(s, sock[1]);
+
+    s->starter_pid = pid;
+    cleanup_commit(cl, multi_starter_cleanup, s);
+    s->starter = fdh_dup(sock[0]);
+    reslist_xfer(s->rl, rl_spawn);
+    s->state = MULTI_STARTING;
+}
+
+// Take the starter's reply and, if it got the stub going, launch
+// the session.
+static void
+multi_starter_done_1(void* data)
+{
+    struct multi_session* s = data;
+    SCOPED_RESLIST(rl_done);
+
+    struct multi_start_reply reply;
+    int fds[2];
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof (fds))];
+    } control;
+    struct iovec iov = { &reply, sizeof (reply) };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof (control.buf),
+    };
+
+    struct reslist* rl_received = reslist_push_new();
+    struct cleanup* cl[2] = { cleanup_allocate(), cleanup_allocate() };
+    ssize_t ret;
+    do {
+        ret = recvmsg(s->starter->fd, &mh, MSG_CMSG_CLOEXEC);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1)
+        die_errno("recvmsg");
+
+    bool fds_p = false;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+    if (cmsg != NULL &&
+        cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof (fds)))
+    {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof (fds));
+        cleanup_commit_close_fd(cl[0], fds[0]);
+        cleanup_commit_close_fd(cl[1], fds[1]);
+        fds_p = true;
+    }
+
+    reslist_pop_nodestroy(rl_received);
+    multi_reap_starter(s);
+    fdh_destroy(s->starter);
+    s->starter = NULL;
+
+    if (ret != sizeof (reply))
+        die(ECOMM, "stub starter died");
+
+    if (reply.err != 0)
+        die(reply.err, "%s", reply.msg);
+
+    if (reply.conn_p) {
+        if (!fds_p)
+            die(ECOMM, "stub starter sent no connection");
+        s->conn.to = fdh_dup(fds[0]);
+        s->conn.from = fdh_dup(fds[1]);
+        s->uid = reply.uid;
+        s->clean_p = reply.clean_p;
+    }
+
+    reslist_destroy(rl_received);
+    reslist_xfer(s->rl, rl_done);
+    multi_launch_1(s);
+}
+
+static void
+multi_probe_connect_1(void* data)
+{
+    struct multi_session* s = data;
+    SCOPED_RESLIST(rl_probe);
+    s->probe_fd = adb_connect_service(
+        xaprintf("exec:exec %s stub", FB_ADB_REMOTE_FILENAME),
+        s->adb_args);
+    fd_set_blocking_mode(s->probe_fd, non_blocking);
+    reslist_xfer(s->probe_rl, rl_probe);
+}
+
+// The probe found a current stub: run the session over its
+// connection.
+static void
+multi_adopt_probe_1(void* data)
+{
+    struct multi_session* s = data;
+    SCOPED_RESLIST(rl_adopt);
+
+    s->conn.to = fdh_dup(s->probe_fd);
+    s->conn.from = fdh_dup(s->probe_fd);
+    s->clean_p = true;
+    reslist_xfer(s->rl, rl_adopt);
+    reslist_destroy(s->probe_rl);
+    s->probe_rl = NULL;
+    if (multi_want_re_exec_p(s))
+        multi_spawn_starter_1(s);
+    else
+        multi_launch_1(s);
+}
+
+// Ask the device for a stub over adb's exec service, as
+// try_adb_stub_clean does, but don't wait for its start line: that
+// arrives in multi_probe_read.
+static void
+multi_probe_start(struct multi_session* s)
+{
+    struct errinfo ei = { .want_msg = true };
+    if (catch_error(multi_probe_connect_1, s, &ei)) {
+        dbg("%s: clean adb shell unavailable: %s", s->serial, ei.msg);
+        multi_call(s, multi_spawn_starter_1);
+        return;
+    }
+
+    s->state = MULTI_PROBING;
+}
+
+// Read what we can of the stub's start line.  Once we have all of
+// it, start the session over the probe connection if it's from a
+// current stub, or fall back to a starter process if not.
+static void
+multi_probe_read(struct multi_session* s)
+{
+    bool eof = false;
+    size_t len = s->start_line_len;
+    for (;;) {
+        char c;
+        ssize_t ret = read(s->probe_fd, &c, 1);
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret < 0 && errno == EAGAIN) {
+            s->start_line_len = len;
+            return;
+        }
+
+        if (ret <= 0) {
+            eof = true;
+            break;
+        }
+
+        if (c == '\n')
+            break;
+
+        if (len < sizeof (s->start_line) - 1)
+            s->start_line[len++] = c;
+    }
+
+    while (len > 0 && s->start_line[len - 1] == '\r')
+        len--;
+
+    s->start_line[len] = '\0';
+    s->start_line_len = len;
+    if (!eof && check_stub_start_line(s->start_line, &s->uid)) {
+        multi_call(s, multi_adopt_probe_1);
+        return;
+    }
+
+    dbg("%s: clean adb shell unavailable: %s", s->serial, s->start_line);
+    reslist_destroy(s->probe_rl);
+    s->probe_rl = NULL;
+    multi_call(s, multi_spawn_starter_1);
+}
+
+// Set up S's output and get its stub going.
+static void
+multi_start(struct multi_session* s, bool pipes_p)
+{
+    // The session owns its output pipes, so their write ends close
+    // when it ends, however it ends.  We keep our own copy of each
+    // read end until we've drained it.
+    int pipe_read[2];
+    s->rl = reslist_push_new();
+    for (int i = 0; i < 2; ++i) {
+        s->pipe_write[i] = -1;
+        if (pipes_p)
+            xpipe(&pipe_read[i], &s->pipe_write[i]);
+    }
+
+    reslist_pop_nodestroy(s->rl);
+    for (int i = 0; pipes_p && i < 2; ++i)
+        s->stream[i].fdh = fdh_dup(pipe_read[i]);
+    s->probe_rl = reslist_push_new();
+    reslist_pop_nodestroy(s->probe_rl);
+
+    if (s->cfg->local_mode || s->cfg->force_send_stub)
+        multi_call(s, multi_spawn_starter_1);
+    else
+        multi_probe_start(s);
+}
+
+static void
+multi_pump_1(void* data)
+{
+    struct multi_session* s = data;
+    struct fb_adb_sh* sh = &s->shex.sh;
+
+    io_loop_pump(sh);
+    if (s->state == MULTI_RUNNING &&
+        (s->shex.child_exited || channel_dead_p(sh->ch[FROM_PEER])))
+    {
+        for (unsigned chno = CHILD_STDIN; chno < sh->nrch; ++chno)
+            channel_close(sh->ch[chno]);
+
+        s->state = MULTI_CLOSING;
+        io_loop_pump(sh);
+    }
+
+    if (s->state == MULTI_CLOSING && !multi_output_live_p(sh)) {
+        if (!s->shex.child_exited)
+            die(EPIPE, "lost connection to peer");
+
+        multi_end(s, s->shex.child_exit_status);
+    }
+}
+
+static void
+multi_handle_poll_1(void* data)
+{
+    struct multi_session* s = data;
+    io_loop_handle_poll(&s->shex.sh, s->polls);
+}
+
+static bool
+multi_session_live_p(const struct multi_session* s)
+{
+    return s->state == MULTI_RUNNING || s->state == MULTI_CLOSING;
+}
+
+// Read from ST's pipe and pass it along; at EOF, print anything
+// left over and let the pipe go.
+static void
+multi_stream_read(struct multi_session* s,
+                  struct multi_stream* st,
+                  char* buf)
+{
+    ssize_t nr_read = read(st->fdh->fd, buf, MULTI_IO_BUFSZ);
+    if (nr_read < 0 && (errno == EINTR || errno == EAGAIN))
+        return;
+
+    if (nr_read < 0)
+        die_errno("read");
+
+    if (nr_read > 0) {
+        multi_stream_output(s, st, buf, nr_read);
+        return;
+    }
+
+    multi_stream_flush(s, st);
+    fdh_destroy(st->fdh);
+    st->fdh = NULL;
+}
+
+// One trip around the loop: wait for anything any session or
+// output pipe needs and deal with it.
+static void
+multi_do_io(struct multi_session* sessions,
+            unsigned nr_sessions,
+            char* buf)
+{
+    SCOPED_RESLIST(rl_io);
+
+    unsigned nr_polls = 0;
+    for (unsigned i = 0; i < nr_sessions; ++i) {
+        struct multi_session* s = &sessions[i];
+        if (s->state == MULTI_PROBING || s->state == MULTI_STARTING)
+            nr_polls += 1;
+        else if (multi_session_live_p(s))
+            nr_polls += io_loop_nr_polls(&s->shex.sh);
+
+        for (int j = 0; j < 2; ++j)
+            if (s->stream[j].fdh != NULL)
+                nr_polls += 1;
+    }
+
+    struct pollfd* polls = xalloc(XMAX(nr_polls, 1) * sizeof (*polls));
+    uint64_t deadline_ns = UINT64_MAX;
+    short work = 0;
+    unsigned n = 0;
+    for (unsigned i = 0; i < nr_sessions; ++i) {
+        struct multi_session* s = &sessions[i];
+        s->polled_state = s->state;
+        s->polls = &polls[n];
+        if (s->state == MULTI_PROBING) {
+            polls[n++] = (struct pollfd){ s->probe_fd, POLLIN, 0 };
+            work |= POLLIN;
+        } else if (s->state == MULTI_STARTING) {
+            polls[n++] = (struct pollfd){ s->starter->fd, POLLIN, 0 };
+            work |= POLLIN;
+        } else if (multi_session_live_p(s)) {
+            struct fb_adb_sh* sh = &s->shex.sh;
+            uint64_t session_deadline_ns;
+            work |= io_loop_request_poll(sh, &polls[n],
+                                         &session_deadline_ns);
+            deadline_ns = XMIN(deadline_ns, session_deadline_ns);
+            n += io_loop_nr_polls(sh);
+        }
+
+        for (int j = 0; j < 2; ++j) {
+            struct multi_stream* st = &s->stream[j];
+            st->poll = NULL;
+            if (st->fdh != NULL) {
+                st->poll = &polls[n];
+                polls[n++] = (struct pollfd){ st->fdh->fd, POLLIN, 0 };
+                work |= POLLIN;
+            }
+        }
+    }
+
+    struct timespec timeout;
+    struct timespec* timeoutp = NULL;
+    if (deadline_ns != UINT64_MAX) {
+        uint64_t now = monotonic_ns();
+        uint64_t wait_ns = (deadline_ns > now ? deadline_ns - now : 0);
+        timeout.tv_sec = wait_ns / 1000000000;
+        timeout.tv_nsec = wait_ns % 1000000000;
+        timeoutp = &timeout;
+    }
+
+    if (work != 0 || timeoutp != NULL) {
+        if (ppoll(polls, n, timeoutp, NULL) < 0) {
+            if (errno == EINTR)
+                return;
+            die_errno("poll");
+        }
+    }
+
+    for (unsigned i = 0; i < nr_sessions; ++i) {
+        struct multi_session* s = &sessions[i];
+        if (s->polled_state == MULTI_PROBING &&
+            s->state == MULTI_PROBING &&
+            s->polls[0].revents != 0)
+        {
+            multi_probe_read(s);
+        } else if (s->polled_state == MULTI_STARTING &&
+                   s->state == MULTI_STARTING &&
+                   s->polls[0].revents != 0)
+        {
+            multi_call(s, multi_starter_done_1);
+        } else if ((s->polled_state == MULTI_RUNNING ||
+                    s->polled_state == MULTI_CLOSING) &&
+                   multi_session_live_p(s))
+        {
+            multi_call(s, multi_handle_poll_1);
+        }
+
+        for (int j = 0; j < 2; ++j) {
+            struct multi_stream* st = &s->stream[j];
+            if (st->poll != NULL && st->poll->revents != 0)
+                multi_stream_read(s, st, buf);
+        }
+    }
+}
+
+int
+multi_main(int argc, const char** argv)
+{
+    const char* const* serials = empty_argv;
+    const char* const* adb_args = empty_argv;
+    const char* output_dir = NULL;
+    bool all_p = false;
+    unsigned max_jobs = 0;
+    struct multi_config cfg;
+    memset(&cfg, 0, sizeof (cfg));
+
+    static struct option opts[] = {
+        { "help", no_argument, NULL, 'h' },
+        { "all", no_argument, NULL, 'a' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "output-dir", required_argument, NULL, 'o' },
+        { "local", no_argument, NULL, 'l' },
+        { "root", no_argument, NULL, 'r' },
+        { "user", required_argument, NULL, 'u' },
+        { "force-send-stub", no_argument, NULL, 'f' },
+        { 0 }
+    };
+
+    for (;;) {
+        char c = getopt_long(argc,
+                             (char**) argv,
+                             "+:hs:aj:o:lru:fH:P:",
+                             opts,
+                             NULL);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 's':
+                serials = argv_concat(serials,
+                                      (const char*[]){optarg, NULL},
+                                      NULL);
+                break;
+            case 'a':
+                all_p = true;
+                break;
+            case 'j': {
+                char* end;
+                errno = 0;
+                unsigned long n = strtoul(optarg, &end, 10);
+                if (errno != 0 || *end != '\0' || n == 0 || n > UINT_MAX)
+                    die(EINVAL, "invalid job count: %s", optarg);
+                max_jobs = n;
+                break;
+            }
+            case 'o':
+                output_dir = optarg;
+                break;
+            case 'l':
+                cfg.local_mode = true;
+                break;
+            case 'r':
+                if (cfg.want_user != NULL)
+                    die(EINVAL, "cannot both run-as user and su to root");
+                cfg.want_root = true;
+                break;
+            case 'u':
+                if (cfg.want_root)
+                    die(EINVAL, "cannot both run-as user and su to root");
+                cfg.want_user = optarg;
+                break;
+            case 'f':
+                cfg.force_send_stub = true;
+                break;
+            case 'H':
+            case 'P':
+                adb_args = argv_concat(
+                    adb_args,
+                    (const char*[]){xaprintf("-%c", c), optarg, NULL},
+                    NULL);
+                break;
+            case ':':
+                die(EINVAL, "missing option for -%c", optopt);
+            case '?':
+                if (optopt != '?')
+                    die(EINVAL, "invalid option -%c", optopt);
+            case 'h':
+                printf("%s [OPTS] CMD [ARGS...]: "
+                       "run shell command on many Android devices\n",
+                       prgname);
+                fputs(usage, stdout);
+                return 0;
+            default:
+                abort();
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc == 0)
+        die(EINVAL, "no command given");
+
+    if (cfg.local_mode && (cfg.want_root || cfg.want_user != NULL))
+        die(EINVAL, "--root and --user make no sense with --local");
+
+    if (all_p) {
+        if (cfg.local_mode)
+            die(EINVAL, "--all makes no sense with --local");
+        serials = argv_concat(serials, adb_list_devices(adb_args), NULL);
+    }
+
+    unsigned nr_sessions = argv_count(serials);
+    if (nr_sessions == 0)
+        die(EINVAL, "no devices given");
+
+    if (max_jobs == 0 || max_jobs > nr_sessions)
+        max_jobs = nr_sessions;
+
+    if (output_dir != NULL &&
+        mkdir(output_dir, 0777) == -1 &&
+        errno != EEXIST)
+    {
+        die_errno("mkdir(\"%s\")", output_dir);
+    }
+
+    // Run CMD through the shell, as fb-adb shell would.
+    cfg.argc = argc;
+    cfg.argv = argv;
+    make_shell_command_line("sh", &cfg.argc, &cfg.argv);
+
+    struct multi_session* sessions =
+        xcalloc(nr_sessions * sizeof (*sessions));
+    for (unsigned i = 0; i < nr_sessions; ++i) {
+        struct multi_session* s = &sessions[i];
+        s->serial = serials[i];
+        s->cfg = &cfg;
+        s->adb_args = argv_concat(adb_args,
+                                  (const char*[]){"-s", s->serial, NULL},
+                                  NULL);
+        multi_open_outputs(s, output_dir);
+    }
+
+    char* buf = xalloc(MULTI_IO_BUFSZ);
+    unsigned nr_started = 0;
+
+    for (;;) {
+        unsigned nr_active = 0;
+        bool busy = false;
+        for (unsigned i = 0; i < nr_started; ++i) {
+            struct multi_session* s = &sessions[i];
+            if (s->state != MULTI_DONE)
+                nr_active += 1;
+            if (s->state != MULTI_DONE ||
+                s->stream[0].fdh != NULL ||
+                s->stream[1].fdh != NULL)
+            {
+                busy = true;
+            }
+        }
+
+        if (nr_started < nr_sessions && nr_active < max_jobs) {
+            multi_start(&sessions[nr_started++], output_dir == NULL);
+            continue;
+        }
+
+        if (!busy)
+            break;
+
+        for (unsigned i = 0; i < nr_started; ++i)
+            if (multi_session_live_p(&sessions[i]))
+                multi_call(&sessions[i], multi_pump_1);
+
+        multi_do_io(sessions, nr_started, buf);
+    }
+
+    int ret = 0;
+    for (unsigned i = 0; i < nr_sessions; ++i) {
+        struct multi_session* s = &sessions[i];
+        if (s->exit_status != 0) {
+            fprintf(stderr, "%s: %s: exit status %d\n",
+                    prgname, s->serial, s->exit_status);
+            ret = XMAX(ret, s->exit_status);
+        }
+    }
+
+    return ret;
+}
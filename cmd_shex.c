@@ -15,30 +15,53 @@
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/wait.h>
 #include <getopt.h>
 #include <sys/ioctl.h>
 #include <termios.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <poll.h>
+#include <sys/stat.h>
 #include "util.h"
 #include "child.h"
 #include "ringbuf.h"
 #include "proto.h"
 #include "core.h"
 #include "channel.h"
+#include "fwd.h"
 #include "xmkraw.h"
 #include "termbits.h"
 #include "adbenc.h"
 #include "constants.h"
 #include "adb.h"
+#include "linkemu.h"
 #include "chat.h"
 #include "stubs.h"
 #include "timestamp.h"
 #include "argv.h"
+#include "timing.h"
+#include "stats.h"
+#include "trace.h"
+#include "pipeline.h"
+#include "shex.h"
 
 enum shex_mode {
     SHEX_MODE_SHELL,
     SHEX_MODE_RCMD,
     SHEX_MODE_SU,
+    SHEX_MODE_PUSH,
+    SHEX_MODE_PULL,
+    SHEX_MODE_SYNC,
+    SHEX_MODE_BATCH,
+};
+
+enum shex_transport {
+    TRANSPORT_AUTO,
+    TRANSPORT_PTY,
+    TRANSPORT_SHELL,
+    TRANSPORT_SOCKET,
 };
 
 static const char usage[] = (
@@ -68,6 +91,62 @@ static const char usage[] = (
     "  --socket\n"
     "    Use a socketpair for child stdin and stdout.\n"
     "\n"
+    "  -X\n"
+    "  --threaded-io\n"
+    "    Move IO on the adb connection and on our standard streams\n"
+    "    to dedicated threads so that a slow terminal can't stall\n"
+    "    the connection.\n"
+    "\n"
+    "  --timing\n"
+    "    At exit, print how long each phase of setting up and\n"
+    "    tearing down the session took, here and on the device.\n"
+    "    Setting FB_ADB_TIMING does the same.\n"
+    "\n"
+    "  --trace FILE\n"
+    "    Record a binary trace of this session, here and on the\n"
+    "    device, and write it to FILE at exit.  Setting FB_ADB_TRACE\n"
+    "    to FILE does the same.  Use `fb-adb trace-decode FILE' to\n"
+    "    read it.\n"
+    "\n"
+    "  --pipeline-stats\n"
+    "    At exit, print percentiles of how long output waited in\n"
+    "    each buffer between the remote command and our stdout.\n"
+    "    With --stats, the counters include them too.\n"
+    "\n"
+    "  --stats FILE\n"
+    "    At exit, append the session's IO counters to FILE as a line\n"
+    "    of JSON; \"-\" means standard error.  Setting FB_ADB_STATS\n"
+    "    to FILE does the same.  SIGUSR1 appends the counters so far\n"
+    "    to FILE, or to standard error if there's no FILE.  With a\n"
+    "    pty, the counters include percentiles of the time from\n"
+    "    reading a keystroke to the next output.\n"
+    "\n"
+    "  -F FD[:in|:out]\n"
+    "  --fd FD[:in|:out]\n"
+    "    Give the remote command our descriptor FD (3 or more) as\n"
+    "    its own FD, which it reads from (in) or writes to (out).\n"
+    "    Without a direction, go by how FD is open.  Repeatable.\n"
+    "\n"
+    "  -k TRANSPORT\n"
+    "  --transport TRANSPORT\n"
+    "    How to talk to the stub: pty, through the adb shell pty;\n"
+    "    shell, through adb's binary-clean exec service when the\n"
+    "    device supports it, falling back to pty; socket, through an\n"
+    "    adb forward to a socket the stub listens on, falling back\n"
+    "    to shell; or auto (the default), which picks socket for\n"
+    "    file transfers and shell otherwise.\n"
+    "\n"
+    "  -L LOCAL=REMOTE\n"
+    "  --forward LOCAL=REMOTE\n"
+    "    Listen on LOCAL and forward connections to REMOTE on the\n"
+    "    device for as long as the session lasts.  Endpoints are\n"
+    "    tcp:PORT (on localhost) or localabstract:NAME.\n"
+    "\n"
+    "  -R REMOTE=LOCAL\n"
+    "  --reverse REMOTE=LOCAL\n"
+    "    Listen on REMOTE on the device and forward connections to\n"
+    "    LOCAL here.\n"
+    "\n"
     "  -h\n"
     "  --help\n"
     "    Display this message.\n"
@@ -77,6 +156,13 @@ static const char usage[] = (
     "\n"
     );
 
+static const char sync_usage[] = (
+    "\n"
+    "  -D\n"
+    "  --delete\n"
+    "    Delete remote files that aren't in LOCAL.\n"
+    );
+
 static void
 print_usage(enum shex_mode smode)
 {
@@ -84,22 +170,34 @@ print_usage(enum shex_mode smode)
         printf("%s [OPTS] [CMD [ARGS...]]: "
                "run shell command on Android device\n",
                prgname);
+    else if (smode == SHEX_MODE_PUSH)
+        printf("%s [OPTS] LOCAL REMOTE: "
+               "copy file LOCAL to REMOTE on Android device\n",
+               prgname);
+    else if (smode == SHEX_MODE_PULL)
+        printf("%s [OPTS] REMOTE LOCAL: "
+               "copy file or directory REMOTE on Android device to LOCAL\n",
+               prgname);
+    else if (smode == SHEX_MODE_SYNC)
+        printf("%s [OPTS] LOCAL REMOTE: "
+               "make directory REMOTE on Android device match LOCAL\n",
+               prgname);
+    else if (smode == SHEX_MODE_BATCH)
+        printf("%s [OPTS]: "
+               "run batch-runner on Android device (internal)\n",
+               prgname);
     else
         printf("%s [OPTS] PROGRAM [ARGS...]: "
                "run program on Android device; bypass shell\n",
                prgname);
 
+    if (smode == SHEX_MODE_SYNC)
+        fputs(sync_usage, stdout);
     fputs(usage, stdout);
 }
 
-struct fb_adb_shex {
-    struct fb_adb_sh sh;
-    int child_exit_status;
-    bool child_exited;
-};
-
-static struct child*
-start_stub_local(void)
+void
+start_stub_local(struct stub_conn* conn)
 {
     struct child_start_info csi = {
         .flags = CHILD_INHERIT_STDERR,
@@ -108,12 +206,15 @@ start_stub_local(void)
     };
 
     struct child* child = child_start(&csi);
+    timing_mark("stub spawned");
     char c;
     do {
         read_all(child->fd[1]->fd, &c, 1);
     } while (c != '\n');
+    timing_mark("start line");
 
-    return child;
+    conn->to = child->fd[0];
+    conn->from = child->fd[1];
 }
 
 #ifndef BUILD_STUB
@@ -125,22 +226,38 @@ send_stub(const void* data, size_t datasz, const char* const* adb_args)
     FILE* tmpfile = xnamed_tempfile(&tmpfilename);
     if (fwrite(data, datasz, 1, tmpfile) != 1)
         die_errno("fwrite");
+    if (fflush(tmpfile) == EOF)
+        die_errno("fflush");
     if (fchmod(fileno(tmpfile), 0755) == -1)
         die_errno("fchmod");
     adb_send_file(tmpfilename, FB_ADB_REMOTE_FILENAME, adb_args);
+    timing_mark("stub pushed");
 }
 #endif
 
-static struct child*
-try_adb_stub(struct child_start_info* csi, int* uid, char** err)
+bool
+check_stub_start_line(const char* resp, int* uid)
 {
-    struct reslist* rl_stub = reslist_push_new();
-    struct child* child = child_start(csi);
-    SCOPED_RESLIST(rl_local);
-    struct chat* cc = chat_new(child->fd[0]->fd, child->fd[1]->fd);
+    dbg("stub resp: [%s]", resp);
+    int n = -1;
+    uintmax_t ver;
+    sscanf(resp, FB_ADB_PROTO_START_LINE "%n", &ver, uid, &n);
+    return n != -1 && build_time <= ver;
+}
+
+static void
+chat_start_stub_1(int to,
+                  int from,
+                  const char* stub_path,
+                  char* resp,
+                  size_t respsz)
+{
+    SCOPED_RESLIST(rl_chat);
+    struct chat* cc = chat_new(to, from);
     chat_swallow_prompt(cc);
+    timing_mark("shell prompt");
 
-    char* cmd = xaprintf("exec %s stub", FB_ADB_REMOTE_FILENAME);
+    char* cmd = xaprintf("exec %s stub", stub_path);
     unsigned promptw = 40;
     if (strlen(cmd) > promptw) {
         // The extra round trip sucks, but if we don't do this, mksh's
@@ -151,40 +268,180 @@ try_adb_stub(struct child_start_info* csi, int* uid, char** err)
     }
 
     chat_talk_at(cc, cmd);
-    char* resp = chat_read_line(cc);
-    dbg("stub resp: [%s]", resp);
-    int n = -1;
-    uintmax_t ver;
-    sscanf(resp, FB_ADB_PROTO_START_LINE "%n", &ver, uid, &n);
-    if (n != -1 && build_time <= ver) {
+    timing_mark("stub command echoed");
+    snprintf(resp, respsz, "%s", chat_read_line(cc));
+    timing_mark("start line");
+}
+
+// Talk the interactive shell on TO and FROM into running the stub at
+// STUB_PATH and return the first line we get back.
+static char*
+chat_start_stub(int to, int from, const char* stub_path)
+{
+    char resp[512];
+    chat_start_stub_1(to, from, stub_path, resp, sizeof (resp));
+    return xstrdup(resp);
+}
+
+static void
+read_start_line_1(int to, int from, char* resp, size_t respsz)
+{
+    SCOPED_RESLIST(rl_chat);
+    struct chat* cc = chat_new(to, from);
+    snprintf(resp, respsz, "%s", chat_read_line(cc));
+    timing_mark("start line");
+}
+
+// Return the first line that the stub, or whatever ran in its
+// place, wrote to FROM.
+static char*
+read_start_line(int to, int from)
+{
+    char resp[512];
+    read_start_line_1(to, from, resp, sizeof (resp));
+    return xstrdup(resp);
+}
+
+static bool
+try_adb_stub(const char* const* adb_args,
+             int* uid,
+             char** err,
+             struct stub_conn* conn)
+{
+    struct reslist* rl_stub = reslist_push_new();
+    int s = adb_connect_service("shell:", adb_args);
+    char* resp = chat_start_stub(s, s, FB_ADB_REMOTE_FILENAME);
+    if (check_stub_start_line(resp, uid)) {
         reslist_pop_nodestroy(rl_stub);
-        return child;
+        conn->to = fdh_dup(s);
+        conn->from = fdh_dup(s);
+        return true;
     }
 
     reslist_pop_nodestroy(rl_stub);
     *err = xstrdup(resp);
     reslist_destroy(rl_stub);
-    return NULL;
+    return false;
 }
 
-static struct child*
-start_stub_adb(bool force_send_stub,
-               const char* const* adb_args,
-               int* uid)
+// Run the local stub behind fb-adb link-emulator (see cmd_linkemu.c)
+// so that it sees the kind of link adb would give it: for the pty
+// transport, we go through an interactive shell on a pty, as with
+// adb's shell: service.
+static void
+start_stub_local_link(const char* link,
+                      bool want_clean,
+                      struct stub_conn* conn)
 {
+    const char* clean_argv[] = {
+        orig_argv0, "link-emulator", link, orig_argv0, "stub", NULL,
+    };
+
+    const char* pty_argv[] = {
+        orig_argv0, "link-emulator", "--pty", link,
+        "sh", "-c", "PS1='$ ' exec sh -i", NULL,
+    };
+
     struct child_start_info csi = {
         .flags = CHILD_INHERIT_STDERR,
-        .exename = "adb",
-        .argv = argv_concat((const char*[]){"adb", NULL},
-                            adb_args,
-                            (const char*[]){"shell", NULL},
-                            NULL)
+        .exename = orig_argv0,
+        .argv = want_clean ? clean_argv : pty_argv,
+    };
+
+    struct child* child = child_start(&csi);
+    timing_mark("stub spawned");
+    char* resp;
+    if (want_clean)
+        resp = read_start_line(child->fd[0]->fd, child->fd[1]->fd);
+    else
+        resp = chat_start_stub(child->fd[0]->fd,
+                               child->fd[1]->fd,
+                               orig_argv0);
+
+    int uid;
+    if (!check_stub_start_line(resp, &uid))
+        die(ECOMM, "trouble starting local stub: %s", resp);
+
+    conn->to = child->fd[0];
+    conn->from = child->fd[1];
+}
+
+
+struct adb_stub_clean_info {
+    const char* const* adb_args;
+    int s;
+};
+
+static void
+try_adb_stub_clean_1(void* data)
+{
+    struct adb_stub_clean_info* info = data;
+    info->s = adb_connect_service(
+        xaprintf("exec:exec %s stub", FB_ADB_REMOTE_FILENAME),
+        info->adb_args);
+}
+
+// Start the stub through adb's exec service, which runs it with no
+// pty over a binary-clean pipe, so we can skip the adb encoding once
+// we're past the handshake.  Devices too old to have the service
+// refuse it; a missing or stale stub shows up as a bad start line.
+// Either way, we fall back to the pty.  To try both paths without
+// a device, point ANDROID_ADB_SERVER_PORT at fb-adb adb-emulator
+// (see cmd_adbemu.c), with and without --no-exec.
+static bool
+try_adb_stub_clean(const char* const* adb_args,
+                   int* uid,
+                   char** err,
+                   struct stub_conn* conn)
+{
+    struct reslist* rl_stub = reslist_push_new();
+    struct adb_stub_clean_info info = {
+        .adb_args = adb_args,
+        .s = -1,
     };
 
-    struct child* child = NULL;
+    struct errinfo ei = { .want_msg = true };
+    const char* resp;
+    if (catch_error(try_adb_stub_clean_1, &info, &ei)) {
+        resp = ei.msg;
+    } else {
+        resp = read_start_line(info.s, info.s);
+        if (check_stub_start_line(resp, uid)) {
+            reslist_pop_nodestroy(rl_stub);
+            conn->to = fdh_dup(info.s);
+            conn->from = fdh_dup(info.s);
+            return true;
+        }
+    }
+
+    reslist_pop_nodestroy(rl_stub);
+    *err = xstrdup(resp);
+    reslist_destroy(rl_stub);
+    return false;
+}
+
+void
+start_stub_adb(bool force_send_stub,
+               bool want_clean,
+               const char* const* adb_args,
+               int* uid,
+               bool* clean_p,
+               struct stub_conn* conn)
+{
+    bool started = false;
     char* err = NULL;
+    *clean_p = false;
+    if (!force_send_stub && want_clean) {
+        if (try_adb_stub_clean(adb_args, uid, &err, conn)) {
+            *clean_p = true;
+            return;
+        }
+
+        dbg("clean adb shell unavailable: %s", err);
+    }
+
     if (!force_send_stub)
-        child = try_adb_stub(&csi, uid, &err);
+        started = try_adb_stub(adb_args, uid, &err, conn);
 
 #ifndef BUILD_STUB
     const struct {
@@ -197,19 +454,17 @@ start_stub_adb(bool force_send_stub,
         { x86_stub, x86_stubsz },
     };
 
-    for (unsigned i = 0; i < ARRAYSIZE(stubs) && !child; ++i) {
+    for (unsigned i = 0; i < ARRAYSIZE(stubs) && !started; ++i) {
         send_stub(stubs[i].data, stubs[i].size, adb_args);
-        child = try_adb_stub(&csi, uid, &err);
+        started = try_adb_stub(adb_args, uid, &err, conn);
     }
 #endif
 
-    if (!child)
+    if (!started)
         die(ECOMM, "trouble starting adb stub: %s", err);
-
-    return child;
 }
 
-static void
+void
 shex_process_msg(struct fb_adb_sh* sh, struct msg mhdr)
 {
     if (mhdr.type == MSG_CHILD_EXIT) {
@@ -219,9 +474,63 @@ shex_process_msg(struct fb_adb_sh* sh, struct msg mhdr)
         dbgmsg(&m.msg, "recv");
         shex->child_exited = true;
         shex->child_exit_status = m.exit_status;
+        timing_mark("child exit");
+        return;
+    }
+
+    if (mhdr.type == MSG_STUB_TIMING) {
+        if (mhdr.size < sizeof (struct msg_stub_timing))
+            die(ECOMM, "bad MSG_STUB_TIMING");
+        struct msg_stub_timing* m = xalloc(mhdr.size);
+        read_cmdmsg(sh, mhdr, m, mhdr.size);
+        timing_note_peer(m->phases,
+                         ((m->msg.size - sizeof (*m))
+                          / sizeof (m->phases[0])));
+        return;
+    }
+
+    if (mhdr.type == MSG_STUB_TRACE) {
+        if (mhdr.size < sizeof (struct msg_stub_trace))
+            die(ECOMM, "bad MSG_STUB_TRACE");
+        struct msg_stub_trace* m = xalloc(mhdr.size);
+        read_cmdmsg(sh, mhdr, m, mhdr.size);
+        trace_note_peer(m->pid,
+                        m->nr_dropped,
+                        m->events,
+                        ((m->msg.size - sizeof (*m))
+                         / sizeof (m->events[0])));
+        return;
+    }
+
+    if (mhdr.type == MSG_STUB_PIPELINE) {
+        if (mhdr.size < sizeof (struct msg_stub_pipeline))
+            die(ECOMM, "bad MSG_STUB_PIPELINE");
+        struct msg_stub_pipeline* m = xalloc(mhdr.size);
+        read_cmdmsg(sh, mhdr, m, mhdr.size);
+        pipeline_note_peer(sh,
+                           m->samples,
+                           ((m->msg.size - sizeof (*m))
+                            / sizeof (m->samples[0])));
         return;
     }
 
+    if (mhdr.type == MSG_CHANNEL_DATA) {
+        struct fb_adb_shex* shex = (struct fb_adb_shex*) sh;
+        if (!shex->saw_output) {
+            shex->saw_output = true;
+            timing_mark("first output");
+        }
+    }
+
+    if (mhdr.type == MSG_ERROR) {
+        if (mhdr.size < sizeof (struct msg_error))
+            die(ECOMM, "bad MSG_ERROR");
+        struct msg_error* m = xalloc(mhdr.size);
+        read_cmdmsg(sh, mhdr, m, mhdr.size);
+        die(ECOMM, "remote: %.*s",
+            (int) (m->msg.size - sizeof (*m)), m->text);
+    }
+
     fb_adb_sh_process_msg(sh, mhdr);
 }
 
@@ -246,10 +555,62 @@ fill_window_size(int fd, struct window_size* ws)
     return ret == 0;
 }
 
-struct tty_flags {
-    unsigned tty_p : 1;
-    unsigned want_pty_p : 1;
-};
+static bool
+channels_live_p(struct channel** ch, unsigned first, unsigned end)
+{
+    for (unsigned chno = first; chno < end; ++chno)
+        if (!channel_dead_p(ch[chno]))
+            return true;
+
+    return false;
+}
+
+// Parse the argument to --cmd-bufsz or --stream-bufsz.
+static size_t
+parse_bufsz(const char* arg, size_t min, size_t max)
+{
+    char* end;
+    errno = 0;
+    unsigned long n = strtoul(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || n < min || n > max)
+        die(EINVAL, "invalid buffer size %s: must be between %zu and %zu",
+            arg, min, max);
+    return n;
+}
+
+// Parse the argument to -F.
+static struct child_extra_fd
+parse_extra_fd(const char* spec)
+{
+    char* end;
+    errno = 0;
+    long fd = strtol(spec, &end, 10);
+    if (end == spec || errno != 0 || fd < 3 || fd > INT_MAX)
+        die(EINVAL, "invalid descriptor \"%s\": need a number >= 3", spec);
+
+    int fl = fcntl(fd, F_GETFL);
+    if (fl == -1)
+        die_errno("descriptor %ld", fd);
+
+    struct child_extra_fd efd = { .fd = fd };
+    if (!strcmp(end, ":in")) {
+        efd.child_writes_p = false;
+    } else if (!strcmp(end, ":out")) {
+        efd.child_writes_p = true;
+    } else if (*end != '\0') {
+        die(EINVAL, "invalid descriptor \"%s\": use FD, FD:in, or FD:out",
+            spec);
+    } else if ((fl & O_ACCMODE) == O_RDONLY) {
+        efd.child_writes_p = false;
+    } else if ((fl & O_ACCMODE) == O_WRONLY) {
+        efd.child_writes_p = true;
+    } else {
+        die(EINVAL, "descriptor %ld is open for reading and writing: "
+            "say %ld:in or %ld:out", fd, fd, fd);
+    }
+
+    return efd;
+}
 
 struct msg_shex_hello*
 make_hello_msg(size_t cmd_bufsz,
@@ -265,7 +626,7 @@ make_hello_msg(size_t cmd_bufsz,
     m->nr_argv = nr_argv;
     m->maxmsg = cmd_bufsz;
     m->stub_send_bufsz = cmd_bufsz;
-    m->stub_recv_bufsz = cmd_bufsz;
+    m->stub_recv_bufsz = cmd_bufsz * RECV_BUFSZ_MSGS;
     for (int i = 0; i < 3; ++i) {
         m->si[i].bufsz = stream_bufsz;
         m->si[i].pty_p = tty_flags[i].want_pty_p;
@@ -398,7 +759,7 @@ lim_format_shell_command_line(const char *const* argv,
 }
 
 /* Replace a command line with a shell invocation. */
-static void
+void
 make_shell_command_line(const char* shell,
                         int* argc,
                         const char*** argv)
@@ -414,7 +775,7 @@ make_shell_command_line(const char* shell,
                         NULL);
 }
 
-static void
+void
 send_cmdline(int fd,
              int argc,
              const char* const* argv,
@@ -442,23 +803,270 @@ send_cmdline(int fd,
     }
 }
 
+static struct msg_open_file*
+make_open_file_msg(const char* path,
+                   const char* name,
+                   bool write_p,
+                   uint64_t size,
+                   mode_t mode)
+{
+    struct msg_open_file* m;
+    size_t namelen = name != NULL ? strlen(name) : 0;
+    size_t pathlen;
+    size_t totalsz;
+    if (SATADD(&pathlen, strlen(path), namelen) ||
+        SATADD(&totalsz, sizeof (*m), pathlen) ||
+        totalsz > UINT16_MAX)
+    {
+        die(EINVAL, "path too long");
+    }
+
+    m = xcalloc(totalsz);
+    m->msg.type = MSG_OPEN_FILE;
+    m->msg.size = totalsz;
+    m->write_p = write_p;
+    m->mode = mode;
+    m->size = size;
+    m->namelen = namelen;
+    memcpy(m->path, path, pathlen - namelen);
+    memcpy(m->path + pathlen - namelen, name, namelen);
+    return m;
+}
+
+static struct msg*
+make_batch_msg(void)
+{
+    struct msg_run_batch* m = xcalloc(sizeof (*m));
+    m->msg.type = MSG_RUN_BATCH;
+    m->msg.size = sizeof (*m);
+    return &m->msg;
+}
+
+static struct msg_sync_dir*
+make_sync_dir_msg(const char* path, bool delete_p)
+{
+    struct msg_sync_dir* m;
+    size_t pathlen = strlen(path);
+    size_t totalsz;
+    if (SATADD(&totalsz, sizeof (*m), pathlen) || totalsz > UINT16_MAX)
+        die(EINVAL, "path too long");
+
+    m = xcalloc(totalsz);
+    m->msg.type = MSG_SYNC_DIR;
+    m->msg.size = totalsz;
+    m->delete_p = delete_p;
+    memcpy(m->path, path, pathlen);
+    return m;
+}
+
+// The sending half of a delta sync runs in a child of ours so that
+// it can block on its peer without stalling the session.
+static struct child*
+start_sync_sender(const char* local)
+{
+    struct child_start_info csi = {
+        .flags = CHILD_INHERIT_STDERR,
+        .exename = orig_argv0,
+        .argv = (const char*[]){orig_argv0, "sync-sender", local, NULL},
+    };
+
+    return child_start(&csi);
+}
+
+// Read the stub's reply to MSG_OPEN_FILE.
+static struct msg_file_info*
+read_file_info(int fd)
+{
+    struct msg* mhdr = read_msg(fd, read_all);
+    if (mhdr->type == MSG_ERROR && mhdr->size >= sizeof (struct msg_error)) {
+        struct msg_error* m = (struct msg_error*) mhdr;
+        die(ECOMM, "remote: %.*s",
+            (int) (m->msg.size - sizeof (*m)), m->text);
+    }
+
+    if (mhdr->type != MSG_FILE_INFO ||
+        mhdr->size < sizeof (struct msg_file_info))
+    {
+        die(ECOMM, "bad handshake: expected MSG_FILE_INFO");
+    }
+
+    dbgmsg(mhdr, "recv");
+    return (struct msg_file_info*) mhdr;
+}
+
 static void
-command_re_exec_as_root(struct child* child)
+xmkdir_p(const char* path)
+{
+    if (mkdir(path, 0777) == -1 && errno != EEXIST)
+        die_errno("mkdir(\"%s\")", path);
+}
+
+// Open the local end of a pull.  A remote directory arrives as a
+// tar stream, which we unpack with tar(1) as it comes in.
+static struct fdh*
+open_pull_destination(const char* remote,
+                      const char* local,
+                      const struct msg_file_info* info,
+                      struct child** extractor)
+{
+    struct stat st;
+    if (stat(local, &st) == 0 && S_ISDIR(st.st_mode))
+        local = xaprintf("%s/%s", local, basename(xstrdup(remote)));
+
+    if (!info->directory_p) {
+        int fd = xopen(local, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        preallocate_file(fd, info->size);
+        return fdh_dup(fd);
+    }
+
+    xmkdir_p(local);
+    struct child_start_info csi = {
+        .flags = CHILD_INHERIT_STDERR,
+        .exename = "tar",
+        .argv = (const char*[]){"tar", "-x", "--no-same-owner",
+                                "-f", "-", "-C", local, NULL},
+    };
+
+    *extractor = child_start(&csi);
+    return (*extractor)->fd[0];
+}
+
+struct socket_transport_info {
+    struct stub_conn* stub;
+    bool local_mode;
+    const char* local_link;
+    const char* const* adb_args;
+    unsigned port;
+    int s;
+};
+
+static void
+socket_transport_connect_1(void* data)
+{
+    struct socket_transport_info* info = data;
+    struct msg m = { .size = sizeof (m), .type = MSG_SOCKET_LISTEN };
+    write_all_adb_encoded(info->stub->to->fd, &m, sizeof (m));
+
+    struct msg* mhdr = read_msg(info->stub->from->fd, read_all);
+    if (mhdr->type != MSG_SOCKET_LISTENING ||
+        mhdr->size < sizeof (struct msg_socket_listening))
+    {
+        die(ECOMM, "bad reply to MSG_SOCKET_LISTEN");
+    }
+
+    struct msg_socket_listening* lm = (struct msg_socket_listening*) mhdr;
+    size_t namesz = lm->msg.size - sizeof (*lm);
+    if (namesz == 0)
+        die(ECOMM, "stub could not listen");
+
+    const char* name = xaprintf("%.*s", (int) namesz, lm->name);
+    const char* spec;
+    if (info->local_mode) {
+        spec = xaprintf("localabstract:%s", name);
+    } else {
+        info->port = adb_forward_abstract(name, info->adb_args);
+        spec = xaprintf("tcp:%u", info->port);
+    }
+
+    // adb accepts the connection before it tries to reach the
+    // device end of the forward, so wait for the stub to greet us,
+    // but not forever: it may never see our connection.
+    int s;
+    if (info->local_link != NULL) {
+        struct child_start_info csi = {
+            .flags = CHILD_SOCKETPAIR_STDIO | CHILD_INHERIT_STDERR,
+            .exename = orig_argv0,
+            .argv = (const char*[]){
+                orig_argv0, "link-emulator", "--connect", spec,
+                info->local_link, NULL},
+        };
+        s = child_start(&csi)->fd[0]->fd;
+    } else {
+        s = fwd_endpoint_connect(spec);
+    }
+
+    struct msg_socket_cookie cm = {
+        .msg = { .size = sizeof (cm), .type = MSG_SOCKET_COOKIE },
+    };
+    memcpy(cm.cookie, lm->cookie, sizeof (cm.cookie));
+    write_all(s, &cm, sizeof (cm));
+
+    struct pollfd p = { s, POLLIN, 0 };
+    int ret;
+    while ((ret = poll(&p, 1, SOCKET_HANDSHAKE_TIMEOUT_MS)) == -1)
+        if (errno != EINTR)
+            die_errno("poll");
+
+    if (ret == 0)
+        die(ETIMEDOUT, "stub did not greet us on socket");
+
+    mhdr = read_msg(s, read_all);
+    if (mhdr->type != MSG_SOCKET_CONNECTED)
+        die(ECOMM, "bad greeting on socket");
+
+    info->s = s;
+}
+
+static void
+socket_transport_unforward_1(void* data)
+{
+    struct socket_transport_info* info = data;
+    adb_forward_remove(info->port, info->adb_args);
+}
+
+// Ask STUB to listen on a socket and connect to it: directly in
+// local mode (through a link emulator with --local-link), and
+// otherwise through a forward that we remove once we're connected.
+// The socket is 8-bit clean and bypasses the pty, so nothing we
+// send over it needs encoding.  Return the socket, or -1 if we
+// couldn't connect; the stub then keeps using the pty.
+static int
+try_socket_transport(struct stub_conn* stub,
+                     bool local_mode,
+                     const char* local_link,
+                     const char* const* adb_args)
+{
+    struct socket_transport_info info = {
+        .stub = stub,
+        .local_mode = local_mode,
+        .local_link = local_link,
+        .adb_args = adb_args,
+        .s = -1,
+    };
+
+    struct errinfo ei = { .want_msg = true };
+    if (catch_error(socket_transport_connect_1, &info, &ei))
+        dbg("socket transport unavailable: %s", ei.msg);
+    else
+        dbg("using socket transport");
+
+    if (info.port != 0 &&
+        catch_error(socket_transport_unforward_1, &info, &ei))
+    {
+        dbg("could not remove forward: %s", ei.msg);
+    }
+
+    return info.s;
+}
+
+void
+command_re_exec_as_root(struct stub_conn* stub)
 {
     SCOPED_RESLIST(rl_re_exec_as_root);
 
-    // Tell child to re-exec itself as root.  It'll send another hello
-    // message, which we read below.
+    // Tell the stub to re-exec itself as root.  It'll send another
+    // hello message, which we read below.
 
     struct msg rmsg = {
         .size = sizeof (rmsg),
         .type = MSG_EXEC_AS_ROOT,
     };
 
-    write_all_adb_encoded(child->fd[0]->fd, &rmsg, rmsg.size);
+    write_all_adb_encoded(stub->to->fd, &rmsg, rmsg.size);
 
-    struct chat* cc = chat_new(child->fd[0]->fd, child->fd[1]->fd);
+    struct chat* cc = chat_new(stub->to->fd, stub->from->fd);
     char* resp = chat_read_line(cc);
+    timing_mark("start line");
     int n = -1;
     int uid;
     uintmax_t ver;
@@ -468,15 +1076,17 @@ command_re_exec_as_root(struct child* child)
         die(ECOMM, "trouble re-execing adb stub as root: %s", resp);
 
     if (uid != 0)
-        die(ECOMM, "told child to re-exec as root; gave us uid=%d", uid);
+        die(ECOMM, "told stub to re-exec as root; gave us uid=%d", uid);
+
+    timing_mark("re-exec as root");
 }
 
-static void
-command_re_exec_as_user(struct child* child, const char* username)
+void
+command_re_exec_as_user(struct stub_conn* stub, const char* username)
 {
     SCOPED_RESLIST(rl_re_exec_as_root);
 
-    // Tell child to re-exec itself as our user.  It'll send another
+    // Tell the stub to re-exec itself as our user.  It'll send another
     // hello message, which we read below.
 
     struct msg_exec_as_user* m;
@@ -489,10 +1099,11 @@ command_re_exec_as_user(struct child* child, const char* username)
     m->msg.size = alloc_size;
     m->msg.type = MSG_EXEC_AS_USER;
     memcpy(m->username, username, username_length);
-    write_all_adb_encoded(child->fd[0]->fd, m, m->msg.size);
+    write_all_adb_encoded(stub->to->fd, m, m->msg.size);
 
-    struct chat* cc = chat_new(child->fd[0]->fd, child->fd[1]->fd);
+    struct chat* cc = chat_new(stub->to->fd, stub->from->fd);
     char* resp = chat_read_line(cc);
+    timing_mark("start line");
     int n = -1;
     int uid;
     uintmax_t ver;
@@ -501,15 +1112,56 @@ command_re_exec_as_user(struct child* child, const char* username)
     if (n == -1)
         die(ECOMM, "trouble re-execing adb stub as %s: %s",
             username, resp);
+
+    timing_mark("re-exec as user");
 }
 
+static const struct option shex_opts[] = {
+    { "help", no_argument, NULL, 'h' },
+    { "local", no_argument, NULL, 'l' },
+    { "exename", required_argument, NULL, 'E' },
+    { "force-send-stub", no_argument, NULL, 'f' },
+    { "force-tty", no_argument, NULL, 't' },
+    { "disable-tty", no_argument, NULL, 'T' },
+    { "root", no_argument, NULL, 'r' },
+    { "socket", no_argument, NULL, 'U' },
+    { "user", required_argument, NULL, 'u' },
+    { "threaded-io", no_argument, NULL, 'X' },
+    { "delete", no_argument, NULL, 'D' },
+    { "fd", required_argument, NULL, 'F' },
+    { "forward", required_argument, NULL, 'L' },
+    { "reverse", required_argument, NULL, 'R' },
+    { "transport", required_argument, NULL, 'k' },
+    { "local-link", required_argument, NULL, 'Y' },
+    { "cmd-bufsz", required_argument, NULL, 'M' },
+    { "stream-bufsz", required_argument, NULL, 'W' },
+    { "timing", no_argument, NULL, 'Z' },
+    { "stats", required_argument, NULL, 'O' },
+    { "trace", required_argument, NULL, 'V' },
+    { "pipeline-stats", no_argument, NULL, 'Q' },
+    { 0 }
+};
+
+static const char shex_optstring[] = "+:lhE:ftTdes:p:H:P:rUu:XDF:L:R:k:";
+
 static int
 shex_main_common(enum shex_mode smode, int argc, const char** argv)
 {
     size_t cmd_bufsz = DEFAULT_CMD_BUFSZ;
     size_t child_stream_bufsz = DEFAULT_STREAM_BUFSZ;
     size_t our_stream_bufsz = DEFAULT_STREAM_BUFSZ;
+    size_t forced_cmd_bufsz = 0;
+    size_t forced_stream_bufsz = 0;
     bool local_mode = false;
+    const char* local_link = NULL;
+    const char* stats_path = NULL;
+    bool pipeline_p = false;
+    bool threaded_io = false;
+    bool delete_p = false;
+    enum shex_transport transport = TRANSPORT_AUTO;
+    struct fwd* fwd = NULL;
+    struct child_extra_fd extra_fds[MAX_EXTRA_FDS];
+    unsigned nr_extra_fds = 0;
     enum { TTY_AUTO,
            TTY_SOCKPAIR,
            TTY_DISABLE,
@@ -532,24 +1184,11 @@ shex_main_common(enum shex_mode smode, int argc, const char** argv)
             tty_flags[i].tty_p = true;
         }
 
-    static struct option opts[] = {
-        { "help", no_argument, NULL, 'h' },
-        { "local", no_argument, NULL, 'l' },
-        { "exename", required_argument, NULL, 'E' },
-        { "force-send-stub", no_argument, NULL, 'f' },
-        { "force-tty", no_argument, NULL, 't' },
-        { "disable-tty", no_argument, NULL, 'T' },
-        { "root", no_argument, NULL, 'r' },
-        { "socket", no_argument, NULL, 'U' },
-        { "user", required_argument, NULL, 'u' },
-        { 0 }
-    };
-
     for (;;) {
         char c = getopt_long(argc,
                              (char**) argv,
-                             "+:lhE:ftTdes:p:H:P:rUu:",
-                             opts,
+                             shex_optstring,
+                             shex_opts,
                              NULL);
         if (c == -1)
             break;
@@ -569,6 +1208,39 @@ shex_main_common(enum shex_mode smode, int argc, const char** argv)
             case 'l':
                 local_mode = true;
                 break;
+            case 'Y': {
+#ifdef BUILD_STUB
+                die(EINVAL, "the stub has no link emulator");
+#else
+                struct link_params lp;
+                link_params_parse(optarg, &lp);
+                local_link = xstrdup(optarg);
+                local_mode = true;
+                break;
+#endif
+            }
+            case 'M':
+                forced_cmd_bufsz = parse_bufsz(optarg,
+                                               MIN_CMD_BUFSZ,
+                                               XFER_CMD_BUFSZ);
+                break;
+            case 'W':
+                forced_stream_bufsz = parse_bufsz(optarg,
+                                                  1,
+                                                  MAX_STREAM_BUFSZ);
+                break;
+            case 'Z':
+                timing_set_enabled(true);
+                break;
+            case 'O':
+                stats_path = optarg;
+                break;
+            case 'V':
+                trace_enable(optarg, false);
+                break;
+            case 'Q':
+                pipeline_p = true;
+                break;
             case 't':
                 if (tty_mode == TTY_ENABLE)
                     tty_mode = TTY_SUPER_ENABLE;
@@ -599,6 +1271,58 @@ shex_main_common(enum shex_mode smode, int argc, const char** argv)
             case 'U':
                 tty_mode = TTY_SOCKPAIR;
                 break;
+            case 'X':
+                threaded_io = true;
+                break;
+            case 'D':
+                if (smode != SHEX_MODE_SYNC)
+                    die(EINVAL, "--delete works only with sync");
+                delete_p = true;
+                break;
+            case 'F':
+                if (smode == SHEX_MODE_PUSH ||
+                    smode == SHEX_MODE_PULL ||
+                    smode == SHEX_MODE_SYNC ||
+                    smode == SHEX_MODE_BATCH)
+                {
+                    die(EINVAL, "-F works only when running a command");
+                }
+                if (nr_extra_fds == MAX_EXTRA_FDS)
+                    die(EINVAL, "too many extra descriptors");
+                extra_fds[nr_extra_fds] = parse_extra_fd(optarg);
+                for (unsigned i = 0; i < nr_extra_fds; ++i)
+                    if (extra_fds[i].fd == extra_fds[nr_extra_fds].fd)
+                        die(EINVAL, "descriptor %d given twice",
+                            extra_fds[i].fd);
+                nr_extra_fds += 1;
+                break;
+            case 'L':
+            case 'R':
+                if (smode == SHEX_MODE_PUSH ||
+                    smode == SHEX_MODE_PULL ||
+                    smode == SHEX_MODE_SYNC)
+                {
+                    die(EINVAL, "forwarding works only with a session");
+                }
+                if (fwd == NULL)
+                    fwd = fwd_new(true);
+                if (c == 'L')
+                    fwd_add_forward(fwd, optarg);
+                else
+                    fwd_add_reverse(fwd, optarg);
+                break;
+            case 'k':
+                if (!strcmp(optarg, "auto"))
+                    transport = TRANSPORT_AUTO;
+                else if (!strcmp(optarg, "pty"))
+                    transport = TRANSPORT_PTY;
+                else if (!strcmp(optarg, "shell"))
+                    transport = TRANSPORT_SHELL;
+                else if (!strcmp(optarg, "socket"))
+                    transport = TRANSPORT_SOCKET;
+                else
+                    die(EINVAL, "unknown transport \"%s\"", optarg);
+                break;
             case 'u':
                 if (want_root)
                     die(EINVAL, "cannot both run-as user and su to root");
@@ -619,10 +1343,129 @@ shex_main_common(enum shex_mode smode, int argc, const char** argv)
 
     argc -= optind;
     argv += optind;
+    timing_mark("args parsed");
 
     if (smode == SHEX_MODE_RCMD && argc == 0)
         die(EINVAL, "remote command not given");
 
+    // For push and pull, the stub moves the file over the child's
+    // stdin or stdout channel in big frames; window-based flow
+    // control keeps enough data in flight to cover adb's latency.
+    // Sync runs its own protocol over the same channels.
+    struct msg* open_file_msg = NULL;
+    struct fdh* xfer_fdh = NULL;
+    uint64_t xfer_size = 0;
+    const char* pull_remote = NULL;
+    const char* pull_local = NULL;
+    const char* sync_local = NULL;
+    struct child* extractor = NULL;
+    struct child* sync_sender = NULL;
+    if (smode == SHEX_MODE_PUSH ||
+        smode == SHEX_MODE_PULL ||
+        smode == SHEX_MODE_SYNC)
+    {
+        if (argc != 2)
+            die(EINVAL, "need exactly one source and one destination");
+
+        tty_mode = TTY_DISABLE;
+        cmd_bufsz = XFER_CMD_BUFSZ;
+        child_stream_bufsz = XFER_STREAM_BUFSZ;
+        our_stream_bufsz = XFER_STREAM_BUFSZ;
+        struct stat st;
+
+        if (smode == SHEX_MODE_PUSH) {
+            int fd = xopen(argv[0], O_RDONLY, 0);
+            if (fstat(fd, &st) == -1)
+                die_errno("fstat");
+            if (S_ISDIR(st.st_mode))
+                die(EISDIR, "%s: is a directory", argv[0]);
+
+            hint_sequential_read(fd);
+            xfer_size = st.st_size;
+            xfer_fdh = fdh_dup(fd);
+            const char* remote = argv[1];
+            const char* name = basename(xstrdup(argv[0]));
+            if (remote[0] != '\0' && remote[strlen(remote) - 1] == '/') {
+                remote = xaprintf("%s%s", remote, name);
+                name = NULL;
+            }
+            open_file_msg = &make_open_file_msg(remote,
+                                                name,
+                                                true,
+                                                xfer_size,
+                                                st.st_mode & 0777)->msg;
+        } else if (smode == SHEX_MODE_PULL) {
+            // We open the local end once we know what we're pulling.
+            pull_remote = argv[0];
+            pull_local = argv[1];
+            open_file_msg = &make_open_file_msg(argv[0],
+                                                NULL,
+                                                false,
+                                                0,
+                                                0)->msg;
+        } else {
+            if (stat(argv[0], &st) == -1)
+                die_errno("stat(\"%s\")", argv[0]);
+            if (!S_ISDIR(st.st_mode))
+                die(ENOTDIR, "%s: not a directory", argv[0]);
+
+            sync_local = argv[0];
+            open_file_msg = &make_sync_dir_msg(argv[1], delete_p)->msg;
+        }
+
+        argc = 0;
+    }
+
+    // A batch runs an internal protocol over our stdin and stdout;
+    // see cmd_batch.c.
+    if (smode == SHEX_MODE_BATCH) {
+        if (argc != 0)
+            die(EINVAL, "this command is internal");
+
+        tty_mode = TTY_DISABLE;
+        open_file_msg = make_batch_msg();
+    }
+
+    // A command whose stdin or stdout is redirected to a regular file
+    // is a bulk transfer too, so give it the same big frames and
+    // buffers that push and pull get.
+    bool file_stdio[2] = { false, false };
+    size_t file_stdio_bufsz = XFER_STREAM_BUFSZ;
+    if (open_file_msg == NULL) {
+        for (int i = 0; i < 2; ++i) {
+            struct stat st;
+            file_stdio[i] = fstat(i, &st) == 0 && S_ISREG(st.st_mode);
+        }
+
+        if (file_stdio[0])
+            hint_sequential_read(0);
+
+        if (file_stdio[0] || file_stdio[1]) {
+            cmd_bufsz = XFER_CMD_BUFSZ;
+            child_stream_bufsz = XFER_STREAM_BUFSZ;
+        }
+    }
+
+    // Setting up the socket costs a couple of adb round trips, which
+    // pay off only when there's a lot of data to move.
+    if (transport == TRANSPORT_AUTO)
+        transport = ((open_file_msg != NULL ||
+                      file_stdio[0] ||
+                      file_stdio[1])
+                     ? TRANSPORT_SOCKET
+                     : TRANSPORT_SHELL);
+
+    // Sizes given explicitly (fb-adb bench sweeps them) beat all the
+    // guesses above.
+    if (forced_cmd_bufsz != 0)
+        cmd_bufsz = forced_cmd_bufsz;
+
+    if (forced_stream_bufsz != 0) {
+        child_stream_bufsz = forced_stream_bufsz;
+        our_stream_bufsz = forced_stream_bufsz;
+        file_stdio_bufsz = forced_stream_bufsz;
+    }
+
     if (smode == SHEX_MODE_SHELL && argc > 0)
         make_shell_command_line("sh", &argc, &argv);
 
@@ -638,10 +1481,15 @@ shex_main_common(enum shex_mode smode, int argc, const char** argv)
 
     sigemptyset(&blocked_signals);
     sigaddset(&blocked_signals, SIGWINCH);
+    sigaddset(&blocked_signals, SIGUSR1);
     sigprocmask(SIG_BLOCK, &blocked_signals, &orig_sigmask);
     signal(SIGWINCH, handle_sigwinch);
+    stats_init(stats_path);
 
     size_t args_to_send = XMAX((size_t) argc + 1, 2);
+    if (open_file_msg != NULL)
+        args_to_send = 0;
+
     struct msg_shex_hello* hello_msg =
         make_hello_msg(cmd_bufsz,
                        child_stream_bufsz,
@@ -652,24 +1500,96 @@ shex_main_common(enum shex_mode smode, int argc, const char** argv)
         hello_msg->stdio_socket_p = 1;
     }
 
-    struct child* child;
+    hello_msg->nr_extra_fds = nr_extra_fds;
+    // Lining up the stub's trace or samples with ours needs its
+    // timing marks.
+    hello_msg->timing_p = timing_enabled_p() || trace_enabled || pipeline_p;
+    hello_msg->trace_p = trace_enabled;
+    hello_msg->pipeline_p = pipeline_p;
+
+    struct stub_conn stub;
     int uid;
+    bool clean_p;
     if (local_mode) {
         if (want_root)
             die(EINVAL, "root upgrade not supported in local mode");
-        child = start_stub_local();
+        clean_p = (transport != TRANSPORT_PTY);
+        if (local_link != NULL)
+            start_stub_local_link(local_link, clean_p, &stub);
+        else
+            start_stub_local(&stub);
     } else {
-        child = start_stub_adb(force_send_stub, adb_args, &uid);
+        start_stub_adb(force_send_stub,
+                       transport != TRANSPORT_PTY,
+                       adb_args,
+                       &uid,
+                       &clean_p,
+                       &stub);
     }
 
+    hello_msg->clean_transport_p = clean_p;
+
     if (want_root && uid != 0)
-        command_re_exec_as_root(child);
+        command_re_exec_as_root(&stub);
 
     if (want_user)
-        command_re_exec_as_user(child, want_user);
+        command_re_exec_as_user(&stub, want_user);
+
+    // The handshake is adb-encoded on every transport; see
+    // struct msg_socket_listening.
+    struct fdh* to_stub = stub.to;
+    struct fdh* from_stub = stub.from;
+    bool socket_p = false;
+    if (transport == TRANSPORT_SOCKET) {
+        int s = try_socket_transport(&stub,
+                                     local_mode,
+                                     local_link,
+                                     adb_args);
+        if (s != -1) {
+            to_stub = fdh_dup(s);
+            from_stub = fdh_dup(s);
+            socket_p = true;
+            timing_mark("socket connected");
+        }
+    }
+
+    // Mark before writing, so that the stub can't see the hello
+    // before our mark says we sent it.  See timing_peer_offset.
+    timing_mark("hello sent");
+    write_all_adb_encoded(to_stub->fd, hello_msg, hello_msg->msg.size);
+    for (unsigned i = 0; i < nr_extra_fds; ++i) {
+        struct msg_extra_fd m;
+        memset(&m, 0, sizeof (m));
+        m.msg.type = MSG_EXTRA_FD;
+        m.msg.size = sizeof (m);
+        m.fd = extra_fds[i].fd;
+        m.child_writes_p = extra_fds[i].child_writes_p;
+        m.bufsz = EXTRA_FD_BUFSZ;
+        write_all_adb_encoded(to_stub->fd, &m, sizeof (m));
+    }
+
 
-    write_all_adb_encoded(child->fd[0]->fd, hello_msg, hello_msg->msg.size);
-    send_cmdline(child->fd[0]->fd, argc, argv, exename);
+    if (open_file_msg != NULL)
+        write_all_adb_encoded(to_stub->fd,
+                              open_file_msg,
+                              open_file_msg->size);
+    else
+        send_cmdline(to_stub->fd, argc, argv, exename);
+
+    timing_mark("command sent");
+
+    if (open_file_msg != NULL) {
+        struct msg_file_info* info = read_file_info(from_stub->fd);
+        if (smode == SHEX_MODE_PULL) {
+            xfer_size = info->size;
+            xfer_fdh = open_pull_destination(pull_remote,
+                                             pull_local,
+                                             info,
+                                             &extractor);
+        } else if (smode == SHEX_MODE_SYNC) {
+            sync_sender = start_sync_sender(sync_local);
+        }
+    }
 
     struct fb_adb_shex shex;
     memset(&shex, 0, sizeof (shex));
@@ -678,28 +1598,57 @@ shex_main_common(enum shex_mode smode, int argc, const char** argv)
     sh->poll_mask = &orig_sigmask;
     sh->max_outgoing_msg = cmd_bufsz;
     sh->process_msg = shex_process_msg;
-    sh->nrch = 5;
+    sh->fwd = fwd;
+    sh->nrch = FIRST_EXTRA_CHANNEL + nr_extra_fds;
     struct channel** ch = xalloc(sh->nrch * sizeof (*ch));
 
-    ch[FROM_PEER] = channel_new(child->fd[1], cmd_bufsz, CHANNEL_FROM_FD);
+    ch[FROM_PEER] = channel_new(from_stub,
+                                cmd_bufsz * RECV_BUFSZ_MSGS,
+                                CHANNEL_FROM_FD);
     ch[FROM_PEER]->window = UINT32_MAX;
 
-    ch[TO_PEER] = channel_new(child->fd[0], cmd_bufsz, CHANNEL_TO_FD);
-    ch[TO_PEER]->adb_encoding_hack = true;
+    ch[TO_PEER] = channel_new(to_stub, cmd_bufsz, CHANNEL_TO_FD);
+    ch[TO_PEER]->adb_encoding_hack = !socket_p && !clean_p;
+    ch[TO_PEER]->shutdown_on_close = socket_p;
+
+    struct fdh* stdio_fdh[3] = { NULL, NULL, NULL };
+    if (smode == SHEX_MODE_PUSH) {
+        stdio_fdh[0] = xfer_fdh;
+    } else if (smode == SHEX_MODE_PULL) {
+        stdio_fdh[1] = xfer_fdh;
+        if (extractor != NULL)
+            stdio_fdh[2] = fdh_dup(2);
+    } else if (smode == SHEX_MODE_SYNC) {
+        stdio_fdh[0] = sync_sender->fd[1];
+        stdio_fdh[1] = sync_sender->fd[0];
+        stdio_fdh[2] = fdh_dup(2);
+    } else {
+        for (int i = 0; i < 3; ++i)
+            stdio_fdh[i] = fdh_dup(i);
+    }
 
-    ch[CHILD_STDIN] = channel_new(fdh_dup(0),
-                                  our_stream_bufsz,
+    ch[CHILD_STDIN] = channel_new(stdio_fdh[0],
+                                  (file_stdio[0]
+                                   ? file_stdio_bufsz
+                                   : our_stream_bufsz),
                                   CHANNEL_FROM_FD);
     ch[CHILD_STDIN]->track_window = true;
-
-    ch[CHILD_STDOUT] = channel_new(fdh_dup(1),
-                                   our_stream_bufsz,
+    // Keystrokes shouldn't queue behind bulk uploads.
+    ch[CHILD_STDIN]->prio = (tty_flags[0].want_pty_p
+                             ? CHANNEL_PRIO_INTERACTIVE
+                             : CHANNEL_PRIO_BULK);
+    ch[CHILD_STDIN]->weight = CHANNEL_WEIGHT_STDIO;
+
+    ch[CHILD_STDOUT] = channel_new(stdio_fdh[1],
+                                   (file_stdio[1]
+                                    ? file_stdio_bufsz
+                                    : our_stream_bufsz),
                                    CHANNEL_TO_FD);
     ch[CHILD_STDOUT]->track_bytes_written = true;
     ch[CHILD_STDOUT]->bytes_written =
         ringbuf_room(ch[CHILD_STDOUT]->rb);
 
-    ch[CHILD_STDERR] = channel_new(fdh_dup(2),
+    ch[CHILD_STDERR] = channel_new(stdio_fdh[2],
                                    our_stream_bufsz,
                                    CHANNEL_TO_FD);
     ch[CHILD_STDERR]->track_window = true;
@@ -707,6 +1656,23 @@ shex_main_common(enum shex_mode smode, int argc, const char** argv)
     ch[CHILD_STDERR]->bytes_written =
         ringbuf_room(ch[CHILD_STDERR]->rb);
 
+    for (unsigned i = 0; i < nr_extra_fds; ++i) {
+        struct fdh* fdh = fdh_dup(extra_fds[i].fd);
+        replace_with_dev_null(extra_fds[i].fd);
+        struct channel* c;
+        if (extra_fds[i].child_writes_p) {
+            c = channel_new(fdh, EXTRA_FD_BUFSZ, CHANNEL_TO_FD);
+            c->track_bytes_written = true;
+            c->bytes_written = ringbuf_room(c->rb);
+        } else {
+            c = channel_new(fdh, EXTRA_FD_BUFSZ, CHANNEL_FROM_FD);
+            c->track_window = true;
+            c->prio = CHANNEL_PRIO_BULK;
+        }
+
+        ch[FIRST_EXTRA_CHANNEL + i] = c;
+    }
+
     sh->ch = ch;
 
     for (int i = 0; i <3; ++i)
@@ -717,14 +1683,29 @@ shex_main_common(enum shex_mode smode, int argc, const char** argv)
     replace_with_dev_null(1);
 
     io_loop_init(sh);
+    if (tty_flags[0].want_pty_p)
+        stats_track_echo(sh);
+    if (pipeline_p)
+        pipeline_enable(sh, false);
+
+    if (threaded_io)
+        for (unsigned chno = 0; chno < sh->nrch; ++chno)
+            channel_start_thread(ch[chno]);
+
+    if (fwd != NULL)
+        fwd_start(sh);
+
     dbg("starting main loop");
+    uint64_t start_ns = monotonic_ns();
 
     resume_loop:
 
+    // The stub exits as soon as it has written its exit status, so
+    // TO_PEER can fail with EPIPE while FROM_PEER still holds the
+    // tail of the output.  Keep reading until FROM_PEER hits EOF.
     PUMP_WHILE(sh, (!saw_sigwinch &&
                     !shex.child_exited &&
-                    !channel_dead_p(ch[FROM_PEER]) &&
-                    !channel_dead_p(ch[TO_PEER])));
+                    !channel_dead_p(ch[FROM_PEER])));
 
     if (saw_sigwinch) {
         dbg("SIGWINCH");
@@ -747,17 +1728,53 @@ shex_main_common(enum shex_mode smode, int argc, const char** argv)
 
     dbg("closing standard streams");
 
-    channel_close(ch[CHILD_STDIN]);
-    channel_close(ch[CHILD_STDOUT]);
-    channel_close(ch[CHILD_STDERR]);
+    unsigned nr_child_ch = FIRST_EXTRA_CHANNEL + nr_extra_fds;
+    for (unsigned chno = CHILD_STDIN; chno < nr_child_ch; ++chno)
+        channel_close(ch[chno]);
+
+    PUMP_WHILE(sh, channels_live_p(ch, CHILD_STDIN, nr_child_ch));
+    timing_mark("output flushed");
+
+    if (pipeline_p)
+        pipeline_report(sh);
 
-    PUMP_WHILE(sh, (!channel_dead_p(ch[CHILD_STDIN]) ||
-                    !channel_dead_p(ch[CHILD_STDOUT]) ||
-                    !channel_dead_p(ch[CHILD_STDERR])));
+    if (stats_at_exit_p())
+        stats_dump(sh, "exit");
 
     if (!shex.child_exited)
         die(EPIPE, "lost connection to peer");
 
+    if (extractor != NULL) {
+        int status = child_wait(extractor);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            die(EIO, "tar failed to extract %s", pull_remote);
+    }
+
+    if (sync_sender != NULL) {
+        int status = child_wait(sync_sender);
+        if (shex.child_exit_status == 0 &&
+            (!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+        {
+            shex.child_exit_status = 1;
+        }
+    }
+
+    if (open_file_msg != NULL &&
+        smode != SHEX_MODE_BATCH &&
+        shex.child_exit_status == 0)
+    {
+        double secs = (monotonic_ns() - start_ns) / 1e9;
+        if (extractor != NULL || sync_sender != NULL)
+            fprintf(stderr, "%s: %s in %.3fs\n",
+                    prgname, pull_remote ?: sync_local, secs);
+        else
+            fprintf(stderr, "%s: %ju bytes in %.3fs (%.1f MB/s)\n",
+                    prgname,
+                    (uintmax_t) xfer_size,
+                    secs,
+                    secs > 0 ? xfer_size / secs / 1e6 : 0.0);
+    }
+
     return shex.child_exit_status;
 }
 
@@ -772,3 +1789,105 @@ shex_main_rcmd(int argc, const char** argv)
 {
     return shex_main_common(SHEX_MODE_RCMD, argc, argv);
 }
+
+int
+shex_main_push(int argc, const char** argv)
+{
+    return shex_main_common(SHEX_MODE_PUSH, argc, argv);
+}
+
+int
+shex_main_pull(int argc, const char** argv)
+{
+    return shex_main_common(SHEX_MODE_PULL, argc, argv);
+}
+
+int
+shex_main_sync(int argc, const char** argv)
+{
+    return shex_main_common(SHEX_MODE_SYNC, argc, argv);
+}
+
+// Parse ARGV, the arguments to one of our transfer commands, the way
+// shex_main_common will.  Return the number of words that follow our
+// options and point *POS at them, or return -1 if ARGV has options
+// we don't know.  Set *HELP if ARGV asks for our help.
+static int
+shex_positional_args(int argc,
+                     const char** argv,
+                     const char* const** pos,
+                     bool* help)
+{
+    bool bad = false;
+    *help = false;
+    opterr = 0;
+    for (;;) {
+        int c = getopt_long(argc,
+                            (char**) argv,
+                            shex_optstring,
+                            shex_opts,
+                            NULL);
+        if (c == -1)
+            break;
+        if (c == ':' || c == '?')
+            bad = true;
+        if (c == 'h')
+            *help = true;
+    }
+
+    int nr = argc - optind;
+    *pos = &argv[optind];
+
+    // Let shex_main_common parse from the start.
+    optind = 0;
+    opterr = 1;
+    return bad ? -1 : nr;
+}
+
+// adb has push, pull, and sync commands of its own that accept more
+// than ours do: several sources, directories, a missing destination,
+// and flags of their own.  These predicates say whether ARGV, the
+// arguments to the fb-adb command, are meant for us; anything else
+// belongs to adb.
+
+// One local file that isn't a directory and one remote path.
+bool
+shex_push_args_p(int argc, const char** argv)
+{
+    const char* const* pos;
+    bool help;
+    int nr = shex_positional_args(argc, argv, &pos, &help);
+    struct stat st;
+    return nr != -1 &&
+        (help ||
+         (nr == 2 && stat(pos[0], &st) == 0 && !S_ISDIR(st.st_mode)));
+}
+
+// One remote path and one local one.
+bool
+shex_pull_args_p(int argc, const char** argv)
+{
+    const char* const* pos;
+    bool help;
+    int nr = shex_positional_args(argc, argv, &pos, &help);
+    return nr != -1 && (help || nr == 2);
+}
+
+// One local directory and one remote path.
+bool
+shex_sync_args_p(int argc, const char** argv)
+{
+    const char* const* pos;
+    bool help;
+    int nr = shex_positional_args(argc, argv, &pos, &help);
+    struct stat st;
+    return nr != -1 &&
+        (help ||
+         (nr == 2 && stat(pos[0], &st) == 0 && S_ISDIR(st.st_mode)));
+}
+
+int
+shex_main_batch(int argc, const char** argv)
+{
+    return shex_main_common(SHEX_MODE_BATCH, argc, argv);
+}
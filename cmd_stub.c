@@ -20,32 +20,133 @@
 #include <getopt.h>
 #include <sys/ioctl.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include "util.h"
 #include "child.h"
 #include "xmkraw.h"
 #include "ringbuf.h"
 #include "ringbuf.h"
 #include "proto.h"
+#include "archive.h"
 #include "core.h"
 #include "channel.h"
+#include "fwd.h"
 #include "adbenc.h"
 #include "termbits.h"
 #include "constants.h"
 #include "timestamp.h"
+#include "timing.h"
+#include "trace.h"
+#include "pipeline.h"
 
 static void
-send_exit_message(int status, struct fb_adb_sh* sh)
+send_exit_code(uint8_t exit_status, struct fb_adb_sh* sh)
 {
     struct msg_child_exit m;
     memset(&m, 0, sizeof (m));
     m.msg.type = MSG_CHILD_EXIT;
     m.msg.size = sizeof (m);
+    m.exit_status = exit_status;
+    queue_message_synch(sh, &m.msg);
+}
+
+static void
+send_exit_message(int status, struct fb_adb_sh* sh)
+{
+    uint8_t exit_status = 0;
     if (WIFEXITED(status))
-        m.exit_status = WEXITSTATUS(status);
+        exit_status = WEXITSTATUS(status);
     else if (WIFSIGNALED(status))
-        m.exit_status = 128 + WTERMSIG(status);
+        exit_status = 128 + WTERMSIG(status);
 
-    queue_message_synch(sh, &m.msg);
+    send_exit_code(exit_status, sh);
+}
+
+static void
+send_timing(struct fb_adb_sh* sh)
+{
+    struct timing_phase phases[TIMING_MAX_PHASES];
+    unsigned n = timing_get_phases(phases, ARRAYSIZE(phases));
+    n = XMIN(n, (unsigned) ((sh->max_outgoing_msg -
+                             sizeof (struct msg_stub_timing))
+                            / sizeof (phases[0])));
+    size_t size = sizeof (struct msg_stub_timing) + n * sizeof (phases[0]);
+    struct msg_stub_timing* m = xcalloc(size);
+    m->msg.type = MSG_STUB_TIMING;
+    m->msg.size = size;
+    memcpy(m->phases, phases, n * sizeof (phases[0]));
+    queue_message_synch(sh, &m->msg);
+}
+
+// Send our trace ring to the host, as many events to a message as
+// will fit.
+static void
+send_trace(struct fb_adb_sh* sh)
+{
+    size_t per_msg = ((sh->max_outgoing_msg - sizeof (struct msg_stub_trace))
+                      / sizeof (struct trace_event));
+    size_t size = sizeof (struct msg_stub_trace) +
+        per_msg * sizeof (struct trace_event);
+    struct msg_stub_trace* m = xcalloc(size);
+    unsigned first = 0;
+    uint64_t nr_dropped;
+    unsigned n;
+
+    // Don't let the messages we're sending push the oldest events
+    // out from under us.
+    trace_enabled = false;
+    while ((n = trace_get_events(m->events, first, per_msg, &nr_dropped))) {
+        m->msg.type = MSG_STUB_TRACE;
+        m->msg.size = sizeof (*m) + n * sizeof (m->events[0]);
+        m->pid = getpid();
+        m->nr_dropped = XMIN(nr_dropped, UINT32_MAX);
+        queue_message_synch(sh, &m->msg);
+        first += n;
+    }
+
+    trace_sent();
+}
+
+// Send the host the samples we took of CHILD_STDOUT, as many to a
+// message as will fit.
+static void
+send_pipeline(struct fb_adb_sh* sh)
+{
+    // Let the output we followed leave TO_PEER, so that we know when
+    // it did.
+    struct channel* to_peer = sh->ch[TO_PEER];
+    PUMP_WHILE(sh, to_peer->fdh != NULL && channel_buffered(to_peer) > 0);
+
+    size_t per_msg = ((sh->max_outgoing_msg -
+                       sizeof (struct msg_stub_pipeline))
+                      / sizeof (struct pipeline_sample));
+    size_t size = sizeof (struct msg_stub_pipeline) +
+        per_msg * sizeof (struct pipeline_sample);
+    struct msg_stub_pipeline* m = xcalloc(size);
+    unsigned first = 0;
+    unsigned n;
+
+    while ((n = pipeline_get_samples(sh, m->samples, first, per_msg))) {
+        m->msg.type = MSG_STUB_PIPELINE;
+        m->msg.size = sizeof (*m) + n * sizeof (m->samples[0]);
+        queue_message_synch(sh, &m->msg);
+        first += n;
+    }
+}
+
+static void
+send_error_message(const char* text, struct fb_adb_sh* sh)
+{
+    size_t textsz = XMIN(strlen(text),
+                         sh->max_outgoing_msg - sizeof (struct msg_error));
+    struct msg_error* m = xcalloc(sizeof (*m) + textsz);
+    m->msg.type = MSG_ERROR;
+    m->msg.size = sizeof (*m) + textsz;
+    memcpy(m->text, text, textsz);
+    queue_message_synch(sh, &m->msg);
 }
 
 static void
@@ -79,7 +180,7 @@ stub_process_msg(struct fb_adb_sh* sh, struct msg mhdr)
         read_cmdmsg(sh, mhdr, &m, sizeof (m));
         dbgmsg(&m.msg, "recv");
         struct stub* stub = (struct stub*) sh;
-        if (stub->child->pty_master)
+        if (stub->child && stub->child->pty_master)
             set_window_size(stub->child->pty_master->fd, &m.ws);
 
         return;
@@ -213,8 +314,45 @@ read_child_arglist(size_t expected)
     return argv;
 }
 
+// Reject a buffer size from the host outside the range that
+// --stream-bufsz accepts, before it turns into an allocation.
+static void
+check_stream_bufsz(uint32_t bufsz, const char* what)
+{
+    if (bufsz == 0 || bufsz > MAX_STREAM_BUFSZ)
+        die(ECOMM, "bad handshake: %s buffer size %u out of range",
+            what, (unsigned) bufsz);
+}
+
+// Read the MSG_EXTRA_FD messages that follow the hello.
+static struct msg_extra_fd**
+read_extra_fds(unsigned nr_extra_fds)
+{
+    struct msg_extra_fd** extra =
+        xalloc((nr_extra_fds + 1) * sizeof (*extra));
+
+    for (unsigned i = 0; i < nr_extra_fds; ++i) {
+        struct msg* mhdr = read_msg(0, read_all_adb_encoded);
+        if (mhdr->type != MSG_EXTRA_FD ||
+            mhdr->size != sizeof (struct msg_extra_fd))
+        {
+            die(ECOMM, "bad handshake: expected MSG_EXTRA_FD");
+        }
+
+        extra[i] = (struct msg_extra_fd*) mhdr;
+        if (extra[i]->fd < 3 || extra[i]->fd > INT_MAX)
+            die(ECOMM, "bad handshake: invalid extra fd %u",
+                (unsigned) extra[i]->fd);
+
+        check_stream_bufsz(extra[i]->bufsz, "extra fd");
+    }
+
+    return extra;
+}
+
 static struct child*
-start_child(struct msg_shex_hello* shex_hello)
+start_child(struct msg_shex_hello* shex_hello,
+            struct msg_extra_fd** extra)
 {
     if (shex_hello->nr_argv < 2)
         die(ECOMM, "insufficient arguments given");
@@ -241,9 +379,383 @@ start_child(struct msg_shex_hello* shex_hello)
     if (shex_hello->stdio_socket_p)
         csi.flags |= CHILD_SOCKETPAIR_STDIO;
 
+    unsigned nr_extra_fd = shex_hello->nr_extra_fds;
+    struct child_extra_fd* extra_fd =
+        xalloc((nr_extra_fd + 1) * sizeof (*extra_fd));
+    for (unsigned i = 0; i < nr_extra_fd; ++i) {
+        extra_fd[i].fd = extra[i]->fd;
+        extra_fd[i].child_writes_p = extra[i]->child_writes_p;
+    }
+
+    csi.extra_fd = extra_fd;
+    csi.nr_extra_fd = nr_extra_fd;
     return child_start(&csi);
 }
 
+// File transfer mode: instead of running a child, we move a single
+// file over the child's stdin or stdout channel, or stream a
+// directory tree as a tar archive over the child's stdout.  A delta
+// sync or a batch does run a child, but one of our choosing.
+struct stub_file {
+    struct msg_open_file* m;
+    struct msg_sync_dir* sync;
+    bool batch_p;
+    struct fdh* fdh;
+    struct child* child;
+    const char* path;
+    uint64_t size;
+    bool directory_p;
+};
+
+// Delta sync: run the receiver as our child, in a directory we
+// create if needed.
+static void
+start_sync_receiver(struct stub_file* sf)
+{
+    struct msg_sync_dir* m = sf->sync;
+    size_t pathlen = m->msg.size - sizeof (*m);
+    if (pathlen > INT_MAX)
+        die(ECOMM, "path length overflow");
+
+    const char* path = xaprintf("%.*s", (int) pathlen, m->path);
+    struct stat st;
+    if (mkdir(path, 0777) == -1 && errno != EEXIST)
+        die_errno("mkdir(\"%s\")", path);
+    if (stat(path, &st) == -1)
+        die_errno("stat(\"%s\")", path);
+    if (!S_ISDIR(st.st_mode))
+        die(ENOTDIR, "%s: not a directory", path);
+
+    const char* argv[5];
+    unsigned argc = 0;
+    argv[argc++] = orig_argv0;
+    argv[argc++] = "sync-receiver";
+    if (m->delete_p)
+        argv[argc++] = "--delete";
+    argv[argc++] = path;
+    argv[argc++] = NULL;
+
+    struct child_start_info csi = {
+        .exename = orig_argv0,
+        .argv = argv,
+    };
+
+    sf->child = child_start(&csi);
+    sf->directory_p = true;
+}
+
+// Batch: run the runner as our child; it reads the commands from
+// its stdin.
+static void
+start_batch_runner(struct stub_file* sf)
+{
+    struct child_start_info csi = {
+        .exename = orig_argv0,
+        .argv = (const char*[]){orig_argv0, "batch-runner", NULL},
+    };
+
+    sf->child = child_start(&csi);
+}
+
+static void
+open_stub_file_1(void* arg)
+{
+    struct stub_file* sf = arg;
+    if (sf->sync != NULL) {
+        start_sync_receiver(sf);
+        return;
+    }
+
+    if (sf->batch_p) {
+        start_batch_runner(sf);
+        return;
+    }
+
+    struct msg_open_file* m = sf->m;
+    size_t pathlen = m->msg.size - sizeof (*m);
+    if (pathlen > INT_MAX)
+        die(ECOMM, "path length overflow");
+
+    if (m->namelen > pathlen)
+        die(ECOMM, "bad file name length");
+
+    size_t namelen = m->namelen;
+    const char* path = xaprintf("%.*s", (int) (pathlen - namelen), m->path);
+    struct stat st;
+    int fd;
+
+    if (m->write_p) {
+        if (namelen > 0 && stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+            path = xaprintf("%s/%.*s",
+                            path,
+                            (int) namelen,
+                            m->path + pathlen - namelen);
+        fd = xopen(path, O_WRONLY | O_CREAT | O_TRUNC, m->mode);
+        preallocate_file(fd, m->size);
+    } else {
+        fd = xopen(path, O_RDONLY, 0);
+        if (fstat(fd, &st) == -1)
+            die_errno("fstat");
+        if (S_ISDIR(st.st_mode)) {
+            sf->directory_p = true;
+            sf->path = path;
+            return;
+        }
+
+        hint_sequential_read(fd);
+        sf->size = st.st_size;
+    }
+
+    sf->fdh = fdh_dup(fd);
+}
+
+// Tell the peer whether we could open its file.  We do this before
+// starting the session so that the peer knows how to set up its
+// end before any data arrives.
+static bool
+open_stub_file(struct stub_file* sf, size_t maxmsg)
+{
+    struct errinfo ei = { .want_msg = true };
+    if (catch_error(open_stub_file_1, sf, &ei)) {
+        size_t textsz = XMIN(strlen(ei.msg),
+                             maxmsg - sizeof (struct msg_error));
+        struct msg_error* m = xcalloc(sizeof (*m) + textsz);
+        m->msg.type = MSG_ERROR;
+        m->msg.size = sizeof (*m) + textsz;
+        memcpy(m->text, ei.msg, textsz);
+        write_all(1, m, m->msg.size);
+        return false;
+    }
+
+    struct msg_file_info m;
+    memset(&m, 0, sizeof (m));
+    m.msg.type = MSG_FILE_INFO;
+    m.msg.size = sizeof (m);
+    m.size = sf->size;
+    m.directory_p = sf->directory_p;
+    write_all(1, &m, sizeof (m));
+    return true;
+}
+
+// Is any of the child's channels going in direction DIR still open?
+static bool
+child_channels_live_p(struct channel** ch,
+                      unsigned nr_extra,
+                      enum channel_direction dir)
+{
+    for (unsigned chno = CHILD_STDIN;
+         chno < FIRST_EXTRA_CHANNEL + nr_extra;
+         ++chno)
+    {
+        if (ch[chno]->dir == dir && !channel_dead_p(ch[chno]))
+            return true;
+    }
+
+    return false;
+}
+
+struct socket_listen_info {
+    const char* spec;
+    int s;
+};
+
+static void
+socket_listen_1(void* data)
+{
+    struct socket_listen_info* info = data;
+    info->s = fwd_endpoint_listen(info->spec);
+}
+
+// Socket transport: listen for the host on an abstract socket with
+// a random name, so that concurrent stubs don't collide and nobody
+// can guess it, and tell the host the name along with the cookie it
+// must send to prove it's the one we told.  Return the listening
+// socket, or -1 if we can't listen, in which case we tell the host
+// that instead.
+static int
+socket_transport_listen(uint8_t cookie[SOCKET_COOKIE_SIZE])
+{
+    uint8_t nonce[8];
+    xgetrandom(nonce, sizeof (nonce));
+    xgetrandom(cookie, SOCKET_COOKIE_SIZE);
+    const char* name = "fb-adb-stub-";
+    for (unsigned i = 0; i < sizeof (nonce); ++i)
+        name = xaprintf("%s%02x", name, nonce[i]);
+
+    struct socket_listen_info info = {
+        .spec = xaprintf("localabstract:%s", name),
+        .s = -1,
+    };
+
+    struct errinfo ei = { .want_msg = true };
+    if (catch_error(socket_listen_1, &info, &ei)) {
+        dbg("socket transport unavailable: %s", ei.msg);
+        name = "";
+    }
+
+    size_t namesz = strlen(name);
+    struct msg_socket_listening* m = xcalloc(sizeof (*m) + namesz);
+    m->msg.type = MSG_SOCKET_LISTENING;
+    m->msg.size = sizeof (*m) + namesz;
+    memcpy(m->cookie, cookie, SOCKET_COOKIE_SIZE);
+    memcpy(m->name, name, namesz);
+    write_all(1, m, m->msg.size);
+    return info.s;
+}
+
+// Could the peer on S be the host?  The host reaches us through
+// adbd, which runs as shell or root, or, in local mode, directly as
+// whoever started us.  Anyone else has no business here.
+static bool
+socket_transport_peer_ok_p(int s)
+{
+    struct ucred cred;
+    socklen_t credsz = sizeof (cred);
+    if (getsockopt(s, SOL_SOCKET, SO_PEERCRED, &cred, &credsz) == -1) {
+        dbg("SO_PEERCRED: %s", strerror(errno));
+        return false;
+    }
+
+    if (cred.uid == getuid() || cred.uid == 0)
+        return true;
+#ifdef __ANDROID__
+    if (cred.uid == AID_SHELL)
+        return true;
+#endif
+    dbg("rejecting socket peer pid %d uid %d",
+        (int) cred.pid, (int) cred.uid);
+    return false;
+}
+
+// Does the peer on S send COOKIE as its first message, and soon?
+static bool
+socket_transport_cookie_ok_p(int s, const uint8_t* cookie)
+{
+    struct msg_socket_cookie m;
+    size_t nr_read = 0;
+    while (nr_read < sizeof (m)) {
+        struct pollfd p = { s, POLLIN, 0 };
+        int ret = poll(&p, 1, SOCKET_HANDSHAKE_TIMEOUT_MS);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1)
+            die_errno("poll");
+        if (ret == 0) {
+            dbg("socket peer sent no cookie");
+            return false;
+        }
+
+        ssize_t r = read(s, (char*) &m + nr_read, sizeof (m) - nr_read);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        nr_read += r;
+    }
+
+    uint8_t diff = 0;
+    for (unsigned i = 0; i < SOCKET_COOKIE_SIZE; ++i)
+        diff |= m.cookie[i] ^ cookie[i];
+
+    if (m.msg.type != MSG_SOCKET_COOKIE ||
+        m.msg.size != sizeof (m) ||
+        diff != 0)
+    {
+        dbg("socket peer sent a bad cookie");
+        return false;
+    }
+
+    return true;
+}
+
+// Read and discard whatever the host still sends on socket S until
+// it closes its end.  Closing a socket with unread data makes the
+// kernel reset the connection, and a reset can cost the peer bytes
+// we've already sent it.
+static void
+socket_transport_drain(int s)
+{
+    char buf[4096];
+    for (;;) {
+        ssize_t r = read(s, buf, sizeof (buf));
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1 && errno == EAGAIN) {
+            struct pollfd p = { s, POLLIN, 0 };
+            int ret = poll(&p, 1, SOCKET_LINGER_TIMEOUT_MS);
+            if (ret == -1 && errno == EINTR)
+                continue;
+            if (ret <= 0) {
+                dbg("socket peer did not hang up");
+                return;
+            }
+            continue;
+        }
+        if (r <= 0)
+            return;
+    }
+}
+
+// Wait for the host to connect to listening socket L or to give up
+// and go on talking over the pty.  If it connects, move our stdin
+// and stdout to the connection and return true.  Connections that
+// fail our checks are closed, and we keep waiting.
+static bool
+socket_transport_accept(int l, const uint8_t* cookie)
+{
+    for (;;) {
+        struct pollfd polls[2] = {
+            { l, POLLIN, 0 },
+            { 0, POLLIN, 0 },
+        };
+
+        while (poll(polls, ARRAYSIZE(polls), -1) == -1)
+            if (errno != EINTR)
+                die_errno("poll");
+
+        if (polls[1].revents != 0)
+            return false;
+
+        SCOPED_RESLIST(rl_conn);
+        struct cleanup* cl = cleanup_allocate();
+        int s = accept(l, NULL, NULL);
+        if (s == -1 &&
+            (errno == EINTR || errno == EAGAIN || errno == ECONNABORTED))
+        {
+            continue;
+        }
+
+        if (s == -1)
+            die_errno("accept");
+
+        cleanup_commit_close_fd(cl, s);
+        if (!socket_transport_peer_ok_p(s) ||
+            !socket_transport_cookie_ok_p(s, cookie))
+        {
+            continue;
+        }
+
+        struct msg m = {
+            .size = sizeof (m),
+            .type = MSG_SOCKET_CONNECTED
+        };
+        write_all(s, &m, sizeof (m));
+        if (dup2(s, 0) == -1 || dup2(s, 1) == -1)
+            die_errno("dup2");
+
+        return true;
+    }
+}
+
+static bool
+socket_transport_start(void)
+{
+    SCOPED_RESLIST(rl_listen);
+    uint8_t cookie[SOCKET_COOKIE_SIZE];
+    int l = socket_transport_listen(cookie);
+    return l != -1 && socket_transport_accept(l, cookie);
+}
+
 static void __attribute__((noreturn))
 re_exec_as_root()
 {
@@ -275,6 +787,9 @@ stub_main(int argc, const char** argv)
     if (isatty(1))
         xmkraw(1, XMKRAW_SKIP_CLEANUP);
 
+    // Mark before writing, so that the host can't see the line
+    // before our mark says we sent it.  See timing_peer_offset.
+    timing_mark("start line");
     printf(FB_ADB_PROTO_START_LINE "\n", build_time, (int) getuid());
     fflush(stdout);
 
@@ -298,6 +813,12 @@ stub_main(int argc, const char** argv)
         re_exec_as_user(username); // Never returns
     }
 
+    bool socket_p = false;
+    if (mhdr->type == MSG_SOCKET_LISTEN) {
+        socket_p = socket_transport_start();
+        mhdr = read_msg(0, read_all_adb_encoded);
+    }
+
     if (mhdr->type != MSG_SHEX_HELLO ||
         mhdr->size < sizeof (struct msg_shex_hello))
     {
@@ -305,8 +826,65 @@ stub_main(int argc, const char** argv)
     }
 
     shex_hello = (struct msg_shex_hello*) mhdr;
+    for (int i = 0; i < 3; ++i)
+        check_stream_bufsz(shex_hello->si[i].bufsz, "stream");
+
+    timing_mark("hello");
+    if (shex_hello->trace_p)
+        trace_enable(xaprintf("%s/fb-adb-trace.%d",
+                              DEFAULT_TEMP_DIR,
+                              (int) getpid()),
+                     true);
+    unsigned nr_extra = shex_hello->nr_extra_fds;
+    struct msg_extra_fd** extra = read_extra_fds(nr_extra);
+
+    struct child* child = NULL;
+    struct stub_file file;
+    struct archive* ar = NULL;
+    struct fdh* child_fdh[3] = { NULL, NULL, NULL };
+
+    memset(&file, 0, sizeof (file));
+    if (shex_hello->nr_argv == 0) {
+        if (nr_extra > 0)
+            die(ECOMM, "bad handshake: extra fds without a command");
+
+        mhdr = read_msg(0, read_all_adb_encoded);
+        if (mhdr->type == MSG_OPEN_FILE &&
+            mhdr->size >= sizeof (struct msg_open_file))
+        {
+            file.m = (struct msg_open_file*) mhdr;
+        } else if (mhdr->type == MSG_SYNC_DIR &&
+                   mhdr->size >= sizeof (struct msg_sync_dir))
+        {
+            file.sync = (struct msg_sync_dir*) mhdr;
+        } else if (mhdr->type == MSG_RUN_BATCH &&
+                   mhdr->size >= sizeof (struct msg_run_batch))
+        {
+            file.batch_p = true;
+        } else {
+            die(ECOMM, "bad handshake: expected MSG_OPEN_FILE");
+        }
+
+        if (!open_stub_file(&file, shex_hello->maxmsg))
+            return 1;
+
+        if (file.child != NULL) {
+            child = file.child;
+            for (int i = 0; i < 3; ++i)
+                child_fdh[i] = child->fd[i];
+        } else if (file.directory_p) {
+            ar = archive_start(file.path, &child_fdh[1], &child_fdh[2]);
+        } else {
+            child_fdh[file.m->write_p ? 0 : 1] = file.fdh;
+        }
+    } else {
+        child = start_child(shex_hello, extra);
+        for (int i = 0; i < 3; ++i)
+            child_fdh[i] = child->fd[i];
+    }
+
+    timing_mark("child started");
 
-    struct child* child = start_child(shex_hello);
     struct stub stub;
     memset(&stub, 0, sizeof (stub));
     stub.child = child;
@@ -314,23 +892,31 @@ stub_main(int argc, const char** argv)
 
     sh->process_msg = stub_process_msg;
     sh->max_outgoing_msg = shex_hello->maxmsg;
-    sh->nrch = 5;
+    sh->coalesce_delay_ns = DEFAULT_COALESCE_DELAY_NS;
+    sh->coalesce_bytes = XMIN((size_t) DEFAULT_COALESCE_BYTES,
+                              (size_t) shex_hello->maxmsg / 2);
+    sh->nrch = FIRST_EXTRA_CHANNEL + nr_extra;
     struct channel** ch = xalloc(sh->nrch * sizeof (*ch));
 
+    // Only a pty transport hangs up on the child when we lose the
+    // peer; see below.
+    bool pty_transport_p = !socket_p && !shex_hello->clean_transport_p;
     ch[FROM_PEER] = channel_new(fdh_dup(0),
                                 shex_hello->stub_recv_bufsz,
                                 CHANNEL_FROM_FD);
 
     ch[FROM_PEER]->window = UINT32_MAX;
-    ch[FROM_PEER]->adb_encoding_hack = true;
+    ch[FROM_PEER]->adb_encoding_hack =
+        !socket_p && !shex_hello->clean_transport_p;
     replace_with_dev_null(0);
 
     ch[TO_PEER] = channel_new(fdh_dup(1),
                               shex_hello->stub_send_bufsz,
                               CHANNEL_TO_FD);
+    ch[TO_PEER]->shutdown_on_close = socket_p;
     replace_with_dev_null(1);
 
-    ch[CHILD_STDIN] = channel_new(child->fd[0],
+    ch[CHILD_STDIN] = channel_new(child_fdh[0],
                                   shex_hello->si[0].bufsz,
                                   CHANNEL_TO_FD);
 
@@ -338,23 +924,59 @@ stub_main(int argc, const char** argv)
     ch[CHILD_STDIN]->bytes_written =
         ringbuf_room(ch[CHILD_STDIN]->rb);
 
-    ch[CHILD_STDOUT] = channel_new(child->fd[1],
+    ch[CHILD_STDOUT] = channel_new(child_fdh[1],
                                    shex_hello->si[1].bufsz,
                                    CHANNEL_FROM_FD);
     ch[CHILD_STDOUT]->track_window = true;
+    ch[CHILD_STDOUT]->weight = CHANNEL_WEIGHT_STDIO;
+    if (shex_hello->si[1].pty_p)
+        ch[CHILD_STDOUT]->prio = CHANNEL_PRIO_INTERACTIVE;
+    else if (child != NULL)
+        ch[CHILD_STDOUT]->coalesce = true;
 
-    ch[CHILD_STDERR] = channel_new(child->fd[2],
+    ch[CHILD_STDERR] = channel_new(child_fdh[2],
                                    shex_hello->si[2].bufsz,
                                    CHANNEL_FROM_FD);
     ch[CHILD_STDERR]->track_window = true;
+    ch[CHILD_STDERR]->weight = CHANNEL_WEIGHT_STDIO;
+    if (shex_hello->si[2].pty_p)
+        ch[CHILD_STDERR]->prio = CHANNEL_PRIO_INTERACTIVE;
+    else
+        ch[CHILD_STDERR]->coalesce = true;
+
+    for (unsigned i = 0; i < nr_extra; ++i) {
+        struct channel* c;
+        if (extra[i]->child_writes_p) {
+            c = channel_new(child->extra_fd[i],
+                            extra[i]->bufsz,
+                            CHANNEL_FROM_FD);
+            c->track_window = true;
+            c->coalesce = true;
+        } else {
+            c = channel_new(child->extra_fd[i],
+                            extra[i]->bufsz,
+                            CHANNEL_TO_FD);
+            c->track_bytes_written = true;
+            c->bytes_written = ringbuf_room(c->rb);
+        }
+
+        ch[FIRST_EXTRA_CHANNEL + i] = c;
+    }
 
     sh->ch = ch;
+    sh->fwd = fwd_new(false);
     io_loop_init(sh);
+    if (shex_hello->pipeline_p)
+        pipeline_enable(sh, true);
+    fwd_start(sh);
 
+    // When writing a file, we're done once the peer has closed our
+    // stdin and we've drained it.
     PUMP_WHILE(sh, (!channel_dead_p(ch[FROM_PEER]) &&
                     !channel_dead_p(ch[TO_PEER]) &&
-                    (!channel_dead_p(ch[CHILD_STDOUT]) ||
-                     !channel_dead_p(ch[CHILD_STDERR]))));
+                    (child_channels_live_p(ch, nr_extra, CHANNEL_FROM_FD) ||
+                     (file.m != NULL &&
+                      !channel_dead_p(ch[CHILD_STDIN])))));
 
     if (channel_dead_p(ch[FROM_PEER]) || channel_dead_p(ch[TO_PEER])) {
         //
@@ -372,9 +994,28 @@ stub_main(int argc, const char** argv)
         PUMP_WHILE(sh, (!channel_dead_p(ch[FROM_PEER]) ||
                         !channel_dead_p(ch[TO_PEER])));
 
+        // Over a socket or a binary-clean exec: transport, nothing
+        // hangs up on the child for us, so do it ourselves.  (A
+        // socket can go away while the adb shell that started us
+        // lives on.)  Don't drain the child's stdin, either: the
+        // child may be blocked writing output we'll never read, and
+        // then we'd both wait forever.
+        if (!pty_transport_p) {
+            if (child != NULL)
+                child_kill_deathsig(child);
+            return 128 + SIGHUP;
+        }
+
         // Drain output buffers
-        channel_close(ch[CHILD_STDIN]);
-        PUMP_WHILE(sh, !channel_dead_p(ch[CHILD_STDIN]));
+        for (unsigned chno = CHILD_STDIN;
+             chno < FIRST_EXTRA_CHANNEL + nr_extra;
+             ++chno)
+        {
+            if (ch[chno]->dir == CHANNEL_TO_FD)
+                channel_close(ch[chno]);
+        }
+
+        PUMP_WHILE(sh, child_channels_live_p(ch, nr_extra, CHANNEL_TO_FD));
         return 128 + SIGHUP;
     }
 
@@ -386,18 +1027,48 @@ stub_main(int argc, const char** argv)
 
     dbg("clean exit");
 
-    channel_close(ch[CHILD_STDIN]);
-    channel_close(ch[CHILD_STDOUT]);
-    channel_close(ch[CHILD_STDERR]);
+    for (unsigned chno = CHILD_STDIN;
+         chno < FIRST_EXTRA_CHANNEL + nr_extra;
+         ++chno)
+    {
+        channel_close(ch[chno]);
+    }
+
+    PUMP_WHILE(sh, (child_channels_live_p(ch, nr_extra, CHANNEL_FROM_FD) ||
+                    child_channels_live_p(ch, nr_extra, CHANNEL_TO_FD)));
+    timing_mark("streams drained");
 
-    PUMP_WHILE (sh, (!channel_dead_p(ch[CHILD_STDIN]) ||
-                     !channel_dead_p(ch[CHILD_STDOUT]) ||
-                     !channel_dead_p(ch[CHILD_STDERR])));
+    int status = 0;
+    if (child != NULL) {
+        status = child_wait(child);
+        timing_mark("child exited");
+    }
+
+    if (shex_hello->timing_p)
+        send_timing(sh);
+
+    if (shex_hello->trace_p)
+        send_trace(sh);
+
+    if (shex_hello->pipeline_p)
+        send_pipeline(sh);
+
+    if (child != NULL) {
+        send_exit_message(status, sh);
+    } else if (ar != NULL) {
+        send_exit_code(archive_finish(ar) != 0, sh);
+    } else {
+        int err = ch[CHILD_STDIN]->err ?: ch[CHILD_STDOUT]->err;
+        if (err != 0)
+            send_error_message(strerror(err), sh);
+        send_exit_code(err != 0, sh);
+    }
 
-    send_exit_message(child_wait(child), sh);
     channel_close(ch[TO_PEER]);
 
     PUMP_WHILE(sh, !channel_dead_p(ch[TO_PEER]));
+    if (socket_p && ch[FROM_PEER]->fdh != NULL)
+        socket_transport_drain(ch[FROM_PEER]->fdh->fd);
     channel_close(ch[FROM_PEER]);
     PUMP_WHILE(sh, !channel_dead_p(ch[FROM_PEER]));
     return 0;
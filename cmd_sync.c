@@ -0,0 +1,1582 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "util.h"
+#include "hash.h"
+#include "constants.h"
+
+// Delta sync of a host directory tree onto the device.
+//
+// The host runs "sync-sender LOCAL" and the stub runs "sync-receiver
+// REMOTE"; fb-adb connects the sender's stdout to the receiver's
+// stdin and vice versa.  The conversation is pipelined so that it
+// costs no round trips per file:
+//
+//   1. The sender sends the whole file list.
+//
+//   2. The receiver forks.  The generator half brings directories
+//      and symlinks up to date and, for each regular file whose size
+//      or mtime differs, sends a request carrying the block
+//      signatures of the receiver's old copy, if any.  The applier
+//      half reads deltas and writes new files.
+//
+//   3. The sender answers each request, in order, with a delta: a
+//      list of blocks to copy from the old file and literal bytes.
+//      Worker threads search files for matching blocks in parallel.
+//
+// Because the generator only writes and the applier only reads, no
+// side ever waits on a pipe its peer isn't draining.
+//
+// The receiver remembers the signatures of files it writes in an
+// index next to the stub, so the next sync doesn't have to read a
+// file back to find out what it contains.
+//
+// Size and mtime can't vouch for a file whose mtime is the second in
+// which the sender looked at it: on filesystems with coarse
+// timestamps, a write later in that second leaves both alone.  The
+// sender marks such files SYNC_ENTRY_RECENT and the receiver
+// transfers them regardless.  It also marks their index entries, so
+// that the next sync, which can't see that the file was recent,
+// doesn't skip it on the strength of the copy we made.
+
+#pragma pack(push, 1)
+
+enum sync_entry_type {
+    SYNC_END = 0,
+    SYNC_FILE = 'f',
+    SYNC_DIR = 'd',
+    SYNC_SYMLINK = 'l',
+};
+
+enum sync_entry_flags {
+    SYNC_ENTRY_RECENT = 1 << 0,
+};
+
+struct sync_entry_hdr {
+    uint8_t type;
+    uint8_t flags;
+    uint32_t mode;
+    uint64_t size;
+    int64_t mtime;
+    uint32_t mtime_ns;
+    uint16_t pathlen;
+    uint16_t linklen;
+};
+
+struct sync_request_hdr {
+    uint32_t index;
+    uint32_t block_size;
+    uint32_t nr_blocks;
+};
+
+struct sync_block_sum {
+    uint32_t weak;
+    uint64_t strong;
+};
+
+struct sync_delta_hdr {
+    uint32_t index;
+    uint32_t block_size;
+};
+
+enum sync_op_kind {
+    SYNC_OP_END = 0,
+    SYNC_OP_LITERAL = 1,
+    SYNC_OP_COPY = 2,
+};
+
+// SYNC_OP_END is followed by the hash64 of the whole file.
+struct sync_op {
+    uint8_t kind;
+    uint32_t arg;
+};
+
+#pragma pack(pop)
+
+#define SYNC_NO_INDEX UINT32_MAX
+
+struct sync_entry {
+    uint8_t type;
+    bool recent;
+    mode_t mode;
+    uint64_t size;
+    int64_t mtime;
+    uint32_t mtime_ns;
+    char* path;
+    char* link;
+};
+
+static uint32_t
+sync_block_size(uint64_t size)
+{
+    // About the square root of the file size, like rsync: small
+    // blocks find more matches but cost more signatures.
+    uint32_t bs = SYNC_MIN_BLOCK;
+    while ((uint64_t) bs * bs < size && bs < SYNC_MAX_BLOCK)
+        bs *= 2;
+    return bs;
+}
+
+static uint32_t
+sync_nr_blocks(uint64_t size, uint32_t bs)
+{
+    return (size + bs - 1) / bs;
+}
+
+static void*
+sync_grow(void* array, size_t* capacity, size_t nr, size_t eltsz)
+{
+    if (nr < *capacity)
+        return array;
+
+    size_t newcap = XMAX(*capacity * 2, (size_t) 16);
+    void* newarray = xalloc(newcap * eltsz);
+    if (nr > 0)
+        memcpy(newarray, array, nr * eltsz);
+    *capacity = newcap;
+    return newarray;
+}
+
+static void
+xfread(void* buf, size_t sz, FILE* in)
+{
+    if (sz > 0 && fread(buf, sz, 1, in) != 1) {
+        if (ferror(in))
+            die_errno("read");
+        die(ECOMM, "sync peer disconnected");
+    }
+}
+
+static void
+xfwrite(const void* buf, size_t sz, FILE* out)
+{
+    if (sz > 0 && fwrite(buf, sz, 1, out) != 1)
+        die_errno("write");
+}
+
+static void
+xfflush(FILE* out)
+{
+    if (fflush(out) == EOF)
+        die_errno("write");
+}
+
+static int
+cmp_entry_path(const void* a, const void* b)
+{
+    const struct sync_entry* const* ea = a;
+    const struct sync_entry* const* eb = b;
+    return strcmp((*ea)->path, (*eb)->path);
+}
+
+// Sorted view of an entry list for lookups by name.
+static struct sync_entry**
+sync_sorted_entries(struct sync_entry* entries, size_t nr)
+{
+    struct sync_entry** sorted = xalloc(XMAX(nr, (size_t) 1) *
+                                        sizeof (*sorted));
+    for (size_t i = 0; i < nr; ++i)
+        sorted[i] = &entries[i];
+    qsort(sorted, nr, sizeof (*sorted), cmp_entry_path);
+    return sorted;
+}
+
+static bool
+sync_entry_exists_p(struct sync_entry** sorted, size_t nr, const char* path)
+{
+    struct sync_entry key = { .path = (char*) path };
+    struct sync_entry* keyp = &key;
+    return bsearch(&keyp, sorted, nr, sizeof (*sorted), cmp_entry_path);
+}
+
+// ----------------------------------------------------------------
+// Sender
+
+struct sync_op_rec {
+    uint64_t off;
+    uint32_t len;
+    uint32_t block;
+    bool copy;
+};
+
+enum sync_job_state {
+    SYNC_JOB_PENDING,
+    SYNC_JOB_RUNNING,
+    SYNC_JOB_DONE,
+};
+
+struct sync_job {
+    struct sync_job* next;
+    enum sync_job_state state;
+    uint32_t index;
+    uint32_t block_size;
+    uint32_t nr_blocks;
+    struct sync_block_sum* sums;
+    int err;
+    const uint8_t* map;
+    uint64_t size;
+    struct sync_op_rec* ops;
+    size_t nr_ops;
+    size_t ops_capacity;
+    uint64_t hash;
+};
+
+struct sync_sender {
+    const char* root;
+    struct sync_entry* entries;
+    size_t nr_entries;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct sync_job* head;
+    struct sync_job** tailp;
+    size_t nr_jobs;
+    bool requests_done;
+    bool stop;
+    unsigned nr_workers;
+    pthread_t reader;
+    pthread_t workers[SYNC_HASH_THREADS];
+};
+
+static void
+sync_walk(const char* root,
+          const char* rel,
+          struct sync_entry** entries,
+          size_t* nr,
+          size_t* capacity)
+{
+    const char* dirpath = rel[0] ? xaprintf("%s/%s", root, rel) : root;
+    DIR* dir = opendir(dirpath);
+    if (dir == NULL)
+        die_errno("opendir(\"%s\")", dirpath);
+
+    struct cleanup* cl = cleanup_allocate();
+    cleanup_commit(cl, (cleanupfn) closedir, dir);
+
+    struct dirent* de;
+    while ((errno = 0, de = readdir(dir)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+
+        const char* relpath = (rel[0]
+                               ? xaprintf("%s/%s", rel, de->d_name)
+                               : xstrdup(de->d_name));
+        const char* path = xaprintf("%s/%s", root, relpath);
+        struct stat st;
+        if (lstat(path, &st) == -1)
+            die_errno("lstat(\"%s\")", path);
+
+        struct sync_entry e = {
+            .recent = st.st_mtime >= time(NULL),
+            .mode = st.st_mode & 07777,
+            .size = st.st_size,
+            .mtime = st.st_mtim.tv_sec,
+            .mtime_ns = st.st_mtim.tv_nsec,
+            .path = (char*) relpath,
+        };
+
+        if (S_ISREG(st.st_mode)) {
+            e.type = SYNC_FILE;
+        } else if (S_ISDIR(st.st_mode)) {
+            e.type = SYNC_DIR;
+            e.size = 0;
+        } else if (S_ISLNK(st.st_mode)) {
+            char target[PATH_MAX + 1];
+            ssize_t len = readlink(path, target, sizeof (target) - 1);
+            if (len < 0)
+                die_errno("readlink(\"%s\")", path);
+            e.type = SYNC_SYMLINK;
+            e.size = 0;
+            e.link = xaprintf("%.*s", (int) len, target);
+        } else {
+            fprintf(stderr, "%s: %s: skipping special file\n",
+                    prgname, path);
+            continue;
+        }
+
+        if (strlen(e.path) > UINT16_MAX ||
+            (e.link && strlen(e.link) > UINT16_MAX))
+        {
+            die(ENAMETOOLONG, "%s: name too long", path);
+        }
+
+        *entries = sync_grow(*entries, capacity, *nr, sizeof (**entries));
+        (*entries)[(*nr)++] = e;
+        if (e.type == SYNC_DIR)
+            sync_walk(root, relpath, entries, nr, capacity);
+    }
+
+    if (errno != 0)
+        die_errno("readdir(\"%s\")", dirpath);
+}
+
+static void
+sync_write_entries(const struct sync_entry* entries, size_t nr, FILE* out)
+{
+    for (size_t i = 0; i < nr; ++i) {
+        const struct sync_entry* e = &entries[i];
+        struct sync_entry_hdr hdr = {
+            .type = e->type,
+            .flags = e->recent ? SYNC_ENTRY_RECENT : 0,
+            .mode = e->mode,
+            .size = e->size,
+            .mtime = e->mtime,
+            .mtime_ns = e->mtime_ns,
+            .pathlen = strlen(e->path),
+            .linklen = e->link ? strlen(e->link) : 0,
+        };
+
+        xfwrite(&hdr, sizeof (hdr), out);
+        xfwrite(e->path, hdr.pathlen, out);
+        xfwrite(e->link, hdr.linklen, out);
+    }
+
+    struct sync_entry_hdr end = { .type = SYNC_END };
+    xfwrite(&end, sizeof (end), out);
+    xfflush(out);
+}
+
+static bool
+sync_read_raw(int fd, void* buf, size_t sz)
+{
+    char* p = buf;
+    while (sz > 0) {
+        ssize_t ret = read(fd, p, sz);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        p += ret;
+        sz -= ret;
+    }
+
+    return true;
+}
+
+static void
+sync_free_job(struct sync_job* j)
+{
+    if (j->map != NULL && j->size > 0)
+        munmap((void*) j->map, j->size);
+    free(j->sums);
+    free(j->ops);
+    free(j);
+}
+
+// Read requests from the receiver and queue them for the workers.
+// Runs on its own thread so that the main thread can keep writing
+// deltas while requests arrive.
+static void*
+sync_reader_main(void* arg)
+{
+    struct sync_sender* s = arg;
+    for (;;) {
+        struct sync_request_hdr hdr;
+        if (!sync_read_raw(0, &hdr, sizeof (hdr)) ||
+            hdr.index == SYNC_NO_INDEX)
+        {
+            break;
+        }
+
+        struct sync_job* j = calloc(1, sizeof (*j));
+        if (j == NULL)
+            break;
+
+        j->index = hdr.index;
+        j->block_size = hdr.block_size;
+        j->nr_blocks = hdr.nr_blocks;
+        if (hdr.index >= s->nr_entries ||
+            s->entries[hdr.index].type != SYNC_FILE ||
+            hdr.nr_blocks > SYNC_MAX_SIGNATURES ||
+            (hdr.nr_blocks > 0 && hdr.block_size == 0))
+        {
+            free(j);
+            break;
+        }
+
+        size_t sumsz = (size_t) hdr.nr_blocks * sizeof (*j->sums);
+        j->sums = malloc(XMAX(sumsz, (size_t) 1));
+        if (j->sums == NULL || !sync_read_raw(0, j->sums, sumsz)) {
+            sync_free_job(j);
+            break;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        while (s->nr_jobs >= SYNC_MAX_JOBS && !s->stop)
+            pthread_cond_wait(&s->cond, &s->lock);
+        *s->tailp = j;
+        s->tailp = &j->next;
+        s->nr_jobs += 1;
+        pthread_cond_broadcast(&s->cond);
+        bool stop = s->stop;
+        pthread_mutex_unlock(&s->lock);
+        if (stop)
+            break;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->requests_done = true;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+static bool
+sync_add_op(struct sync_job* j, struct sync_op_rec op)
+{
+    if (!op.copy && op.len == 0)
+        return true;
+
+    if (j->nr_ops == j->ops_capacity) {
+        size_t newcap = XMAX(j->ops_capacity * 2, (size_t) 16);
+        struct sync_op_rec* ops = realloc(j->ops, newcap * sizeof (*ops));
+        if (ops == NULL)
+            return false;
+        j->ops = ops;
+        j->ops_capacity = newcap;
+    }
+
+    j->ops[j->nr_ops++] = op;
+    return true;
+}
+
+static bool
+sync_add_literal(struct sync_job* j, uint64_t off, uint64_t len)
+{
+    while (len > 0) {
+        uint32_t chunk = XMIN(len, (uint64_t) SYNC_LITERAL_MAX);
+        struct sync_op_rec op = { .off = off, .len = chunk };
+        if (!sync_add_op(j, op))
+            return false;
+        off += chunk;
+        len -= chunk;
+    }
+
+    return true;
+}
+
+struct sync_sigtab {
+    uint32_t* slots; // Block number plus one; zero means empty
+    size_t mask;
+};
+
+static bool
+sync_sigtab_init(struct sync_sigtab* t, const struct sync_job* j)
+{
+    size_t nslots = nextpow2sz(XMAX((size_t) j->nr_blocks * 2, (size_t) 2));
+    t->slots = calloc(nslots, sizeof (*t->slots));
+    t->mask = nslots - 1;
+    if (t->slots == NULL)
+        return false;
+
+    for (uint32_t i = 0; i < j->nr_blocks; ++i) {
+        size_t slot = j->sums[i].weak & t->mask;
+        while (t->slots[slot] != 0)
+            slot = (slot + 1) & t->mask;
+        t->slots[slot] = i + 1;
+    }
+
+    return true;
+}
+
+// Find an old block whose signature matches the BS bytes at DATA.
+// Only full-size blocks are candidates.
+static long
+sync_sigtab_find(const struct sync_sigtab* t,
+                 const struct sync_job* j,
+                 uint32_t weak,
+                 const uint8_t* data,
+                 uint64_t old_size)
+{
+    bool have_strong = false;
+    uint64_t strong = 0;
+    size_t slot = weak & t->mask;
+    uint32_t bs = j->block_size;
+
+    for (; t->slots[slot] != 0; slot = (slot + 1) & t->mask) {
+        uint32_t block = t->slots[slot] - 1;
+        if (j->sums[block].weak != weak)
+            continue;
+        if ((uint64_t) (block + 1) * bs > old_size)
+            continue;
+        if (!have_strong) {
+            strong = hash64(data, bs);
+            have_strong = true;
+        }
+        if (j->sums[block].strong == strong)
+            return block;
+    }
+
+    return -1;
+}
+
+static int
+sync_match(struct sync_sender* s, struct sync_job* j)
+{
+    const struct sync_entry* e = &s->entries[j->index];
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof (path), "%s/%s", s->root, e->path)
+        >= (int) sizeof (path))
+    {
+        return ENAMETOOLONG;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return errno;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+
+    j->size = st.st_size;
+    if (j->size > 0) {
+        void* map = mmap(NULL, j->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            int err = errno;
+            close(fd);
+            return err;
+        }
+        j->map = map;
+        (void) madvise(map, j->size, MADV_SEQUENTIAL);
+    }
+
+    close(fd);
+    j->hash = hash64(j->map, j->size);
+
+    if (j->nr_blocks == 0)
+        return sync_add_literal(j, 0, j->size) ? 0 : ENOMEM;
+
+    // The old file's size is implied by its block count, except that
+    // its last block may be short; we can't know how short, so we
+    // match the last block only if it's full-size.
+    uint64_t old_size = (uint64_t) j->nr_blocks * j->block_size;
+    struct sync_sigtab t;
+    if (!sync_sigtab_init(&t, j))
+        return ENOMEM;
+
+    const uint8_t* d = j->map;
+    uint64_t size = j->size;
+    uint32_t bs = j->block_size;
+    uint64_t lit = 0;
+    uint64_t pos = 0;
+    bool have_sum = false;
+    struct rollsum rs;
+    int err = 0;
+
+    while (err == 0 && pos + bs <= size) {
+        if (!have_sum) {
+            rollsum_init(&rs, d + pos, bs);
+            have_sum = true;
+        }
+
+        long block = sync_sigtab_find(&t, j, rollsum_digest(&rs),
+                                      d + pos, old_size);
+        if (block >= 0) {
+            struct sync_op_rec op = { .copy = true, .block = block };
+            if (!sync_add_literal(j, lit, pos - lit) || !sync_add_op(j, op))
+                err = ENOMEM;
+            pos += bs;
+            lit = pos;
+            have_sum = false;
+            continue;
+        }
+
+        if (pos + bs == size)
+            break;
+
+        rollsum_roll(&rs, d[pos], d[pos + bs]);
+        pos += 1;
+    }
+
+    if (err == 0 && !sync_add_literal(j, lit, size - lit))
+        err = ENOMEM;
+
+    free(t.slots);
+    return err;
+}
+
+static void*
+sync_worker_main(void* arg)
+{
+    struct sync_sender* s = arg;
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        struct sync_job* j = s->head;
+        while (j != NULL && j->state != SYNC_JOB_PENDING)
+            j = j->next;
+
+        if (s->stop || (j == NULL && s->requests_done))
+            break;
+
+        if (j == NULL) {
+            pthread_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+
+        j->state = SYNC_JOB_RUNNING;
+        pthread_mutex_unlock(&s->lock);
+        int err = sync_match(s, j);
+        pthread_mutex_lock(&s->lock);
+        j->err = err;
+        j->state = SYNC_JOB_DONE;
+        pthread_cond_broadcast(&s->cond);
+    }
+
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+struct sync_stats {
+    size_t nr_files;
+    size_t nr_changed;
+    uint64_t literal_bytes;
+    uint64_t matched_bytes;
+    unsigned nr_problems;
+};
+
+static void
+sync_emit(struct sync_sender* s,
+          struct sync_job* j,
+          struct sync_stats* stats,
+          FILE* out)
+{
+    const char* path = s->entries[j->index].path;
+    if (j->err != 0) {
+        fprintf(stderr, "%s: %s: %s\n", prgname, path, strerror(j->err));
+        stats->nr_problems += 1;
+        return;
+    }
+
+    struct sync_delta_hdr hdr = {
+        .index = j->index,
+        .block_size = j->block_size,
+    };
+
+    xfwrite(&hdr, sizeof (hdr), out);
+    for (size_t i = 0; i < j->nr_ops; ++i) {
+        const struct sync_op_rec* r = &j->ops[i];
+        struct sync_op op;
+        if (r->copy) {
+            op.kind = SYNC_OP_COPY;
+            op.arg = r->block;
+            xfwrite(&op, sizeof (op), out);
+            stats->matched_bytes += j->block_size;
+        } else {
+            op.kind = SYNC_OP_LITERAL;
+            op.arg = r->len;
+            xfwrite(&op, sizeof (op), out);
+            xfwrite(j->map + r->off, r->len, out);
+            stats->literal_bytes += r->len;
+        }
+    }
+
+    struct sync_op end = { .kind = SYNC_OP_END };
+    xfwrite(&end, sizeof (end), out);
+    xfwrite(&j->hash, sizeof (j->hash), out);
+    xfflush(out);
+    stats->nr_changed += 1;
+}
+
+static void
+sync_sender_cleanup(void* arg)
+{
+    struct sync_sender* s = arg;
+    pthread_mutex_lock(&s->lock);
+    s->stop = true;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    // The reader may be blocked in read(2); it'll see EOF once the
+    // receiver goes away, which is what our dying brings about.
+    for (unsigned i = 0; i < s->nr_workers; ++i)
+        pthread_join(s->workers[i], NULL);
+}
+
+int
+sync_sender_main(int argc, const char** argv)
+{
+    if (argc != 2)
+        die(EINVAL, "this command is internal");
+
+    struct sync_sender* s = xcalloc(sizeof (*s));
+    s->root = argv[1];
+    s->tailp = &s->head;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+
+    size_t capacity = 0;
+    sync_walk(s->root, "", &s->entries, &s->nr_entries, &capacity);
+    if (s->nr_entries >= SYNC_NO_INDEX)
+        die(EFBIG, "too many files");
+
+    FILE* out = stdout;
+    setvbuf(out, xalloc(SYNC_IO_BUFSZ), _IOFBF, SYNC_IO_BUFSZ);
+    sync_write_entries(s->entries, s->nr_entries, out);
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    s->nr_workers = XMAX(1, XMIN(ncpu, SYNC_HASH_THREADS));
+
+    struct cleanup* cl = cleanup_allocate();
+    sigset_t all_signals;
+    sigset_t saved_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &saved_mask);
+    int ret = pthread_create(&s->reader, NULL, sync_reader_main, s);
+    unsigned nr_started = 0;
+    while (ret == 0 && nr_started < s->nr_workers) {
+        ret = pthread_create(&s->workers[nr_started], NULL,
+                             sync_worker_main, s);
+        if (ret == 0)
+            nr_started += 1;
+    }
+    s->nr_workers = nr_started;
+    pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+    cleanup_commit(cl, sync_sender_cleanup, s);
+    if (ret != 0)
+        die(ret, "pthread_create: %s", strerror(ret));
+
+    struct sync_stats stats = { .nr_files = 0 };
+    for (size_t i = 0; i < s->nr_entries; ++i)
+        if (s->entries[i].type == SYNC_FILE)
+            stats.nr_files += 1;
+
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        while (!(s->head && s->head->state == SYNC_JOB_DONE) &&
+               !(s->head == NULL && s->requests_done))
+        {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+
+        struct sync_job* j = s->head;
+        if (j != NULL) {
+            s->head = j->next;
+            if (s->head == NULL)
+                s->tailp = &s->head;
+            s->nr_jobs -= 1;
+            pthread_cond_broadcast(&s->cond);
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        if (j == NULL)
+            break;
+
+        sync_emit(s, j, &stats, out);
+        sync_free_job(j);
+    }
+
+    struct sync_delta_hdr end = { .index = SYNC_NO_INDEX };
+    xfwrite(&end, sizeof (end), out);
+    xfflush(out);
+    pthread_join(s->reader, NULL);
+
+    fprintf(stderr,
+            "%s: %zu of %zu files changed; "
+            "%ju bytes sent, %ju bytes matched\n",
+            prgname,
+            stats.nr_changed,
+            stats.nr_files,
+            (uintmax_t) stats.literal_bytes,
+            (uintmax_t) stats.matched_bytes);
+
+    return stats.nr_problems > 0;
+}
+
+// ----------------------------------------------------------------
+// Receiver
+
+struct sync_cached {
+    char* path;
+    bool recent;
+    uint64_t size;
+    int64_t mtime;
+    uint32_t mtime_ns;
+    uint64_t ino;
+    uint32_t block_size;
+    uint32_t nr_blocks;
+    struct sync_block_sum* sums;
+};
+
+#pragma pack(push, 1)
+struct sync_index_hdr {
+    uint16_t pathlen;
+    uint8_t recent;
+    uint64_t size;
+    int64_t mtime;
+    uint32_t mtime_ns;
+    uint64_t ino;
+    uint32_t block_size;
+    uint32_t nr_blocks;
+};
+#pragma pack(pop)
+
+static const char sync_index_magic[8] = "FBSYNC2\n";
+
+struct sync_receiver {
+    const char* root;
+    bool delete_p;
+    struct sync_entry* entries;
+    size_t nr_entries;
+    struct sync_entry** sorted;
+    const char* index_name;
+    struct sync_cached* cache;
+    size_t nr_cache;
+    struct sync_cached* fresh;
+    size_t nr_fresh;
+    size_t fresh_capacity;
+    unsigned nr_problems;
+};
+
+static struct sync_entry*
+sync_read_entries(FILE* in, size_t* nr_out)
+{
+    struct sync_entry* entries = NULL;
+    size_t nr = 0;
+    size_t capacity = 0;
+
+    for (;;) {
+        struct sync_entry_hdr hdr;
+        xfread(&hdr, sizeof (hdr), in);
+        if (hdr.type == SYNC_END)
+            break;
+
+        if (hdr.type != SYNC_FILE &&
+            hdr.type != SYNC_DIR &&
+            hdr.type != SYNC_SYMLINK)
+        {
+            die(ECOMM, "bad sync entry type %u", (unsigned) hdr.type);
+        }
+
+        if (hdr.mtime_ns >= 1000000000)
+            die(ECOMM, "bad sync mtime");
+
+        struct sync_entry e = {
+            .type = hdr.type,
+            .recent = (hdr.flags & SYNC_ENTRY_RECENT) != 0,
+            .mode = hdr.mode & 07777,
+            .size = hdr.size,
+            .mtime = hdr.mtime,
+            .mtime_ns = hdr.mtime_ns,
+            .path = xcalloc(hdr.pathlen + 1),
+        };
+
+        xfread(e.path, hdr.pathlen, in);
+        if (hdr.type == SYNC_SYMLINK) {
+            e.link = xcalloc(hdr.linklen + 1);
+            xfread(e.link, hdr.linklen, in);
+        } else if (hdr.linklen != 0) {
+            die(ECOMM, "unexpected link target");
+        }
+
+        // Never let the peer write outside the tree.
+        if (e.path[0] == '\0' ||
+            e.path[0] == '/' ||
+            strlen(e.path) != hdr.pathlen ||
+            !strcmp(e.path, "..") ||
+            !strncmp(e.path, "../", 3) ||
+            strstr(e.path, "/../") ||
+            (strlen(e.path) >= 3 &&
+             !strcmp(e.path + strlen(e.path) - 3, "/..")))
+        {
+            die(ECOMM, "bad sync path");
+        }
+
+        entries = sync_grow(entries, &capacity, nr, sizeof (*entries));
+        entries[nr++] = e;
+    }
+
+    *nr_out = nr;
+    return entries;
+}
+
+// The index lives next to the stub, keyed by the absolute path of
+// the tree it describes.
+static const char*
+sync_index_name(const char* root)
+{
+    char* abs_root = realpath(root, NULL);
+    char* exe = realpath(orig_argv0, NULL);
+    if (abs_root == NULL || exe == NULL) {
+        free(abs_root);
+        free(exe);
+        return NULL;
+    }
+
+    const char* dir = xaprintf("%s/%s", dirname(exe), SYNC_INDEX_DIR);
+    const char* name = xaprintf("%s/%016llx",
+                                dir,
+                                (unsigned long long)
+                                hash64(abs_root, strlen(abs_root)));
+    free(abs_root);
+    free(exe);
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+        return NULL;
+    return name;
+}
+
+static int
+cmp_cached_path(const void* a, const void* b)
+{
+    return strcmp(((const struct sync_cached*) a)->path,
+                  ((const struct sync_cached*) b)->path);
+}
+
+static void
+sync_load_index_1(void* arg)
+{
+    struct sync_receiver* r = arg;
+    int fd = xopen(r->index_name, O_RDONLY, 0);
+    FILE* in = xfdopen(fd, "r");
+    char magic[sizeof (sync_index_magic)];
+    xfread(magic, sizeof (magic), in);
+    if (memcmp(magic, sync_index_magic, sizeof (magic)))
+        die(EINVAL, "bad index");
+
+    struct sync_cached* cache = NULL;
+    size_t nr = 0;
+    size_t capacity = 0;
+    struct sync_index_hdr hdr;
+    while (fread(&hdr, sizeof (hdr), 1, in) == 1) {
+        if (hdr.nr_blocks > SYNC_MAX_SIGNATURES)
+            die(EINVAL, "bad index");
+
+        struct sync_cached c = {
+            .path = xcalloc(hdr.pathlen + 1),
+            .recent = hdr.recent,
+            .size = hdr.size,
+            .mtime = hdr.mtime,
+            .mtime_ns = hdr.mtime_ns,
+            .ino = hdr.ino,
+            .block_size = hdr.block_size,
+            .nr_blocks = hdr.nr_blocks,
+            .sums = xalloc(XMAX((size_t) hdr.nr_blocks, (size_t) 1) *
+                           sizeof (struct sync_block_sum)),
+        };
+
+        xfread(c.path, hdr.pathlen, in);
+        xfread(c.sums, hdr.nr_blocks * sizeof (*c.sums), in);
+        cache = sync_grow(cache, &capacity, nr, sizeof (*cache));
+        cache[nr++] = c;
+    }
+
+    qsort(cache, nr, sizeof (*cache), cmp_cached_path);
+    r->cache = cache;
+    r->nr_cache = nr;
+}
+
+static void
+sync_load_index(struct sync_receiver* r)
+{
+    r->index_name = sync_index_name(r->root);
+    if (r->index_name != NULL && access(r->index_name, F_OK) == 0) {
+        struct errinfo ei = { 0 };
+        if (catch_error(sync_load_index_1, r, &ei)) {
+            r->cache = NULL;
+            r->nr_cache = 0;
+        }
+    }
+}
+
+// Return the cached signatures of PATH if they still describe the
+// file as it stands.
+static const struct sync_cached*
+sync_lookup_cache(struct sync_receiver* r,
+                  const char* path,
+                  const struct stat* st)
+{
+    struct sync_cached key = { .path = (char*) path };
+    const struct sync_cached* c =
+        bsearch(&key, r->cache, r->nr_cache, sizeof (key), cmp_cached_path);
+    if (c != NULL &&
+        c->size == (uint64_t) st->st_size &&
+        c->mtime == st->st_mtim.tv_sec &&
+        c->mtime_ns == st->st_mtim.tv_nsec &&
+        c->ino == st->st_ino &&
+        c->block_size == sync_block_size(st->st_size))
+    {
+        return c;
+    }
+
+    return NULL;
+}
+
+static void
+sync_save_index(struct sync_receiver* r)
+{
+    if (r->index_name == NULL)
+        return;
+
+    const char* tmpname = xaprintf("%s.tmp", r->index_name);
+    FILE* out = fopen(tmpname, "we");
+    if (out == NULL)
+        return;
+
+    bool ok = fwrite(sync_index_magic, sizeof (sync_index_magic), 1, out);
+
+    // Files we just wrote, then still-valid entries from last time
+    // for files we didn't touch.
+    for (int pass = 0; pass < 2 && ok; ++pass) {
+        struct sync_cached* list = pass == 0 ? r->fresh : r->cache;
+        size_t nr = pass == 0 ? r->nr_fresh : r->nr_cache;
+        for (size_t i = 0; i < nr && ok; ++i) {
+            struct sync_cached* c = &list[i];
+            if (pass == 1) {
+                struct stat st;
+                struct sync_cached key = { .path = c->path };
+                const char* path = xaprintf("%s/%s", r->root, c->path);
+                if (bsearch(&key, r->fresh, r->nr_fresh,
+                            sizeof (key), cmp_cached_path) ||
+                    !sync_entry_exists_p(r->sorted, r->nr_entries, c->path) ||
+                    lstat(path, &st) == -1 ||
+                    sync_lookup_cache(r, c->path, &st) != c)
+                {
+                    continue;
+                }
+            }
+
+            struct sync_index_hdr hdr = {
+                .pathlen = strlen(c->path),
+                .recent = c->recent,
+                .size = c->size,
+                .mtime = c->mtime,
+                .mtime_ns = c->mtime_ns,
+                .ino = c->ino,
+                .block_size = c->block_size,
+                .nr_blocks = c->nr_blocks,
+            };
+
+            ok = (fwrite(&hdr, sizeof (hdr), 1, out) == 1 &&
+                  fwrite(c->path, hdr.pathlen, 1, out) == 1 &&
+                  (c->nr_blocks == 0 ||
+                   fwrite(c->sums, c->nr_blocks * sizeof (*c->sums),
+                          1, out) == 1));
+        }
+    }
+
+    if (fclose(out) == EOF)
+        ok = false;
+    if (!ok || rename(tmpname, r->index_name) == -1)
+        unlink(tmpname);
+}
+
+static void
+sync_remove_tree(const char* path)
+{
+    struct stat st;
+    if (lstat(path, &st) == -1) {
+        if (errno == ENOENT)
+            return;
+        die_errno("lstat(\"%s\")", path);
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        if (unlink(path) == -1)
+            die_errno("unlink(\"%s\")", path);
+        return;
+    }
+
+    DIR* dir = opendir(path);
+    if (dir == NULL)
+        die_errno("opendir(\"%s\")", path);
+
+    struct cleanup* cl = cleanup_allocate();
+    cleanup_commit(cl, (cleanupfn) closedir, dir);
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL)
+        if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+            sync_remove_tree(xaprintf("%s/%s", path, de->d_name));
+
+    if (rmdir(path) == -1)
+        die_errno("rmdir(\"%s\")", path);
+}
+
+static void
+sync_delete_extraneous(struct sync_receiver* r, const char* rel)
+{
+    const char* dirpath = rel[0] ? xaprintf("%s/%s", r->root, rel) : r->root;
+    DIR* dir = opendir(dirpath);
+    if (dir == NULL)
+        die_errno("opendir(\"%s\")", dirpath);
+
+    struct cleanup* cl = cleanup_allocate();
+    cleanup_commit(cl, (cleanupfn) closedir, dir);
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+
+        const char* relpath = (rel[0]
+                               ? xaprintf("%s/%s", rel, de->d_name)
+                               : de->d_name);
+        const char* path = xaprintf("%s/%s", r->root, relpath);
+        if (!sync_entry_exists_p(r->sorted, r->nr_entries, relpath)) {
+            sync_remove_tree(path);
+            continue;
+        }
+
+        struct stat st;
+        if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode))
+            sync_delete_extraneous(r, xstrdup(relpath));
+    }
+}
+
+static void
+sync_delete_extraneous_1(void* arg)
+{
+    sync_delete_extraneous(arg, "");
+}
+
+static void
+sync_send_signatures(struct sync_receiver* r,
+                     uint32_t index,
+                     const char* path,
+                     const struct stat* st,
+                     FILE* out)
+{
+    struct sync_request_hdr hdr = { .index = index };
+    const struct sync_cached* c = NULL;
+
+    if (st != NULL)
+        c = sync_lookup_cache(r, r->entries[index].path, st);
+
+    if (c != NULL) {
+        hdr.block_size = c->block_size;
+        hdr.nr_blocks = c->nr_blocks;
+        xfwrite(&hdr, sizeof (hdr), out);
+        xfwrite(c->sums, c->nr_blocks * sizeof (*c->sums), out);
+        xfflush(out);
+        return;
+    }
+
+    if (st != NULL) {
+        hdr.block_size = sync_block_size(st->st_size);
+        hdr.nr_blocks = sync_nr_blocks(st->st_size, hdr.block_size);
+    }
+
+    if (hdr.nr_blocks > SYNC_MAX_SIGNATURES)
+        hdr.nr_blocks = 0;
+
+    if (hdr.nr_blocks == 0) {
+        xfwrite(&hdr, sizeof (hdr), out);
+        xfflush(out);
+        return;
+    }
+
+    int fd = xopen(path, O_RDONLY, 0);
+    hint_sequential_read(fd);
+    struct sync_block_sum* sums =
+        xalloc(hdr.nr_blocks * sizeof (*sums));
+    uint8_t* buf = xalloc(hdr.block_size);
+    for (uint32_t i = 0; i < hdr.nr_blocks; ++i) {
+        size_t n = read_all(fd, buf, hdr.block_size);
+        if (n == 0) {
+            // The file shrank; describe what's there.
+            hdr.nr_blocks = i;
+            break;
+        }
+
+        struct rollsum rs;
+        rollsum_init(&rs, buf, n);
+        sums[i].weak = rollsum_digest(&rs);
+        sums[i].strong = hash64(buf, n);
+    }
+
+    xfwrite(&hdr, sizeof (hdr), out);
+    xfwrite(sums, hdr.nr_blocks * sizeof (*sums), out);
+    xfflush(out);
+}
+
+struct sync_generate_info {
+    struct sync_receiver* r;
+    uint32_t index;
+    FILE* out;
+};
+
+static void
+sync_generate_1(void* arg)
+{
+    SCOPED_RESLIST(rl_generate);
+    struct sync_generate_info* gi = arg;
+    struct sync_receiver* r = gi->r;
+    const struct sync_entry* e = &r->entries[gi->index];
+    const char* path = xaprintf("%s/%s", r->root, e->path);
+    struct stat st;
+    bool exists = lstat(path, &st) == 0;
+    if (!exists && errno != ENOENT)
+        die_errno("lstat(\"%s\")", path);
+
+    if (e->type == SYNC_DIR) {
+        if (exists && !S_ISDIR(st.st_mode)) {
+            sync_remove_tree(path);
+            exists = false;
+        }
+
+        if (!exists && mkdir(path, e->mode | 0700) == -1)
+            die_errno("mkdir(\"%s\")", path);
+        if (!exists || (st.st_mode & 07777) != e->mode)
+            if (chmod(path, e->mode | 0700) == -1)
+                die_errno("chmod(\"%s\")", path);
+    } else if (e->type == SYNC_SYMLINK) {
+        char target[PATH_MAX + 1];
+        ssize_t len = -1;
+        if (exists && S_ISLNK(st.st_mode))
+            len = readlink(path, target, sizeof (target) - 1);
+        if (len >= 0 && (size_t) len == strlen(e->link) &&
+            !memcmp(target, e->link, len))
+        {
+            return;
+        }
+
+        if (exists)
+            sync_remove_tree(path);
+        if (symlink(e->link, path) == -1)
+            die_errno("symlink(\"%s\")", path);
+    } else {
+        if (exists && !S_ISREG(st.st_mode)) {
+            sync_remove_tree(path);
+            exists = false;
+        }
+
+        const struct sync_cached* c = NULL;
+        if (exists)
+            c = sync_lookup_cache(r, e->path, &st);
+
+        if (exists &&
+            !e->recent &&
+            !(c != NULL && c->recent) &&
+            (uint64_t) st.st_size == e->size &&
+            st.st_mtim.tv_sec == e->mtime &&
+            st.st_mtim.tv_nsec == e->mtime_ns)
+        {
+            if ((st.st_mode & 07777) != e->mode &&
+                chmod(path, e->mode) == -1)
+            {
+                die_errno("chmod(\"%s\")", path);
+            }
+            return;
+        }
+
+        sync_send_signatures(r, gi->index, path,
+                             exists ? &st : NULL, gi->out);
+    }
+}
+
+static int
+sync_generate(struct sync_receiver* r)
+{
+    FILE* out = stdout;
+    setvbuf(out, xalloc(SYNC_IO_BUFSZ), _IOFBF, SYNC_IO_BUFSZ);
+    unsigned nr_problems = 0;
+
+    if (r->delete_p) {
+        struct errinfo ei = { .want_msg = true };
+        if (catch_error(sync_delete_extraneous_1, r, &ei))
+        {
+            fprintf(stderr, "%s: %s\n", prgname, ei.msg);
+            nr_problems += 1;
+        }
+    }
+
+    for (size_t i = 0; i < r->nr_entries; ++i) {
+        struct sync_generate_info gi = { r, i, out };
+        struct errinfo ei = { .want_msg = true };
+        if (catch_error(sync_generate_1, &gi, &ei)) {
+            fprintf(stderr, "%s: %s\n", prgname, ei.msg);
+            nr_problems += 1;
+        }
+    }
+
+    struct sync_request_hdr end = { .index = SYNC_NO_INDEX };
+    xfwrite(&end, sizeof (end), out);
+    xfflush(out);
+    return nr_problems > 0;
+}
+
+// Where the applier puts a file while it's being written; also
+// builds the signatures we'll cache for the new file.
+struct sync_output {
+    int fd;
+    int err;
+    const char* errmsg;
+    struct hash64 hash;
+    uint64_t size;
+    uint32_t block_size;
+    uint8_t* block;
+    size_t fill;
+    struct sync_block_sum* sums;
+    size_t nr_sums;
+    size_t sums_capacity;
+};
+
+static void
+sync_output_sum_block(struct sync_output* o)
+{
+    if (o->fill == 0)
+        return;
+
+    if (o->nr_sums < SYNC_MAX_SIGNATURES) {
+        struct rollsum rs;
+        rollsum_init(&rs, o->block, o->fill);
+        o->sums = sync_grow(o->sums, &o->sums_capacity,
+                            o->nr_sums, sizeof (*o->sums));
+        o->sums[o->nr_sums].weak = rollsum_digest(&rs);
+        o->sums[o->nr_sums].strong = hash64(o->block, o->fill);
+    }
+
+    o->nr_sums += 1;
+    o->fill = 0;
+}
+
+static void
+sync_output_write(struct sync_output* o, const uint8_t* data, size_t sz)
+{
+    hash64_update(&o->hash, data, sz);
+    o->size += sz;
+
+    for (size_t pos = 0; pos < sz && o->err == 0;) {
+        ssize_t ret = write(o->fd, data + pos, sz - pos);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            o->err = errno;
+        else
+            pos += ret;
+    }
+
+    while (sz > 0) {
+        size_t n = XMIN(sz, o->block_size - o->fill);
+        memcpy(o->block + o->fill, data, n);
+        o->fill += n;
+        data += n;
+        sz -= n;
+        if (o->fill == o->block_size)
+            sync_output_sum_block(o);
+    }
+}
+
+struct sync_apply_buffers {
+    uint8_t* literal;
+    uint8_t* copy;
+    size_t copy_size;
+    uint8_t* block;
+    size_t block_size;
+};
+
+// Apply one delta from IN.  Problems with the file don't stop us
+// from reading the rest of the delta: the stream has to stay in
+// sync.
+static void
+sync_apply(struct sync_receiver* r,
+           const struct sync_delta_hdr* hdr,
+           struct sync_apply_buffers* bufs,
+           FILE* in)
+{
+    if (hdr->index >= r->nr_entries ||
+        r->entries[hdr->index].type != SYNC_FILE ||
+        hdr->block_size > SYNC_MAX_BLOCK)
+    {
+        die(ECOMM, "bad sync delta");
+    }
+
+    const struct sync_entry* e = &r->entries[hdr->index];
+    const char* path = xaprintf("%s/%s", r->root, e->path);
+    const char* slash = strrchr(path, '/');
+    char* tmpname = xaprintf("%.*s/.fb-adb-sync-XXXXXX",
+                             (int) (slash - path), path);
+
+    struct sync_output o = {
+        .fd = mkostemp(tmpname, O_CLOEXEC),
+        .block_size = sync_block_size(e->size),
+    };
+
+    hash64_init(&o.hash);
+    if (o.fd == -1)
+        o.err = errno;
+
+    if (bufs->block_size < o.block_size) {
+        bufs->block = xalloc(o.block_size);
+        bufs->block_size = o.block_size;
+    }
+
+    o.block = bufs->block;
+
+    if (bufs->copy_size < hdr->block_size) {
+        bufs->copy = xalloc(hdr->block_size);
+        bufs->copy_size = hdr->block_size;
+    }
+
+    int oldfd = -1;
+    bool tried_old = false;
+
+    for (;;) {
+        struct sync_op op;
+        xfread(&op, sizeof (op), in);
+        if (op.kind == SYNC_OP_END)
+            break;
+
+        if (op.kind == SYNC_OP_LITERAL) {
+            if (op.arg > SYNC_LITERAL_MAX)
+                die(ECOMM, "bad sync literal");
+            xfread(bufs->literal, op.arg, in);
+            sync_output_write(&o, bufs->literal, op.arg);
+        } else if (op.kind == SYNC_OP_COPY) {
+            if (!tried_old) {
+                oldfd = open(path, O_RDONLY | O_CLOEXEC);
+                if (oldfd == -1 && o.err == 0)
+                    o.err = errno;
+                tried_old = true;
+            }
+
+            ssize_t n = -1;
+            if (oldfd != -1)
+                n = pread(oldfd, bufs->copy, hdr->block_size,
+                          (off_t) op.arg * hdr->block_size);
+            if (n < (ssize_t) hdr->block_size) {
+                if (o.err == 0)
+                    o.err = n < 0 ? errno : EIO;
+                n = 0;
+            }
+
+            sync_output_write(&o, bufs->copy, n);
+        } else {
+            die(ECOMM, "bad sync op %u", (unsigned) op.kind);
+        }
+    }
+
+    uint64_t hash;
+    xfread(&hash, sizeof (hash), in);
+    sync_output_sum_block(&o);
+    if (oldfd != -1)
+        close(oldfd);
+
+    if (o.err == 0 && hash != hash64_final(&o.hash)) {
+        o.err = EIO;
+        o.errmsg = "checksum mismatch; sync again";
+    }
+
+    struct timespec times[2] = {
+        { .tv_sec = e->mtime, .tv_nsec = e->mtime_ns },
+        { .tv_sec = e->mtime, .tv_nsec = e->mtime_ns },
+    };
+
+    if (o.err == 0 && fchmod(o.fd, e->mode) == -1)
+        o.err = errno;
+    if (o.err == 0 && futimens(o.fd, times) == -1)
+        o.err = errno;
+    if (o.fd != -1 && close(o.fd) == -1 && o.err == 0)
+        o.err = errno;
+    if (o.err == 0 && rename(tmpname, path) == -1)
+        o.err = errno;
+
+    if (o.err != 0) {
+        if (o.fd != -1)
+            unlink(tmpname);
+        fprintf(stderr, "%s: %s: %s\n",
+                prgname, path, o.errmsg ?: strerror(o.err));
+        r->nr_problems += 1;
+        return;
+    }
+
+    struct stat st;
+    if (o.size == e->size &&
+        o.nr_sums <= SYNC_MAX_SIGNATURES &&
+        lstat(path, &st) == 0)
+    {
+        r->fresh = sync_grow(r->fresh, &r->fresh_capacity,
+                             r->nr_fresh, sizeof (*r->fresh));
+        r->fresh[r->nr_fresh++] = (struct sync_cached) {
+            .path = e->path,
+            .recent = e->recent,
+            .size = st.st_size,
+            .mtime = st.st_mtim.tv_sec,
+            .mtime_ns = st.st_mtim.tv_nsec,
+            .ino = st.st_ino,
+            .block_size = o.block_size,
+            .nr_blocks = o.nr_sums,
+            .sums = o.sums,
+        };
+    }
+}
+
+int
+sync_receiver_main(int argc, const char** argv)
+{
+    struct sync_receiver* r = xcalloc(sizeof (*r));
+    if (argc == 3 && !strcmp(argv[1], "--delete"))
+        r->delete_p = true;
+    else if (argc != 2)
+        die(EINVAL, "this command is internal");
+
+    r->root = argv[argc - 1];
+    FILE* in = stdin;
+    setvbuf(in, xalloc(SYNC_IO_BUFSZ), _IOFBF, SYNC_IO_BUFSZ);
+    r->entries = sync_read_entries(in, &r->nr_entries);
+    r->sorted = sync_sorted_entries(r->entries, r->nr_entries);
+    sync_load_index(r);
+
+    pid_t generator = fork();
+    if (generator == -1)
+        die_errno("fork");
+
+    if (generator == 0) {
+        replace_with_dev_null(0);
+        int status = sync_generate(r);
+        fflush(stderr);
+        _exit(status);
+    }
+
+    replace_with_dev_null(1);
+    struct sync_apply_buffers bufs = {
+        .literal = xalloc(SYNC_LITERAL_MAX),
+    };
+
+    for (;;) {
+        struct sync_delta_hdr hdr;
+        xfread(&hdr, sizeof (hdr), in);
+        if (hdr.index == SYNC_NO_INDEX)
+            break;
+        sync_apply(r, &hdr, &bufs, in);
+    }
+
+    int status;
+    int ret;
+    do {
+        ret = waitpid(generator, &status, 0);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1)
+        die_errno("waitpid");
+
+    qsort(r->fresh, r->nr_fresh, sizeof (*r->fresh), cmp_cached_path);
+    sync_save_index(r);
+
+    return (r->nr_problems > 0 ||
+            !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0);
+}
@@ -0,0 +1,267 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "trace.h"
+
+// fb-adb trace-decode turns the trace files that --trace and
+// FB_ADB_TRACE write (see trace.c) into one timeline.  Events from
+// all sections of all files go on the clock of the first section of
+// the first file.  Sections in later files have no offset relative
+// to it, which is right only for processes on the same machine,
+// like a stub's crash trace from a --local session.
+
+static const char usage[] = (
+    "\n"
+    "  -h\n"
+    "  --help\n"
+    "    Display this message.\n"
+    "\n"
+    );
+
+struct trace_line {
+    int64_t ns;
+    const struct trace_section_header* section;
+    const struct trace_event* ev;
+};
+
+static const char*
+trace_msg_name(uint32_t type)
+{
+    static const char* names[] = {
+        "CHANNEL_DATA",
+        "CHANNEL_WINDOW",
+        "CHANNEL_CLOSE",
+        "CHILD_EXIT",
+        "ERROR",
+        "WINDOW_SIZE",
+        "SHEX_HELLO",
+        "CMDLINE_ARGUMENT",
+        "CMDLINE_DEFAULT_SH",
+        "CMDLINE_DEFAULT_SH_LOGIN",
+        "EXEC_AS_ROOT",
+        "EXEC_AS_USER",
+        "OPEN_FILE",
+        "FILE_INFO",
+        "SYNC_DIR",
+        "FWD_LISTEN",
+        "FWD_OPEN",
+        "FWD_RELEASE",
+        "EXTRA_FD",
+        "RUN_BATCH",
+        "SOCKET_LISTEN",
+        "SOCKET_LISTENING",
+        "SOCKET_CONNECTED",
+        "STUB_TIMING",
+        "STUB_TRACE",
+        "STUB_PIPELINE",
+    };
+
+    if (type < MSG_CHANNEL_DATA ||
+        type - MSG_CHANNEL_DATA >= ARRAYSIZE(names))
+    {
+        return xaprintf("%u", type);
+    }
+
+    return names[type - MSG_CHANNEL_DATA];
+}
+
+static const char*
+trace_describe(const struct trace_event* ev)
+{
+    const uint32_t* a = ev->args;
+    switch (ev->id) {
+        case TRACE_START:
+            return xaprintf("start      pid=%u stub=%u", a[0], a[1]);
+        case TRACE_MSG_SEND:
+        case TRACE_MSG_RECV:
+            return xaprintf("%s   %s ch=%u size=%u",
+                            ev->id == TRACE_MSG_SEND ? "send" : "recv",
+                            trace_msg_name(a[0]), a[1], a[2]);
+        case TRACE_POLL_SLEEP:
+            if (a[1] == UINT32_MAX)
+                return xaprintf("poll       nfds=%u", a[0]);
+            return xaprintf("poll       nfds=%u timeout=%uus", a[0], a[1]);
+        case TRACE_POLL_WAKE:
+            if ((int32_t) a[0] < 0)
+                return xaprintf("wake       error=%s", strerror(a[1]));
+            return xaprintf("wake       ready=%u", a[0]);
+        case TRACE_CHANNEL_READ:
+            return xaprintf("read       ch=%u bytes=%u window=%u",
+                            a[0], a[1], a[2]);
+        case TRACE_CHANNEL_WRITE:
+            return xaprintf("write      ch=%u bytes=%u left=%u",
+                            a[0], a[1], a[2]);
+        case TRACE_CHANNEL_CLOSE:
+            return xaprintf("close      ch=%u", a[0]);
+        case TRACE_WINDOW:
+            return xaprintf("window     ch=%u delta=%u window=%u",
+                            a[0], a[1], a[2]);
+        default:
+            return xaprintf("event-%u    %u %u %u",
+                            ev->id, a[0], a[1], a[2]);
+    }
+}
+
+static int
+trace_line_cmp(const void* a, const void* b)
+{
+    const struct trace_line* la = a;
+    const struct trace_line* lb = b;
+    if (la->ns != lb->ns)
+        return la->ns < lb->ns ? -1 : 1;
+    // Keep each section's events in the order it recorded them.
+    return la->ev < lb->ev ? -1 : (la->ev > lb->ev);
+}
+
+static char*
+trace_slurp(const char* filename, size_t* size)
+{
+    int fd = xopen(filename, O_RDONLY, 0);
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        die_errno("fstat");
+    char* buf = xalloc(st.st_size);
+    if (read_all(fd, buf, st.st_size) != st.st_size)
+        die(EIO, "%s: short read", filename);
+    *size = st.st_size;
+    return buf;
+}
+
+// Check a trace file's layout and tally its events.
+static unsigned
+trace_count_events(const char* filename, const char* buf, size_t size)
+{
+    const struct trace_file_header* fh = (const void*) buf;
+    if (size < sizeof (*fh) ||
+        memcmp(fh->magic, TRACE_FILE_MAGIC, sizeof (fh->magic)))
+    {
+        die(EINVAL, "%s: not an fb-adb trace", filename);
+    }
+
+    size_t off = sizeof (*fh);
+    unsigned total = 0;
+    for (uint32_t s = 0; s < fh->nr_sections; ++s) {
+        const struct trace_section_header* sh = (const void*) (buf + off);
+        if (size - off < sizeof (*sh) ||
+            (size - off - sizeof (*sh)) / sizeof (struct trace_event)
+            < sh->nr_events)
+        {
+            die(EINVAL, "%s: truncated trace", filename);
+        }
+
+        off += sizeof (*sh) + sh->nr_events * sizeof (struct trace_event);
+        total += sh->nr_events;
+    }
+
+    return total;
+}
+
+int
+trace_decode_main(int argc, const char** argv)
+{
+    static struct option opts[] = {
+        { "help", no_argument, NULL, 'h' },
+        { 0 }
+    };
+
+    for (;;) {
+        char c = getopt_long(argc, (char**) argv, "+:h", opts, NULL);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case ':':
+                die(EINVAL, "missing option for -%c", optopt);
+            case '?':
+                if (optopt != '?')
+                    die(EINVAL, "invalid option -%c", optopt);
+            case 'h':
+                printf("%s [OPTS] FILE...: "
+                       "print fb-adb traces as one timeline\n",
+                       prgname);
+                printf("%s", usage);
+                return 0;
+            default:
+                abort();
+        }
+    }
+
+    if (optind == argc)
+        die(EINVAL, "no trace files given");
+
+    unsigned nr_files = argc - optind;
+    char** bufs = xalloc(nr_files * sizeof (*bufs));
+    unsigned nr_lines = 0;
+    for (unsigned f = 0; f < nr_files; ++f) {
+        size_t size;
+        bufs[f] = trace_slurp(argv[optind + f], &size);
+        nr_lines += trace_count_events(argv[optind + f], bufs[f], size);
+    }
+
+    struct trace_line* lines = xalloc(nr_lines * sizeof (*lines));
+    unsigned n = 0;
+    for (unsigned f = 0; f < nr_files; ++f) {
+        const struct trace_file_header* fh = (const void*) bufs[f];
+        size_t off = sizeof (*fh);
+        for (uint32_t s = 0; s < fh->nr_sections; ++s) {
+            const struct trace_section_header* sh =
+                (const void*) (bufs[f] + off);
+            const struct trace_event* ev =
+                (const void*) (bufs[f] + off + sizeof (*sh));
+
+            if (sh->nr_dropped > 0)
+                fprintf(stderr, "%s: %s:%u: oldest %ju events lost\n",
+                        prgname, sh->role, sh->pid,
+                        (uintmax_t) sh->nr_dropped);
+            if (sh->clock_slop_ns < 0)
+                fprintf(stderr, "%s: %s:%u: clock not aligned\n",
+                        prgname, sh->role, sh->pid);
+            else if (sh->clock_slop_ns > 0)
+                fprintf(stderr, "%s: %s:%u: clock aligned to %.3f ms\n",
+                        prgname, sh->role, sh->pid,
+                        sh->clock_slop_ns / 1e6);
+
+            for (uint32_t i = 0; i < sh->nr_events; ++i)
+                lines[n++] = (struct trace_line){
+                    (int64_t) ev[i].ns + sh->clock_offset_ns, sh, &ev[i] };
+
+            off += sizeof (*sh) + sh->nr_events * sizeof (*ev);
+        }
+    }
+
+    qsort(lines, nr_lines, sizeof (*lines), trace_line_cmp);
+
+    int64_t t0 = nr_lines > 0 ? lines[0].ns : 0;
+    int64_t prev = t0;
+    for (unsigned i = 0; i < nr_lines; ++i) {
+        SCOPED_RESLIST(rl_line);
+        printf("%14.6f %+11.6f  %.*s:%-6u  %s\n",
+               (lines[i].ns - t0) / 1e9,
+               (lines[i].ns - prev) / 1e9,
+               (int) sizeof (lines[i].section->role),
+               lines[i].section->role,
+               lines[i].section->pid,
+               trace_describe(lines[i].ev));
+        prev = lines[i].ns;
+    }
+
+    if (fflush(stdout) != 0)
+        die_errno("write");
+
+    return 0;
+}
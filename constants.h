@@ -13,6 +13,8 @@
 #ifdef __ANDROID__
 #define DEFAULT_SHELL "/system/bin/sh"
 #define DEFAULT_TEMP_DIR "/data/local/tmp"
+// The uid adbd runs as when it isn't root.
+#define AID_SHELL 2000
 #else
 #define DEFAULT_SHELL "/bin/sh"
 #define DEFAULT_TEMP_DIR "/tmp"
@@ -20,4 +22,70 @@
 
 #define DEFAULT_CMD_BUFSZ 4096
 #define DEFAULT_STREAM_BUFSZ 4096
+#define DEFAULT_COALESCE_DELAY_NS 500000
+#define DEFAULT_COALESCE_BYTES 2048
+// Within a scheduling class, a session's own stdio earns
+// CHANNEL_WEIGHT_STDIO frames of credit per round for every one an
+// extra fd or a forwarded connection earns.  A lower class that has
+// waited through SCHED_STARVE_FRAMES full frames from higher classes
+// gets to send one frame of its own.
+#define CHANNEL_WEIGHT_STDIO 4
+#define SCHED_STARVE_FRAMES 16
+// Receive buffers hold this many maximum-size messages so that
+// payloads can wait there for slow channels without blocking others.
+#define RECV_BUFSZ_MSGS 4
+// File transfers use the largest frame a struct msg can describe
+// and a window big enough to cover adb's round trip.
+#define XFER_CMD_BUFSZ 65535
+#define XFER_STREAM_BUFSZ (1024*1024)
+// Limits on sizes given explicitly with --cmd-bufsz and --stream-bufsz.
+#define MIN_CMD_BUFSZ 512
+#define MAX_STREAM_BUFSZ (64*1024*1024)
+// How long each end of the socket transport waits for the other's
+// first message on a new connection before giving up on it.
+#define SOCKET_HANDSHAKE_TIMEOUT_MS 10000
+// How long the stub waits, after it's done writing to the socket
+// transport, for the host to finish writing to it too.
+#define SOCKET_LINGER_TIMEOUT_MS 10000
+// Directory transfers stream a tar archive built on the device.
+// Files up to ARCHIVE_SMALL_FILE_MAX are read ahead into memory by
+// ARCHIVE_READER_THREADS threads, ARCHIVE_PREFETCH_MAX bytes at most.
+#define ARCHIVE_BLOCKSZ 512
+#define ARCHIVE_READER_THREADS 4
+#define ARCHIVE_SMALL_FILE_MAX (256*1024)
+#define ARCHIVE_PREFETCH_MAX (4*1024*1024)
+#define ARCHIVE_STREAM_BUFSZ (256*1024)
+// Delta sync.  Block sizes scale with the square root of the file
+// size between these bounds.  The sender searches up to
+// SYNC_HASH_THREADS files for matching blocks at once.
+#define SYNC_MIN_BLOCK 2048
+#define SYNC_MAX_BLOCK (256*1024)
+#define SYNC_MAX_SIGNATURES (1<<22)
+#define SYNC_LITERAL_MAX (64*1024)
+#define SYNC_HASH_THREADS 8
+#define SYNC_MAX_JOBS 64
+#define SYNC_IO_BUFSZ (256*1024)
+#define SYNC_INDEX_DIR ".fb-adb-sync"
+// Extra descriptors passed to the child with -F carry bulk data.
+#define MAX_EXTRA_FDS 32
+#define EXTRA_FD_BUFSZ (256*1024)
+// Each forwarded connection gets a pair of channels with buffers of
+// FWD_BUFSZ bytes, which is also the window either end may fill
+// before hearing from the other.
+#define FWD_BUFSZ (64*1024)
+#define FWD_MAX_CONNECTIONS 256
+#define FWD_SPEC_MAX 128
+// fb-adb multi reads session output in MULTI_IO_BUFSZ pieces and
+// holds at most MULTI_LINE_MAX bytes of an unfinished line per
+// stream before printing it anyway.  The usage text in cmd_multi.c
+// gives this limit too.
+#define MULTI_IO_BUFSZ (64*1024)
+#define MULTI_LINE_MAX 4096
+// fb-adb batch moves command output in BATCH_IO_BUFSZ pieces and
+// runs at most BATCH_MAX_JOBS commands at once.  Past
+// BATCH_MAX_HELD bytes of output held in memory for commands whose
+// turn hasn't come, we hold the rest in temporary files.
+#define BATCH_IO_BUFSZ (64*1024)
+#define BATCH_MAX_JOBS 64
+#define BATCH_MAX_HELD (16*1024*1024)
 #define FB_ADB_REMOTE_FILENAME "/data/local/tmp/fb-adb"
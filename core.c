@@ -14,9 +14,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/uio.h>
+#include <sys/stat.h>
 #include "core.h"
+#include "constants.h"
 #include "ringbuf.h"
 #include "channel.h"
+#include "fwd.h"
+#include "pipeline.h"
+#include "stats.h"
+#include "trace.h"
 
 __attribute__((noreturn,format(printf,1,2)))
 static void
@@ -52,6 +58,15 @@ detect_msg(struct ringbuf* rb, struct msg* mhdr)
     return true;                /* Can now read msg */
 }
 
+static void
+trace_recv(struct ringbuf* rb, struct msg mhdr)
+{
+    struct msg_channel_data hdr;
+    size_t hdrsz = XMIN((size_t) mhdr.size, sizeof (hdr));
+    ringbuf_copy_out(rb, &hdr, hdrsz);
+    trace_msg(TRACE_MSG_RECV, &hdr, hdrsz);
+}
+
 static void
 fb_adb_sh_process_msg_channel_data(struct fb_adb_sh* sh,
                                    struct msg_channel_data* m)
@@ -59,30 +74,50 @@ fb_adb_sh_process_msg_channel_data(struct fb_adb_sh* sh,
     unsigned nrch = sh->nrch;
     struct channel* cmdch = sh->ch[FROM_PEER];
 
-    if (m->channel <= NR_SPECIAL_CH || m->channel > nrch)
+    if (m->channel <= NR_SPECIAL_CH || m->channel >= nrch)
         die_proto_error("data: invalid channel %d", m->channel);
 
     struct channel* c = sh->ch[m->channel];
-    if (c->dir == CHANNEL_FROM_FD)
+    if (c != NULL && c->dir == CHANNEL_FROM_FD)
         die_proto_error("wrong channel direction ch=%u", m->channel);
 
     size_t payloadsz = m->msg.size - sizeof (*m);
 
-    if (c->fdh == NULL) {
-        /* Channel already closed.  Just drop the write. */
+    if (c == NULL || c->fdh == NULL) {
+        /* Channel already closed or released.  Just drop the write. */
         ringbuf_note_removed(cmdch->rb, payloadsz);
         return;
     }
 
     /* If we received more data than will fit in the receive
-     * buffer, peer didn't respect window requirements.  */
-    if (ringbuf_room(c->rb) < payloadsz)
+     * buffer, peer didn't respect window requirements.  Bytes we
+     * hold for C in FROM_PEER count against C's buffer too: we
+     * might have to copy them there.  */
+    if (ringbuf_room(c->rb) < c->chain_bytes ||
+        ringbuf_room(c->rb) - c->chain_bytes < payloadsz)
+    {
         die_proto_error("window desync");
+    }
 
-    struct iovec iov[2];
-    ringbuf_readable_iov(cmdch->rb, iov, payloadsz);
-    channel_write(c, iov, 2);
-    ringbuf_note_removed(cmdch->rb, payloadsz);
+    c->stats.frames += 1;
+    if (sh->pipeline != NULL)
+        pipeline_note_received(sh, c, payloadsz);
+    channel_write_from(c, cmdch->rb, payloadsz);
+}
+
+// Payloads we hold in FROM_PEER for slow channels keep that space
+// from the peer.  Once the space left can't accommodate a
+// maximum-size message, copy the held bytes into their channels' own
+// buffers so that traffic for other channels keeps flowing.
+// Unchaining a channel takes it off SH->held.
+static void
+relieve_from_peer(struct fb_adb_sh* sh)
+{
+    if (ringbuf_room(sh->ch[FROM_PEER]->rb) >= sh->max_outgoing_msg)
+        return;
+
+    while (!TAILQ_EMPTY(&sh->held))
+        channel_unchain(TAILQ_FIRST(&sh->held));
 }
 
 static void
@@ -90,19 +125,35 @@ fb_adb_sh_process_msg_channel_window(struct fb_adb_sh* sh,
                                      struct msg_channel_window* m)
 {
     unsigned nrch = sh->nrch;
-    if (m->channel <= NR_SPECIAL_CH || m->channel > nrch)
+    if (m->channel <= NR_SPECIAL_CH || m->channel >= nrch)
         die_proto_error("window: invalid channel %d", m->channel);
 
     struct channel* c = sh->ch[m->channel];
+    if (c == NULL)
+        return;         /* Channel already released */
+
     if (c->dir == CHANNEL_TO_FD)
         die_proto_error("wrong channel direction");
 
     if (c->fdh == NULL)
         return;         /* Channel already closed */
 
-    if (SATADD(&c->window, c->window, m->window_delta)) {
-        die_proto_error("window overflow!?");
-    }
+    // An IO thread may be consuming the window concurrently.
+    uint32_t window = __atomic_load_n(&c->window, __ATOMIC_ACQUIRE);
+    uint32_t new_window;
+    do {
+        if (SATADD(&new_window, window, m->window_delta))
+            die_proto_error("window overflow!?");
+    } while (!__atomic_compare_exchange_n(&c->window,
+                                          &window,
+                                          new_window,
+                                          false,
+                                          __ATOMIC_ACQ_REL,
+                                          __ATOMIC_ACQUIRE));
+
+    trace(TRACE_WINDOW, m->channel, m->window_delta, new_window);
+
+    channel_mark_dirty(c);
 }
 
 static void
@@ -110,10 +161,13 @@ fb_adb_sh_process_msg_channel_close(struct fb_adb_sh* sh,
                                     struct msg_channel_close* m)
 {
     unsigned nrch = sh->nrch;
-    if (m->channel <= NR_SPECIAL_CH || m->channel > nrch)
+    if (m->channel <= NR_SPECIAL_CH || m->channel >= nrch)
         return;                 /* Ignore invalid close */
 
     struct channel* c = sh->ch[m->channel];
+    if (c == NULL)
+        return;                 /* Channel already released */
+
     c->sent_eof = true; /* Peer already knows we're closed. */
     channel_close(c);
 }
@@ -156,6 +210,8 @@ fb_adb_sh_process_msg(struct fb_adb_sh* sh, struct msg mhdr)
         read_cmdmsg(sh, mhdr, &m, sizeof (m));
         dbgmsg(&m.msg, "recv");
         fb_adb_sh_process_msg_channel_close(sh, &m);
+    } else if (sh->fwd != NULL && fwd_process_msg(sh, mhdr)) {
+        /* Forwarding message: handled */
     } else {
         ringbuf_note_removed(cmdch->rb, mhdr.size);
         die(ECOMM, "unrecognized command %d (sz=%hu)",
@@ -163,6 +219,11 @@ fb_adb_sh_process_msg(struct fb_adb_sh* sh, struct msg mhdr)
     }
 }
 
+// Room in TO_PEER we never fill with channel data, so that control
+// messages generated after we queue a data frame can still go out
+// immediately instead of waiting for the frame to drain.
+static const size_t control_reserve = 64;
+
 static size_t
 fb_adb_maxoutmsg(struct fb_adb_sh* sh)
 {
@@ -170,51 +231,336 @@ fb_adb_maxoutmsg(struct fb_adb_sh* sh)
                 ringbuf_room(sh->ch[TO_PEER]->rb));
 }
 
+// Bytes in TO_PEER are out of the scheduler's hands: control
+// messages and window updates we queue later wait for them to drain.
+// So we commit channel data to TO_PEER only once it holds less than
+// a full frame, and keep the rest in the channels' own buffers.
+static size_t
+fb_adb_maxdatamsg(struct fb_adb_sh* sh)
+{
+    struct channel* to_peer = sh->ch[TO_PEER];
+    if (channel_buffered(to_peer) >= sh->max_outgoing_msg)
+        return 0;
+
+    size_t room = ringbuf_room(to_peer->rb);
+    if (room < control_reserve)
+        return 0;
+
+    return XMIN(sh->max_outgoing_msg, room - control_reserve);
+}
+
+// Trace a message we're about to send.  Its header can straddle the
+// end of a ringbuf, so gather it first.
+static void
+trace_send(const struct iovec* iov, unsigned nio)
+{
+    struct msg_channel_data hdr;
+    size_t hdrsz = 0;
+    for (unsigned i = 0; i < nio && hdrsz < sizeof (hdr); ++i) {
+        size_t n = XMIN(iov[i].iov_len, sizeof (hdr) - hdrsz);
+        memcpy((char*) &hdr + hdrsz, iov[i].iov_base, n);
+        hdrsz += n;
+    }
+
+    trace_msg(TRACE_MSG_SEND, &hdr, hdrsz);
+}
+
+// Queue a message for the peer.  The caller has made sure it fits.
 static void
+to_peer_write(struct fb_adb_sh* sh, const struct iovec* iov, unsigned nio)
+{
+    struct channel* to_peer = sh->ch[TO_PEER];
+    to_peer->stats.frames += 1;
+    if (trace_enabled)
+        trace_send(iov, nio);
+    channel_write(to_peer, iov, nio);
+}
+
+// Returns false if we have an ack to send but no room to send it.
+static bool
 xmit_acks(struct channel* c, unsigned chno, struct fb_adb_sh* sh)
 {
     size_t maxoutmsg = fb_adb_maxoutmsg(sh);
     struct msg_channel_window m;
 
-    if (c->bytes_written > 0 && maxoutmsg >= sizeof (m)) {
-        memset(&m, 0, sizeof (m));
-        m.msg.type = MSG_CHANNEL_WINDOW;
-        m.msg.size = sizeof (m);
-        m.channel = chno;
-        m.window_delta = c->bytes_written;
-        dbgmsg(&m.msg, "send");
-        channel_write(sh->ch[TO_PEER], &(struct iovec){&m, sizeof (m)}, 1);
-        c->bytes_written = 0;
+    if (c->bytes_written == 0)
+        return true;
+
+    if (maxoutmsg < sizeof (m))
+        return false;
+
+    memset(&m, 0, sizeof (m));
+    m.msg.type = MSG_CHANNEL_WINDOW;
+    m.msg.size = sizeof (m);
+    m.channel = chno;
+    m.window_delta = c->bytes_written;
+    dbgmsg(&m.msg, "send");
+    to_peer_write(sh, &(struct iovec){&m, sizeof (m)}, 1);
+    c->bytes_written = 0;
+    return true;
+}
+
+// Like xmit_data, but for bytes C left in its pipe: write just the
+// frame header to TO_PEER and have the kernel move the payload
+// straight from C's pipe to TO_PEER's fd.  TO_PEER can owe only one
+// such payload at a time.
+static size_t
+xmit_data_spliced(struct channel* c,
+                  unsigned chno,
+                  struct fb_adb_sh* sh,
+                  size_t limit)
+{
+    struct channel* to_peer = sh->ch[TO_PEER];
+    size_t maxdatamsg = fb_adb_maxdatamsg(sh);
+    size_t avail = XMIN(c->splice_avail, limit);
+    struct msg_channel_data m;
+
+    if (maxdatamsg <= sizeof (m) ||
+        avail == 0 ||
+        to_peer->fdh == NULL ||
+        to_peer->splice_left > 0)
+    {
+        return 0;
     }
+
+    size_t payloadsz = XMIN(avail, maxdatamsg - sizeof (m));
+    memset(&m, 0, sizeof (m));
+    m.msg.type = MSG_CHANNEL_DATA;
+    m.channel = chno;
+    m.msg.size = sizeof (m) + payloadsz;
+    dbgmsg(&m.msg, "send[splice]");
+    if (sh->pipeline != NULL)
+        pipeline_note_sent(sh, c, payloadsz);
+    to_peer_write(sh, &(struct iovec){&m, sizeof (m)}, 1);
+    channel_splice_from(to_peer, c, payloadsz);
+    c->splice_avail -= payloadsz;
+    c->stats.frames += 1;
+    return payloadsz;
 }
 
-static void
+// Send one data frame carrying at most LIMIT bytes of C's buffered
+// data.  Return the number of payload bytes sent.
+static size_t
 xmit_data(struct channel* c,
           unsigned chno,
-          struct fb_adb_sh* sh)
+          struct fb_adb_sh* sh,
+          size_t limit)
 {
-    if (c->dir != CHANNEL_FROM_FD)
-        return;
+    assert(c->dir == CHANNEL_FROM_FD);
 
-    size_t maxoutmsg = fb_adb_maxoutmsg(sh);
-    size_t avail = ringbuf_size(c->rb);
+    // Bytes in the ringbuf arrived before any still in the pipe.
+    if (ringbuf_size(c->rb) == 0 && c->splice_avail > 0)
+        return xmit_data_spliced(c, chno, sh, limit);
+
+    size_t maxdatamsg = fb_adb_maxdatamsg(sh);
+    size_t avail = XMIN(ringbuf_size(c->rb), limit);
     struct msg_channel_data m;
 
-    if (maxoutmsg > sizeof (m) && avail > 0) {
-        size_t payloadsz = XMIN(avail, maxoutmsg - sizeof (m));
-        struct iovec iov[3] = {{ &m, sizeof (m) }};
-        ringbuf_readable_iov(c->rb, &iov[1], payloadsz);
-        memset(&m, 0, sizeof (m));
-        m.msg.type = MSG_CHANNEL_DATA;
-        m.channel = chno;
-        m.msg.size = iovec_sum(iov, ARRAYSIZE(iov));
-        assert(chno != 0);
-        dbgmsg(&m.msg, "send");
-        channel_write(sh->ch[TO_PEER], iov, ARRAYSIZE(iov));
-        ringbuf_note_removed(c->rb, payloadsz);
+    if (maxdatamsg <= sizeof (m) || avail == 0)
+        return 0;
+
+    size_t payloadsz = XMIN(avail, maxdatamsg - sizeof (m));
+    struct iovec iov[3] = {{ &m, sizeof (m) }};
+    ringbuf_readable_iov(c->rb, &iov[1], payloadsz);
+    memset(&m, 0, sizeof (m));
+    m.msg.type = MSG_CHANNEL_DATA;
+    m.channel = chno;
+    m.msg.size = iovec_sum(iov, ARRAYSIZE(iov));
+    assert(chno != 0);
+    dbgmsg(&m.msg, "send");
+    if (sh->pipeline != NULL)
+        pipeline_note_sent(sh, c, payloadsz);
+    to_peer_write(sh, iov, ARRAYSIZE(iov));
+    ringbuf_note_removed(c->rb, payloadsz);
+    c->stats.frames += 1;
+    if (channel_buffered(c) == 0)
+        c->first_buffered_ns = 0;
+
+    return payloadsz;
+}
+
+// Should we hold C's small amount of buffered data in the hope that
+// the child writes more soon?  Holding trades a little latency for
+// fewer, larger frames when a child writes in tiny pieces.  We never
+// hold once the child has closed its end, once we can't read any
+// more anyway, or past the coalescing deadline.
+static bool
+coalesce_hold_p(struct fb_adb_sh* sh, struct channel* c)
+{
+    if (!c->coalesce ||
+        c->fdh == NULL ||
+        c->first_buffered_ns == 0 ||
+        channel_buffered(c) >= sh->coalesce_bytes ||
+        XMIN(ringbuf_room(c->rb), c->window) == 0)
+    {
+        return false;
+    }
+
+    uint64_t deadline = c->first_buffered_ns + sh->coalesce_delay_ns;
+    if (monotonic_ns() >= deadline)
+        return false;
+
+    if (sh->coalesce_deadline_ns == 0 || deadline < sh->coalesce_deadline_ns)
+        sh->coalesce_deadline_ns = deadline;
+
+    return true;
+}
+
+static void
+sched_add(struct fb_adb_sh* sh, struct channel* c)
+{
+    if (!c->scheduled &&
+        c->chno > NR_SPECIAL_CH &&
+        c->dir == CHANNEL_FROM_FD &&
+        channel_buffered(c) > 0 &&
+        !coalesce_hold_p(sh, c))
+    {
+        TAILQ_INSERT_TAIL(&sh->runq[c->prio], c, sched_link);
+        c->scheduled = true;
     }
 }
 
+// Move every channel on FROM to the tail of TO, in order.
+static void
+runq_move(struct channel_list* to, struct channel_list* from)
+{
+    struct channel* c;
+    while ((c = TAILQ_FIRST(from)) != NULL) {
+        TAILQ_REMOVE(from, c, sched_link);
+        TAILQ_INSERT_TAIL(to, c, sched_link);
+    }
+}
+
+// Class PRIO just sent SENT bytes: it's no longer starved, and every
+// lower class with data waiting is that much more so.
+static void
+sched_note_sent(struct fb_adb_sh* sh, unsigned prio, size_t sent)
+{
+    sh->starved[prio] = 0;
+    for (unsigned lower = prio + 1; lower < NR_CHANNEL_PRIO; ++lower)
+        if (!TAILQ_EMPTY(&sh->runq[lower]))
+            sh->starved[lower] += sent;
+}
+
+// Let the channels in class PRIO share TO_PEER by deficit round
+// robin, each turn earning a channel WEIGHT full-size frames' worth
+// of credit, until they've sent BUDGET bytes or have nothing more to
+// send.  A channel that can't send while there's room (its bytes are
+// still in its pipe and TO_PEER owes another splice) sits out the
+// rest of this pass without holding up the channels behind it.
+// Return false if TO_PEER filled up.
+static bool
+xmit_class(struct fb_adb_sh* sh, unsigned prio, size_t budget)
+{
+    struct channel_list* runq = &sh->runq[prio];
+    struct channel_list stuck;
+    struct channel* c;
+    bool room_p = true;
+    TAILQ_INIT(&stuck);
+    while (budget > 0 && (c = TAILQ_FIRST(runq)) != NULL) {
+        if (!c->has_turn) {
+            c->deficit += (size_t) c->weight * sh->max_outgoing_msg;
+            c->has_turn = true;
+        }
+
+        size_t sent = xmit_data(c, c->chno, sh, XMIN(c->deficit, budget));
+        if (sent == 0 &&
+            fb_adb_maxdatamsg(sh) <= sizeof (struct msg_channel_data))
+        {
+            /* TO_PEER is full */
+            room_p = false;
+            break;
+        }
+
+        if (sent == 0) {
+            TAILQ_REMOVE(runq, c, sched_link);
+            TAILQ_INSERT_TAIL(&stuck, c, sched_link);
+            continue;
+        }
+
+        stall_note(&c->stats.to_peer_blocked, false);
+        sched_note_sent(sh, prio, sent);
+        budget -= sent;
+        c->deficit -= sent;
+        if (channel_buffered(c) == 0) {
+            TAILQ_REMOVE(runq, c, sched_link);
+            c->scheduled = false;
+            c->has_turn = false;
+            c->deficit = 0;
+        } else if (c->deficit == 0) {
+            TAILQ_REMOVE(runq, c, sched_link);
+            TAILQ_INSERT_TAIL(runq, c, sched_link);
+            c->has_turn = false;
+        }
+    }
+
+    runq_move(&stuck, runq);
+    runq_move(runq, &stuck);
+    return room_p;
+}
+
+// Move channel data into TO_PEER.  Priority classes are served
+// strictly in order, so keystrokes don't queue behind bulk data,
+// except that a class that has waited through SCHED_STARVE_FRAMES
+// full frames from the classes above it first gets to send one
+// frame.  A busy interactive channel thus can't shut out a bulk
+// transfer entirely.
+static void
+xmit_scheduled_data(struct fb_adb_sh* sh)
+{
+    size_t starve_limit = SCHED_STARVE_FRAMES * sh->max_outgoing_msg;
+    for (unsigned prio = 1; prio < NR_CHANNEL_PRIO; ++prio) {
+        if (TAILQ_EMPTY(&sh->runq[prio]))
+            sh->starved[prio] = 0;
+        else if (sh->starved[prio] >= starve_limit &&
+                 !xmit_class(sh, prio, sh->max_outgoing_msg))
+            return;
+    }
+
+    for (unsigned prio = 0; prio < NR_CHANNEL_PRIO; ++prio)
+        if (!xmit_class(sh, prio, SIZE_MAX))
+            return;
+}
+
+// Anything still on a run queue after xmit_scheduled_data is waiting
+// for room in TO_PEER, as is a blocked control queue.
+static void
+note_to_peer_stalls(struct fb_adb_sh* sh, bool control_blocked)
+{
+    bool full = control_blocked;
+    for (unsigned prio = 0; prio < NR_CHANNEL_PRIO; ++prio) {
+        struct channel* c;
+        TAILQ_FOREACH(c, &sh->runq[prio], sched_link) {
+            stall_note(&c->stats.to_peer_blocked, true);
+            full = true;
+        }
+    }
+
+    stall_note(&sh->to_peer_full, full);
+}
+
+// Move whole messages from the control queue to TO_PEER.  Return
+// true if the control queue is now empty.
+static bool
+flush_control_queue(struct fb_adb_sh* sh)
+{
+    struct ringbuf* ctlq = sh->ctlq;
+    struct msg mhdr;
+
+    while (ringbuf_size(ctlq) > 0) {
+        ringbuf_copy_out(ctlq, &mhdr, sizeof (mhdr));
+        if (fb_adb_maxoutmsg(sh) < mhdr.size)
+            return false;
+
+        struct iovec iov[2];
+        ringbuf_readable_iov(ctlq, iov, mhdr.size);
+        to_peer_write(sh, iov, ARRAYSIZE(iov));
+        ringbuf_note_removed(ctlq, mhdr.size);
+    }
+
+    return true;
+}
+
 static void
 xmit_eof(struct channel* c,
          unsigned chno,
@@ -224,7 +570,7 @@ xmit_eof(struct channel* c,
 
     if (c->fdh == NULL &&
         c->sent_eof == false &&
-        ringbuf_size(c->rb) == 0 &&
+        channel_buffered(c) == 0 &&
         fb_adb_maxoutmsg(sh) >= sizeof (m))
     {
         memset(&m, 0, sizeof (m));
@@ -232,7 +578,7 @@ xmit_eof(struct channel* c,
         m.msg.size = sizeof (m);
         m.channel = chno;
         dbgmsg(&m.msg, "send");
-        channel_write(sh->ch[TO_PEER], &(struct iovec){&m, sizeof (m)}, 1);
+        to_peer_write(sh, &(struct iovec){&m, sizeof (m)}, 1);
         c->sent_eof = true;
     }
 }
@@ -242,7 +588,7 @@ do_pending_close(struct channel* c)
 {
     if (c->dir == CHANNEL_TO_FD &&
         c->fdh != NULL &&
-        ringbuf_size(c->rb) == 0 &&
+        channel_buffered(c) == 0 &&
         c->pending_close)
     {
         channel_close(c);
@@ -255,37 +601,230 @@ io_loop_init(struct fb_adb_sh* sh)
     struct channel** ch = sh->ch;
     unsigned nrch = sh->nrch;
     unsigned chno;
-    for (chno = 0; chno < nrch; ++chno)
-        if (ch[chno]->fdh != NULL)
-            fd_set_blocking_mode(ch[chno]->fdh->fd, non_blocking);
+
+    TAILQ_INIT(&sh->dirty);
+    TAILQ_INIT(&sh->held);
+    for (unsigned prio = 0; prio < NR_CHANNEL_PRIO; ++prio) {
+        TAILQ_INIT(&sh->runq[prio]);
+        sh->starved[prio] = 0;
+    }
+
+    sh->start_ns = monotonic_ns();
+
+    sh->ctlq = ringbuf_new(sh->max_outgoing_msg);
+
+    // If we can hand TO_PEER's fd bytes unchanged, let channels that
+    // read from pipes splice bulk data to it without copying.
+    // FB_ADB_NO_SPLICE turns this off so that fb-adb bench can
+    // measure the difference; a local stub inherits it from us.
+    bool splice_ok = (ch[TO_PEER] != NULL &&
+                      channel_can_splice(ch[TO_PEER]) &&
+                      getenv("FB_ADB_NO_SPLICE") == NULL);
+
+    for (chno = 0; chno < nrch; ++chno) {
+        struct channel* c = ch[chno];
+        ch[chno] = NULL;
+        if (c == NULL)
+            continue;
+
+        if (splice_ok &&
+            chno > NR_SPECIAL_CH &&
+            c->dir == CHANNEL_FROM_FD &&
+            channel_can_splice(c))
+        {
+            c->splice_p = true;
+        }
+
+        io_loop_add_channel(sh, chno, c);
+    }
 }
 
+// Install C as channel CHNO of a running session.  The slot must
+// be empty.
 void
-io_loop_do_io(struct fb_adb_sh* sh)
+io_loop_add_channel(struct fb_adb_sh* sh,
+                    unsigned chno,
+                    struct channel* c)
 {
-    SCOPED_RESLIST(rl);
-    dbgch("before io_loop_do_io", sh->ch, sh->nrch);
+    assert(chno < sh->nrch);
+    assert(sh->ch[chno] == NULL);
+    sh->ch[chno] = c;
+    c->chno = chno;
+    c->dirty_list = &sh->dirty;
+    c->held_list = &sh->held;
+    channel_mark_dirty(c);
+    if (c->fdh != NULL) {
+        fd_set_blocking_mode(c->fdh->fd, non_blocking);
+
+        // Regular files never make us wait, so io_loop_do_io doesn't
+        // bother polling them.  Output to one goes out in as few
+        // writes as we can manage: we buffer everything the pump
+        // produces and write it all the next time around.
+        struct stat st;
+        if (fstat(c->fdh->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            c->regular_file = true;
+            if (c->dir == CHANNEL_TO_FD)
+                c->always_buffer = true;
+        }
+    }
+}
 
+// Forget channel CHNO, which must not have an IO thread.  Messages
+// that arrive for the empty slot afterward are dropped.  The caller
+// owns the channel's memory.
+void
+io_loop_remove_channel(struct fb_adb_sh* sh, unsigned chno)
+{
+    struct channel* c = sh->ch[chno];
+    assert(c != NULL && c->iot == NULL);
+    if (c->dirty) {
+        TAILQ_REMOVE(&sh->dirty, c, dirty_link);
+        c->dirty = false;
+    }
+
+    if (c->scheduled) {
+        TAILQ_REMOVE(&sh->runq[c->prio], c, sched_link);
+        c->scheduled = false;
+    }
+
+    if (c->held) {
+        TAILQ_REMOVE(&sh->held, c, held_link);
+        c->held = false;
+    }
+
+    c->dirty_list = NULL;
+    c->held_list = NULL;
+    sh->ch[chno] = NULL;
+}
+
+unsigned
+io_loop_nr_polls(const struct fb_adb_sh* sh)
+{
+    return sh->nrch + (sh->fwd ? fwd_nr_polls(sh->fwd) : 0);
+}
+
+short
+io_loop_request_poll(struct fb_adb_sh* sh,
+                     struct pollfd* polls,
+                     uint64_t* deadline_ns)
+{
     struct channel** ch = sh->ch;
     unsigned nrch = sh->nrch;
-    struct pollfd polls[nrch];
     short work = 0;
+    bool ready_now = false;
     for (unsigned chno = 0; chno < nrch; ++chno) {
-        polls[chno] = channel_request_poll(ch[chno]);
+        polls[chno] = (ch[chno] != NULL
+                       ? channel_request_poll(ch[chno])
+                       : (struct pollfd){-1, 0, 0});
         work |= polls[chno].events;
-    }
 
-    if (work != 0) {
-        if (ppoll(polls, nrch, NULL, sh->poll_mask) < 0
-            && errno != EINTR)
+        // Keep regular files out of the poll set, but don't sleep if
+        // one of them has work: we can do it right away.
+        if (polls[chno].events != 0 &&
+            ch[chno]->regular_file &&
+            ch[chno]->iot == NULL)
         {
-            die_errno("poll");
+            polls[chno].fd = -1;
+            ready_now = true;
         }
     }
 
-    for (unsigned chno = 0; chno < nrch; ++chno)
+    if (sh->fwd != NULL)
+        work |= fwd_request_poll(sh, &polls[nrch]);
+
+    // If we're holding data for coalescing, wake up in time to send
+    // it even if nothing else happens.
+    *deadline_ns = UINT64_MAX;
+    if (sh->coalesce_deadline_ns != 0)
+        *deadline_ns = sh->coalesce_deadline_ns;
+
+    if (ready_now)
+        *deadline_ns = 0;
+
+    return work;
+}
+
+void
+io_loop_handle_poll(struct fb_adb_sh* sh, struct pollfd* polls)
+{
+    struct channel** ch = sh->ch;
+    unsigned nrch = sh->nrch;
+    for (unsigned chno = 0; chno < nrch; ++chno) {
+        if (polls[chno].fd == -1 && polls[chno].events != 0)
+            polls[chno].revents = polls[chno].events;
+
         if (polls[chno].revents != 0)
             channel_poll(ch[chno]);
+    }
+
+    // Accepting connections can grow the channel table, so do it
+    // only after we're done with CH.
+    if (sh->fwd != NULL)
+        fwd_poll(sh, &polls[nrch]);
+}
+
+void
+io_loop_do_io(struct fb_adb_sh* sh)
+{
+    SCOPED_RESLIST(rl);
+    dbgch("before io_loop_do_io", sh->ch, sh->nrch);
+
+    unsigned nr_polls = io_loop_nr_polls(sh);
+    struct pollfd polls[nr_polls];
+    uint64_t deadline_ns;
+    short work = io_loop_request_poll(sh, polls, &deadline_ns);
+
+    struct timespec timeout;
+    struct timespec* timeoutp = NULL;
+    if (deadline_ns != UINT64_MAX) {
+        uint64_t now = monotonic_ns();
+        uint64_t wait_ns = (deadline_ns > now ? deadline_ns - now : 0);
+        timeout.tv_sec = wait_ns / 1000000000;
+        timeout.tv_nsec = wait_ns % 1000000000;
+        timeoutp = &timeout;
+    }
+
+    if (work != 0 || timeoutp != NULL) {
+        trace(TRACE_POLL_SLEEP,
+              nr_polls,
+              (timeoutp != NULL
+               ? XMIN(timeoutp->tv_sec * 1000000 + timeoutp->tv_nsec / 1000,
+                      UINT32_MAX - 1)
+               : UINT32_MAX),
+              0);
+        int ret = ppoll(polls, nr_polls, timeoutp, sh->poll_mask);
+        trace(TRACE_POLL_WAKE, ret, ret < 0 ? errno : 0, 0);
+        if (ret < 0 && errno != EINTR)
+            die_errno("poll");
+    }
+
+    if (stats_dump_requested)
+        stats_dump(sh, "signal");
+
+    io_loop_handle_poll(sh, polls);
+}
+
+// Does C still have work for io_loop_pump to do?  Channels stay on
+// the dirty list until the answer is no, so a channel we couldn't
+// service fully (say, because TO_PEER was full) gets another look
+// next time.
+static bool
+channel_needs_pump(struct channel* c)
+{
+    if (c->bytes_written > 0)
+        return true;
+
+    if (c->chno > NR_SPECIAL_CH &&
+        c->dir == CHANNEL_FROM_FD &&
+        channel_buffered(c) > 0)
+    {
+        return true;
+    }
+
+    if (c->dir == CHANNEL_TO_FD && c->fdh != NULL && c->pending_close)
+        return true;
+
+    return c->fdh == NULL && c->sent_eof == false;
 }
 
 void
@@ -294,32 +833,93 @@ io_loop_pump(struct fb_adb_sh* sh)
     SCOPED_RESLIST(rl);
 
     struct channel** ch = sh->ch;
-    unsigned chno;
-    unsigned nrch = sh->nrch;
-    assert(nrch >= NR_SPECIAL_CH);
+    struct channel* c;
+    assert(sh->nrch >= NR_SPECIAL_CH);
+
+    // Catch IO that io_loop_do_io just did before we do any more.
+    if (sh->echo != NULL)
+        stats_note_echo(sh);
+    if (sh->pipeline != NULL)
+        pipeline_note(sh);
 
     struct msg mhdr;
-    while (detect_msg(ch[FROM_PEER]->rb, &mhdr))
+    relieve_from_peer(sh);
+    while (detect_msg(ch[FROM_PEER]->rb, &mhdr)) {
+        ch[FROM_PEER]->stats.frames += 1;
+        if (trace_enabled)
+            trace_recv(ch[FROM_PEER]->rb, mhdr);
         sh->process_msg(sh, mhdr);
+        relieve_from_peer(sh);
+    }
 
-    for (chno = 0; chno < nrch; ++chno)
-        xmit_acks(ch[chno], chno, sh);
+    // Control traffic goes first.  If any of it is stuck, don't let
+    // channel data get ahead of it in TO_PEER.
+    bool control_blocked = !flush_control_queue(sh);
+    sh->coalesce_deadline_ns = 0;
 
-    for (chno = 0; chno < nrch; ++chno) {
-        if (chno > NR_SPECIAL_CH)
-            xmit_data(ch[chno], chno, sh);
+    TAILQ_FOREACH(c, &sh->dirty, dirty_link) {
+        if (!xmit_acks(c, c->chno, sh))
+            control_blocked = true;
 
-        do_pending_close(ch[chno]);
-        xmit_eof(ch[chno], chno, sh);
+        channel_note_stalls(c);
+        sched_add(sh, c);
     }
+
+    if (!control_blocked)
+        xmit_scheduled_data(sh);
+
+    note_to_peer_stalls(sh, control_blocked);
+
+    TAILQ_FOREACH(c, &sh->dirty, dirty_link) {
+        do_pending_close(c);
+        xmit_eof(c, c->chno, sh);
+    }
+
+    struct channel* next;
+    for (c = TAILQ_FIRST(&sh->dirty); c != NULL; c = next) {
+        next = TAILQ_NEXT(c, dirty_link);
+        if (!channel_needs_pump(c)) {
+            TAILQ_REMOVE(&sh->dirty, c, dirty_link);
+            c->dirty = false;
+        }
+    }
+
+    if (sh->fwd != NULL)
+        fwd_pump(sh);
+
+    if (sh->echo != NULL)
+        stats_note_echo(sh);
+    if (sh->pipeline != NULL)
+        pipeline_note(sh);
 }
 
+// Send a control message ahead of any channel data we haven't yet
+// queued.  Return once the message is in TO_PEER.
 void
 queue_message_synch(struct fb_adb_sh* sh, struct msg* m)
 {
-    PUMP_WHILE(sh, fb_adb_maxoutmsg(sh) < m->size);
+    if (m->size > ringbuf_capacity(sh->ctlq))
+        die(EINVAL, "control message too large");
+
+    PUMP_WHILE(sh, ringbuf_room(sh->ctlq) < m->size);
     dbgmsg(m, "send[synch]");
-    channel_write(sh->ch[TO_PEER], &(struct iovec){m, m->size}, 1);
+    ringbuf_copy_in(sh->ctlq, m, m->size);
+    ringbuf_note_added(sh->ctlq, m->size);
+    PUMP_WHILE(sh, ringbuf_size(sh->ctlq) > 0);
+}
+
+// Write M straight to TO_PEER if it fits there now, bypassing the
+// control queue.  Unlike queue_message_synch, safe to call from
+// inside the pump.  Return false if there's no room.
+bool
+send_message_now(struct fb_adb_sh* sh, struct msg* m)
+{
+    if (fb_adb_maxoutmsg(sh) < m->size)
+        return false;
+
+    dbgmsg(m, "send");
+    to_peer_write(sh, &(struct iovec){m, m->size}, 1);
+    return true;
 }
 
 struct msg*
@@ -14,8 +14,7 @@
 #include <signal.h>
 #include "util.h"
 #include "proto.h"
-
-struct channel;
+#include "channel.h"
 
 enum channel_names {
     FROM_PEER,
@@ -23,18 +22,54 @@ enum channel_names {
     NR_SPECIAL_CH = TO_PEER
 };
 
+struct fwd;
+struct echo_latency;
+struct pipeline;
+struct pollfd;
+
 struct fb_adb_sh {
     sigset_t* poll_mask;
     size_t max_outgoing_msg;
     unsigned nrch;
     struct channel** ch;
+    struct channel_list dirty;
+    struct channel_list held;
+    struct channel_list runq[NR_CHANNEL_PRIO];
+    size_t starved[NR_CHANNEL_PRIO]; // Bytes sent over our heads
+    struct ringbuf* ctlq;
+    uint64_t coalesce_delay_ns;
+    size_t coalesce_bytes;
+    uint64_t coalesce_deadline_ns;
     void (*process_msg)(struct fb_adb_sh* sh, struct msg mhdr);
+    struct fwd* fwd;
+    uint64_t start_ns;
+    struct stall to_peer_full;
+    struct echo_latency* echo;
+    struct pipeline* pipeline;
 };
 
 void queue_message_synch(struct fb_adb_sh* sh, struct msg* m);
+bool send_message_now(struct fb_adb_sh* sh, struct msg* m);
 void io_loop_init(struct fb_adb_sh* sh);
+void io_loop_add_channel(struct fb_adb_sh* sh,
+                         unsigned chno,
+                         struct channel* c);
+void io_loop_remove_channel(struct fb_adb_sh* sh, unsigned chno);
 void io_loop_pump(struct fb_adb_sh* sh);
 void io_loop_do_io(struct fb_adb_sh* sh);
+
+// io_loop_do_io in pieces, for callers that wait on several
+// sessions at once.  io_loop_request_poll fills in
+// io_loop_nr_polls(SH) entries of POLLS and sets *DEADLINE_NS to the
+// monotonic time by which io_loop_handle_poll must run even if none
+// of them fires (0 for right away, UINT64_MAX for never).  It
+// returns the union of the events requested; if that's zero and
+// there's no deadline, SH has nothing to wait for.
+unsigned io_loop_nr_polls(const struct fb_adb_sh* sh);
+short io_loop_request_poll(struct fb_adb_sh* sh,
+                           struct pollfd* polls,
+                           uint64_t* deadline_ns);
+void io_loop_handle_poll(struct fb_adb_sh* sh, struct pollfd* polls);
 void fb_adb_sh_process_msg(struct fb_adb_sh* sh, struct msg mhdr);
 
 void read_cmdmsg(struct fb_adb_sh* sh,
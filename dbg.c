@@ -188,6 +188,43 @@ dbgmsg(struct msg* msg, const char* tag)
             dbg("%s MSG_CHILD_EXIT status=%u", tag, m->exit_status);
             break;
         }
+        case MSG_STUB_TIMING: {
+            dbg("%s MSG_STUB_TIMING nr_phases=%zu",
+                tag, (msg->size - sizeof (struct msg_stub_timing)) /
+                sizeof (struct timing_phase));
+            break;
+        }
+        case MSG_STUB_TRACE: {
+            struct msg_stub_trace* m = (void*) msg;
+            dbg("%s MSG_STUB_TRACE pid=%u nr_events=%zu",
+                tag, m->pid, (msg->size - sizeof (*m)) /
+                sizeof (struct trace_event));
+            break;
+        }
+        case MSG_STUB_PIPELINE: {
+            dbg("%s MSG_STUB_PIPELINE nr_samples=%zu",
+                tag, (msg->size - sizeof (struct msg_stub_pipeline)) /
+                sizeof (struct pipeline_sample));
+            break;
+        }
+        case MSG_FILE_INFO: {
+            struct msg_file_info* m = (void*) msg;
+            dbg("%s MSG_FILE_INFO size=%ju directory_p=%d",
+                tag, (uintmax_t) m->size, (int) m->directory_p);
+            break;
+        }
+        case MSG_FWD_OPEN: {
+            struct msg_fwd_open* m = (void*) msg;
+            dbg("%s MSG_FWD_OPEN ch=%u id=%u target=%.*s",
+                tag, m->channel, m->id,
+                (int) (m->msg.size - sizeof (*m)), m->target);
+            break;
+        }
+        case MSG_FWD_RELEASE: {
+            struct msg_fwd_release* m = (void*) msg;
+            dbg("%s MSG_FWD_RELEASE ch=%u", tag, m->channel);
+            break;
+        }
         default: {
             dbg("%s MSG_??? type=%d sz=%d", tag, msg->type, msg->size);
             break;
@@ -224,6 +261,9 @@ dbgch(const char* label, struct channel** ch, unsigned nrch)
 
     for (chno = 0; chno < nrch; ++chno) {
         struct channel* c = ch[chno];
+        if (c == NULL)
+            continue;
+
         struct pollfd p = channel_request_poll(ch[chno]);
         const char* pev;
         switch (p.events) {
@@ -244,7 +284,7 @@ dbgch(const char* label, struct channel** ch, unsigned nrch)
                 break;
         }
 
-        assert(p.fd == -1 || p.fd == c->fdh->fd);
+        assert(p.fd == -1 || c->iot != NULL || p.fd == c->fdh->fd);
 
         dbg("  %-18s size:%-4zu room:%-4zu window:%-4d %s%-2s %p %s",
             xaprintf("ch[%d=%s]", chno, chname(chno)),
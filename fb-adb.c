@@ -21,6 +21,24 @@
 extern int stub_main(int, const char**);
 extern int shex_main(int, const char**);
 extern int shex_main_rcmd(int, const char**);
+extern int shex_main_push(int, const char**);
+extern int shex_main_pull(int, const char**);
+extern int shex_main_sync(int, const char**);
+extern bool shex_push_args_p(int, const char**);
+extern bool shex_pull_args_p(int, const char**);
+extern bool shex_sync_args_p(int, const char**);
+extern int shex_main_batch(int, const char**);
+extern int batch_runner_main(int, const char**);
+extern int sync_sender_main(int, const char**);
+extern int sync_receiver_main(int, const char**);
+#ifndef BUILD_STUB
+extern int multi_main(int, const char**);
+extern int batch_main(int, const char**);
+extern int link_emulator_main(int, const char**);
+extern int adb_emulator_main(int, const char**);
+extern int bench_main(int, const char**);
+extern int trace_decode_main(int, const char**);
+#endif
 
 __attribute__((noreturn))
 static void
@@ -34,6 +52,31 @@ usage(void)
            prgname);
     printf("    using the shell.\n");
     printf("\n");
+    printf("  %s push LOCAL REMOTE - Copy a file to the device.\n",
+           prgname);
+    printf("\n");
+    printf("  %s pull REMOTE LOCAL - Copy a file or tree from the device.\n",
+           prgname);
+    printf("\n");
+    printf("  %s sync LOCAL REMOTE - Update a tree on the device,\n",
+           prgname);
+    printf("    sending only what changed.\n");
+    printf("\n");
+    printf("  %s multi -s SERIAL... CMD [ARGS...] - Run a shell command\n",
+           prgname);
+    printf("    on many devices at once.\n");
+    printf("\n");
+    printf("  %s batch [FILE] - Run shell commands listed one per line\n",
+           prgname);
+    printf("    over a single session.\n");
+    printf("\n");
+    printf("  %s bench - Measure session throughput on this machine.\n",
+           prgname);
+    printf("\n");
+    printf("  %s trace-decode FILE... - Print fb-adb traces (see\n",
+           prgname);
+    printf("    --trace) as one timeline.\n");
+    printf("\n");
     printf("  Other commands forward to adb. See below.\n");
     printf("\n");
     fflush(stdout);
@@ -109,6 +152,28 @@ real_main(int argc, char** argv)
     int (*sub_main)(int, const char**) = NULL;
     if (!strcmp(prgarg, "stub")) {
         sub_main = stub_main;
+    } else if (!strcmp(prgarg, "sync-sender")) {
+        sub_main = sync_sender_main;
+    } else if (!strcmp(prgarg, "sync-receiver")) {
+        sub_main = sync_receiver_main;
+    } else if (!strcmp(prgarg, "batch-session")) {
+        sub_main = shex_main_batch;
+    } else if (!strcmp(prgarg, "batch-runner")) {
+        sub_main = batch_runner_main;
+#ifndef BUILD_STUB
+    } else if (!strcmp(prgarg, "link-emulator")) {
+        sub_main = link_emulator_main;
+    } else if (!strcmp(prgarg, "adb-emulator")) {
+        sub_main = adb_emulator_main;
+    } else if (!strcmp(prgarg, "bench")) {
+        sub_main = bench_main;
+    } else if (!strcmp(prgarg, "trace-decode")) {
+        sub_main = trace_decode_main;
+    } else if (!strcmp(prgarg, "multi")) {
+        sub_main = multi_main;
+    } else if (!strcmp(prgarg, "batch")) {
+        sub_main = batch_main;
+#endif
     } else if (!strcmp(prgarg, "shellx") || !strcmp(prgarg, "sh")) {
         sub_main = shex_main;
     } else if (!strcmp(prgarg, "shell") &&
@@ -117,6 +182,24 @@ real_main(int argc, char** argv)
         sub_main = shex_main;
     } else if (!strcmp(prgarg, "rcmd")) {
         sub_main = shex_main_rcmd;
+    } else if (!strcmp(prgarg, "push") &&
+               !getenv("ADB_PUSH_PULL_OLD_BEHAVIOR") &&
+               shex_push_args_p(argc - non_adb_off,
+                                (const char**) &argv[non_adb_off]))
+    {
+        sub_main = shex_main_push;
+    } else if (!strcmp(prgarg, "pull") &&
+               !getenv("ADB_PUSH_PULL_OLD_BEHAVIOR") &&
+               shex_pull_args_p(argc - non_adb_off,
+                                (const char**) &argv[non_adb_off]))
+    {
+        sub_main = shex_main_pull;
+    } else if (!strcmp(prgarg, "sync") &&
+               !getenv("ADB_PUSH_PULL_OLD_BEHAVIOR") &&
+               shex_sync_args_p(argc - non_adb_off,
+                                (const char**) &argv[non_adb_off]))
+    {
+        sub_main = shex_main_sync;
     } else if (!strcmp(prgarg, "help") ||
                !strcmp(prgarg, "-h") ||
                !strcmp(prgarg, "--help"))
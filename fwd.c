@@ -0,0 +1,651 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include "fwd.h"
+#include "util.h"
+#include "core.h"
+#include "channel.h"
+#include "ringbuf.h"
+#include "constants.h"
+
+struct fwd_listener {
+    int fd;
+    uint32_t id;
+    const char* target;         // Host: where the stub connects
+};
+
+struct fwd_reverse {
+    const char* spec;           // Where the stub listens
+    const char* target;         // Where we connect
+};
+
+struct fwd_pair {
+    struct reslist* rl;         // Owns the channels; NULL if free
+    bool opener_p;
+    bool released_p;            // Opener: peer is done with it
+};
+
+struct fwd {
+    struct reslist* rl;
+    bool host_p;
+    struct fwd_listener* listeners;
+    unsigned nr_listeners;
+    struct fwd_reverse* reverse;
+    unsigned nr_reverse;
+    struct fwd_pair* pairs;
+    unsigned nr_pairs;
+    unsigned nr_open;
+    unsigned first_channel;
+};
+
+__attribute__((noreturn,format(printf,1,2)))
+static void
+fwd_proto_error(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    die(ECOMM, "protocol error: %s", xavprintf(fmt, args));
+}
+
+struct fwd*
+fwd_new(bool host_p)
+{
+    struct reslist* rl = reslist_push_new();
+    struct fwd* fwd = xcalloc(sizeof (*fwd));
+    reslist_pop_nodestroy(rl);
+    fwd->rl = rl;
+    fwd->host_p = host_p;
+    return fwd;
+}
+
+// Allocate zeroed memory that lives as long as FWD does.  We get
+// here from inside the io loop, whose scratch allocations don't
+// survive an iteration.
+static void*
+fwd_alloc(struct fwd* fwd, size_t sz)
+{
+    SCOPED_RESLIST(rl_alloc);
+    void* p = xcalloc(sz);
+    reslist_xfer(fwd->rl, rl_alloc);
+    return p;
+}
+
+// Copy OLD into a bigger array.  The old array stays around until
+// the session ends: callers (like the users of sh->ch) may still be
+// holding it, and since tables at least double, the waste is small.
+static void*
+fwd_grow(struct fwd* fwd, const void* old, size_t oldsz, size_t newsz)
+{
+    void* p = fwd_alloc(fwd, newsz);
+    if (oldsz > 0)
+        memcpy(p, old, oldsz);
+    return p;
+}
+
+static void
+fwd_parse_spec(const char* spec,
+               struct sockaddr_storage* ss,
+               socklen_t* sslen)
+{
+    memset(ss, 0, sizeof (*ss));
+    if (strlen(spec) >= FWD_SPEC_MAX)
+        die(EINVAL, "forwarding endpoint too long: \"%s\"", spec);
+
+    if (!strncmp(spec, "tcp:", strlen("tcp:"))) {
+        const char* portstr = spec + strlen("tcp:");
+        char* end;
+        unsigned long port = strtoul(portstr, &end, 10);
+        if (*portstr == '\0' || *end != '\0' || port == 0 || port > 65535)
+            die(EINVAL, "invalid TCP port in \"%s\"", spec);
+
+        struct sockaddr_in* sin = (struct sockaddr_in*) ss;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        *sslen = sizeof (*sin);
+    } else if (!strncmp(spec, "localabstract:", strlen("localabstract:"))) {
+        const char* name = spec + strlen("localabstract:");
+        struct sockaddr_un* sun = (struct sockaddr_un*) ss;
+        size_t namesz = strlen(name);
+        if (namesz == 0 || namesz >= sizeof (sun->sun_path))
+            die(EINVAL, "invalid socket name in \"%s\"", spec);
+
+        sun->sun_family = AF_UNIX;
+        memcpy(&sun->sun_path[1], name, namesz);
+        *sslen = offsetof(struct sockaddr_un, sun_path) + 1 + namesz;
+    } else {
+        die(EINVAL,
+            "unsupported forwarding endpoint \"%s\": "
+            "use tcp:PORT or localabstract:NAME",
+            spec);
+    }
+}
+
+static int
+fwd_socket(int family)
+{
+    struct cleanup* cl = cleanup_allocate();
+    int s = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s == -1)
+        die_errno("socket");
+
+    cleanup_commit_close_fd(cl, s);
+    return s;
+}
+
+int
+fwd_endpoint_listen(const char* spec)
+{
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    fwd_parse_spec(spec, &ss, &sslen);
+    int s = fwd_socket(ss.ss_family);
+    if (ss.ss_family == AF_INET) {
+        int on = 1;
+        if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on)) == -1)
+            die_errno("setsockopt");
+    }
+
+    if (bind(s, (struct sockaddr*) &ss, sslen) == -1)
+        die_errno("bind(\"%s\")", spec);
+
+    if (listen(s, SOMAXCONN) == -1)
+        die_errno("listen(\"%s\")", spec);
+
+    return s;
+}
+
+int
+fwd_endpoint_connect(const char* spec)
+{
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    fwd_parse_spec(spec, &ss, &sslen);
+    int s = fwd_socket(ss.ss_family);
+    // Endpoints are local, so connect doesn't block long.
+    if (connect(s, (struct sockaddr*) &ss, sslen) == -1)
+        die_errno("connect(\"%s\")", spec);
+
+    return s;
+}
+
+static void
+fwd_add_listener(struct fwd* fwd,
+                 const char* spec,
+                 uint32_t id,
+                 const char* target)
+{
+    SCOPED_RESLIST(rl_listener);
+
+    int s = fwd_endpoint_listen(spec);
+    fd_set_blocking_mode(s, non_blocking);
+
+    unsigned n = fwd->nr_listeners;
+    fwd->listeners = fwd_grow(fwd,
+                              fwd->listeners,
+                              n * sizeof (*fwd->listeners),
+                              (n + 1) * sizeof (*fwd->listeners));
+    fwd->listeners[n].fd = s;
+    fwd->listeners[n].id = id;
+    fwd->listeners[n].target = target;
+    fwd->nr_listeners = n + 1;
+    reslist_xfer(fwd->rl, rl_listener);
+}
+
+// Split LOCAL=REMOTE at the first '=' and check both halves.
+static void
+fwd_split_arg(struct fwd* fwd,
+              const char* arg,
+              const char** first,
+              const char** second)
+{
+    const char* eq = strchr(arg, '=');
+    if (eq == NULL)
+        die(EINVAL, "forwarding spec \"%s\" lacks '='", arg);
+
+    char* f = fwd_alloc(fwd, eq - arg + 1);
+    memcpy(f, arg, eq - arg);
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    fwd_parse_spec(f, &ss, &sslen);
+    fwd_parse_spec(eq + 1, &ss, &sslen);
+    *first = f;
+    *second = eq + 1;
+}
+
+void
+fwd_add_forward(struct fwd* fwd, const char* arg)
+{
+    assert(fwd->host_p);
+    const char* local;
+    const char* remote;
+    fwd_split_arg(fwd, arg, &local, &remote);
+    fwd_add_listener(fwd, local, 0, remote);
+}
+
+void
+fwd_add_reverse(struct fwd* fwd, const char* arg)
+{
+    assert(fwd->host_p);
+    unsigned n = fwd->nr_reverse;
+    struct fwd_reverse r;
+    fwd_split_arg(fwd, arg, &r.spec, &r.target);
+    fwd->reverse = fwd_grow(fwd,
+                            fwd->reverse,
+                            n * sizeof (*fwd->reverse),
+                            (n + 1) * sizeof (*fwd->reverse));
+    fwd->reverse[n] = r;
+    fwd->nr_reverse = n + 1;
+}
+
+void
+fwd_start(struct fb_adb_sh* sh)
+{
+    SCOPED_RESLIST(rl_start);
+    struct fwd* fwd = sh->fwd;
+    fwd->first_channel = sh->nrch;
+
+    for (unsigned id = 0; id < fwd->nr_reverse; ++id) {
+        size_t specsz = strlen(fwd->reverse[id].spec);
+        struct msg_fwd_listen* m = xcalloc(sizeof (*m) + specsz);
+        m->msg.type = MSG_FWD_LISTEN;
+        m->msg.size = sizeof (*m) + specsz;
+        m->id = id;
+        memcpy(m->spec, fwd->reverse[id].spec, specsz);
+        queue_message_synch(sh, &m->msg);
+    }
+}
+
+static unsigned
+fwd_pair_base(const struct fwd* fwd, unsigned p)
+{
+    return fwd->first_channel + 2 * p;
+}
+
+// Make room for pair P in both our table and the session's channel
+// table.
+static void
+fwd_reserve_pair(struct fb_adb_sh* sh, unsigned p)
+{
+    struct fwd* fwd = sh->fwd;
+    if (p < fwd->nr_pairs)
+        return;
+
+    unsigned nr_pairs = XMAX(p + 1, 2 * fwd->nr_pairs);
+    fwd->pairs = fwd_grow(fwd,
+                          fwd->pairs,
+                          fwd->nr_pairs * sizeof (*fwd->pairs),
+                          nr_pairs * sizeof (*fwd->pairs));
+    fwd->nr_pairs = nr_pairs;
+
+    unsigned nrch = fwd_pair_base(fwd, nr_pairs);
+    if (sh->nrch < nrch) {
+        sh->ch = fwd_grow(fwd,
+                          sh->ch,
+                          sh->nrch * sizeof (*sh->ch),
+                          nrch * sizeof (*sh->ch));
+        sh->nrch = nrch;
+    }
+}
+
+// Create the channels for pair P around socket S, or around nothing
+// if S is -1, in which case the peer just sees both directions
+// close.  Channel BASE carries data from the opener to the
+// connecting side; BASE+1 carries data the other way.
+static void
+fwd_install_pair(struct fb_adb_sh* sh, unsigned p, bool opener_p, int s)
+{
+    struct fwd* fwd = sh->fwd;
+    fwd_reserve_pair(sh, p);
+    struct fwd_pair* pair = &fwd->pairs[p];
+    assert(pair->rl == NULL);
+
+    SCOPED_RESLIST(rl_pair_alloc);
+    struct reslist* rl = reslist_push_new();
+    struct channel* c[2];
+    for (int i = 0; i < 2; ++i) {
+        bool from_fd = ((i == 0) == opener_p);
+        c[i] = channel_new(s != -1 ? fdh_dup(s) : NULL,
+                           FWD_BUFSZ,
+                           from_fd ? CHANNEL_FROM_FD : CHANNEL_TO_FD);
+        if (from_fd) {
+            // The peer's buffer is the same size as ours, so assume
+            // the window it would grant us.
+            c[i]->track_window = true;
+            c[i]->window = ringbuf_room(c[i]->rb);
+        } else {
+            c[i]->track_bytes_written = true;
+            c[i]->shutdown_on_close = true;
+        }
+    }
+
+    reslist_pop_nodestroy(rl);
+    reslist_xfer(fwd->rl, rl_pair_alloc);
+
+    pair->rl = rl;
+    pair->opener_p = opener_p;
+    pair->released_p = false;
+    fwd->nr_open += 1;
+
+    unsigned base = fwd_pair_base(fwd, p);
+    io_loop_add_channel(sh, base, c[0]);
+    io_loop_add_channel(sh, base + 1, c[1]);
+}
+
+static void
+fwd_destroy_pair(struct fb_adb_sh* sh, unsigned p)
+{
+    struct fwd* fwd = sh->fwd;
+    struct fwd_pair* pair = &fwd->pairs[p];
+    unsigned base = fwd_pair_base(fwd, p);
+    io_loop_remove_channel(sh, base);
+    io_loop_remove_channel(sh, base + 1);
+    reslist_destroy(pair->rl);
+    pair->rl = NULL;
+    fwd->nr_open -= 1;
+}
+
+// Find the pair that the peer's message names by CHNO.
+static unsigned
+fwd_peer_pair(struct fb_adb_sh* sh, uint32_t chno, bool peer_opened_p)
+{
+    struct fwd* fwd = sh->fwd;
+    if (chno < fwd->first_channel || (chno - fwd->first_channel) % 2 != 0)
+        fwd_proto_error("bad forwarding channel %u", chno);
+
+    unsigned p = (chno - fwd->first_channel) / 2;
+    if (p >= 2 * FWD_MAX_CONNECTIONS)
+        fwd_proto_error("too many forwarded connections");
+
+    bool ours_p = ((p % 2 == 0) == fwd->host_p);
+    if (ours_p == peer_opened_p)
+        fwd_proto_error("forwarding channel %u opened by wrong side", chno);
+
+    return p;
+}
+
+struct fwd_connect_info {
+    const char* target;
+    int s;
+};
+
+// Start connecting to the target without waiting for the connection
+// to complete: a TCP target that's slow to answer mustn't stall the
+// whole session.  The pair's channels poll the socket like any
+// other, so they finish the job: they see it become readable or
+// writable once it connects, and if the connection fails, their
+// first read or write gets the error and the pair closes as if the
+// target had hung up.
+static void
+fwd_connect_1(void* data)
+{
+    struct fwd_connect_info* info = data;
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    fwd_parse_spec(info->target, &ss, &sslen);
+    int s = fwd_socket(ss.ss_family);
+    fd_set_blocking_mode(s, non_blocking);
+    if (connect(s, (struct sockaddr*) &ss, sslen) == -1 &&
+        errno != EINPROGRESS)
+    {
+        die_errno("connect(\"%s\")", info->target);
+    }
+
+    info->s = s;
+}
+
+static void
+fwd_handle_open(struct fb_adb_sh* sh, struct msg_fwd_open* m)
+{
+    struct fwd* fwd = sh->fwd;
+    unsigned p = fwd_peer_pair(sh, m->channel, true);
+    if (p < fwd->nr_pairs && fwd->pairs[p].rl != NULL)
+        fwd_proto_error("forwarding channel %u already open", m->channel);
+
+    struct fwd_connect_info info = { .s = -1 };
+    if (fwd->host_p) {
+        if (m->id >= fwd->nr_reverse)
+            fwd_proto_error("unknown reverse forward %u", m->id);
+        info.target = fwd->reverse[m->id].target;
+    } else {
+        info.target = xaprintf("%.*s",
+                               (int) (m->msg.size - sizeof (*m)),
+                               m->target);
+    }
+
+    // If we can't reach the target, the peer's connection just
+    // closes, as it would with adb forward.
+    struct errinfo ei = { .want_msg = true };
+    if (catch_error(fwd_connect_1, &info, &ei))
+        dbg("forwarding failed: %s", ei.msg);
+
+    fwd_install_pair(sh, p, false, info.s);
+}
+
+static void
+fwd_handle_release(struct fb_adb_sh* sh, struct msg_fwd_release* m)
+{
+    struct fwd* fwd = sh->fwd;
+    unsigned p = fwd_peer_pair(sh, m->channel, false);
+    if (p >= fwd->nr_pairs || fwd->pairs[p].rl == NULL)
+        fwd_proto_error("release of unused channel %u", m->channel);
+
+    fwd->pairs[p].released_p = true;
+}
+
+struct fwd_listen_info {
+    struct fwd* fwd;
+    const char* spec;
+    uint32_t id;
+};
+
+static void
+fwd_listen_1(void* data)
+{
+    struct fwd_listen_info* info = data;
+    fwd_add_listener(info->fwd, info->spec, info->id, NULL);
+}
+
+static void
+fwd_handle_listen(struct fb_adb_sh* sh, struct msg_fwd_listen* m)
+{
+    struct fwd_listen_info info = {
+        .fwd = sh->fwd,
+        .spec = xaprintf("%.*s", (int) (m->msg.size - sizeof (*m)), m->spec),
+        .id = m->id,
+    };
+
+    struct errinfo ei = { .want_msg = true };
+    if (catch_error(fwd_listen_1, &info, &ei)) {
+        // The host gives up when it sees this.
+        size_t textsz = XMIN(strlen(ei.msg),
+                             sh->max_outgoing_msg - sizeof (struct msg_error));
+        struct msg_error* em = xcalloc(sizeof (*em) + textsz);
+        em->msg.type = MSG_ERROR;
+        em->msg.size = sizeof (*em) + textsz;
+        memcpy(em->text, ei.msg, textsz);
+        if (!send_message_now(sh, &em->msg))
+            die(ECOMM, "%s", ei.msg);
+    }
+}
+
+static void*
+fwd_read_msg(struct fb_adb_sh* sh, struct msg mhdr, size_t minsz)
+{
+    if (mhdr.size < minsz)
+        fwd_proto_error("wrong msg size type:%u size:%u",
+                        mhdr.type, mhdr.size);
+
+    struct msg* m = xalloc(mhdr.size);
+    read_cmdmsg(sh, mhdr, m, mhdr.size);
+    dbgmsg(m, "recv");
+    return m;
+}
+
+bool
+fwd_process_msg(struct fb_adb_sh* sh, struct msg mhdr)
+{
+    struct fwd* fwd = sh->fwd;
+
+    if (mhdr.type == MSG_FWD_LISTEN && !fwd->host_p) {
+        fwd_handle_listen(
+            sh, fwd_read_msg(sh, mhdr, sizeof (struct msg_fwd_listen)));
+    } else if (mhdr.type == MSG_FWD_OPEN) {
+        fwd_handle_open(
+            sh, fwd_read_msg(sh, mhdr, sizeof (struct msg_fwd_open)));
+    } else if (mhdr.type == MSG_FWD_RELEASE) {
+        fwd_handle_release(
+            sh, fwd_read_msg(sh, mhdr, sizeof (struct msg_fwd_release)));
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+unsigned
+fwd_nr_polls(const struct fwd* fwd)
+{
+    return fwd->nr_listeners;
+}
+
+// Accept new connections only when we can announce them at once.
+short
+fwd_request_poll(struct fb_adb_sh* sh, struct pollfd* polls)
+{
+    struct fwd* fwd = sh->fwd;
+    struct channel* to_peer = sh->ch[TO_PEER];
+    size_t room = XMIN(sh->max_outgoing_msg, ringbuf_room(to_peer->rb));
+    bool accept_p = (to_peer->fdh != NULL &&
+                     fwd->nr_open < FWD_MAX_CONNECTIONS &&
+                     room >= sizeof (struct msg_fwd_open) + FWD_SPEC_MAX);
+    short work = 0;
+
+    for (unsigned i = 0; i < fwd->nr_listeners; ++i) {
+        polls[i].fd = fwd->listeners[i].fd;
+        polls[i].events = accept_p ? POLLIN : 0;
+        polls[i].revents = 0;
+        work |= polls[i].events;
+    }
+
+    return work;
+}
+
+static unsigned
+fwd_unused_pair(struct fwd* fwd)
+{
+    unsigned p = fwd->host_p ? 0 : 1;
+    while (p < fwd->nr_pairs && fwd->pairs[p].rl != NULL)
+        p += 2;
+
+    return p;
+}
+
+static void
+fwd_accept(struct fb_adb_sh* sh, struct fwd_listener* l)
+{
+    SCOPED_RESLIST(rl_accept);
+    struct fwd* fwd = sh->fwd;
+
+    struct cleanup* cl = cleanup_allocate();
+    int s = accept(l->fd, NULL, NULL);
+    if (s == -1) {
+        // Spurious wakeup, aborted connection, or out of fds: try
+        // again next time around.
+        dbg("accept: %s", strerror(errno));
+        return;
+    }
+
+    cleanup_commit_close_fd(cl, s);
+    if (fcntl(s, F_SETFD, FD_CLOEXEC) == -1)
+        die_errno("fcntl");
+
+    unsigned p = fwd_unused_pair(fwd);
+    size_t targetsz = l->target ? strlen(l->target) : 0;
+    struct msg_fwd_open* m = xcalloc(sizeof (*m) + targetsz);
+    m->msg.type = MSG_FWD_OPEN;
+    m->msg.size = sizeof (*m) + targetsz;
+    m->channel = fwd_pair_base(fwd, p);
+    m->id = l->id;
+    if (targetsz > 0)
+        memcpy(m->target, l->target, targetsz);
+
+    // MSG_FWD_OPEN must reach the peer before anything on the new
+    // channels, including a MSG_CHANNEL_CLOSE, which bypasses the
+    // control queue; write it to TO_PEER directly.
+    if (!send_message_now(sh, &m->msg))
+        die(ECOMM, "no room to announce forwarded connection");
+
+    fwd_install_pair(sh, p, true, s);
+}
+
+void
+fwd_poll(struct fb_adb_sh* sh, const struct pollfd* polls)
+{
+    struct fwd* fwd = sh->fwd;
+    for (unsigned i = 0; i < fwd->nr_listeners; ++i)
+        if (polls[i].revents & POLLIN)
+            fwd_accept(sh, &fwd->listeners[i]);
+}
+
+static bool
+fwd_channel_done_p(const struct channel* c)
+{
+    return c->fdh == NULL && c->sent_eof;
+}
+
+// Retire connections whose channels have both closed.  The
+// connecting side lets go of a pair first and tells the opener with
+// MSG_FWD_RELEASE; only then can the opener reuse the pair, since
+// until then messages for the old connection might still be on
+// their way.
+void
+fwd_pump(struct fb_adb_sh* sh)
+{
+    struct fwd* fwd = sh->fwd;
+    if (fwd->nr_open == 0)
+        return;
+
+    for (unsigned p = 0; p < fwd->nr_pairs; ++p) {
+        struct fwd_pair* pair = &fwd->pairs[p];
+        unsigned base = fwd_pair_base(fwd, p);
+        if (pair->rl == NULL ||
+            !fwd_channel_done_p(sh->ch[base]) ||
+            !fwd_channel_done_p(sh->ch[base + 1]))
+        {
+            continue;
+        }
+
+        if (pair->opener_p) {
+            if (!pair->released_p)
+                continue;
+        } else {
+            struct msg_fwd_release m;
+            memset(&m, 0, sizeof (m));
+            m.msg.type = MSG_FWD_RELEASE;
+            m.msg.size = sizeof (m);
+            m.channel = base;
+            if (!send_message_now(sh, &m.msg))
+                break;
+        }
+
+        fwd_destroy_pair(sh, p);
+    }
+}
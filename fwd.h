@@ -0,0 +1,62 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+#include <stdbool.h>
+#include <sys/poll.h>
+#include "proto.h"
+
+// Port forwarding over a live session.  Each forwarded connection
+// lives on its own pair of channels, allocated past the fixed ones:
+// the side that accepted the connection (the opener) picks a free
+// pair, sends MSG_FWD_OPEN, and starts sending data right away;
+// the other side (the connecting side) starts a nonblocking connect
+// to the target and plugs the socket into the pair.  Once both
+// channels have closed, the connecting side forgets the pair and
+// sends MSG_FWD_RELEASE, after which the opener may reuse it.
+// Both sides grant each other a full window up front, so opening
+// costs no round trip beyond the data itself.  The host opens
+// even-numbered pairs and the stub opens odd-numbered ones, so the
+// two never race for a slot.
+//
+// Endpoints are tcp:PORT on the loopback interface or
+// localabstract:NAME in the abstract Unix socket namespace.
+
+struct fb_adb_sh;
+struct fwd;
+
+struct fwd* fwd_new(bool host_p);
+
+// Host only.  ARG is LOCAL=REMOTE: listen on LOCAL and connect each
+// connection to REMOTE on the device.
+void fwd_add_forward(struct fwd* fwd, const char* arg);
+
+// Host only.  ARG is REMOTE=LOCAL: have the stub listen on REMOTE
+// and connect each connection to LOCAL here.
+void fwd_add_reverse(struct fwd* fwd, const char* arg);
+
+// Start forwarding on SH: connections go on channels past the ones
+// SH has now.  On the host, also ask the stub to set up reverse
+// listeners.  Call after io_loop_init.
+void fwd_start(struct fb_adb_sh* sh);
+
+// Listen on or connect to the endpoint SPEC and return the socket,
+// which the current reslist owns.  The socket transport (see
+// cmd_shex.c) uses these too.
+int fwd_endpoint_listen(const char* spec);
+int fwd_endpoint_connect(const char* spec);
+
+// Hooks for the io loop.  fwd_process_msg returns false if MHDR
+// isn't a forwarding message.
+bool fwd_process_msg(struct fb_adb_sh* sh, struct msg mhdr);
+unsigned fwd_nr_polls(const struct fwd* fwd);
+short fwd_request_poll(struct fb_adb_sh* sh, struct pollfd* polls);
+void fwd_poll(struct fb_adb_sh* sh, const struct pollfd* polls);
+void fwd_pump(struct fb_adb_sh* sh);
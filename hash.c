@@ -0,0 +1,175 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <string.h>
+#include "hash.h"
+
+static const uint64_t P1 = 11400714785074694791ULL;
+static const uint64_t P2 = 14029467366897019727ULL;
+static const uint64_t P3 = 1609587929392839161ULL;
+static const uint64_t P4 = 9650029242287828579ULL;
+static const uint64_t P5 = 2870177450012600261ULL;
+
+static inline uint64_t
+rotl64(uint64_t x, unsigned r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+load64(const uint8_t* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof (v));
+    return v;
+}
+
+static inline uint32_t
+load32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof (v));
+    return v;
+}
+
+static inline uint64_t
+hash64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * P2;
+    acc = rotl64(acc, 31);
+    return acc * P1;
+}
+
+static inline uint64_t
+hash64_merge(uint64_t acc, uint64_t v)
+{
+    acc ^= hash64_round(0, v);
+    return acc * P1 + P4;
+}
+
+// Consume as many whole 32-byte stripes of DATA as we can and
+// return the number of bytes consumed.
+static size_t
+hash64_stripes(uint64_t v[4], const uint8_t* data, size_t sz)
+{
+    uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+    size_t pos = 0;
+    for (; pos + 32 <= sz; pos += 32) {
+        v0 = hash64_round(v0, load64(data + pos + 0));
+        v1 = hash64_round(v1, load64(data + pos + 8));
+        v2 = hash64_round(v2, load64(data + pos + 16));
+        v3 = hash64_round(v3, load64(data + pos + 24));
+    }
+
+    v[0] = v0, v[1] = v1, v[2] = v2, v[3] = v3;
+    return pos;
+}
+
+void
+hash64_init(struct hash64* h)
+{
+    memset(h, 0, sizeof (*h));
+    h->v[0] = P1 + P2;
+    h->v[1] = P2;
+    h->v[2] = 0;
+    h->v[3] = -P1;
+}
+
+void
+hash64_update(struct hash64* h, const void* data, size_t sz)
+{
+    const uint8_t* p = data;
+    h->total += sz;
+
+    if (h->bufsz > 0) {
+        size_t fill = sizeof (h->buf) - h->bufsz;
+        if (sz < fill) {
+            memcpy(h->buf + h->bufsz, p, sz);
+            h->bufsz += sz;
+            return;
+        }
+
+        memcpy(h->buf + h->bufsz, p, fill);
+        hash64_stripes(h->v, h->buf, sizeof (h->buf));
+        h->bufsz = 0;
+        p += fill;
+        sz -= fill;
+    }
+
+    size_t done = hash64_stripes(h->v, p, sz);
+    memcpy(h->buf, p + done, sz - done);
+    h->bufsz = sz - done;
+}
+
+uint64_t
+hash64_final(const struct hash64* h)
+{
+    uint64_t acc;
+    if (h->total >= 32) {
+        acc = rotl64(h->v[0], 1) + rotl64(h->v[1], 7) +
+            rotl64(h->v[2], 12) + rotl64(h->v[3], 18);
+        for (int i = 0; i < 4; ++i)
+            acc = hash64_merge(acc, h->v[i]);
+    } else {
+        acc = P5;
+    }
+
+    acc += h->total;
+
+    const uint8_t* p = h->buf;
+    const uint8_t* end = h->buf + h->bufsz;
+    for (; p + 8 <= end; p += 8) {
+        acc ^= hash64_round(0, load64(p));
+        acc = rotl64(acc, 27) * P1 + P4;
+    }
+
+    if (p + 4 <= end) {
+        acc ^= load32(p) * P1;
+        acc = rotl64(acc, 23) * P2 + P3;
+        p += 4;
+    }
+
+    for (; p < end; ++p) {
+        acc ^= *p * P5;
+        acc = rotl64(acc, 11) * P1;
+    }
+
+    acc ^= acc >> 33;
+    acc *= P2;
+    acc ^= acc >> 29;
+    acc *= P3;
+    acc ^= acc >> 32;
+    return acc;
+}
+
+uint64_t
+hash64(const void* data, size_t sz)
+{
+    struct hash64 h;
+    hash64_init(&h);
+    hash64_update(&h, data, sz);
+    return hash64_final(&h);
+}
+
+void
+rollsum_init(struct rollsum* rs, const void* data, size_t sz)
+{
+    const uint8_t* p = data;
+    uint32_t a = 0;
+    uint32_t b = 0;
+    for (size_t i = 0; i < sz; ++i) {
+        a += p[i];
+        b += (uint32_t) (sz - i) * p[i];
+    }
+
+    rs->a = a;
+    rs->b = b;
+    rs->len = sz;
+}
@@ -0,0 +1,53 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Fast non-cryptographic 64-bit hash (the xxHash64 construction).
+// It keeps four independent accumulators so that the compiler can
+// vectorize the main loop and the CPU can overlap the multiplies.
+
+struct hash64 {
+    uint64_t v[4];
+    uint64_t total;
+    uint8_t buf[32];
+    unsigned bufsz;
+};
+
+void hash64_init(struct hash64* h);
+void hash64_update(struct hash64* h, const void* data, size_t sz);
+uint64_t hash64_final(const struct hash64* h);
+uint64_t hash64(const void* data, size_t sz);
+
+// rsync-style weak checksum that can slide along a buffer one byte
+// at a time.
+
+struct rollsum {
+    uint32_t a;
+    uint32_t b;
+    uint32_t len;
+};
+
+void rollsum_init(struct rollsum* rs, const void* data, size_t sz);
+
+static inline void
+rollsum_roll(struct rollsum* rs, uint8_t out, uint8_t in)
+{
+    rs->a += in - out;
+    rs->b += rs->a - rs->len * out;
+}
+
+static inline uint32_t
+rollsum_digest(const struct rollsum* rs)
+{
+    return (rs->a & 0xFFFF) | (rs->b << 16);
+}
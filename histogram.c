@@ -0,0 +1,85 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include "util.h"
+#include "histogram.h"
+
+// Values below HISTOGRAM_SUB_BUCKETS get a bucket each.  Above that,
+// a value whose top bit is bit E lands in row E - SUB_BITS + 1, at
+// the column given by the SUB_BITS bits below the top one.
+
+static unsigned
+histogram_bucket(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return value;
+
+    unsigned e = 63 - __builtin_clzll(value);
+    unsigned shift = e - HISTOGRAM_SUB_BITS;
+    unsigned sub = (value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+// Largest value that lands in bucket B.
+static uint64_t
+histogram_bucket_top(unsigned b)
+{
+    if (b < HISTOGRAM_SUB_BUCKETS)
+        return b;
+
+    unsigned shift = b / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t sub = b % HISTOGRAM_SUB_BUCKETS;
+    uint64_t base = (HISTOGRAM_SUB_BUCKETS + sub) << shift;
+    return base + ((UINT64_C(1) << shift) - 1);
+}
+
+void
+histogram_record(struct histogram* h, uint64_t value)
+{
+    h->buckets[histogram_bucket(value)] += 1;
+    h->count += 1;
+    if (value > h->max)
+        h->max = value;
+}
+
+// Smallest value at or below which PCT percent of recorded values
+// fall, to the histogram's precision.  Zero if we've recorded
+// nothing.
+uint64_t
+histogram_percentile(const struct histogram* h, double pct)
+{
+    if (h->count == 0)
+        return 0;
+
+    uint64_t want = (uint64_t) (h->count * pct / 100.0 + 0.5);
+    want = XMAX(want, (uint64_t) 1);
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < HISTOGRAM_NR_BUCKETS; ++b) {
+        seen += h->buckets[b];
+        if (seen >= want)
+            return XMIN(histogram_bucket_top(b), h->max);
+    }
+
+    return h->max;
+}
+
+// Write H's summary as a JSON object, dividing values by UNIT.
+void
+histogram_dump_json(FILE* out, const struct histogram* h, double unit)
+{
+    fprintf(out,
+            "{\"count\":%ju,\"p50\":%.6f,\"p90\":%.6f,"
+            "\"p99\":%.6f,\"max\":%.6f}",
+            (uintmax_t) h->count,
+            histogram_percentile(h, 50) / unit,
+            histogram_percentile(h, 90) / unit,
+            histogram_percentile(h, 99) / unit,
+            h->max / unit);
+}
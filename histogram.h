@@ -0,0 +1,34 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+
+// A log-linear histogram of uint64_t values in the style of
+// HdrHistogram: each power of two splits into HISTOGRAM_SUB_BUCKETS
+// equal buckets, so any value we report is within 1/32 of one we
+// recorded, whatever its magnitude.  Recording is a few shifts and
+// an increment.  See histogram.c.
+
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_NR_BUCKETS \
+    ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+    uint64_t count;
+    uint64_t max;
+    uint32_t buckets[HISTOGRAM_NR_BUCKETS];
+};
+
+void histogram_record(struct histogram* h, uint64_t value);
+uint64_t histogram_percentile(const struct histogram* h, double pct);
+void histogram_dump_json(FILE* out, const struct histogram* h, double unit);
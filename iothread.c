@@ -0,0 +1,212 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include "iothread.h"
+#include "channel.h"
+#include "ringbuf.h"
+#include "util.h"
+
+// An IO thread moves bytes between a channel's file descriptor and
+// its ringbuf so that the main loop never blocks on a slow endpoint.
+// The ringbuf is the only data structure the two threads share: the
+// IO thread is its producer for CHANNEL_FROM_FD channels and its
+// consumer for CHANNEL_TO_FD channels.  Everything else the main
+// loop needs to know (bytes transferred, EOF, errors) is published
+// through the fields below and harvested by the main thread when the
+// notification pipe becomes readable.
+//
+// The IO thread must never call anything that can die() or allocate
+// on a reslist: neither error handling nor resource tracking is
+// thread-safe.
+
+struct iothread {
+    struct channel* c;
+    int fd;
+    pthread_t thread;
+    bool running;
+    int kick_rd;
+    int kick_wr;
+    int notify_rd;
+    int notify_wr;
+    int stop;
+    int sleeping;
+    int notified;
+    size_t nr_done;
+    int err;
+    int eof;
+};
+
+static void
+drain_pipe(int fd)
+{
+    char buf[64];
+    while (read(fd, buf, sizeof (buf)) > 0)
+        ;
+}
+
+static void
+poke_pipe(int fd)
+{
+    char c = 0;
+    while (write(fd, &c, 1) == -1 && errno == EINTR)
+        ;
+}
+
+static void
+iothread_notify(struct iothread* iot)
+{
+    if (!__atomic_exchange_n(&iot->notified, 1, __ATOMIC_SEQ_CST))
+        poke_pipe(iot->notify_wr);
+}
+
+// Sleep until either our kick pipe or the channel fd (if EVENTS is
+// non-zero) becomes ready.
+static void
+iothread_wait(struct iothread* iot, short events)
+{
+    struct pollfd polls[2] = {
+        { iot->kick_rd, POLLIN, 0 },
+        { events ? iot->fd : -1, events, 0 },
+    };
+
+    if (poll(polls, ARRAYSIZE(polls), -1) > 0 && polls[0].revents)
+        drain_pipe(iot->kick_rd);
+}
+
+static void*
+iothread_main(void* arg)
+{
+    struct iothread* iot = arg;
+    struct channel* c = iot->c;
+    short events = (c->dir == CHANNEL_FROM_FD) ? POLLIN : POLLOUT;
+
+    while (!__atomic_load_n(&iot->stop, __ATOMIC_SEQ_CST)) {
+        size_t sz = channel_thread_wanted(c);
+        if (sz == 0) {
+            // Advertise that we're about to sleep, then check again
+            // so that we can't miss a kick sent in between.
+            __atomic_store_n(&iot->sleeping, 1, __ATOMIC_SEQ_CST);
+            if (channel_thread_wanted(c) == 0 &&
+                !__atomic_load_n(&iot->stop, __ATOMIC_SEQ_CST))
+            {
+                iothread_wait(iot, 0);
+            }
+
+            __atomic_store_n(&iot->sleeping, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        ssize_t ret = channel_thread_io(c, sz);
+        if (ret > 0) {
+            __atomic_add_fetch(&iot->nr_done, ret, __ATOMIC_SEQ_CST);
+            iothread_notify(iot);
+        } else if (ret == 0 && c->dir == CHANNEL_FROM_FD) {
+            __atomic_store_n(&iot->eof, 1, __ATOMIC_SEQ_CST);
+            iothread_notify(iot);
+            break;
+        } else if (ret == 0 || errno == EAGAIN || errno == EINTR) {
+            iothread_wait(iot, events);
+        } else {
+            // Mirror channel_poll: a write error purges bytes we'll
+            // never be able to deliver.
+            int err = errno;
+            if (c->dir == CHANNEL_TO_FD)
+                ringbuf_note_removed(c->rb, ringbuf_size(c->rb));
+
+            __atomic_store_n(&iot->err, err, __ATOMIC_SEQ_CST);
+            iothread_notify(iot);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+iothread_cleanup(void* arg)
+{
+    iothread_stop(arg);
+}
+
+struct iothread*
+iothread_start(struct channel* c)
+{
+    assert(c->fdh != NULL);
+
+    struct iothread* iot = xcalloc(sizeof (*iot));
+    iot->c = c;
+    iot->fd = c->fdh->fd;
+    xpipe(&iot->kick_rd, &iot->kick_wr);
+    xpipe(&iot->notify_rd, &iot->notify_wr);
+    fd_set_blocking_mode(iot->kick_rd, non_blocking);
+    fd_set_blocking_mode(iot->notify_rd, non_blocking);
+    fd_set_blocking_mode(iot->notify_wr, non_blocking);
+    fd_set_blocking_mode(iot->fd, non_blocking);
+
+    // Run the thread with all signals blocked so that signals we
+    // care about (e.g., SIGWINCH) keep interrupting the main loop's
+    // ppoll.
+    struct cleanup* cl = cleanup_allocate();
+    sigset_t all_signals;
+    sigset_t saved_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &saved_mask);
+    int ret = pthread_create(&iot->thread, NULL, iothread_main, iot);
+    pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+    if (ret != 0)
+        die(ret, "pthread_create: %s", strerror(ret));
+
+    iot->running = true;
+    cleanup_commit(cl, iothread_cleanup, iot);
+    return iot;
+}
+
+void
+iothread_stop(struct iothread* iot)
+{
+    if (!iot->running)
+        return;
+
+    __atomic_store_n(&iot->stop, 1, __ATOMIC_SEQ_CST);
+    poke_pipe(iot->kick_wr);
+    pthread_join(iot->thread, NULL);
+    iot->running = false;
+}
+
+void
+iothread_kick(struct iothread* iot)
+{
+    if (__atomic_exchange_n(&iot->sleeping, 0, __ATOMIC_SEQ_CST))
+        poke_pipe(iot->kick_wr);
+}
+
+int
+iothread_notify_fd(const struct iothread* iot)
+{
+    return iot->notify_rd;
+}
+
+void
+iothread_harvest(struct iothread* iot, struct iothread_result* r)
+{
+    // Order matters: drain, then re-arm, then read state.  Anything
+    // the thread publishes after we re-arm generates a new wakeup.
+    drain_pipe(iot->notify_rd);
+    __atomic_store_n(&iot->notified, 0, __ATOMIC_SEQ_CST);
+    r->nr_done = __atomic_exchange_n(&iot->nr_done, 0, __ATOMIC_SEQ_CST);
+    r->eof = __atomic_load_n(&iot->eof, __ATOMIC_SEQ_CST);
+    r->err = __atomic_load_n(&iot->err, __ATOMIC_SEQ_CST);
+}
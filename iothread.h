@@ -0,0 +1,28 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+struct channel;
+struct iothread;
+
+struct iothread_result {
+    size_t nr_done;
+    int err;
+    bool eof;
+};
+
+struct iothread* iothread_start(struct channel* c);
+void iothread_stop(struct iothread* iot);
+void iothread_kick(struct iothread* iot);
+int iothread_notify_fd(const struct iothread* iot);
+void iothread_harvest(struct iothread* iot, struct iothread_result* r);
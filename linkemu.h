@@ -0,0 +1,30 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Old adb moves at most 4k per packet.
+#define LINK_DEFAULT_PACKET_SIZE 4096
+#define LINK_DEFAULT_QUEUE_SIZE (64*1024)
+
+// What fb-adb link-emulator makes of a link spec like
+// "bw=4M,lat=2,jitter=0.5".  See cmd_linkemu.c.
+struct link_params {
+    uint64_t bandwidth; // Bytes per second; 0 for unlimited
+    uint64_t latency_ns;
+    uint64_t jitter_ns;
+    size_t packet_size;
+    size_t queue_size;
+    uint64_t seed;
+};
+
+void link_params_parse(const char* spec, struct link_params* lp);
@@ -0,0 +1,558 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#include "util.h"
+#include "ringbuf.h"
+#include "adbenc.h"
+#include "core.h"
+#include "channel.h"
+#include "constants.h"
+
+// fb-adb-microbench times the kernels every byte of a session goes
+// through, in isolation: ringbuf copies, ringbuf system call IO,
+// the adb encoding, and the message pump's parsing and dispatch of
+// FROM_PEER.  It links against libfb-adb.a and supplies its own
+// real_main, so it gets util.c's main and error handling but none of
+// the commands, and it needs neither a device nor a child process:
+// the only descriptors involved are a pipe and /dev/null.
+//
+// Each benchmark runs for a calibrated number of iterations, several
+// times over, and we report the fastest run.  Cycle counts come from
+// the CPU's cycle counter through perf_event_open when the kernel
+// lets us have it and from the x86 time stamp counter, which ticks
+// at a constant rate rather than with the core clock, otherwise.
+
+static const char usage[] = (
+    "\n"
+    "  -t MS\n"
+    "  --time MS\n"
+    "    Time each run for about MS milliseconds.  Default 200.\n"
+    "\n"
+    "  -r N\n"
+    "  --runs N\n"
+    "    Report the fastest of N runs.  Default 5.\n"
+    "\n"
+    "  -l\n"
+    "  --list\n"
+    "    List the benchmarks and exit.\n"
+    "\n"
+    "  -h\n"
+    "  --help\n"
+    "    Display this message.\n"
+    "\n"
+    "  Each PATTERN selects the benchmarks whose names contain it.\n"
+    "  Without any, we run them all.\n"
+    "\n"
+    );
+
+#define MB_BUFSZ (64*1024)
+
+struct mb_state {
+    size_t size;
+    unsigned variant;
+    struct ringbuf* rb;
+    char* in;
+    char* out;
+    size_t in_size;
+    int pipe[2];
+    struct fb_adb_sh* sh;
+    char* stream;
+    size_t stream_size;
+    unsigned stream_msgs;
+};
+
+struct microbench {
+    const char* name;
+    size_t size;                // Bytes per operation
+    unsigned variant;
+    void (*setup)(struct mb_state* st);
+    void (*run)(struct mb_state* st, uint64_t iters);
+};
+
+static int mb_perf_fd = -1;
+static const char* mb_cycle_source = NULL;
+
+static void
+mb_cycles_init(void)
+{
+#ifdef HAVE_LINUX_PERF_EVENT_H
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof (attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof (attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    mb_perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (mb_perf_fd != -1) {
+        mb_cycle_source = "cpu cycles";
+        return;
+    }
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    mb_cycle_source = "tsc ticks";
+#endif
+}
+
+static uint64_t
+mb_cycles(void)
+{
+    if (mb_perf_fd != -1) {
+        uint64_t count;
+        if (read(mb_perf_fd, &count, sizeof (count)) != sizeof (count))
+            die_errno("read cycle counter");
+        return count;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void
+mb_fill(char* buf, size_t size, unsigned escape_percent)
+{
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+    for (size_t i = 0; i < size; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        char c = (char) (x >> 32);
+        if (c == '~' || c == '!')
+            c = 'x';
+        if ((x >> 8) % 100 < escape_percent)
+            c = (x & 1) ? '~' : '!';
+        buf[i] = c;
+    }
+}
+
+// ringbuf_copy_in and ringbuf_copy_out, SIZE bytes at a time.
+// Variant 1 straddles the end of the buffer so that each copy splits
+// in two; variant 0 never wraps.  Marking the rest of the buffer
+// added and removed brings us back to the same spot each time.
+
+static void
+mb_setup_ringbuf_copy(struct mb_state* st)
+{
+    st->rb = ringbuf_new(MB_BUFSZ);
+    st->in = xalloc(st->size);
+    st->out = xalloc(st->size);
+    mb_fill(st->in, st->size, 0);
+    size_t start = st->variant ? MB_BUFSZ - st->size / 2 : 0;
+    ringbuf_note_added(st->rb, start);
+    ringbuf_note_removed(st->rb, start);
+}
+
+static void
+mb_run_ringbuf_copy(struct mb_state* st, uint64_t iters)
+{
+    struct ringbuf* rb = st->rb;
+    size_t size = st->size;
+    for (uint64_t i = 0; i < iters; ++i) {
+        ringbuf_copy_in(rb, st->in, size);
+        ringbuf_note_added(rb, size);
+        ringbuf_copy_out(rb, st->out, size);
+        ringbuf_note_removed(rb, size);
+        ringbuf_note_added(rb, MB_BUFSZ - size);
+        ringbuf_note_removed(rb, MB_BUFSZ - size);
+    }
+}
+
+// ringbuf_write_out into a pipe and ringbuf_read_in back out of it,
+// across the end of the buffer.
+
+static void
+mb_setup_ringbuf_io(struct mb_state* st)
+{
+    mb_setup_ringbuf_copy(st);
+    xpipe(&st->pipe[0], &st->pipe[1]);
+    ringbuf_copy_in(st->rb, st->in, st->size);
+    ringbuf_note_added(st->rb, st->size);
+}
+
+static void
+mb_run_ringbuf_io(struct mb_state* st, uint64_t iters)
+{
+    struct ringbuf* rb = st->rb;
+    size_t size = st->size;
+    for (uint64_t i = 0; i < iters; ++i) {
+        if (ringbuf_write_out(rb, st->pipe[1], size) != size)
+            die(EIO, "short write to pipe");
+        ringbuf_note_removed(rb, size);
+        ringbuf_note_added(rb, MB_BUFSZ - size);
+        ringbuf_note_removed(rb, MB_BUFSZ - size);
+        if (ringbuf_read_in(rb, st->pipe[0], size) != size)
+            die(EIO, "short read from pipe");
+        ringbuf_note_added(rb, size);
+    }
+}
+
+// adb_encode and adb_decode over SIZE bytes in which VARIANT percent
+// of the bytes need escaping.
+
+static void
+mb_setup_adbenc(struct mb_state* st)
+{
+    st->in = xalloc(st->size);
+    st->out = xalloc(2 * st->size);
+    mb_fill(st->in, st->size, st->variant);
+}
+
+static void
+mb_run_adb_encode(struct mb_state* st, uint64_t iters)
+{
+    for (uint64_t i = 0; i < iters; ++i) {
+        unsigned state = 0;
+        char* enc = st->out;
+        const char* in = st->in;
+        adb_encode(&state, &enc, st->out + 2 * st->size,
+                   &in, st->in + st->size);
+    }
+}
+
+static void
+mb_setup_adb_decode(struct mb_state* st)
+{
+    char* plain = xalloc(st->size);
+    mb_fill(plain, st->size, st->variant);
+    st->in = xalloc(2 * st->size);
+    st->out = xalloc(st->size);
+
+    unsigned state = 0;
+    char* enc = st->in;
+    const char* in = plain;
+    adb_encode(&state, &enc, st->in + 2 * st->size,
+               &in, plain + st->size);
+    st->in_size = enc - st->in;
+}
+
+static void
+mb_run_adb_decode(struct mb_state* st, uint64_t iters)
+{
+    for (uint64_t i = 0; i < iters; ++i) {
+        unsigned state = 0;
+        char* dec = st->out;
+        const char* in = st->in;
+        adb_decode(&state, &dec, st->out + st->size,
+                   &in, st->in + st->in_size);
+    }
+}
+
+// The message pump parsing a FROM_PEER full of MSG_CHANNEL_DATA
+// messages with SIZE-byte payloads, each followed by a
+// MSG_CHANNEL_WINDOW, and dispatching them with
+// fb_adb_sh_process_msg.  detect_msg is private to core.c, so we go
+// through io_loop_pump, which is what calls it.  In variant 0, the
+// channels are closed and the pump drops what it parses; in variant
+// 1, the data goes out to /dev/null and acknowledgements come back
+// through TO_PEER, as on a live session.
+
+enum {
+    MB_DATA_CH = NR_SPECIAL_CH + 1,
+    MB_WINDOW_CH,
+    MB_NRCH
+};
+
+static struct fdh*
+mb_dev_null(void)
+{
+    return fdh_dup(xopen("/dev/null", O_RDWR, 0));
+}
+
+static void
+mb_setup_pump(struct mb_state* st)
+{
+    bool live_p = st->variant != 0;
+    struct fb_adb_sh* sh = xcalloc(sizeof (*sh));
+    sh->process_msg = fb_adb_sh_process_msg;
+    sh->max_outgoing_msg = DEFAULT_CMD_BUFSZ;
+    sh->nrch = MB_NRCH;
+    sh->ch = xcalloc(sh->nrch * sizeof (*sh->ch));
+    sh->ch[FROM_PEER] = channel_new(NULL,
+                                    DEFAULT_CMD_BUFSZ * RECV_BUFSZ_MSGS,
+                                    CHANNEL_FROM_FD);
+    sh->ch[TO_PEER] = channel_new(mb_dev_null(),
+                                  DEFAULT_CMD_BUFSZ,
+                                  CHANNEL_TO_FD);
+    // The data channel's window has to cover everything we put in
+    // FROM_PEER at once.
+    struct channel* data_ch = channel_new(live_p ? mb_dev_null() : NULL,
+                                          DEFAULT_CMD_BUFSZ * RECV_BUFSZ_MSGS,
+                                          CHANNEL_TO_FD);
+    data_ch->track_bytes_written = true;
+    data_ch->bytes_written = ringbuf_room(data_ch->rb);
+    sh->ch[MB_DATA_CH] = data_ch;
+    sh->ch[MB_WINDOW_CH] = channel_new(live_p ? mb_dev_null() : NULL,
+                                       DEFAULT_STREAM_BUFSZ,
+                                       CHANNEL_FROM_FD);
+    io_loop_init(sh);
+    st->sh = sh;
+
+    // As many message pairs as fit in FROM_PEER at once.
+    size_t data_msg_size = sizeof (struct msg_channel_data) + st->size;
+    size_t pair_size = data_msg_size + sizeof (struct msg_channel_window);
+    if (data_msg_size > DEFAULT_CMD_BUFSZ)
+        die(EINVAL, "payload too large");
+    unsigned nr_pairs = ringbuf_capacity(sh->ch[FROM_PEER]->rb) / pair_size;
+    st->stream_size = nr_pairs * pair_size;
+    st->stream_msgs = 2 * nr_pairs;
+    st->stream = xalloc(st->stream_size);
+    char* pos = st->stream;
+    for (unsigned i = 0; i < nr_pairs; ++i) {
+        struct msg_channel_data* dm = (struct msg_channel_data*) pos;
+        dm->msg.type = MSG_CHANNEL_DATA;
+        dm->msg.size = data_msg_size;
+        dm->channel = MB_DATA_CH;
+        mb_fill(dm->data, st->size, 0);
+        pos += data_msg_size;
+
+        struct msg_channel_window* wm = (struct msg_channel_window*) pos;
+        wm->msg.type = MSG_CHANNEL_WINDOW;
+        wm->msg.size = sizeof (*wm);
+        wm->channel = MB_WINDOW_CH;
+        wm->window_delta = st->size;
+        pos += sizeof (*wm);
+    }
+}
+
+static void
+mb_run_pump(struct mb_state* st, uint64_t iters)
+{
+    struct fb_adb_sh* sh = st->sh;
+    struct ringbuf* from_peer = sh->ch[FROM_PEER]->rb;
+    for (uint64_t i = 0; i < iters; ++i) {
+        if (ringbuf_room(from_peer) < st->stream_size)
+            die(EINVAL, "pump fell behind");
+        ringbuf_copy_in(from_peer, st->stream, st->stream_size);
+        ringbuf_note_added(from_peer, st->stream_size);
+        io_loop_pump(sh);
+        if (st->variant != 0) {
+            channel_poll(sh->ch[MB_DATA_CH]);
+            io_loop_pump(sh);
+            channel_poll(sh->ch[TO_PEER]);
+            sh->ch[MB_WINDOW_CH]->window = 0;
+        }
+    }
+}
+
+static const struct microbench microbenchmarks[] = {
+    { "ringbuf-copy-flat-16", 16, 0,
+      mb_setup_ringbuf_copy, mb_run_ringbuf_copy },
+    { "ringbuf-copy-wrap-16", 16, 1,
+      mb_setup_ringbuf_copy, mb_run_ringbuf_copy },
+    { "ringbuf-copy-flat-512", 512, 0,
+      mb_setup_ringbuf_copy, mb_run_ringbuf_copy },
+    { "ringbuf-copy-wrap-512", 512, 1,
+      mb_setup_ringbuf_copy, mb_run_ringbuf_copy },
+    { "ringbuf-copy-flat-4096", 4096, 0,
+      mb_setup_ringbuf_copy, mb_run_ringbuf_copy },
+    { "ringbuf-copy-wrap-4096", 4096, 1,
+      mb_setup_ringbuf_copy, mb_run_ringbuf_copy },
+    { "ringbuf-copy-flat-32768", 32768, 0,
+      mb_setup_ringbuf_copy, mb_run_ringbuf_copy },
+    { "ringbuf-copy-wrap-32768", 32768, 1,
+      mb_setup_ringbuf_copy, mb_run_ringbuf_copy },
+    { "ringbuf-io-wrap-512", 512, 1,
+      mb_setup_ringbuf_io, mb_run_ringbuf_io },
+    { "ringbuf-io-wrap-4096", 4096, 1,
+      mb_setup_ringbuf_io, mb_run_ringbuf_io },
+    { "ringbuf-io-wrap-32768", 32768, 1,
+      mb_setup_ringbuf_io, mb_run_ringbuf_io },
+    { "adb-encode-0%", MB_BUFSZ, 0,
+      mb_setup_adbenc, mb_run_adb_encode },
+    { "adb-encode-1%", MB_BUFSZ, 1,
+      mb_setup_adbenc, mb_run_adb_encode },
+    { "adb-encode-10%", MB_BUFSZ, 10,
+      mb_setup_adbenc, mb_run_adb_encode },
+    { "adb-encode-50%", MB_BUFSZ, 50,
+      mb_setup_adbenc, mb_run_adb_encode },
+    { "adb-encode-100%", MB_BUFSZ, 100,
+      mb_setup_adbenc, mb_run_adb_encode },
+    { "adb-decode-0%", MB_BUFSZ, 0,
+      mb_setup_adb_decode, mb_run_adb_decode },
+    { "adb-decode-1%", MB_BUFSZ, 1,
+      mb_setup_adb_decode, mb_run_adb_decode },
+    { "adb-decode-10%", MB_BUFSZ, 10,
+      mb_setup_adb_decode, mb_run_adb_decode },
+    { "adb-decode-50%", MB_BUFSZ, 50,
+      mb_setup_adb_decode, mb_run_adb_decode },
+    { "adb-decode-100%", MB_BUFSZ, 100,
+      mb_setup_adb_decode, mb_run_adb_decode },
+    { "pump-drop-64", 64, 0, mb_setup_pump, mb_run_pump },
+    { "pump-drop-1024", 1024, 0, mb_setup_pump, mb_run_pump },
+    { "pump-deliver-64", 64, 1, mb_setup_pump, mb_run_pump },
+    { "pump-deliver-1024", 1024, 1, mb_setup_pump, mb_run_pump },
+};
+
+struct mb_result {
+    uint64_t iters;
+    uint64_t ns;
+    uint64_t cycles;
+};
+
+static void
+mb_time(const struct microbench* mb,
+        struct mb_state* st,
+        uint64_t iters,
+        struct mb_result* r)
+{
+    uint64_t start_cycles = mb_cycles();
+    uint64_t start_ns = monotonic_ns();
+    mb->run(st, iters);
+    r->ns = monotonic_ns() - start_ns;
+    r->cycles = mb_cycles() - start_cycles;
+    r->iters = iters;
+}
+
+static void
+mb_run(const struct microbench* mb, uint64_t target_ns, unsigned nr_runs)
+{
+    SCOPED_RESLIST(rl);
+    struct mb_state st;
+    memset(&st, 0, sizeof (st));
+    st.size = mb->size;
+    st.variant = mb->variant;
+    mb->setup(&st);
+
+    // Grow the iteration count until a run takes long enough to time.
+    struct mb_result r;
+    uint64_t iters = 1;
+    for (;;) {
+        mb_time(mb, &st, iters, &r);
+        if (r.ns >= target_ns / 4)
+            break;
+        iters *= (r.ns < target_ns / 64) ? 16 : 2;
+    }
+
+    iters = XMAX((uint64_t) 1, iters * target_ns / XMAX(r.ns, 1));
+    struct mb_result best = { 0 };
+    for (unsigned i = 0; i < nr_runs; ++i) {
+        mb_time(mb, &st, iters, &r);
+        if (best.iters == 0 || r.ns < best.ns)
+            best = r;
+    }
+
+    // Pump benchmarks count messages as operations and the whole
+    // message stream as their bytes.
+    uint64_t ops = best.iters;
+    double bytes = (double) best.iters * mb->size;
+    if (mb->setup == mb_setup_pump) {
+        ops *= st.stream_msgs;
+        bytes = (double) best.iters * st.stream_size;
+    }
+
+    printf("%-24s %10.1f ns/op", mb->name, (double) best.ns / ops);
+    if (mb_cycle_source != NULL)
+        printf(" %10.1f cyc/op %8.3f cyc/B",
+               (double) best.cycles / ops,
+               best.cycles / bytes);
+    printf(" %10.1f MB/s\n", bytes / (1024.0 * 1024.0) / (best.ns / 1e9));
+    fflush(stdout);
+}
+
+static bool
+mb_selected(const struct microbench* mb, int argc, const char** argv)
+{
+    if (argc == 0)
+        return true;
+
+    for (int i = 0; i < argc; ++i)
+        if (strstr(mb->name, argv[i]) != NULL)
+            return true;
+
+    return false;
+}
+
+int
+real_main(int argc, char** argv_)
+{
+    const char** argv = (const char**) argv_;
+    uint64_t target_ns = 200 * 1000000ULL;
+    unsigned nr_runs = 5;
+    bool list_p = false;
+
+    static struct option opts[] = {
+        { "help", no_argument, NULL, 'h' },
+        { "time", required_argument, NULL, 't' },
+        { "runs", required_argument, NULL, 'r' },
+        { "list", no_argument, NULL, 'l' },
+        { 0 }
+    };
+
+    for (;;) {
+        char c = getopt_long(argc, argv_, "+:ht:r:l", opts, NULL);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 't':
+            case 'r': {
+                char* end;
+                errno = 0;
+                unsigned long n = strtoul(optarg, &end, 10);
+                if (errno != 0 || *end != '\0' || n == 0 || n > 1000000)
+                    die(EINVAL, "invalid number: %s", optarg);
+                if (c == 't')
+                    target_ns = n * 1000000ULL;
+                else
+                    nr_runs = n;
+                break;
+            }
+            case 'l':
+                list_p = true;
+                break;
+            case ':':
+                die(EINVAL, "missing option for -%c", optopt);
+            case '?':
+                if (optopt != '?')
+                    die(EINVAL, "invalid option -%c", optopt);
+            case 'h':
+                printf("%s [OPTS] [PATTERN...]: "
+                       "time fb-adb's inner loops\n",
+                       prgname);
+                fputs(usage, stdout);
+                return 0;
+            default:
+                abort();
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (list_p) {
+        for (unsigned i = 0; i < ARRAYSIZE(microbenchmarks); ++i)
+            if (mb_selected(&microbenchmarks[i], argc, argv))
+                printf("%s\n", microbenchmarks[i].name);
+        return 0;
+    }
+
+    mb_cycles_init();
+    printf("# cycles are %s\n",
+           mb_cycle_source ? mb_cycle_source : "unavailable");
+
+    for (unsigned i = 0; i < ARRAYSIZE(microbenchmarks); ++i)
+        if (mb_selected(&microbenchmarks[i], argc, argv))
+            mb_run(&microbenchmarks[i], target_ns, nr_runs);
+
+    return 0;
+}
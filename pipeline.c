@@ -0,0 +1,427 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "core.h"
+#include "channel.h"
+#include "ringbuf.h"
+#include "histogram.h"
+#include "timing.h"
+#include "pipeline.h"
+
+// Bulk output crosses six buffers on its way to our stdout: the
+// child's pipe, the stub's CHILD_STDOUT ringbuf, the stub's TO_PEER,
+// the link, our FROM_PEER, and our CHILD_STDOUT ringbuf.  To see
+// where it waits, both ends follow every INTERVAL-th byte of the
+// stream, which is the same byte on both ends because stream offsets
+// survive framing.  The stub notes when it read the byte, when it
+// put it in a frame, and when TO_PEER wrote that frame position to
+// the link; we note when FROM_PEER read it, when we took it out of
+// its frame, and when we wrote it to our stdout.  The stub sends us
+// its samples at the end of the session (see struct
+// msg_stub_pipeline), and we line the two up by offset, putting the
+// stub's times on our clock the way timing.c does.
+//
+// We learn about output only when we read it, so the time it spent
+// in the child's pipe is out of reach.  The stub leaves the pipe
+// unread only when CHILD_STDOUT is out of window or buffer, which
+// --stats reports as window_blocked time.
+//
+// All the byte counters we go by are ones that struct channel_stats
+// keeps anyway, and the pump tells us when to look at them, so
+// following bytes costs a comparison per pump and a clock read per
+// sample.
+
+// FROM_PEER reads we remember.  A frame we take apart has to have
+// arrived in one of them.
+#define PIPELINE_READ_HISTORY 256
+
+enum pipeline_stage {
+    STAGE_STUB_BUFFER,
+    STAGE_TO_PEER,
+    STAGE_LINK,
+    STAGE_FROM_PEER,
+    STAGE_HOST_BUFFER,
+    STAGE_TOTAL,
+    NR_STAGES
+};
+
+static const struct {
+    const char* name;
+    const char* key;
+} stages[NR_STAGES] = {
+    { "stub buffer", "stub_buffer" },
+    { "stub TO_PEER", "to_peer" },
+    { "link", "link" },
+    { "FROM_PEER", "from_peer" },
+    { "stdout buffer", "stdout_buffer" },
+    { "total", "total" },
+};
+
+struct pipeline_read {
+    uint64_t bytes;             // FROM_PEER bytes read, this one included
+    uint64_t ns;
+};
+
+// On the stub, the three times in each sample are when we read the
+// byte, framed it, and wrote it to the link; on the host, when we
+// read it from the link, unframed it, and wrote it to stdout.  Each
+// stage finishes for the samples in offset order, so NR_FRAMED and
+// NR_DONE count the samples that have finished the middle and last
+// stages.
+struct pipeline {
+    bool stub_p;
+    uint64_t interval;
+    uint64_t next;
+    uint64_t seen;
+    unsigned nr;
+    unsigned nr_framed;
+    unsigned nr_done;
+    struct pipeline_sample samples[PIPELINE_MAX_SAMPLES];
+    // Stub: where in TO_PEER's stream each framed sample went.
+    uint64_t wire[PIPELINE_MAX_SAMPLES];
+    // Host: recent FROM_PEER reads and the stub's samples.
+    struct pipeline_read reads[PIPELINE_READ_HISTORY];
+    unsigned nr_reads;
+    uint64_t forgotten;
+    struct pipeline_sample peer[PIPELINE_MAX_SAMPLES];
+    unsigned nr_peer;
+};
+
+void
+pipeline_enable(struct fb_adb_sh* sh, bool stub_p)
+{
+    struct pipeline* p = xcalloc(sizeof (*p));
+    p->stub_p = stub_p;
+    p->interval = PIPELINE_FIRST_INTERVAL;
+    sh->pipeline = p;
+}
+
+static uint64_t
+round_up(uint64_t value, uint64_t interval)
+{
+    return (value + interval - 1) / interval * interval;
+}
+
+// Keep every other sample and sample half as often from now on.
+// Both ends drop the same offsets.
+static void
+pipeline_thin(struct pipeline* p)
+{
+    uint64_t interval = p->interval * 2;
+    unsigned n = 0;
+    unsigned nr_framed = 0;
+    unsigned nr_done = 0;
+
+    for (unsigned i = 0; i < p->nr; ++i) {
+        if (p->samples[i].offset % interval != 0)
+            continue;
+        nr_framed += (i < p->nr_framed);
+        nr_done += (i < p->nr_done);
+        p->samples[n] = p->samples[i];
+        p->wire[n] = p->wire[i];
+        n += 1;
+    }
+
+    p->nr = n;
+    p->nr_framed = nr_framed;
+    p->nr_done = nr_done;
+    p->interval = interval;
+    p->next = round_up(p->next, interval);
+}
+
+// Start following the next byte below LIMIT that we sample, if any.
+static struct pipeline_sample*
+pipeline_next_sample(struct pipeline* p, uint64_t limit)
+{
+    while (p->next < limit) {
+        if (p->nr == PIPELINE_MAX_SAMPLES) {
+            pipeline_thin(p);
+            continue;
+        }
+
+        struct pipeline_sample* s = &p->samples[p->nr++];
+        memset(s, 0, sizeof (*s));
+        s->offset = p->next;
+        p->next += p->interval;
+        return s;
+    }
+
+    return NULL;
+}
+
+// When FROM_PEER read the byte at POS in its stream, or zero if we
+// no longer remember.
+static uint64_t
+pipeline_read_ns(const struct pipeline* p, uint64_t pos)
+{
+    if (pos < p->forgotten)
+        return 0;
+
+    unsigned oldest = p->nr_reads - XMIN(p->nr_reads,
+                                         (unsigned) PIPELINE_READ_HISTORY);
+    uint64_t ns = 0;
+    for (unsigned i = p->nr_reads; i > oldest; --i) {
+        const struct pipeline_read* r =
+            &p->reads[(i - 1) % PIPELINE_READ_HISTORY];
+        if (r->bytes <= pos)
+            break;
+        ns = r->ns;
+    }
+
+    return ns;
+}
+
+static void
+pipeline_note_stub(struct fb_adb_sh* sh, struct pipeline* p)
+{
+    struct channel* out = sh->ch[CHILD_STDOUT];
+    struct channel* to_peer = sh->ch[TO_PEER];
+    uint64_t now = 0;
+
+    if (out != NULL && out->stats.bytes != p->seen) {
+        struct pipeline_sample* s;
+        p->seen = out->stats.bytes;
+        while ((s = pipeline_next_sample(p, p->seen)) != NULL)
+            s->ns[0] = now = (now ?: monotonic_ns());
+    }
+
+    while (p->nr_done < p->nr_framed &&
+           p->wire[p->nr_done] < to_peer->stats.bytes)
+    {
+        now = now ?: monotonic_ns();
+        p->samples[p->nr_done++].ns[2] = now;
+    }
+}
+
+static void
+pipeline_note_host(struct fb_adb_sh* sh, struct pipeline* p)
+{
+    struct channel* from_peer = sh->ch[FROM_PEER];
+    struct channel* out = sh->ch[CHILD_STDOUT];
+    uint64_t now = 0;
+
+    if (from_peer->stats.bytes != p->seen) {
+        struct pipeline_read* r =
+            &p->reads[p->nr_reads++ % PIPELINE_READ_HISTORY];
+        if (p->nr_reads > PIPELINE_READ_HISTORY)
+            p->forgotten = r->bytes;
+        p->seen = from_peer->stats.bytes;
+        r->bytes = p->seen;
+        r->ns = now = monotonic_ns();
+    }
+
+    while (out != NULL &&
+           p->nr_done < p->nr &&
+           p->samples[p->nr_done].offset < out->stats.bytes)
+    {
+        now = now ?: monotonic_ns();
+        p->samples[p->nr_done++].ns[2] = now;
+    }
+}
+
+// Look at the counters again.  The pump calls us before and after
+// each pass so that we see IO as soon after it happens as we can.
+void
+pipeline_note(struct fb_adb_sh* sh)
+{
+    struct pipeline* p = sh->pipeline;
+    if (p->stub_p)
+        pipeline_note_stub(sh, p);
+    else
+        pipeline_note_host(sh, p);
+}
+
+// The stub is about to queue a frame with PAYLOADSZ bytes of C's
+// output.
+void
+pipeline_note_sent(struct fb_adb_sh* sh, struct channel* c, size_t payloadsz)
+{
+    struct pipeline* p = sh->pipeline;
+    if (!p->stub_p || c->chno != CHILD_STDOUT)
+        return;
+
+    pipeline_note_stub(sh, p);
+
+    struct channel* to_peer = sh->ch[TO_PEER];
+    uint64_t off = c->stats.bytes - channel_buffered(c);
+    uint64_t wire = (to_peer->stats.bytes +
+                     channel_buffered(to_peer) +
+                     sizeof (struct msg_channel_data));
+    uint64_t now = 0;
+
+    while (p->nr_framed < p->nr &&
+           p->samples[p->nr_framed].offset < off + payloadsz)
+    {
+        struct pipeline_sample* s = &p->samples[p->nr_framed];
+        now = now ?: monotonic_ns();
+        s->ns[1] = now;
+        p->wire[p->nr_framed] = wire + (s->offset - off);
+        p->nr_framed += 1;
+    }
+}
+
+// We've just taken the header of a frame with PAYLOADSZ bytes for C
+// out of FROM_PEER.
+void
+pipeline_note_received(struct fb_adb_sh* sh,
+                       struct channel* c,
+                       size_t payloadsz)
+{
+    struct pipeline* p = sh->pipeline;
+    if (p->stub_p || c->chno != CHILD_STDOUT)
+        return;
+
+    struct channel* from_peer = sh->ch[FROM_PEER];
+    uint64_t off = c->stats.bytes + channel_buffered(c);
+    uint64_t wire = from_peer->stats.bytes - ringbuf_size(from_peer->rb);
+    uint64_t now = monotonic_ns();
+    struct pipeline_sample* s;
+
+    if (p->next < off)
+        p->next = round_up(off, p->interval);
+
+    while ((s = pipeline_next_sample(p, off + payloadsz)) != NULL) {
+        s->ns[0] = pipeline_read_ns(p, wire + (s->offset - off));
+        s->ns[1] = now;
+    }
+}
+
+unsigned
+pipeline_get_samples(struct fb_adb_sh* sh,
+                     struct pipeline_sample* out,
+                     unsigned first,
+                     unsigned max)
+{
+    struct pipeline* p = sh->pipeline;
+    unsigned n = first < p->nr ? XMIN(max, p->nr - first) : 0;
+    memcpy(out, &p->samples[first], n * sizeof (*out));
+    return n;
+}
+
+void
+pipeline_note_peer(struct fb_adb_sh* sh,
+                   const struct pipeline_sample* samples,
+                   unsigned n)
+{
+    struct pipeline* p = sh->pipeline;
+    if (p == NULL)
+        return;
+
+    n = XMIN(n, (unsigned) PIPELINE_MAX_SAMPLES - p->nr_peer);
+    memcpy(&p->peer[p->nr_peer], samples, n * sizeof (*samples));
+    p->nr_peer += n;
+}
+
+// Record the time from FROM (plus FROM_OFFSET, to put it on our
+// clock) to TO, unless we're missing either one.  Clock slop can
+// make short link times come out negative; call those zero.
+static void
+pipeline_record(struct histogram* h,
+                uint64_t from,
+                int64_t from_offset,
+                uint64_t to)
+{
+    if (from == 0 || to == 0)
+        return;
+
+    int64_t delay = (int64_t) to - ((int64_t) from + from_offset);
+    histogram_record(h, delay > 0 ? delay : 0);
+}
+
+// Sort the samples we've followed all the way through into one
+// histogram per stage.  Set *SLOP_NS to how far off the stub's
+// times might be, or -1 if we couldn't line them up at all.
+static struct histogram*
+pipeline_summarize(struct pipeline* p, int64_t* slop_ns)
+{
+    struct histogram* h = xcalloc(NR_STAGES * sizeof (*h));
+    int64_t offset = 0;
+    bool aligned = timing_peer_offset(&offset, slop_ns);
+    if (!aligned)
+        *slop_ns = -1;
+
+    unsigned j = 0;
+    for (unsigned i = 0; i < p->nr_done; ++i) {
+        const struct pipeline_sample* hs = &p->samples[i];
+        pipeline_record(&h[STAGE_FROM_PEER], hs->ns[0], 0, hs->ns[1]);
+        pipeline_record(&h[STAGE_HOST_BUFFER], hs->ns[1], 0, hs->ns[2]);
+
+        while (j < p->nr_peer && p->peer[j].offset < hs->offset)
+            j += 1;
+        if (j == p->nr_peer || p->peer[j].offset != hs->offset)
+            continue;
+
+        const struct pipeline_sample* ss = &p->peer[j];
+        pipeline_record(&h[STAGE_STUB_BUFFER], ss->ns[0], 0, ss->ns[1]);
+        pipeline_record(&h[STAGE_TO_PEER], ss->ns[1], 0, ss->ns[2]);
+        if (aligned) {
+            pipeline_record(&h[STAGE_LINK], ss->ns[2], offset, hs->ns[0]);
+            pipeline_record(&h[STAGE_TOTAL], ss->ns[0], offset, hs->ns[2]);
+        }
+    }
+
+    return h;
+}
+
+// Print where our samples waited.  Called at the end of a session.
+void
+pipeline_report(struct fb_adb_sh* sh)
+{
+    SCOPED_RESLIST(rl);
+    struct pipeline* p = sh->pipeline;
+    int64_t slop;
+    struct histogram* h = pipeline_summarize(p, &slop);
+
+    fprintf(stderr,
+            "%s: where output waited (ms; every %ju bytes sampled):\n",
+            prgname, (uintmax_t) p->interval);
+    if (slop >= 0)
+        fprintf(stderr, "%s: stub times are good to %.3f ms\n",
+                prgname, slop / 1e6);
+    else
+        fprintf(stderr, "%s: cannot line up stub times with ours\n",
+                prgname);
+
+    fprintf(stderr, "%-14s %7s %9s %9s %9s %9s\n",
+            "stage", "samples", "p50", "p90", "p99", "max");
+    for (unsigned i = 0; i < NR_STAGES; ++i)
+        if (h[i].count > 0)
+            fprintf(stderr, "%-14s %7ju %9.3f %9.3f %9.3f %9.3f\n",
+                    stages[i].name,
+                    (uintmax_t) h[i].count,
+                    histogram_percentile(&h[i], 50) / 1e6,
+                    histogram_percentile(&h[i], 90) / 1e6,
+                    histogram_percentile(&h[i], 99) / 1e6,
+                    h[i].max / 1e6);
+}
+
+// Write the same as a JSON object for --stats.
+void
+pipeline_dump_json(FILE* out, struct fb_adb_sh* sh)
+{
+    SCOPED_RESLIST(rl);
+    struct pipeline* p = sh->pipeline;
+    int64_t slop;
+    struct histogram* h = pipeline_summarize(p, &slop);
+
+    fprintf(out, "{\"interval_bytes\":%ju", (uintmax_t) p->interval);
+    if (slop >= 0)
+        fprintf(out, ",\"stub_clock_slop_ms\":%.6f", slop / 1e6);
+    for (unsigned i = 0; i < NR_STAGES; ++i) {
+        fprintf(out, ",\"%s\":", stages[i].key);
+        histogram_dump_json(out, &h[i], 1e6);
+    }
+
+    fputs("}", out);
+}
@@ -0,0 +1,46 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "proto.h"
+
+// Where CHILD_STDOUT bytes wait between the child and our stdout,
+// for --pipeline-stats.  See pipeline.c.
+
+// Samples per process.  When we run out, we keep every other one
+// and sample half as often.
+#define PIPELINE_MAX_SAMPLES 1024
+
+// Bytes of output between samples, to begin with.
+#define PIPELINE_FIRST_INTERVAL 4096
+
+struct fb_adb_sh;
+struct channel;
+
+void pipeline_enable(struct fb_adb_sh* sh, bool stub_p);
+void pipeline_note(struct fb_adb_sh* sh);
+void pipeline_note_sent(struct fb_adb_sh* sh,
+                        struct channel* c,
+                        size_t payloadsz);
+void pipeline_note_received(struct fb_adb_sh* sh,
+                            struct channel* c,
+                            size_t payloadsz);
+unsigned pipeline_get_samples(struct fb_adb_sh* sh,
+                              struct pipeline_sample* out,
+                              unsigned first,
+                              unsigned max);
+void pipeline_note_peer(struct fb_adb_sh* sh,
+                        const struct pipeline_sample* samples,
+                        unsigned n);
+void pipeline_report(struct fb_adb_sh* sh);
+void pipeline_dump_json(FILE* out, struct fb_adb_sh* sh);
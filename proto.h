@@ -27,6 +27,21 @@ enum msg_type {
     MSG_CMDLINE_DEFAULT_SH_LOGIN,
     MSG_EXEC_AS_ROOT,
     MSG_EXEC_AS_USER,
+    MSG_OPEN_FILE,
+    MSG_FILE_INFO,
+    MSG_SYNC_DIR,
+    MSG_FWD_LISTEN,
+    MSG_FWD_OPEN,
+    MSG_FWD_RELEASE,
+    MSG_EXTRA_FD,
+    MSG_RUN_BATCH,
+    MSG_SOCKET_LISTEN,
+    MSG_SOCKET_LISTENING,
+    MSG_SOCKET_CONNECTED,
+    MSG_STUB_TIMING,
+    MSG_STUB_TRACE,
+    MSG_STUB_PIPELINE,
+    MSG_SOCKET_COOKIE,
 };
 
 struct msg {
@@ -96,6 +111,19 @@ struct msg_shex_hello {
     uint32_t ospeed;
     uint8_t posix_vdisable_value;
     uint8_t stdio_socket_p;
+    uint8_t nr_extra_fds;
+    // Nonzero if our stdin reaches us unmangled (adb's exec service
+    // or local pipes), so the session after the handshake skips the
+    // adb encoding.
+    uint8_t clean_transport_p;
+    // Nonzero if the stub should send MSG_STUB_TIMING.
+    uint8_t timing_p;
+    // Nonzero if the stub should record a trace and send it to us in
+    // MSG_STUB_TRACE.
+    uint8_t trace_p;
+    // Nonzero if the stub should follow CHILD_STDOUT bytes through
+    // its buffers and send us what it saw in MSG_STUB_PIPELINE.
+    uint8_t pipeline_p;
     struct stream_information si[3];
     struct term_control tctl[0];
 };
@@ -110,10 +138,168 @@ struct msg_exec_as_user {
     char username[0];
 };
 
+// Socket transport.  Sent (as a bare struct msg) in place of the
+// hello to ask the stub to listen on an abstract socket.  The stub
+// answers on the pty with MSG_SOCKET_LISTENING, giving a random
+// socket name and a random cookie, or naming nothing if it can't
+// listen.  Anyone on the device can connect to an abstract socket,
+// so the host's first message on the connection must be a
+// msg_socket_cookie carrying that cookie; the stub drops
+// connections that don't send it promptly, and connections from
+// uids that couldn't be us or adbd.  The stub takes the rest of the
+// handshake from whichever comes first: a connection that passes
+// those checks, which it greets with a bare MSG_SOCKET_CONNECTED, or
+// more input on the pty, meaning the host couldn't reach the socket.
+// Either way, the handshake stays adb-encoded; once the session
+// starts, traffic on the socket isn't.
+#define SOCKET_COOKIE_SIZE 16
+
+struct msg_socket_listening {
+    struct msg msg;
+    uint8_t cookie[SOCKET_COOKIE_SIZE];
+    char name[0];
+};
+
+struct msg_socket_cookie {
+    struct msg msg;
+    uint8_t cookie[SOCKET_COOKIE_SIZE];
+};
+
+// Sent right after the hello, once for each of its nr_extra_fds.
+// The child gets descriptor FD as a pipe that it reads from or, if
+// CHILD_WRITES_P, writes to.  The Nth such descriptor is carried on
+// channel FIRST_EXTRA_CHANNEL + N.
+struct msg_extra_fd {
+    struct msg msg;
+    uint32_t fd;
+    uint8_t child_writes_p;
+    uint32_t bufsz;
+};
+
+// Sent instead of the command line when the hello message has
+// nr_argv == 0.  Rather than run a child, the stub opens PATH and
+// writes it from CHILD_STDIN (write_p) or reads it into
+// CHILD_STDOUT.
+struct msg_open_file {
+    struct msg msg;
+    uint8_t write_p;
+    uint32_t mode;
+    uint64_t size;
+    // When writing, the last NAMELEN bytes of PATH are the name of
+    // the local file.  If the rest of PATH is a directory, the stub
+    // writes NAME inside it, as adb push does.
+    uint16_t namelen;
+    char path[0];
+};
+
+// Sent instead of MSG_OPEN_FILE to run the receiving end of a
+// delta sync of the tree at PATH.
+struct msg_sync_dir {
+    struct msg msg;
+    uint8_t delete_p;
+    char path[0];
+};
+
+// Sent instead of MSG_OPEN_FILE to run a batch of commands: the
+// stub runs "batch-runner", which reads the commands from
+// CHILD_STDIN and multiplexes their output and exit statuses onto
+// CHILD_STDOUT.
+struct msg_run_batch {
+    struct msg msg;
+};
+
+// Stub's reply to MSG_OPEN_FILE, MSG_SYNC_DIR, or MSG_RUN_BATCH,
+// written before the session starts; on failure, the stub sends
+// MSG_ERROR instead.  For a directory, the data channel carries a
+// tar archive of the tree and the error channel carries complaints
+// about files we skipped.
+struct msg_file_info {
+    struct msg msg;
+    uint64_t size;
+    uint8_t directory_p;
+};
+
+// Port forwarding; see fwd.h.  The host asks the stub to listen on
+// SPEC and to tag connections it accepts there with ID.
+struct msg_fwd_listen {
+    struct msg msg;
+    uint32_t id;
+    char spec[0];
+};
+
+// Opens a forwarded connection on the channel pair starting at
+// CHANNEL.  From the host, TARGET says where the stub should
+// connect; from the stub, ID names the listener that accepted.
+// Either side may send data right behind this message.
+struct msg_fwd_open {
+    struct msg msg;
+    uint32_t channel;
+    uint32_t id;
+    char target[0];
+};
+
+// Sent by the side that received MSG_FWD_OPEN and connected to the
+// target, once both channels of the pair starting at CHANNEL are
+// closed and it has forgotten them.  The side that sent
+// MSG_FWD_OPEN may reuse the pair only after receiving this.
+struct msg_fwd_release {
+    struct msg msg;
+    uint32_t channel;
+};
+
+// When a phase of the stub's startup or shutdown ended, by the
+// stub's monotonic clock.  See timing.c.
+#define TIMING_PHASE_NAME_MAX 24
+struct timing_phase {
+    uint64_t ns;
+    char name[TIMING_PHASE_NAME_MAX];
+};
+
+// Sent by the stub right before MSG_CHILD_EXIT if the hello asked
+// for it with timing_p.
+struct msg_stub_timing {
+    struct msg msg;
+    struct timing_phase phases[0];
+};
+
+// One entry in a trace ring.  See trace.h for the ids and what their
+// arguments mean.
+struct trace_event {
+    uint64_t ns;
+    uint32_t id;
+    uint32_t args[3];
+};
+
+// Sent by the stub after MSG_STUB_TIMING if the hello asked for it
+// with trace_p, as many times as it takes to send its whole ring,
+// oldest events first.
+struct msg_stub_trace {
+    struct msg msg;
+    uint32_t pid;
+    uint32_t nr_dropped;
+    struct trace_event events[0];
+};
+
+// When the byte at OFFSET in a stream went through each of three
+// stages.  See pipeline.c for what the stages are on either side.
+struct pipeline_sample {
+    uint64_t offset;
+    uint64_t ns[3];
+};
+
+// Sent by the stub after MSG_STUB_TRACE if the hello asked for it
+// with pipeline_p, as many times as it takes to send all its
+// samples, lowest offset first.
+struct msg_stub_pipeline {
+    struct msg msg;
+    struct pipeline_sample samples[0];
+};
+
 #pragma pack(pop)
 
 static const unsigned CHILD_STDIN = 2;
 static const unsigned CHILD_STDOUT = 3;
 static const unsigned CHILD_STDERR = 4;
+static const unsigned FIRST_EXTRA_CHANNEL = 5;
 
 #define FB_ADB_PROTO_START_LINE "FB_ADB protocol %ju follows (uid=%d)"
@@ -16,11 +16,34 @@
 #include "ringbuf.h"
 #include "util.h"
 
+/* A ringbuf is safe for one producer and one consumer running on
+ * different threads: only the producer advances nr_added and only
+ * the consumer advances nr_removed and nr_reclaimed, and each side
+ * publishes its counters with release semantics after touching the
+ * buffer memory.  In the single-threaded case, these atomic
+ * operations compile to plain loads and stores on the architectures
+ * we care about.
+ *
+ * The consumer can remove bytes without giving their space back to
+ * the producer by holding them in a segment (see ringbuf_hold).
+ * nr_reclaimed trails nr_removed by the bytes still held, and the
+ * producer sees only the space behind nr_reclaimed as room.  */
 struct ringbuf {
     size_t nr_removed;
+    size_t nr_reclaimed;
     size_t nr_added;
     size_t capacity;
     char* __restrict__ mem;
+    struct ringbuf_seg* segs;
+    unsigned seg_head;
+    unsigned nr_segs;
+};
+
+struct ringbuf_seg {
+    struct ringbuf* rb;
+    size_t start;
+    size_t len;
+    bool held;
 };
 
 struct ringbuf_io {
@@ -40,6 +63,9 @@ ringbuf_new(size_t capacity)
     struct ringbuf* rb = xcalloc(sizeof (*rb));
     rb->capacity = capacity;
     rb->mem = xalloc(capacity);
+    // Allocate segment slots up front: ringbuf_hold runs inside the
+    // pump, where allocations don't outlive the call.
+    rb->segs = xcalloc(RINGBUF_MAX_SEGS * sizeof (*rb->segs));
     return rb;
 }
 
@@ -57,23 +83,44 @@ ringbuf_capacity(const struct ringbuf* rb)
     return rb->capacity;
 }
 
+static size_t
+ringbuf_load(const size_t* counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_ACQUIRE);
+}
+
+static void
+ringbuf_publish(size_t* counter, size_t value)
+{
+    __atomic_store_n(counter, value, __ATOMIC_RELEASE);
+}
+
 size_t
 ringbuf_size(const struct ringbuf* rb)
 {
-    return rb->nr_added - rb->nr_removed;
+    return ringbuf_load(&rb->nr_added) - ringbuf_load(&rb->nr_removed);
 }
 
 size_t
 ringbuf_room(const struct ringbuf* rb)
 {
-    return ringbuf_capacity(rb) - ringbuf_size(rb);
+    return ringbuf_capacity(rb) -
+        (ringbuf_load(&rb->nr_added) - ringbuf_load(&rb->nr_reclaimed));
+}
+
+static void
+ringbuf_advance(struct ringbuf* rb, size_t nr)
+{
+    assert(nr <= ringbuf_size(rb));
+    ringbuf_publish(&rb->nr_removed, rb->nr_removed + nr);
+    if (rb->nr_segs == 0)
+        ringbuf_publish(&rb->nr_reclaimed, rb->nr_removed);
 }
 
 void
 ringbuf_consume(struct ringbuf* rb, size_t nr)
 {
-    assert(nr <= ringbuf_size(rb));
-    rb->nr_removed += nr;
+    ringbuf_advance(rb, nr);
 }
 
 static struct ringbuf_io
@@ -101,15 +148,14 @@ size_t
 ringbuf_note_added(struct ringbuf* rb, size_t nr)
 {
     assert(nr <= ringbuf_room(rb));
-    rb->nr_added += nr;
+    ringbuf_publish(&rb->nr_added, rb->nr_added + nr);
     return nr;
 }
 
 size_t
 ringbuf_note_removed(struct ringbuf* rb, size_t nr)
 {
-    assert(nr <= ringbuf_size(rb));
-    rb->nr_removed += nr;
+    ringbuf_advance(rb, nr);
     return nr;
 }
 
@@ -180,3 +226,67 @@ ringbuf_writable_iov(const struct ringbuf* rb,
     iov[0] = rio.v[0];
     iov[1] = rio.v[1];
 }
+
+// Remove the next NR bytes from RB, but keep their space reserved
+// until the returned segment is released.  Return NULL if RB can't
+// track any more segments; the caller should then copy the bytes out
+// instead.  Segments are reclaimed in the order
+// they were taken, so a segment held for a long time also pins the
+// space of every segment taken after it.
+struct ringbuf_seg*
+ringbuf_hold(struct ringbuf* rb, size_t nr)
+{
+    assert(nr <= ringbuf_size(rb));
+
+    if (rb->nr_segs == RINGBUF_MAX_SEGS)
+        return NULL;
+
+    unsigned idx = (rb->seg_head + rb->nr_segs) % RINGBUF_MAX_SEGS;
+    struct ringbuf_seg* seg = &rb->segs[idx];
+    seg->rb = rb;
+    seg->start = rb->nr_removed;
+    seg->len = nr;
+    seg->held = true;
+    rb->nr_segs += 1;
+    ringbuf_advance(rb, nr);
+    return seg;
+}
+
+// Give SEG's space back to the producer once every segment taken
+// before it has been released too.
+void
+ringbuf_seg_release(struct ringbuf_seg* seg)
+{
+    assert(seg->held);
+    seg->held = false;
+
+    struct ringbuf* rb = seg->rb;
+    while (rb->nr_segs > 0 && !rb->segs[rb->seg_head].held) {
+        rb->seg_head = (rb->seg_head + 1) % RINGBUF_MAX_SEGS;
+        rb->nr_segs -= 1;
+    }
+
+    ringbuf_publish(&rb->nr_reclaimed,
+                    (rb->nr_segs > 0
+                     ? rb->segs[rb->seg_head].start
+                     : rb->nr_removed));
+}
+
+size_t
+ringbuf_seg_size(const struct ringbuf_seg* seg)
+{
+    return seg->len;
+}
+
+// Describe the bytes of SEG that follow the first SKIP.
+void
+ringbuf_seg_iov(const struct ringbuf_seg* seg,
+                size_t skip,
+                struct iovec iov[2])
+{
+    assert(skip <= seg->len);
+    struct ringbuf_io rio =
+        ringbuf_io_region(seg->rb, seg->start + skip, seg->len - skip);
+    iov[0] = rio.v[0];
+    iov[1] = rio.v[1];
+}
@@ -32,3 +32,14 @@ void ringbuf_writable_iov(const struct ringbuf* rb,
 
 size_t ringbuf_note_removed(struct ringbuf* rb, size_t nr);
 size_t ringbuf_note_added(struct ringbuf* rb, size_t nr);
+
+// Segments let a consumer hand bytes it has removed from a ringbuf
+// to someone else without copying them.  See ringbuf_hold.
+#define RINGBUF_MAX_SEGS 64
+struct ringbuf_seg;
+struct ringbuf_seg* ringbuf_hold(struct ringbuf* rb, size_t nr);
+void ringbuf_seg_release(struct ringbuf_seg* seg);
+size_t ringbuf_seg_size(const struct ringbuf_seg* seg);
+void ringbuf_seg_iov(const struct ringbuf_seg* seg,
+                     size_t skip,
+                     struct iovec iov[2]);
@@ -0,0 +1,70 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include "core.h"
+#include "proto.h"
+
+// The host end of a session, as cmd_shex.c sets it up.  fb-adb
+// multi (cmd_multi.c) drives many of these from one loop.
+
+struct fb_adb_shex {
+    struct fb_adb_sh sh;
+    int child_exit_status;
+    bool child_exited;
+    bool saw_output;
+};
+
+// How we reach the stub: the stdio of a local stub, or a socket to an
+// adb service running the stub on the device.
+struct stub_conn {
+    struct fdh* to;
+    struct fdh* from;
+};
+
+struct tty_flags {
+    unsigned tty_p : 1;
+    unsigned want_pty_p : 1;
+};
+
+// Start the stub and leave CONN connected to it, just past its start
+// line.  start_stub_adb pushes the stub if the device lacks a
+// current one; *CLEAN_P says whether we got a binary-clean pipe.
+void start_stub_local(struct stub_conn* conn);
+void start_stub_adb(bool force_send_stub,
+                    bool want_clean,
+                    const char* const* adb_args,
+                    int* uid,
+                    bool* clean_p,
+                    struct stub_conn* conn);
+
+// Parse a start line from the stub.  Return false if it's not from
+// a stub at least as new as we are.
+bool check_stub_start_line(const char* resp, int* uid);
+
+void command_re_exec_as_root(struct stub_conn* stub);
+void command_re_exec_as_user(struct stub_conn* stub, const char* username);
+
+struct msg_shex_hello* make_hello_msg(size_t cmd_bufsz,
+                                      size_t stream_bufsz,
+                                      size_t nr_argv,
+                                      struct tty_flags tty_flags[3]);
+void make_shell_command_line(const char* shell,
+                             int* argc,
+                             const char*** argv);
+void send_cmdline(int fd,
+                  int argc,
+                  const char* const* argv,
+                  const char* exename);
+
+// process_msg for an fb_adb_shex.
+void shex_process_msg(struct fb_adb_sh* sh, struct msg mhdr);
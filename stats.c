@@ -0,0 +1,233 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "util.h"
+#include "core.h"
+#include "channel.h"
+#include "ringbuf.h"
+#include "histogram.h"
+#include "pipeline.h"
+#include "stats.h"
+
+// Every channel keeps a struct channel_stats and every session a few
+// counters of its own (see struct fb_adb_sh).  Here we write them out
+// as one JSON object per line: at exit when the user gave us a file,
+// and whenever we get SIGUSR1, to the same file or to stderr.
+//
+// Reading a dump: a session whose TO_PEER is stuck full is bound by
+// the link; a channel that spends its time window_blocked is waiting
+// on the consumer at the other end; a TO_FD channel with a peak near
+// its buffer size is waiting on the consumer at this end.
+
+volatile sig_atomic_t stats_dump_requested;
+static const char* stats_path;
+
+// Keystrokes we've read but haven't seen the child answer yet.
+#define ECHO_MAX_PENDING 16
+
+// In an interactive session, the time from reading a keystroke to
+// the next write to our terminal is what the user sees as the
+// session's responsiveness.  The pump tells us whenever it looks at
+// the session, and we watch the CHILD_STDIN and CHILD_STDOUT byte
+// counters: output answers every keystroke read before it.
+struct echo_latency {
+    uint64_t in_bytes;
+    uint64_t out_bytes;
+    uint64_t pending[ECHO_MAX_PENDING];
+    unsigned nr_pending;
+    struct histogram hist;
+};
+
+static void
+handle_sigusr1(int signo)
+{
+    stats_dump_requested = true;
+}
+
+// Dump to PATH ("-" for stderr) at exit.  If PATH is NULL, use
+// FB_ADB_STATS instead, and dump at exit only if that's set.  Either
+// way, dump on SIGUSR1.  The pump notices the signal the next time
+// it polls, so callers that block signals outside ppoll should block
+// SIGUSR1 too.
+void
+stats_init(const char* path)
+{
+    if (path == NULL) {
+        path = getenv("FB_ADB_STATS");
+        if (path != NULL && *path == '\0')
+            path = NULL;
+    }
+
+    stats_path = path;
+    signal(SIGUSR1, handle_sigusr1);
+}
+
+bool
+stats_at_exit_p(void)
+{
+    return stats_path != NULL;
+}
+
+// Start measuring keystroke-to-echo latency in SH.
+void
+stats_track_echo(struct fb_adb_sh* sh)
+{
+    sh->echo = xcalloc(sizeof (*sh->echo));
+}
+
+void
+stats_note_echo(struct fb_adb_sh* sh)
+{
+    struct echo_latency* e = sh->echo;
+    struct channel* in = sh->ch[CHILD_STDIN];
+    struct channel* out = sh->ch[CHILD_STDOUT];
+    uint64_t now = 0;
+
+    // Output first: anything we read just now can't have been
+    // answered yet.
+    if (out != NULL && out->stats.bytes != e->out_bytes) {
+        e->out_bytes = out->stats.bytes;
+        if (e->nr_pending > 0) {
+            now = monotonic_ns();
+            for (unsigned i = 0; i < e->nr_pending; ++i)
+                histogram_record(&e->hist, now - e->pending[i]);
+            e->nr_pending = 0;
+        }
+    }
+
+    if (in != NULL && in->stats.bytes != e->in_bytes) {
+        e->in_bytes = in->stats.bytes;
+        if (e->nr_pending < ECHO_MAX_PENDING)
+            e->pending[e->nr_pending++] = now ?: monotonic_ns();
+    }
+}
+
+static const char*
+stats_chname(unsigned chno)
+{
+    static const char* names[] = {
+        "FROM_PEER",
+        "TO_PEER",
+        "CHILD_STDIN",
+        "CHILD_STDOUT",
+        "CHILD_STDERR",
+    };
+
+    return chno < ARRAYSIZE(names) ? names[chno] : "extra";
+}
+
+static double
+ns_to_s(uint64_t ns)
+{
+    return ns / 1e9;
+}
+
+static void
+stats_dump_channel(FILE* out,
+                   struct fb_adb_sh* sh,
+                   unsigned chno,
+                   uint64_t now)
+{
+    struct channel* c = sh->ch[chno];
+    const struct channel_stats* s = &c->stats;
+
+    fprintf(out,
+            "{\"ch\":%u,\"name\":\"%s\",\"dir\":\"%s\","
+            "\"open\":%s,\"bytes\":%ju,\"frames\":%ju,"
+            "\"syscalls\":%zu,\"escape_bytes\":%zu,"
+            "\"buffered\":%zu,\"peak_buffered\":%zu,\"bufsz\":%zu,"
+            "\"window_blocked_s\":%.6f,\"window_blocked_count\":%ju,"
+            "\"to_peer_blocked_s\":%.6f,\"to_peer_blocked_count\":%ju}",
+            chno,
+            stats_chname(chno),
+            c->dir == CHANNEL_TO_FD ? "to_fd" : "from_fd",
+            c->fdh != NULL ? "true" : "false",
+            (uintmax_t) s->bytes,
+            (uintmax_t) s->frames,
+            __atomic_load_n(&s->syscalls, __ATOMIC_RELAXED),
+            __atomic_load_n(&s->escape_bytes, __ATOMIC_RELAXED),
+            channel_buffered(c),
+            s->peak_buffered,
+            ringbuf_capacity(c->rb),
+            ns_to_s(stall_ns(&s->window_blocked, now)),
+            (uintmax_t) s->window_blocked.count,
+            ns_to_s(stall_ns(&s->to_peer_blocked, now)),
+            (uintmax_t) s->to_peer_blocked.count);
+}
+
+static void
+stats_dump_1(FILE* out, struct fb_adb_sh* sh, const char* why)
+{
+    uint64_t now = monotonic_ns();
+    fprintf(out,
+            "{\"event\":\"%s\",\"pid\":%d,\"elapsed_s\":%.6f,"
+            "\"to_peer_full_s\":%.6f,\"to_peer_full_count\":%ju,"
+            "\"channels\":[",
+            why,
+            (int) getpid(),
+            ns_to_s(now - sh->start_ns),
+            ns_to_s(stall_ns(&sh->to_peer_full, now)),
+            (uintmax_t) sh->to_peer_full.count);
+
+    bool first = true;
+    for (unsigned chno = 0; chno < sh->nrch; ++chno) {
+        if (sh->ch[chno] == NULL)
+            continue;
+        if (!first)
+            fputc(',', out);
+        first = false;
+        stats_dump_channel(out, sh, chno, now);
+    }
+
+    fputs("]", out);
+    if (sh->echo != NULL) {
+        fputs(",\"echo_latency_ms\":", out);
+        histogram_dump_json(out, &sh->echo->hist, 1e6);
+    }
+
+    if (sh->pipeline != NULL) {
+        fputs(",\"pipeline_ms\":", out);
+        pipeline_dump_json(out, sh);
+    }
+
+    fputs("}\n", out);
+}
+
+// Write SH's counters out, labeled WHY.  Failing to write stats
+// isn't worth killing a session over, so we just complain.
+void
+stats_dump(struct fb_adb_sh* sh, const char* why)
+{
+    stats_dump_requested = false;
+
+    if (stats_path == NULL || !strcmp(stats_path, "-")) {
+        stats_dump_1(stderr, sh, why);
+        fflush(stderr);
+        return;
+    }
+
+    FILE* out = fopen(stats_path, "a");
+    if (out == NULL) {
+        fprintf(stderr, "%s: cannot open %s: %s\n",
+                prgname, stats_path, strerror(errno));
+        return;
+    }
+
+    stats_dump_1(out, sh, why);
+    if (fclose(out) != 0)
+        fprintf(stderr, "%s: cannot write %s: %s\n",
+                prgname, stats_path, strerror(errno));
+}
@@ -0,0 +1,26 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+#include <signal.h>
+#include <stdbool.h>
+
+// Session and channel counter dumps for --stats, FB_ADB_STATS and
+// SIGUSR1.  See stats.c.
+
+struct fb_adb_sh;
+
+extern volatile sig_atomic_t stats_dump_requested;
+
+void stats_init(const char* path);
+bool stats_at_exit_p(void);
+void stats_dump(struct fb_adb_sh* sh, const char* why);
+void stats_track_echo(struct fb_adb_sh* sh);
+void stats_note_echo(struct fb_adb_sh* sh);
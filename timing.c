@@ -0,0 +1,186 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "timing.h"
+
+// Code marks the end of each phase of starting and stopping a
+// session with timing_mark.  A mark is a clock read and a copy, so
+// we take them all the time and print the breakdown at exit only if
+// someone asked for it.  The stub sends its marks to us right before
+// the child's exit status (see struct msg_stub_timing), and we put
+// them on our own timeline the way NTP would: the stub can't have
+// written its last start line after we read it, nor read our hello
+// before we sent it, and we split the difference between those
+// bounds, which is off by at most half the round trip.
+
+static struct timing_phase phases[TIMING_MAX_PHASES];
+static unsigned nr_phases;
+static struct timing_phase peer_phases[TIMING_MAX_PHASES];
+static unsigned nr_peer_phases;
+static bool enabled;
+
+// Start the clock.  FB_ADB_TIMING asks for a report just as --timing
+// does; we take it out of the environment so that the fb-adb
+// processes we start don't all print reports of their own.
+void
+timing_start(void)
+{
+    nr_phases = 0;
+    timing_mark("start");
+    const char* tv = getenv("FB_ADB_TIMING");
+    if (tv != NULL && *tv != '\0')
+        enabled = true;
+    unsetenv("FB_ADB_TIMING");
+}
+
+void
+timing_set_enabled(bool new_enabled)
+{
+    enabled = new_enabled;
+}
+
+bool
+timing_enabled_p(void)
+{
+    return enabled;
+}
+
+void
+timing_mark(const char* name)
+{
+    if (nr_phases == TIMING_MAX_PHASES)
+        return;
+
+    struct timing_phase* p = &phases[nr_phases++];
+    p->ns = monotonic_ns();
+    snprintf(p->name, sizeof (p->name), "%s", name);
+}
+
+unsigned
+timing_get_phases(struct timing_phase* out, unsigned max)
+{
+    unsigned n = XMIN(max, nr_phases);
+    memcpy(out, phases, n * sizeof (*out));
+    return n;
+}
+
+void
+timing_note_peer(const struct timing_phase* in, unsigned n)
+{
+    n = XMIN(n, (unsigned) TIMING_MAX_PHASES);
+    memcpy(peer_phases, in, n * sizeof (*in));
+    nr_peer_phases = n;
+}
+
+static const struct timing_phase*
+timing_find_last(const struct timing_phase* p, unsigned n, const char* name)
+{
+    const struct timing_phase* found = NULL;
+    for (unsigned i = 0; i < n; ++i)
+        if (!strncmp(p[i].name, name, sizeof (p[i].name)))
+            found = &p[i];
+    return found;
+}
+
+// Work out what to add to the peer's clock to get ours.  Return
+// false if the peer didn't tell us enough.  Otherwise, set
+// *SLOP_NS to how far off the answer might be, which is never zero.
+//
+// The offset can't be more than UPPER, or the stub would have
+// written its start line after we read it, nor less than LOWER, or
+// the stub would have read our hello before we sent it.  Clocks that
+// drift or step can make the bounds cross.  Then no offset satisfies
+// both, and we widen the slop to reach them both from the middle.
+bool
+timing_peer_offset(int64_t* offset_ns, int64_t* slop_ns)
+{
+    const struct timing_phase* our_start =
+        timing_find_last(phases, nr_phases, "start line");
+    const struct timing_phase* their_start =
+        timing_find_last(peer_phases, nr_peer_phases, "start line");
+    const struct timing_phase* our_hello =
+        timing_find_last(phases, nr_phases, "hello sent");
+    const struct timing_phase* their_hello =
+        timing_find_last(peer_phases, nr_peer_phases, "hello");
+    if (our_start == NULL || their_start == NULL ||
+        our_hello == NULL || their_hello == NULL)
+    {
+        return false;
+    }
+
+    int64_t upper = (int64_t) our_start->ns - (int64_t) their_start->ns;
+    int64_t lower = (int64_t) our_hello->ns - (int64_t) their_hello->ns;
+    int64_t slop = (upper > lower ? upper - lower : lower - upper) / 2;
+    *offset_ns = XMIN(lower, upper) + slop;
+    *slop_ns = XMAX(slop, (int64_t) 1);
+    return true;
+}
+
+struct timing_line {
+    int64_t ns;
+    const struct timing_phase* phase;
+    bool peer_p;
+};
+
+void
+timing_report(void)
+{
+    if (!enabled || nr_phases == 0)
+        return;
+
+    struct timing_line lines[2 * TIMING_MAX_PHASES];
+    unsigned nr_lines = 0;
+    uint64_t t0 = phases[0].ns;
+    for (unsigned i = 0; i < nr_phases; ++i)
+        lines[nr_lines++] = (struct timing_line){
+            phases[i].ns - t0, &phases[i], false };
+
+    int64_t offset;
+    int64_t slop = -1;
+    if (timing_peer_offset(&offset, &slop)) {
+        for (unsigned i = 0; i < nr_peer_phases; ++i) {
+            struct timing_line line = {
+                (int64_t) peer_phases[i].ns + offset - (int64_t) t0,
+                &peer_phases[i],
+                true,
+            };
+
+            // Both lists are in order; keep the result in order too.
+            unsigned pos = nr_lines;
+            while (pos > 0 && lines[pos - 1].ns > line.ns) {
+                lines[pos] = lines[pos - 1];
+                pos -= 1;
+            }
+
+            lines[pos] = line;
+            nr_lines += 1;
+        }
+    }
+
+    fprintf(stderr, "%s: timing (ms since start, ms since previous):\n",
+            prgname);
+    if (slop >= 0)
+        fprintf(stderr, "%s: stub times are good to %.3f ms\n",
+                prgname, slop / 1e6);
+    int64_t prev = 0;
+    for (unsigned i = 0; i < nr_lines; ++i) {
+        fprintf(stderr, "%10.3f %+9.3f  %s%.*s\n",
+                lines[i].ns / 1e6,
+                (lines[i].ns - prev) / 1e6,
+                lines[i].peer_p ? "stub: " : "",
+                (int) sizeof (lines[i].phase->name),
+                lines[i].phase->name);
+        prev = lines[i].ns;
+    }
+}
@@ -0,0 +1,26 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "proto.h"
+
+// Phase timing for --timing and FB_ADB_TIMING.  See timing.c.
+#define TIMING_MAX_PHASES 64
+
+void timing_start(void);
+void timing_set_enabled(bool enabled);
+bool timing_enabled_p(void);
+void timing_mark(const char* name);
+unsigned timing_get_phases(struct timing_phase* phases, unsigned max);
+void timing_note_peer(const struct timing_phase* phases, unsigned n);
+bool timing_peer_offset(int64_t* offset_ns, int64_t* slop_ns);
+void timing_report(void);
@@ -0,0 +1,284 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "util.h"
+#include "timing.h"
+#include "trace.h"
+
+// dbg() formats, locks, and flushes every line, which changes timing
+// enough to hide the problems we want to see.  A trace event is a
+// clock read and four stores into a fixed ring, so tracing barely
+// perturbs the session.  When the process exits, or crashes, we
+// write the ring to a file that `fb-adb trace-decode` turns into a
+// timeline.
+//
+// The stub can't write anywhere we can easily get at, so when the
+// hello asks it to trace, it sends us its ring at the end of the
+// session in MSG_STUB_TRACE and we put it in our file as a second
+// section, along with the clock offset that timing.c works out from
+// the handshake.  If the stub dies before it can do that, it writes
+// its ring to a file in its temporary directory instead.
+//
+// Only the main thread records events: IO threads show up in the
+// trace through the main loop's harvesting of their results.
+
+bool trace_enabled;
+static bool stub_role;
+static char trace_path[PATH_MAX];
+static struct trace_event ring[TRACE_RING_EVENTS];
+static size_t ring_pos;
+
+static struct trace_event peer_ring[TRACE_RING_EVENTS];
+static unsigned nr_peer_events;
+static uint64_t peer_dropped;
+static uint32_t peer_pid;
+static bool have_peer;
+
+static void trace_crash(int signo);
+
+// FB_ADB_TRACE=FILE traces this process into FILE.  Like
+// FB_ADB_TIMING, we take it out of the environment so that the
+// fb-adb processes we start don't overwrite our file.
+void
+trace_init(void)
+{
+    const char* path = getenv("FB_ADB_TRACE");
+    if (path != NULL && *path != '\0')
+        trace_enable(path, false);
+    unsetenv("FB_ADB_TRACE");
+}
+
+// Start recording, and arrange to write the ring to PATH at exit or
+// on a crash.
+void
+trace_enable(const char* path, bool stub_p)
+{
+    static const int crash_signals[] = {
+        SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT,
+    };
+
+    snprintf(trace_path, sizeof (trace_path), "%s", path);
+    stub_role = stub_p;
+    if (!trace_enabled) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof (sa));
+        sa.sa_handler = trace_crash;
+        sa.sa_flags = SA_RESETHAND;
+        for (int i = 0; i < ARRAYSIZE(crash_signals); ++i)
+            sigaction(crash_signals[i], &sa, NULL);
+    }
+
+    trace_enabled = true;
+    trace_1(TRACE_START, getpid(), stub_p, 0);
+}
+
+void
+trace_1(enum trace_event_id id, uint32_t arg0, uint32_t arg1, uint32_t arg2)
+{
+    struct trace_event* ev = &ring[ring_pos++ % TRACE_RING_EVENTS];
+    ev->ns = monotonic_ns();
+    ev->id = id;
+    ev->args[0] = arg0;
+    ev->args[1] = arg1;
+    ev->args[2] = arg2;
+}
+
+// Record sending or receiving a message.  HDR holds the first HDRSZ
+// bytes of it, which needn't cover more than the header; we dig out
+// the channel number if it's there.
+void
+trace_msg(enum trace_event_id id, const void* hdr, size_t hdrsz)
+{
+    if (!trace_enabled)
+        return;
+
+    struct msg_channel_data m;
+    memset(&m, 0, sizeof (m));
+    memcpy(&m, hdr, XMIN(hdrsz, sizeof (m)));
+    uint32_t chno = 0;
+    if (hdrsz >= sizeof (m) &&
+        (m.msg.type == MSG_CHANNEL_DATA ||
+         m.msg.type == MSG_CHANNEL_WINDOW ||
+         m.msg.type == MSG_CHANNEL_CLOSE))
+    {
+        chno = m.channel;
+    }
+
+    trace_1(id, m.msg.type, chno, m.msg.size);
+}
+
+// Copy up to MAX events into OUT, oldest first, skipping the FIRST
+// oldest ones.  Return the number copied and set *NR_DROPPED to the
+// number of events the ring has overwritten.
+unsigned
+trace_get_events(struct trace_event* out,
+                 unsigned first,
+                 unsigned max,
+                 uint64_t* nr_dropped)
+{
+    size_t nr = XMIN(ring_pos, (size_t) TRACE_RING_EVENTS);
+    size_t oldest = ring_pos - nr;
+    unsigned n = 0;
+
+    *nr_dropped = oldest;
+    while (n < max && first + n < nr) {
+        out[n] = ring[(oldest + first + n) % TRACE_RING_EVENTS];
+        n += 1;
+    }
+
+    return n;
+}
+
+void
+trace_note_peer(uint32_t pid,
+                uint32_t nr_dropped,
+                const struct trace_event* events,
+                unsigned n)
+{
+    have_peer = true;
+    peer_pid = pid;
+    peer_dropped = nr_dropped;
+    n = XMIN(n, TRACE_RING_EVENTS - nr_peer_events);
+    memcpy(&peer_ring[nr_peer_events], events, n * sizeof (*events));
+    nr_peer_events += n;
+}
+
+// Everything from here down runs in a crash handler, so we stick to
+// async-signal-safe calls.
+
+static bool
+trace_write_all(int fd, const void* buf, size_t sz)
+{
+    const char* p = buf;
+    while (sz > 0) {
+        ssize_t ret = write(fd, p, sz);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        p += ret;
+        sz -= ret;
+    }
+
+    return true;
+}
+
+static bool
+trace_write_section(int fd,
+                    const char* role,
+                    uint32_t pid,
+                    const struct trace_event* events,
+                    unsigned nr_events,
+                    unsigned first,
+                    uint64_t nr_dropped,
+                    int64_t clock_offset_ns,
+                    int64_t clock_slop_ns)
+{
+    struct trace_section_header sh;
+    memset(&sh, 0, sizeof (sh));
+    memcpy(sh.role, role, XMIN(strlen(role), sizeof (sh.role)));
+    sh.pid = pid;
+    sh.nr_events = nr_events;
+    sh.nr_dropped = nr_dropped;
+    sh.clock_offset_ns = clock_offset_ns;
+    sh.clock_slop_ns = clock_slop_ns;
+
+    // EVENTS is a ring whose oldest event is at FIRST.
+    unsigned nr_tail = XMIN(nr_events, TRACE_RING_EVENTS - first);
+    return (trace_write_all(fd, &sh, sizeof (sh)) &&
+            trace_write_all(fd, &events[first],
+                            nr_tail * sizeof (*events)) &&
+            trace_write_all(fd, &events[0],
+                            (nr_events - nr_tail) * sizeof (*events)));
+}
+
+static bool
+trace_write(void)
+{
+    int fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+    if (fd == -1)
+        return false;
+
+    int64_t offset = 0;
+    int64_t slop = -1;
+    bool peer_p = have_peer;
+    if (peer_p && !timing_peer_offset(&offset, &slop)) {
+        offset = 0;
+        slop = -1;
+    }
+
+    struct trace_file_header fh;
+    memset(&fh, 0, sizeof (fh));
+    memcpy(fh.magic, TRACE_FILE_MAGIC, sizeof (fh.magic));
+    fh.nr_sections = peer_p ? 2 : 1;
+
+    size_t pos = ring_pos;
+    size_t nr = XMIN(pos, (size_t) TRACE_RING_EVENTS);
+    bool ok = (trace_write_all(fd, &fh, sizeof (fh)) &&
+               trace_write_section(fd,
+                                   stub_role ? "stub" : "host",
+                                   getpid(),
+                                   ring,
+                                   nr,
+                                   (pos - nr) % TRACE_RING_EVENTS,
+                                   pos - nr,
+                                   0,
+                                   0));
+    if (ok && peer_p)
+        ok = trace_write_section(fd,
+                                 "stub",
+                                 peer_pid,
+                                 peer_ring,
+                                 nr_peer_events,
+                                 0,
+                                 peer_dropped,
+                                 offset,
+                                 slop);
+
+    close(fd);
+    return ok;
+}
+
+static void
+trace_crash(int signo)
+{
+    if (trace_path[0] != '\0')
+        (void) trace_write();
+    raise(signo);
+}
+
+// The stub calls this once it has sent us its ring: we'll write it
+// out, so it needn't.
+void
+trace_sent(void)
+{
+    trace_path[0] = '\0';
+}
+
+// Write the trace file, if we're tracing.  Called at exit.
+void
+trace_dump(void)
+{
+    if (!trace_enabled || trace_path[0] == '\0')
+        return;
+
+    if (!trace_write())
+        fprintf(stderr, "%s: cannot write trace to %s: %s\n",
+                prgname, trace_path, strerror(errno));
+}
@@ -0,0 +1,81 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "proto.h"
+
+// Binary event tracing for --trace and FB_ADB_TRACE.  See trace.c.
+
+// Events per process.  Must be a power of two.
+#define TRACE_RING_EVENTS 16384
+
+enum trace_event_id {
+    TRACE_START = 1,      // pid, is_stub
+    TRACE_MSG_SEND,       // type, channel, size
+    TRACE_MSG_RECV,       // type, channel, size
+    TRACE_POLL_SLEEP,     // nfds, timeout in us or UINT32_MAX
+    TRACE_POLL_WAKE,      // return value, errno
+    TRACE_CHANNEL_READ,   // channel, bytes, window left
+    TRACE_CHANNEL_WRITE,  // channel, bytes, bytes still buffered
+    TRACE_CHANNEL_CLOSE,  // channel, error
+    TRACE_WINDOW,         // channel, delta, new window
+    NR_TRACE_EVENT_IDS
+};
+
+// A trace file is a trace_file_header followed by nr_sections
+// sections, each a trace_section_header and its nr_events events,
+// oldest first.  The first section is the process that wrote the
+// file; adding a section's clock_offset_ns to its timestamps puts
+// them on the first section's clock.
+#define TRACE_FILE_MAGIC "FBTRACE1"
+
+struct trace_file_header {
+    char magic[8];
+    uint32_t nr_sections;
+    uint32_t reserved;
+};
+
+struct trace_section_header {
+    char role[8];
+    uint32_t pid;
+    uint32_t nr_events;
+    uint64_t nr_dropped;
+    int64_t clock_offset_ns;
+    // How far off clock_offset_ns might be, or -1 if we don't know.
+    int64_t clock_slop_ns;
+};
+
+extern bool trace_enabled;
+
+void trace_init(void);
+void trace_enable(const char* path, bool stub_p);
+void trace_1(enum trace_event_id id,
+             uint32_t arg0,
+             uint32_t arg1,
+             uint32_t arg2);
+void trace_msg(enum trace_event_id id, const void* hdr, size_t hdrsz);
+unsigned trace_get_events(struct trace_event* out,
+                          unsigned first,
+                          unsigned max,
+                          uint64_t* nr_dropped);
+void trace_note_peer(uint32_t pid,
+                     uint32_t nr_dropped,
+                     const struct trace_event* events,
+                     unsigned n);
+void trace_sent(void);
+void trace_dump(void);
+
+#define trace(_id, _a0, _a1, _a2)                       \
+    ({                                                  \
+        if (trace_enabled)                              \
+            trace_1((_id), (_a0), (_a1), (_a2));        \
+    })
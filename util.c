@@ -23,6 +23,8 @@
 #include <sys/uio.h>
 #include <sys/queue.h>
 #include <libgen.h>
+#include <time.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 
 #ifndef SOCK_CLOEXEC
@@ -41,6 +43,8 @@
 
 #include "util.h"
 #include "constants.h"
+#include "timing.h"
+#include "trace.h"
 
 struct errhandler {
     sigjmp_buf where;
@@ -126,6 +130,27 @@ reslist_destroy_guts(struct reslist* rl)
     }
 }
 
+// Move everything DONOR owns to RECIPIENT, keeping its order, so
+// that it lives as long as RECIPIENT instead.
+void
+reslist_xfer(struct reslist* recipient, struct reslist* donor)
+{
+    struct resource* prev = NULL;
+    while (!LIST_EMPTY(&donor->contents)) {
+        struct resource* r = LIST_FIRST(&donor->contents);
+        LIST_REMOVE(r, link);
+        if (r->type == RES_RESLIST || r->type == RES_RESLIST_ONSTACK)
+            ((struct reslist*) r)->parent = recipient;
+
+        if (prev == NULL)
+            LIST_INSERT_HEAD(&recipient->contents, r, link);
+        else
+            LIST_INSERT_AFTER(prev, r, link);
+
+        prev = r;
+    }
+}
+
 void
 reslist_destroy(struct reslist* rl)
 {
@@ -499,6 +524,7 @@ main1(void* arg)
 int
 main(int argc, char** argv)
 {
+    timing_start();
     signal(SIGPIPE, SIG_IGN);
 
     struct main_info mi;
@@ -511,6 +537,7 @@ main(int argc, char** argv)
     struct reslist* top_rl = reslist_push_new();
     dbg_init();
     dbglock_init();
+    trace_init();
     orig_argv0 = argv[0];
     prgname = strdup(basename(xstrdup(argv[0])));
     struct errinfo ei = { .want_msg = true };
@@ -521,6 +548,9 @@ main(int argc, char** argv)
     }
 
     reslist_destroy(top_rl);
+    timing_mark("teardown");
+    timing_report();
+    trace_dump();
     return mi.ret;
 }
 
@@ -542,6 +572,16 @@ nextpow2sz(size_t sz)
     return 1 + sz;
 }
 
+uint64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        abort();
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 char*
 xstrdup(const char* s)
 {
@@ -971,6 +1011,16 @@ replace_with_dev_null(int fd)
     close(nfd);
 }
 
+// Fill BUF with SZ bytes that nobody else can guess.
+void
+xgetrandom(void* buf, size_t sz)
+{
+    SCOPED_RESLIST(rl);
+    int fd = xopen("/dev/urandom", O_RDONLY, 0);
+    if (read_all(fd, buf, sz) != sz)
+        die(EIO, "short read from /dev/urandom");
+}
+
 struct xnamed_tempfile_save {
     char* name;
     int fd;
@@ -1008,3 +1058,31 @@ xnamed_tempfile(const char** out_name)
     *out_name = name;
     return save->stream;
 }
+
+// Tell the kernel we'll read FD front to back so that it reads
+// ahead aggressively.  Purely advisory.
+void
+hint_sequential_read(int fd)
+{
+#ifdef HAVE_POSIX_FADVISE
+    (void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+// Reserve SIZE bytes of disk for FD without changing its apparent
+// size.  Filesystems that can't preallocate are fine, but we want
+// to learn that we're out of space now, not halfway through a
+// transfer.
+void
+preallocate_file(int fd, uint64_t size)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+    off_t len = (off_t) size;
+    if (len > 0 && (uint64_t) len == size &&
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, len) == -1 &&
+        errno == ENOSPC)
+    {
+        die_errno("fallocate");
+    }
+#endif
+}
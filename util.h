@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/types.h>
@@ -53,6 +54,7 @@ void reslist_cleanup_local(struct reslist* rl_local);
 void reslist_pop_nodestroy(struct reslist* rl);
 void reslist_destroy(struct reslist* rl);
 struct reslist* reslist_current(void);
+void reslist_xfer(struct reslist* recipient, struct reslist* donor);
 
 #define PASTE(a,b) a##b
 
@@ -118,6 +120,8 @@ extern int real_main(int argc, char** argv);
 
 size_t nextpow2sz(size_t sz);
 
+uint64_t monotonic_ns(void);
+
 #define XMIN(a,b)                \
     ({ typeof (a) _a = (a);      \
         typeof (a) _b = (b);     \
@@ -182,3 +186,6 @@ FILE* xnamed_tempfile(const char** name);
 #endif
 
 void replace_with_dev_null(int fd);
+void xgetrandom(void* buf, size_t sz);
+void hint_sequential_read(int fd);
+void preallocate_file(int fd, uint64_t size);